@@ -6,36 +6,220 @@
 
 #include "utils/status.h"
 
+#define DEFAULT_UPSTREAM_TIMEOUT_MS 2000
+#define DEFAULT_UPSTREAM_SOCKETS 4
+#define MAX_UPSTREAM_SOCKETS 64
+#define MAX_WORKERS 64
+#define DEFAULT_HEAVY_HITTERS 256
+#define DEFAULT_ECS_IPV4_PREFIX 24
+#define DEFAULT_ECS_IPV6_PREFIX 56
+#define DEFAULT_OVERLOAD_LAG_MS 20
+#define DEFAULT_OVERLOAD_QUEUE_PERCENT 50
+#define DEFAULT_OVERLOAD_DROP_LAG_MS 100
+#define DEFAULT_OVERLOAD_DROP_QUEUE_PERCENT 90
+#define DEFAULT_PREFETCH_HOT_NAMES 100
+#define DEFAULT_PREFETCH_QUERIES_PER_SECOND 20
+#define DEFAULT_PREFETCH_REFRESH_PERCENT 90
+#define DEFAULT_BUSY_POLL_IDLE_US 5000
+#define DEFAULT_BUSY_POLL_SOCKET_US 50
+#define DEFAULT_SLOW_QUERIES 256
+#define DEFAULT_SLOW_THRESHOLD_MS 100
+
 enum dns_filter_type { DNS_FT_IPV4 = 0, DNS_FT_IPV6 = 1, DNS_FT_ALL = 2 };
 typedef enum dns_filter_type dns_filter_type_t;
 
-enum dns_match_type { DNS_MT_CONTAINS = 0, DNS_MT_EXACT = 1 };
+// suffix: the host itself and every name below it, wildcard and regex: see server/pattern_dfa.h
+enum dns_match_type {
+   DNS_MT_CONTAINS = 0,
+   DNS_MT_EXACT = 1,
+   DNS_MT_SUFFIX = 2,
+   DNS_MT_WILDCARD = 3,
+   DNS_MT_REGEX = 4
+};
 typedef enum dns_match_type dns_match_type_t;
 
 enum dns_action_type { DNS_AT_NOTFOUND = 0, DNS_AT_REFUSE = 1, DNS_AT_REDIRECT = 2, DNS_AT_HANDLE = 2 };
 typedef enum dns_action_type dns_action_type_t;
 
+enum dns_access_type { DNS_ACCESS_ALLOW = 0, DNS_ACCESS_DENY = 1 };
+typedef enum dns_access_type dns_access_type_t;
+
+enum dns_rate_limit_action { DNS_RL_DROP = 0, DNS_RL_TRUNCATE = 1 };
+typedef enum dns_rate_limit_action dns_rate_limit_action_t;
+
+enum dns_overload_action { DNS_OVERLOAD_SERVFAIL = 0, DNS_OVERLOAD_TRUNCATE = 1 };
+typedef enum dns_overload_action dns_overload_action_t;
+
+enum dns_io_backend { DNS_IO_SELECT = 0, DNS_IO_URING = 1 };
+typedef enum dns_io_backend dns_io_backend_t;
+
 struct dns_filter_conf {
    dns_filter_type_t filter_type;
    dns_match_type_t match_type;
    dns_action_type_t action_type;
-   uint8_t *host;
+   uint8_t *host; /* names are lowercased when loaded, wildcard and regex patterns are kept as written */
    uint8_t *redirect_addr;
 };
 typedef struct dns_filter_conf dns_filter_conf_t;
+
+// Clients whose address falls into one of `clients` (CIDR prefixes) get the group filters instead of the default ones
+struct dns_group_conf {
+   uint8_t *name;
+   uint8_t **clients;
+   dns_filter_conf_t *filters;
+   dns_access_type_t access;
+   int client_size;
+   int filter_size;
+};
+typedef struct dns_group_conf dns_group_conf_t;
+// One local resource record, `data` in presentation format: an address (A, AAAA), a name (CNAME, PTR), the text
+// (TXT) or "priority weight port target" (SRV)
+struct dns_record_conf {
+   uint8_t *name;
+   uint8_t *data;
+   uint16_t type;
+   uint32_t ttl;
+};
+typedef struct dns_record_conf dns_record_conf_t;
+
+// Names answered by the proxy itself. Names at or below one of `domains` that have no records get NXDOMAIN,
+// every other name without records is forwarded.
+struct dns_zone_conf {
+   uint8_t **domains;
+   dns_record_conf_t *records;
+   int domain_size;
+   int record_size;
+   uint8_t synthesize_ptr; /* PTR records for the A and AAAA records, unless a PTR is configured for the address */
+};
+typedef struct dns_zone_conf dns_zone_conf_t;
+
 struct dns_server_conf {
    uint8_t *addr;
    uint16_t port;
+   int timeout_ms; /* upstreams only, how long to wait for an answer */
+   int sockets;    /* upstreams only, connected sockets the queries are spread over */
 };
 typedef struct dns_server_conf dns_server_conf_t;
 
+// Queries for names at or below one of `domains` go to `upstream` instead of the default forwarder
+struct dns_route_conf {
+   uint8_t **domains;
+   dns_server_conf_t upstream;
+   int domain_size;
+};
+typedef struct dns_route_conf dns_route_conf_t;
+
+struct dns_query_log_conf {
+   uint8_t *path; /* NULL disables the query log */
+   uint64_t max_size;
+   int max_files;
+   int ring_size;
+};
+typedef struct dns_query_log_conf dns_query_log_conf_t;
+
+struct dns_rate_limit_conf {
+   int responses_per_second; /* 0 disables rate limiting */
+   int burst;
+   int ipv4_prefix;
+   int ipv6_prefix;
+   int table_size;
+   dns_rate_limit_action_t action;
+};
+typedef struct dns_rate_limit_conf dns_rate_limit_conf_t;
+
+// Answers of forwarded queries, kept until their smallest TTL runs out
+struct dns_cache_conf {
+   int max_entries; /* 0 disables the cache */
+   uint32_t max_ttl;
+   uint8_t *snapshot_path; /* NULL disables snapshots */
+   int snapshot_interval;  /* seconds between snapshots, 0 writes one at shutdown only */
+};
+typedef struct dns_cache_conf dns_cache_conf_t;
+
+// EDNS Client Subnet: forwarded queries carry the client address truncated to these prefixes, cached answers are
+// kept per scope the upstream returns
+struct dns_ecs_conf {
+   uint8_t enabled;
+   int ipv4_prefix;
+   int ipv6_prefix; /* at most 64 */
+};
+typedef struct dns_ecs_conf dns_ecs_conf_t;
+
+// Load shedding: past the first thresholds a worker answers the queries it would forward with `action`, past the
+// drop thresholds it does not answer them. Cache hits and local answers are served either way.
+struct dns_overload_conf {
+   uint8_t enabled;
+   int lag_ms;        /* age of the oldest query of a batch */
+   int queue_percent; /* fill of the socket receive buffer */
+   int drop_lag_ms;
+   int drop_queue_percent;
+   dns_overload_action_t action;
+};
+typedef struct dns_overload_conf dns_overload_conf_t;
+
+// Names kept in the cache: resolved through the forwarders at startup and refreshed before their answers expire
+struct dns_prefetch_conf {
+   uint8_t **names;   /* "name" or "name TYPE", A and AAAA without a type */
+   uint8_t *hot_path; /* most queried names, written at shutdown and prefetched at the next start, NULL for none */
+   int name_size;
+   int hot_names; /* names written to hot_path */
+   int queries_per_second;
+   int refresh_percent; /* of the TTL, when the refresh is sent */
+   uint8_t edns;        /* queries carry an OPT record, cached apart from the ones without */
+};
+typedef struct dns_prefetch_conf dns_prefetch_conf_t;
+
+// Busy polling: workers spin on non-blocking receives rather than sleeping until a datagram arrives, which takes
+// a core each but saves the wakeup of every query
+struct dns_busy_poll_conf {
+   uint8_t enabled;
+   int idle_us;   /* a worker goes back to sleeping once no datagram came for this long */
+   int socket_us; /* SO_BUSY_POLL of the sockets, 0 leaves the kernel setting */
+   int *cpus;     /* cpu of every worker, NULL leaves them unpinned */
+   int cpu_size;
+};
+typedef struct dns_busy_poll_conf dns_busy_poll_conf_t;
+
+// Queries captured with both packets for the slow query requests of the control socket
+struct dns_slow_queries_conf {
+   int size; /* captures kept, 0 disables the capture */
+   int threshold_ms;
+   int sample_rate; /* one in `sample_rate` answers is kept whatever its latency, 0 keeps none */
+};
+typedef struct dns_slow_queries_conf dns_slow_queries_conf_t;
+
+// Unix socket answering stats, top list and slow query requests
+struct dns_control_conf {
+   uint8_t *path;     /* NULL disables the control socket */
+   int heavy_hitters; /* keys tracked per top list and worker, 0 disables the top lists */
+   dns_slow_queries_conf_t slow_queries;
+};
+typedef struct dns_control_conf dns_control_conf_t;
+
 struct dns_conf {
    dns_filter_conf_t *filters;
+   dns_group_conf_t *groups;
+   dns_route_conf_t *routes;
 
    dns_server_conf_t self;
    dns_server_conf_t upstream;
+   dns_query_log_conf_t query_log;
+   dns_rate_limit_conf_t rate_limit;
+   dns_cache_conf_t cache;
+   dns_ecs_conf_t ecs;
+   dns_overload_conf_t overload;
+   dns_prefetch_conf_t prefetch;
+   dns_busy_poll_conf_t busy_poll;
+   dns_control_conf_t control;
+   dns_zone_conf_t zone;
+   dns_io_backend_t io_backend;
+   int workers;          /* serving threads, each with its own listening socket */
+   uint8_t cpu_steering; /* worker i is pinned to cpu i and gets the datagrams that cpu received */
+   uint8_t stage_latency; /* per stage latency histograms from kernel receive timestamps */
 
    int filter_size;
+   int group_size;
+   int route_size;
 };
 typedef struct dns_conf dns_conf_t;
 
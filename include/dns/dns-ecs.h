@@ -0,0 +1,58 @@
+#ifndef _DNS_ECS_
+#define _DNS_ECS_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "dns/dns-protocol.h"
+
+#define DNS_ECS_OPTION_CODE 8 /* EDNS option code, RFC 7871 */
+#define DNS_ECS_FAMILY_INET 1
+#define DNS_ECS_FAMILY_INET6 2
+#define DNS_ECS_MAX_PREFIX6 64 /* the subnet is kept in 64 bits */
+#define DNS_ECS_MAX_ADDED 27   /* an OPT record holding the option with 8 address bytes */
+#define DNS_ECS_UDP_SIZE 512   /* payload size of an OPT record added for a client that sent none */
+
+// Client subnet of a forwarded query. `subnet` holds the address bits left aligned, the first `source` of them
+// set and the others zero, an IPv4 address in the upper 32 bits.
+struct dns_ecs {
+   uint64_t subnet;
+   uint16_t family; /* DNS_ECS_FAMILY_*, 0 when no subnet is sent */
+   uint8_t source;
+   uint8_t scope; /* of the answer, at most `source` */
+};
+typedef struct dns_ecs dns_ecs_t;
+
+// What dns_ecs_add did to a query, the same has to be undone on its answer
+enum dns_ecs_mode {
+   DNS_ECS_NONE = 0,   /* left alone: it has an ECS option of its own, or records after which none can be added */
+   DNS_ECS_OPTION = 1, /* the option went into the OPT record of the client */
+   DNS_ECS_OPT = 2     /* an OPT record holding the option was appended */
+};
+typedef enum dns_ecs_mode dns_ecs_mode_t;
+
+static inline uint64_t
+dns_ecs_truncate (uint64_t subnet, int prefix)
+{
+   return prefix == 0 ? 0 : prefix >= 64 ? subnet : subnet & ~(UINT64_MAX >> prefix);
+}
+
+// Subnet of `client` (IPv4 mapped IPv6 addresses count as IPv4), returns -1 for other families
+int
+dns_ecs_from_client (dns_ecs_t *ecs, const struct sockaddr_storage *client, int ipv4_prefix, int ipv6_prefix);
+
+// Whether the message carries an ECS option
+int
+dns_ecs_present (const uint8_t *msg, int length);
+
+// Adds `ecs` to the query `msg`, which may grow to `capacity` bytes
+dns_ecs_mode_t
+dns_ecs_add (uint8_t *msg, int *length, int capacity, const dns_ecs_t *ecs);
+
+// Reads the scope of the answer to a query `ecs` was added to with `mode` into `ecs->scope`, 0 when it has no ECS
+// option, and removes what dns_ecs_add added. Returns -1 when its option does not echo the subnet sent, such an
+// answer must not be cached.
+int
+dns_ecs_answer (uint8_t *msg, int *length, dns_ecs_mode_t mode, dns_ecs_t *ecs);
+
+#endif // _DNS_ECS_
@@ -0,0 +1,87 @@
+#ifndef _DNS_NAME_
+#define _DNS_NAME_
+
+#include <stdint.h>
+#include <string.h>
+
+#include "dns/dns-protocol.h"
+
+// Question names are validated, lowercased into their canonical form and hashed in a single pass. The pass is
+// vectorized (AVX2 or SSE2) when the CPU supports it, the implementation is picked once at runtime.
+enum dns_name_impl { DNS_NAME_SCALAR = 0, DNS_NAME_SSE2 = 1, DNS_NAME_AVX2 = 2 };
+typedef enum dns_name_impl dns_name_impl_t;
+
+#define DNS_NAME_HASH_SEED 0x2d358dccaa6c78a5ull
+#define DNS_NAME_HASH_MUL 0x9e3779b97f4a7c15ull
+
+extern const char *dns_name_impl_desc[];
+
+// Hash of `length` bytes of canonical wire format, 8 bytes at a time
+static inline uint64_t
+dns_name_hash_update (uint64_t h, const uint8_t *p, int length)
+{
+   for (; length >= 8; length -= 8, p += 8) {
+      uint64_t w;
+      memcpy (&w, p, sizeof (w));
+      h = (h ^ w) * DNS_NAME_HASH_MUL;
+      h ^= h >> 29;
+   }
+   if (length > 0) {
+      uint64_t w = 0;
+      memcpy (&w, p, length);
+      h = (h ^ w) * DNS_NAME_HASH_MUL;
+      h ^= h >> 29;
+   }
+   return h;
+}
+
+static inline uint64_t
+dns_name_hash_final (uint64_t h)
+{
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdull;
+   h ^= h >> 33;
+   return h;
+}
+
+static inline uint64_t
+dns_name_hash (const uint8_t *wire, int length)
+{
+   return dns_name_hash_final (dns_name_hash_update (DNS_NAME_HASH_SEED ^ length, wire, length));
+}
+
+// Hash of the parent domain starting at label `label`, the same dns_name_hash gives that domain on its own
+static inline uint64_t
+dns_name_suffix_hash (const dns_name_t *name, int label)
+{
+   int off = name->offsets[label];
+   return dns_name_hash (name->wire + off, name->length - off);
+}
+
+// Decodes the uncompressed wire-format name at `src`, reading at most `length` bytes. Label characters must be
+// letters, digits, '-' or '_'. `orig` receives the name as sent (wire format, RR_NAME_MAX bytes), `name` its
+// canonical form. Returns the number of wire bytes consumed, -1 for an invalid name.
+int
+dns_name_fold (uint8_t *orig, dns_name_t *name, const uint8_t *src, int length);
+
+// Canonical form of a dotted name (configured hosts), a trailing dot is optional. Label characters are not
+// checked. Returns the wire length or -1 when a label is empty or the name too long.
+int
+dns_name_from_text (dns_name_t *name, const char *text);
+
+// Offset behind the name at `off` of the message `msg`, compressed or not, -1 when it runs past `length`
+int
+dns_name_skip (const uint8_t *msg, int length, int off);
+
+// Writes the dotted form of `name` into `dst` (RR_NAME_MAX bytes, zero terminated) and returns its length
+int
+dns_name_to_text (char *dst, const dns_name_t *name);
+
+// Switches to `impl`, returns -1 when the CPU does not support it
+int
+dns_name_use_impl (dns_name_impl_t impl);
+
+dns_name_impl_t
+dns_name_current_impl ();
+
+#endif // _DNS_NAME_
@@ -11,8 +11,16 @@ struct dns_h {
 };
 typedef struct dns_h dns_h_t;
 
+int
+process_qname (uint8_t *dst, const uint8_t *src, int length);
+
+int
+convert_to_qname (uint8_t *dst, const char *src, int max_length);
+
+// Parses the questions and answers of the `req_len` bytes at `req`, fails with kDataMalformed when one of them runs
+// past the end
 dns_h_t *
-new_dns_h (const uint8_t *req, dns_rc_t *rc);
+new_dns_h (const uint8_t *req, int req_len, dns_rc_t *rc);
 
 uint8_t *
 new_dns_buffer (const dns_h_t *dns, dns_rc_t *rc, int *out_bufsize);
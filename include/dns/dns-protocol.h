@@ -5,6 +5,7 @@
 #define POINTER_MASK 0xC0 /* flag that indicated that name is pointer */
 #define RR_NAME_MAX 255   /* max length for rr name */
 #define QNAME_MAX_SEG_LEN 63
+#define DNS_NAME_MAX_LABELS 127 /* one character labels filling RR_NAME_MAX */
 #define DNS_UDP_MAX_PACKLEN 512
 #define DEFAULT_TTL 300 // 5 minutes
 
@@ -53,6 +54,8 @@
 #define T_NSEC 47
 #define T_DNSKEY 48
 #define T_NSEC3 50
+#define T_SVCB 64
+#define T_HTTPS 65
 #define T_TKEY 249
 #define T_TSIG 250
 #define T_AXFR 252
@@ -121,13 +124,23 @@ typedef struct dns_header dns_header_t;
       (cp) += 4;                                    \
    }
 
-#pragma pack(push, 1)
+// Canonical form of a name: lowercase wire format with the offset of every label, so the name and all of its
+// parent domains can be used as keys without converting the name again.
+struct dns_name {
+   uint8_t wire[RR_NAME_MAX];
+   uint8_t offsets[DNS_NAME_MAX_LABELS]; /* start of every label in wire, the root label excluded */
+   uint8_t length;                       /* wire length, root label included */
+   uint8_t labels;
+   uint64_t hash; /* dns_name_hash of wire */
+};
+typedef struct dns_name dns_name_t;
+
 struct dns_qrr {
-   uint8_t name[RR_NAME_MAX];
+   uint8_t name[RR_NAME_MAX]; /* wire format as received, case preserved */
    uint16_t type;
    uint16_t class;
+   dns_name_t key;
 };
-#pragma pack(pop)
 typedef struct dns_qrr dns_qrr_t;
 
 #pragma pack(push, 1)
@@ -0,0 +1,91 @@
+#ifndef _QUERY_LOG_H_
+#define _QUERY_LOG_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#include "configuration/configuration.h"
+#include "utils/status.h"
+
+#define QUERY_LOG_DEFAULT_RING_SIZE 4096
+#define QUERY_LOG_DEFAULT_MAX_SIZE (64 * 1024 * 1024)
+#define QUERY_LOG_DEFAULT_MAX_FILES 8
+#define QUERY_LOG_MAX_QUERY 320 /* longest query prefix kept per record */
+
+// One per answered query, written by the hot path. Kept small and flat so reserving a slot is a plain store.
+struct query_log_record {
+   uint64_t time_ns;    /* CLOCK_REALTIME when the reply was sent */
+   uint32_t latency_ns; /* receive to reply */
+   uint16_t client_port;
+   uint16_t query_len;
+   uint8_t client_family; /* AF_INET or AF_INET6 */
+   uint8_t action;        /* dns_verdict_t */
+   uint8_t rcode;
+   uint8_t client_addr[16];
+   uint8_t query[QUERY_LOG_MAX_QUERY];
+};
+typedef struct query_log_record query_log_record_t;
+
+// Single producer (a worker) single consumer (the writer thread) ring
+struct query_log_ring {
+   _Alignas (64) _Atomic uint64_t head; /* next slot the worker fills */
+   _Alignas (64) _Atomic uint64_t tail; /* next slot the writer drains */
+   _Alignas (64) _Atomic uint64_t dropped;
+   uint64_t mask;
+   query_log_record_t *records;
+};
+typedef struct query_log_ring query_log_ring_t;
+
+struct query_log {
+   query_log_ring_t *rings;
+   int ring_count;
+
+   char *path;
+   uint64_t max_size;
+   int max_files;
+
+   FILE *file;
+   uint64_t file_size;
+   pthread_t writer;
+   atomic_int quit;
+};
+typedef struct query_log query_log_t;
+
+query_log_t *
+new_query_log (const dns_query_log_conf_t *conf, int workers, dns_rc_t *rc);
+
+// Stops the writer after it drained every ring
+void
+destroy_query_log (query_log_t *log);
+
+static inline query_log_ring_t *
+query_log_ring (query_log_t *log, int worker)
+{
+   return log == NULL ? NULL : &log->rings[worker];
+}
+
+// Returns a slot to fill or NULL when the writer fell behind (the record is counted as dropped)
+static inline query_log_record_t *
+query_log_reserve (query_log_ring_t *ring)
+{
+   uint64_t head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+   if (head - atomic_load_explicit (&ring->tail, memory_order_acquire) > ring->mask) {
+      atomic_fetch_add_explicit (&ring->dropped, 1, memory_order_relaxed);
+      return NULL;
+   }
+   return &ring->records[head & ring->mask];
+}
+
+static inline void
+query_log_commit (query_log_ring_t *ring)
+{
+   atomic_store_explicit (
+      &ring->head, atomic_load_explicit (&ring->head, memory_order_relaxed) + 1, memory_order_release);
+}
+
+uint64_t
+query_log_dropped (const query_log_t *log);
+
+#endif // _QUERY_LOG_H_
@@ -0,0 +1,138 @@
+#ifndef _CACHE_H_
+#define _CACHE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "configuration/configuration.h"
+#include "dns/dns-ecs.h"
+#include "dns/dns-parse.h"
+#include "utils/status.h"
+
+#define DNS_CACHE_WAYS 4              /* entries of one set, the one expiring first is replaced */
+#define DNS_CACHE_MAX_ANSWER 1232     /* larger answers are not cached, the EDNS size that avoids fragmentation */
+#define DNS_CACHE_MAX_RECORDS 64      /* answers with more records are not cached */
+#define DNS_CACHE_DEFAULT_MAX_TTL 86400
+#define DNS_CACHE_SNAPSHOT_MAGIC 0x43534e44 /* "DNSC" read as a little endian word */
+#define DNS_CACHE_SNAPSHOT_VERSION 1
+#define DNS_CACHE_STRIPES 256 /* locks, set i is guarded by stripe i % DNS_CACHE_STRIPES */
+
+// Key flags, answers differ with them
+#define DNS_CACHE_KEY_CD 0x01   /* checking disabled */
+#define DNS_CACHE_KEY_EDNS 0x02 /* the query has an OPT record */
+#define DNS_CACHE_KEY_DO 0x04   /* DNSSEC records requested */
+#define DNS_CACHE_KEY_INET6 0x08 /* scoped to an IPv6 client subnet */
+
+// One cached answer. The key is the canonical question name, type, class and the key flags, plus the client subnet
+// for answers the upstream scoped to one with EDNS Client Subnet.
+struct dns_cache_entry {
+   uint64_t hash;   /* 0 marks an empty way */
+   uint8_t *blob;   /* record TTL offsets (uint16_t each), the canonical name, the subnet of scoped entries, then
+                       the answer */
+   uint32_t stored; /* CLOCK_REALTIME seconds */
+   uint32_t expire; /* CLOCK_REALTIME seconds, absolute so entries survive a restart */
+   uint16_t type;
+   uint16_t class;
+   uint16_t length; /* answer bytes */
+   uint8_t name_len;
+   uint8_t ttl_count;
+   uint8_t flags;
+   uint8_t scope; /* ECS scope prefix, 0 for answers valid for every client */
+};
+typedef struct dns_cache_entry dns_cache_entry_t;
+
+// Scope prefixes stored under one unscoped key, so a lookup only probes those. Slot i belongs to set i and is
+// guarded by its stripe, a key colliding with another one replaces it.
+struct dns_cache_scopes {
+   uint64_t hash; /* unscoped key, 0 marks an empty slot */
+   uint64_t mask; /* bit s - 1 for scope prefix s */
+};
+typedef struct dns_cache_scopes dns_cache_scopes_t;
+
+// Lock of a group of sets and their counters, a cache line each so workers using different sets share none
+struct dns_cache_stripe {
+   _Alignas (64) pthread_mutex_t lock;
+   uint64_t hits;
+   uint64_t misses;
+   uint64_t evictions;
+   int count;
+};
+typedef struct dns_cache_stripe dns_cache_stripe_t;
+
+struct dns_cache_stats {
+   uint64_t hits;
+   uint64_t misses;
+   uint64_t evictions;
+   int count;
+};
+typedef struct dns_cache_stats dns_cache_stats_t;
+
+// Set associative table of upstream answers. Answers are kept as received with their TTLs capped to max_ttl,
+// a hit copies one, sets the query ID and case and lowers every TTL by the time spent in the cache. Workers share
+// the table, every set is used under the lock of its stripe. Answers scoped to a client subnet live in the set of
+// their subnet, answers of scope 0 take no more room than without ECS.
+struct dns_cache {
+   dns_cache_entry_t *entries;
+   dns_cache_scopes_t *scopes;
+   dns_cache_stripe_t *stripes;
+   uint64_t set_mask;
+   uint32_t max_ttl;
+   int restored; /* entries read from the snapshot at startup */
+};
+typedef struct dns_cache dns_cache_t;
+
+static inline uint32_t
+dns_cache_now ()
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_REALTIME_COARSE, &ts);
+   return (uint32_t) ts.tv_sec;
+}
+
+dns_cache_t *
+new_dns_cache (const dns_cache_conf_t *conf, dns_rc_t *rc);
+
+void
+destroy_dns_cache (dns_cache_t *cache);
+
+// Answers `req` (parsed into `dht`) from the cache. With `ecs` (may be NULL), the client subnet the query would be
+// forwarded with, the answer of the most specific scope covering it is used. Queries with an ECS option of their own
+// bypass the cache. Returns the response length written to `resp` (DNS_CACHE_MAX_ANSWER bytes), 0 on a miss.
+int
+dns_cache_lookup (dns_cache_t *cache,
+                  const dns_h_t *dht,
+                  const uint8_t *req,
+                  int req_len,
+                  const dns_ecs_t *ecs,
+                  uint8_t *resp,
+                  uint32_t now);
+
+// Caches the upstream `answer` to `req` when it is a complete NOERROR or NXDOMAIN answer to the same question.
+// The entry expires with its smallest TTL, the SOA minimum for negative answers. `ecs` (may be NULL) is the subnet
+// the query was forwarded with and the scope of the answer, the ECS option already removed from it. Returns the TTL
+// the entry is kept for, 0 when the answer is not cached.
+uint32_t
+dns_cache_store (dns_cache_t *cache,
+                 const uint8_t *req,
+                 int req_len,
+                 const uint8_t *answer,
+                 int answer_len,
+                 const dns_ecs_t *ecs,
+                 uint32_t now);
+
+// Writes the unexpired entries to `path` through a temporary file renamed over it, so a crash never leaves a
+// partial snapshot behind. Entries scoped to a client subnet are left out.
+dns_rc_t
+dns_cache_save (dns_cache_t *cache, const char *path, uint32_t now);
+
+// Reads a snapshot written by dns_cache_save, expired entries are skipped. Fails with kNotFound when there is no
+// snapshot and kDataMalformed when the file is not one of this version.
+dns_rc_t
+dns_cache_load (dns_cache_t *cache, const char *path, uint32_t now);
+
+// Sums the counters of all stripes
+void
+dns_cache_stats (dns_cache_t *cache, dns_cache_stats_t *stats);
+
+#endif // _CACHE_H_
@@ -0,0 +1,45 @@
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "utils/status.h"
+
+#define DNS_CONTROL_DEFAULT_TOP 10
+#define DNS_CONTROL_MAX_TOP 1000
+#define DNS_CONTROL_MAX_REQUEST 256
+
+struct dns_server;
+
+// Unix stream socket served by its own thread. A client sends one line and gets a text reply, then the connection
+// is closed:
+//   stats                            the counters printed at shutdown
+//   top names|blocked|clients [N]    the N (10 by default) most frequent query names, blocked names or clients of
+//                                    all workers, as "count error key"; the true count is at least count - error
+//   slow [pcap]                      the captured slow and sampled queries as text, or both packets of each as a
+//                                    pcap for the client to save
+//   delta FILE [GROUP]               applies the delta file FILE (see server/filter_delta.h) to the filters of
+//                                    GROUP, the default one without; a large overlay is merged after the reply
+struct dns_control {
+   struct dns_server *server;
+   char *path;
+   int sockfd;
+   dev_t dev; /* of the socket file, an upgraded process may have replaced it by the time this one exits */
+   ino_t ino;
+   pthread_t thread;
+   uint8_t started;
+   atomic_int quit;
+};
+typedef struct dns_control dns_control_t;
+
+dns_control_t *
+new_dns_control (struct dns_server *server, const char *path, dns_rc_t *rc);
+
+// Stops the thread and removes the socket file unless another process bound the path since
+void
+destroy_dns_control (dns_control_t *control);
+
+#endif // _CONTROL_H_
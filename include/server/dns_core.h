@@ -0,0 +1,61 @@
+#ifndef _DNS_CORE_H_
+#define _DNS_CORE_H_
+
+#include "configuration/configuration.h"
+#include "dns/dns-ecs.h"
+#include "dns/dns-parse.h"
+#include "server/cache.h"
+#include "server/latency.h"
+#include "server/policy.h"
+#include "utils/status.h"
+
+// Socket independent packet processing, shared by the server loop and offline tools (replay, benchmarks)
+
+enum dns_verdict { DNS_VERDICT_DROP = 0, DNS_VERDICT_REPLY = 1, DNS_VERDICT_FORWARD = 2 };
+typedef enum dns_verdict dns_verdict_t;
+
+// What process_dns_query learned about a query besides the verdict
+struct dns_query_info {
+   dns_name_t qname;       /* canonical name of the first question, length 0 without one */
+   int upstream;           /* dns_policy_route of forwarded queries */
+   uint8_t filtered;       /* answered by a filter or refused by a deny group */
+   dns_ecs_t ecs;          /* client subnet to forward with, family 0 without ECS */
+   dns_latency_t *latency; /* set by the caller to have the stage times below taken, NULL otherwise */
+   uint64_t parsed_ns;
+   uint64_t decided_ns;
+};
+typedef struct dns_query_info dns_query_info_t;
+
+// First filter of `view` matching a question of `dht`, questions are tried in order. `out_q` gets the question
+// index.
+const dns_filter_conf_t *
+find_filter (const dns_filter_view_t *view, const dns_h_t *dht, uint16_t *out_q);
+
+dns_h_t *
+decide_dns_response (const dns_policy_group_t *group, const dns_h_t *dht);
+
+// Parses `req`, applies the filters of the client group, the local zone and the response cache and either encodes an
+// answer into `resp` (DNS_VERDICT_REPLY) or tells the caller to pass the query to the upstream unchanged
+// (DNS_VERDICT_FORWARD). Queries without exactly one question, or with answers, are dropped. `cache` may be NULL.
+// `resp` should hold at least DNS_CACHE_MAX_ANSWER bytes. `info` (may be NULL) gets the question, and the route and
+// client subnet of forwarded queries.
+dns_verdict_t
+process_dns_query (const dns_policy_t *policy,
+                   dns_cache_t *cache,
+                   const struct sockaddr_storage *client,
+                   const uint8_t *req,
+                   int req_len,
+                   uint8_t *resp,
+                   int *resp_len,
+                   dns_query_info_t *info);
+
+// Encodes a header and question only answer with TC=1 for `req`, telling the client to retry over TCP.
+// Returns the response length or -1 when the query is malformed.
+int
+encode_dns_truncated (const uint8_t *req, int req_len, uint8_t *resp);
+
+// Same as encode_dns_truncated with SERVFAIL instead of TC=1, for queries the upstream did not answer
+int
+encode_dns_servfail (const uint8_t *req, int req_len, uint8_t *resp);
+
+#endif // _DNS_CORE_H_
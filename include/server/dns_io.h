@@ -0,0 +1,100 @@
+#ifndef _DNS_IO_H_
+#define _DNS_IO_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "configuration/configuration.h"
+#include "utils/status.h"
+
+#define DNS_IO_BATCH 64          /* datagrams handed out by one dns_io_receive */
+#define DNS_IO_BUFFER_SIZE 2048  /* one received datagram, io_uring puts the sender address in front of it */
+#define DNS_IO_URING_ENTRIES 512 /* submission queue size */
+#define DNS_IO_URING_BUFFERS 256 /* provided receive buffers, a power of two */
+#define DNS_IO_URING_SEND_SLOTS 256
+#define DNS_IO_MAX_SOCKETS 256    /* the listening socket and the upstream sockets */
+
+extern const char *dns_io_backend_desc[];
+
+struct dns_datagram {
+   const uint8_t *data;
+   int length;
+   struct sockaddr_storage addr;
+   socklen_t addr_len;
+   uint64_t kernel_ns; /* CLOCK_REALTIME the kernel received it, 0 unless the socket has SO_TIMESTAMPNS set */
+   uint16_t buffer; /* backend buffer holding data, given back by dns_io_release */
+   uint16_t socket; /* index of the receiving socket, 0 is the listening one */
+};
+typedef struct dns_datagram dns_datagram_t;
+
+struct dns_io_uring;
+
+// Datagram I/O of the listening socket and the upstream sockets. The select backend waits in poll, receives with
+// recvmsg and sends every datagram right away. The io_uring backend keeps one multishot recvmsg armed on every
+// socket, the kernel picks receive buffers from a provided buffer ring, and sends are queued as sendmsg requests
+// that are submitted together by dns_io_flush, usually with the wait for the next datagrams.
+struct dns_io {
+   dns_io_backend_t backend;
+   int sockfd; /* the listening socket */
+   int sockets[DNS_IO_MAX_SOCKETS];
+   int socket_count;
+   uint8_t *buffers;           /* select: DNS_IO_BATCH receive buffers */
+   struct dns_io_uring *uring; /* io_uring state, NULL for select */
+   struct mmsghdr *msgs;       /* busy polling: recvmmsg headers of the DNS_IO_BATCH buffers */
+   uint64_t busy_idle_ns;      /* busy polling stops this long after the last datagram, 0 when it is off */
+   uint64_t last_ns;           /* CLOCK_MONOTONIC of the last datagram received */
+   uint64_t sleeps;            /* receives that slept after busy polling stopped */
+   uint8_t stopped;
+};
+typedef struct dns_io dns_io_t;
+
+// Fails with kAborted when the kernel does not support the backend (io_uring disabled, older than 6.0)
+dns_io_t *
+new_dns_io (dns_io_backend_t backend, int sockfd, dns_rc_t *rc);
+
+void
+destroy_dns_io (dns_io_t *io);
+
+// Receives from `sockfd` too, returns the index its datagrams carry or -1 when there are too many sockets
+int
+dns_io_add_socket (dns_io_t *io, int sockfd);
+
+// Waits at most `timeout_ms` for datagrams and fills up to `max` (DNS_IO_BATCH at most) of them. The data stays
+// valid until dns_io_release. Returns the datagram count, 0 on timeout or signal, -1 when the socket failed.
+int
+dns_io_receive (dns_io_t *io, dns_datagram_t *dgrams, int max, int timeout_ms);
+
+void
+dns_io_release (dns_io_t *io, const dns_datagram_t *dgrams, int count);
+
+// Has dns_io_receive spin on non-blocking receives from all sockets instead of sleeping, until `idle_us` went by
+// without a datagram; it sleeps as before then, up to the next one. With `socket_us` the sockets added so far get
+// SO_BUSY_POLL and SO_PREFER_BUSY_POLL, so each receive polls the device queue itself. Returns -1 for io_uring,
+// which is left as it is, and when the kernel refused the socket options, the receives spin anyway then.
+int
+dns_io_busy_poll (dns_io_t *io, int idle_us, int socket_us);
+
+// Sends `data` from socket `socket` to `addr`, NULL for a connected socket. The data is copied so the caller may
+// reuse it at once. Returns 0 or -1.
+int
+dns_io_send (dns_io_t *io,
+             int socket,
+             const uint8_t *data,
+             int length,
+             const struct sockaddr_storage *addr,
+             socklen_t addr_len);
+
+// Stops taking datagrams off the listening socket, so another process sharing it gets them. Datagrams the backend
+// already received are still handed out by dns_io_receive, the other sockets are received from as before.
+void
+dns_io_stop (dns_io_t *io);
+
+// 1 after dns_io_stop while datagrams already taken off the listening socket may still be handed out
+int
+dns_io_draining (const dns_io_t *io);
+
+// Submits the queued replies without waiting for them
+void
+dns_io_flush (dns_io_t *io);
+
+#endif // _DNS_IO_H_
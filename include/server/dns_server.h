@@ -1,6 +1,9 @@
 #ifndef _DNS_SERVER_H_
 #define _DNS_SERVER_H_
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
 #include <sys/socket.h>
  #include <sys/time.h>
 #include <unistd.h>
@@ -8,6 +11,19 @@
 #include "netdb.h"
 
 #include "configuration/configuration.h"
+#include "dns/dns-parse.h"
+#include "log/query_log.h"
+#include "server/cache.h"
+#include "server/control.h"
+#include "server/dns_io.h"
+#include "server/heavy_hitters.h"
+#include "server/latency.h"
+#include "server/overload.h"
+#include "server/pending.h"
+#include "server/policy.h"
+#include "server/prefetch.h"
+#include "server/rate_limit.h"
+#include "server/slow_queries.h"
 #include "utils/status.h"
 
 #ifdef __linux__
@@ -17,21 +33,82 @@
 #define DEFAULT_READ_TIMEOUT_USEC 20000
 #endif
 
+#define DNS_UPSTREAM_MAX_FAILURES 3             /* consecutive timeouts before an upstream is marked down */
+#define DNS_UPSTREAM_HOLD_DOWN_NS 5000000000ull /* how long a down upstream is skipped */
+
+// One forwarder with its own sockets and health. Queries routed to an upstream that is down get SERVFAIL instead
+// of being sent somewhere else, after the hold down the next query probes it again. Queries are spread over a pool
+// of connected sockets, each with its own random source port, so answers spread over receive queues.
+struct dns_upstream {
+   struct sockaddr_storage storage;
+   struct addrinfo hints;
+   char host[INET6_ADDRSTRLEN];
+   DNS_SOCK *sockets;
+   uint16_t *io_sockets; /* dns_io index of every socket */
+   int socket_count;
+   int next_socket; /* round robin position */
+   uint64_t timeout_ns;
+   uint16_t port;
+   int failures;        /* consecutive timeouts */
+   uint64_t down_until; /* CLOCK_MONOTONIC ns */
+   uint64_t forwarded;
+   uint64_t timeouts;
+};
+typedef struct dns_upstream dns_upstream_t;
+
+struct dns_server;
+
+// One serving thread with its own socket in the SO_REUSEPORT group of the listening address, its own I/O, upstream
+// pools and pending table. Workers only share the read-only policy and the striped cache and rate limit tables.
+// Everything a worker owns is allocated by its own thread after it is pinned, so it lands on the local NUMA node.
+struct dns_worker {
+   struct dns_server *server;
+   int index;
+   int cpu; /* -1 when not pinned */
+   DNS_SOCK sockfd; /* listening socket */
+   dns_io_t *io;
+   dns_pending_t *pending;    /* forwarded queries waiting for their answer */
+   dns_upstream_t *upstreams; /* 0 is the default forwarder, then one per route */
+   query_log_ring_t *log_ring;
+   dns_heavy_hitters_t *heavy_hitters; /* NULL without top lists */
+   dns_latency_t *latency;             /* NULL without stage latency */
+   dns_overload_t *overload;           /* NULL without load shedding */
+   uint64_t batch_ns;                  /* CLOCK_REALTIME pick up of the current batch, 0 without slow queries */
+   uint64_t answers;                   /* sampling count of the slow queries */
+   _Atomic uint64_t quiescent;         /* server epoch seen between two batches, UINT64_MAX once stopped */
+   pthread_t thread;
+   uint8_t started; /* runs on its own thread, worker 0 runs on the thread calling run_dns_server */
+   dns_rc_t rc;     /* result of the worker setup */
+};
+typedef struct dns_worker dns_worker_t;
+
 struct dns_server {
    struct sockaddr_storage s_storage;
-   struct sockaddr_storage u_storage;
    struct addrinfo s_hints;
-   struct addrinfo u_hints;
 
    READ_TIMEOUT read_timeout;
 
    char s_host[INET6_ADDRSTRLEN];
-   char u_host[INET6_ADDRSTRLEN];
    const dns_conf_t *conf;
-   DNS_SOCK self_sockfd;
-   DNS_SOCK upstream_sockfd;
+   dns_policy_t *policy;
+   query_log_t *query_log;
+   rate_limit_t *rate_limit;
+   dns_cache_t *cache; /* NULL without a cache configuration */
+   dns_control_t *control; /* NULL without a control socket */
+   dns_slow_queries_t *slow_queries; /* NULL without slow query capture */
+   dns_prefetch_t *prefetch;         /* NULL without prefetched names, refreshed by worker 0 */
+   dns_worker_t *workers;
+   int worker_count;
+   int upstream_count;
+   pthread_mutex_t startup_lock; /* workers report their setup, then wait until all of them did */
+   pthread_cond_t startup_cond;
+   int reported;
+   int startup_verdict; /* 0 while workers start, 1 to serve, -1 to exit */
+   _Atomic uint64_t epoch; /* advanced by dns_server_replace_filters */
    uint16_t s_port;
-   uint16_t u_port;
+   const char *upgrade_exe; /* binary started by an upgrade, NULL disables upgrades */
+   volatile uint8_t upgrade; /* changed to request an upgrade */
+   volatile uint8_t handed_off; /* the upgraded process serves, workers stop receiving */
    volatile uint8_t quit;
 };
 typedef struct dns_server dns_server_t;
@@ -43,7 +120,18 @@ void
 destroy_dns_server (dns_server_t *server);
 
 dns_rc_t
-run_dns_server (const dns_server_t *server);
+run_dns_server (dns_server_t *server);
+
+// Makes `view` the filters of client group `group`. The view it replaces is freed once every worker finished a
+// batch since, so workers never wait on an update; the caller waits instead, up to a read timeout. Only one thread
+// may replace views.
+void
+dns_server_replace_filters (dns_server_t *server, int group, dns_filter_view_t *view);
+
+// Counters of all workers, the upstreams, the cache, the load of every worker, the query log and the stage
+// latencies. While the server runs they are read without stopping the workers, so they may be a moment old.
+void
+dns_server_print_stats (const dns_server_t *server, FILE *out);
 
 
 const uint8_t *
@@ -0,0 +1,102 @@
+#ifndef _FILTER_DELTA_H_
+#define _FILTER_DELTA_H_
+
+#include <stdint.h>
+
+#include "configuration/configuration.h"
+#include "server/filter_set.h"
+#include "utils/status.h"
+
+#define DNS_FILTER_DELTA_MAX_LINE 512
+#define DNS_FILTER_MERGE_MIN 4096 /* overlay entries before a merge, a sixteenth of the set when that is more */
+
+// One line of a delta file:
+//   +host [exact|suffix] [refuse|discard]    adds a filter, suffix and refuse by default
+//   -host [exact|suffix]                     removes the filter of that host, suffix by default
+// Empty lines and lines starting with '#' are skipped.
+struct dns_filter_change {
+   uint8_t *host; /* lowercased */
+   dns_match_type_t match_type;
+   dns_action_type_t action_type;
+   uint8_t add;
+};
+typedef struct dns_filter_change dns_filter_change_t;
+
+struct dns_filter_delta {
+   dns_filter_change_t *changes;
+   int size;
+};
+typedef struct dns_filter_delta dns_filter_delta_t;
+
+// Filters of a client group as the workers match them: a compiled set plus a small overlay of the delta files
+// applied since, the filters they removed from the set and the ones they added after it. A view is never changed
+// once published, a delta builds the next one sharing the set, which costs a copy of the overlay only. Once the
+// overlay grows past DNS_FILTER_MERGE_MIN, a merge compiles a new set without it.
+struct dns_filter_view {
+   const dns_filter_set_t *set;
+   dns_filter_set_t *merged;          /* the set when a merge built it, NULL for the one of the configuration */
+   dns_filter_conf_t *merged_filters; /* filters of a merged set, owned with it */
+   uint8_t *removed;                  /* bit per filter of the set removed by delta files, NULL while none is */
+   int removed_count;
+   dns_filter_conf_t *added; /* filters added by delta files, matched after the ones of the set */
+   int added_size;
+   dns_filter_set_t added_set;
+};
+typedef struct dns_filter_view dns_filter_view_t;
+
+// What applying a delta did
+struct dns_filter_delta_stats {
+   int added;
+   int removed;
+   int unknown; /* removals of hosts without a filter */
+};
+typedef struct dns_filter_delta_stats dns_filter_delta_stats_t;
+
+// Reads the delta file `path`. `line` gets the number of the first malformed line, 0 when the file cannot be read.
+dns_filter_delta_t *
+new_dns_filter_delta (const char *path, int *line, dns_rc_t *rc);
+
+void
+destroy_dns_filter_delta (dns_filter_delta_t *delta);
+
+// View of `set` (which must outlive it) without overlay
+dns_filter_view_t *
+new_dns_filter_view (const dns_filter_set_t *set, dns_rc_t *rc);
+
+// Frees the overlay, and with `with_set` the set a merge built
+void
+destroy_dns_filter_view (dns_filter_view_t *view, int with_set);
+
+// Next view of `view` with `delta` applied to its overlay
+dns_filter_view_t *
+dns_filter_view_apply (const dns_filter_view_t *view,
+                       const dns_filter_delta_t *delta,
+                       dns_filter_delta_stats_t *stats,
+                       dns_rc_t *rc);
+
+// Next view of `view` with the overlay compiled into a new set
+dns_filter_view_t *
+dns_filter_view_merge (const dns_filter_view_t *view, dns_rc_t *rc);
+
+static inline int
+dns_filter_view_should_merge (const dns_filter_view_t *view)
+{
+   int overlay = view->added_size + view->removed_count;
+   return overlay >= DNS_FILTER_MERGE_MIN && overlay >= view->set->size / 16;
+}
+
+// The first filter matching `name`, NULL when none does
+static inline const dns_filter_conf_t *
+dns_filter_view_match (const dns_filter_view_t *view, const dns_name_t *name)
+{
+   int f = dns_filter_set_match_except (view->set, view->removed, name);
+   if (f >= 0) {
+      return &view->set->filters[f];
+   }
+   if (view->added_size > 0 && (f = dns_filter_set_match (&view->added_set, name)) >= 0) {
+      return &view->added[f];
+   }
+   return NULL;
+}
+
+#endif // _FILTER_DELTA_H_
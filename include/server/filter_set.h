@@ -0,0 +1,63 @@
+#ifndef _FILTER_SET_H_
+#define _FILTER_SET_H_
+
+#include <stdint.h>
+
+#include "configuration/configuration.h"
+#include "dns/dns-protocol.h"
+#include "server/pattern_dfa.h"
+#include "utils/status.h"
+
+// Exact and suffix filters are indexed by the hash of their host in canonical wire format, so matching costs one
+// probe per label of the query name instead of a pass over every filter. Contains filters cannot be hashed and
+// stay a list, wildcard and regex filters share one automaton. A lookup still returns the first matching filter in
+// configuration order.
+struct dns_filter_key {
+   uint64_t hash;
+   int32_t filter; /* index into the filters, -1 marks an empty slot */
+   uint32_t key;   /* offset of the host in dns_filter_set_t.keys, a length byte followed by the wire format */
+};
+typedef struct dns_filter_key dns_filter_key_t;
+
+struct dns_filter_table {
+   dns_filter_key_t *slots;
+   uint32_t mask;
+   int count;
+};
+typedef struct dns_filter_table dns_filter_table_t;
+
+struct dns_filter_set {
+   const dns_filter_conf_t *filters;
+   int size;
+   dns_filter_table_t exact;
+   dns_filter_table_t suffix;
+   int *contains; /* indexes of the contains filters, ascending */
+   uint64_t *contains_grams; /* bigrams of every contains host, a host is only searched for when all of its
+                                bigrams occur in the name */
+   int contains_count;
+   dns_pattern_dfa_t patterns; /* wildcard and regex filters */
+   uint8_t *keys;
+};
+typedef struct dns_filter_set dns_filter_set_t;
+
+// `filters` must outlive the set
+dns_rc_t
+init_dns_filter_set (dns_filter_set_t *set, const dns_filter_conf_t *filters, int size);
+
+void
+clear_dns_filter_set (dns_filter_set_t *set);
+
+// Returns the index of the first filter matching `name`, -1 when none does
+int
+dns_filter_set_match (const dns_filter_set_t *set, const dns_name_t *name);
+
+// dns_filter_set_match skipping the exact and suffix filters whose bit is set in `removed` (one per filter, NULL
+// skips none)
+int
+dns_filter_set_match_except (const dns_filter_set_t *set, const uint8_t *removed, const dns_name_t *name);
+
+// Index of the exact or suffix filter `name` is the host of, -1 when there is none or for other match types
+int
+dns_filter_set_find (const dns_filter_set_t *set, dns_match_type_t match_type, const dns_name_t *name);
+
+#endif // _FILTER_SET_H_
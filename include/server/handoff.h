@@ -0,0 +1,46 @@
+#ifndef _HANDOFF_H_
+#define _HANDOFF_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <arpa/inet.h>
+
+#define DNS_HANDOFF_ENV "DNS_PROXY_HANDOFF_FD" /* channel descriptor of a process started by an upgrade */
+#define DNS_HANDOFF_MAX_SOCKETS 64
+#define DNS_HANDOFF_TIMEOUT_MS 10000 /* how long the new process may take to start serving */
+
+// Graceful upgrade: the running process execs the new binary and passes it the listening socket over a unix socket
+// pair (SCM_RIGHTS). Both processes serve the shared socket until the new one reports that it is ready, then the old
+// one answers what it already received, waits for the answers to its forwarded queries and exits, so no datagram is
+// lost.
+
+// A socket passed along, known by the address it is bound to
+struct dns_handoff_socket {
+   char host[INET6_ADDRSTRLEN];
+   uint16_t port;
+   int fd;
+};
+typedef struct dns_handoff_socket dns_handoff_socket_t;
+
+// Old process: starts `exe` with the channel in its environment and sends it `sockets`, the listening socket first.
+// Returns the channel for dns_handoff_poll, -1 when the process could not be started.
+int
+dns_handoff_spawn (const char *exe, const dns_handoff_socket_t *sockets, int count, pid_t *pid);
+
+// Old process: 1 once the new process serves, 0 while it starts, -1 when it exited before
+int
+dns_handoff_poll (int channel);
+
+// New process: the channel inherited from the old process, -1 for a normal start
+int
+dns_handoff_channel ();
+
+// New process: receives at most `max` sockets, returns their count or -1
+int
+dns_handoff_receive (int channel, dns_handoff_socket_t *sockets, int max);
+
+// New process: tells the old process to stop and closes the channel
+void
+dns_handoff_ready (int channel);
+
+#endif // _HANDOFF_H_
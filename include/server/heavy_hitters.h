@@ -0,0 +1,79 @@
+#ifndef _HEAVY_HITTERS_H_
+#define _HEAVY_HITTERS_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "dns/dns-protocol.h"
+#include "utils/status.h"
+
+#define DNS_HH_MAX_SIZE 16384 /* keys tracked per sketch and worker */
+#define DNS_HH_KEY_MAX RR_NAME_MAX
+
+enum dns_hh_kind { DNS_HH_NAMES = 0, DNS_HH_BLOCKED = 1, DNS_HH_CLIENTS = 2, DNS_HH_KINDS = 3 };
+typedef enum dns_hh_kind dns_hh_kind_t;
+
+extern const char *dns_hh_kind_desc[];
+
+// A tracked key. Its true count lies between count - error and count.
+struct dns_hh_entry {
+   uint64_t hash;
+   uint64_t count;
+   uint64_t error; /* count of the key this one replaced */
+   int32_t heap;   /* position in dns_hh_sketch_t.heap */
+   uint16_t length;
+   uint8_t key[DNS_HH_KEY_MAX]; /* canonical wire name, or the address family followed by the address */
+};
+typedef struct dns_hh_entry dns_hh_entry_t;
+
+// Space-Saving: a fixed number of counters with a hash index by key and a min-heap by count. A key that is not
+// tracked takes over the counter of the smallest one and inherits its count as error, so any key seen more often
+// than total / size times is guaranteed a counter, whatever the number of distinct keys.
+struct dns_hh_sketch {
+   dns_hh_entry_t *entries;
+   int32_t *heap;  /* entry indexes, smallest count first */
+   int32_t *slots; /* key index, entry index + 1, 0 marks an empty slot */
+   uint32_t slot_mask;
+   int size;
+   int count;
+   uint64_t total; /* keys counted */
+};
+typedef struct dns_hh_sketch dns_hh_sketch_t;
+
+// Sketches of one worker. The worker takes the lock once per query, the control thread while it merges.
+struct dns_heavy_hitters {
+   pthread_mutex_t lock;
+   dns_hh_sketch_t sketches[DNS_HH_KINDS];
+};
+typedef struct dns_heavy_hitters dns_heavy_hitters_t;
+
+// One line of a merged top list
+struct dns_hh_top {
+   uint64_t count;
+   uint64_t error;
+   uint16_t length;
+   uint8_t key[DNS_HH_KEY_MAX];
+};
+typedef struct dns_hh_top dns_hh_top_t;
+
+dns_heavy_hitters_t *
+new_dns_heavy_hitters (int size, dns_rc_t *rc);
+
+void
+destroy_dns_heavy_hitters (dns_heavy_hitters_t *hh);
+
+// Counts the query name (`qname` may have length 0), the name again when the query was `blocked` and the client
+void
+dns_heavy_hitters_count (dns_heavy_hitters_t *hh,
+                         const dns_name_t *qname,
+                         int blocked,
+                         const struct sockaddr_storage *client);
+
+// Merges the `kind` sketches of `count` workers and writes the `n` largest keys into `top`, largest first.
+// Returns the number written, `total` gets the number of keys counted by all of them.
+int
+dns_heavy_hitters_top (
+   dns_heavy_hitters_t *const *hh, int count, dns_hh_kind_t kind, dns_hh_top_t *top, int n, uint64_t *total);
+
+#endif // _HEAVY_HITTERS_H_
@@ -0,0 +1,80 @@
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define DNS_LATENCY_SUB_BUCKETS 4 /* per power of two, a value lands in a bucket at most 25% wider than itself */
+#define DNS_LATENCY_BUCKETS 256
+
+// Where the time of a query goes. All stages start or end at the kernel receive timestamp or at a clock read in
+// the worker, so the queueing before a worker picks a datagram up shows apart from the work done on it.
+enum dns_stage {
+   DNS_STAGE_QUEUE = 0,        /* kernel receive of the query to the worker picking it up */
+   DNS_STAGE_PARSE = 1,        /* parsing the query */
+   DNS_STAGE_DECIDE = 2,       /* client group, filters, zone and cache, encoding an answer of the proxy itself */
+   DNS_STAGE_REPLY = 3,        /* sending an answer of the proxy itself */
+   DNS_STAGE_FORWARD = 4,      /* handing a query to an upstream socket */
+   DNS_STAGE_UPSTREAM = 5,     /* upstream send to the kernel receiving its answer */
+   DNS_STAGE_ANSWER_QUEUE = 6, /* kernel receive of the upstream answer to the worker picking it up */
+   DNS_STAGE_RELAY = 7,        /* relaying the upstream answer to the client */
+   DNS_STAGE_TOTAL = 8,        /* kernel receive of the query to its answer, local or relayed */
+   DNS_STAGES = 9
+};
+typedef enum dns_stage dns_stage_t;
+
+extern const char *dns_stage_desc[];
+
+// Per worker histograms with log-linear buckets, written by the worker only. Clock reads inside a batch are TSC
+// deltas from an anchor taken once per batch from CLOCK_REALTIME, the clock of the kernel timestamps.
+struct dns_latency {
+   uint64_t anchor_ns;
+   uint64_t anchor_tsc;
+   uint64_t counts[DNS_STAGES][DNS_LATENCY_BUCKETS];
+   uint64_t sums[DNS_STAGES];
+   uint64_t max[DNS_STAGES];
+};
+typedef struct dns_latency dns_latency_t;
+
+// Measures the TSC rate against CLOCK_MONOTONIC, once before the workers start. Without an invariant TSC every
+// clock read is a clock_gettime.
+void
+dns_latency_calibrate (void);
+
+dns_latency_t *
+new_dns_latency (void);
+
+void
+destroy_dns_latency (dns_latency_t *lat);
+
+// Takes the CLOCK_REALTIME anchor of the next batch
+void
+dns_latency_anchor (dns_latency_t *lat);
+
+// CLOCK_REALTIME ns
+uint64_t
+dns_latency_now (const dns_latency_t *lat);
+
+// Records `to_ns - from_ns`. Nothing is recorded when `from_ns` is unknown (0) or the clocks disagree.
+static inline void
+dns_latency_add (dns_latency_t *lat, dns_stage_t stage, uint64_t from_ns, uint64_t to_ns)
+{
+   if (from_ns == 0 || to_ns < from_ns) {
+      return;
+   }
+   uint64_t v = to_ns - from_ns;
+   int bucket = (int) v;
+   if (v >= DNS_LATENCY_SUB_BUCKETS) {
+      int msb = 63 - __builtin_clzll (v);
+      bucket = (msb - 1) * DNS_LATENCY_SUB_BUCKETS + (int) ((v >> (msb - 2)) & (DNS_LATENCY_SUB_BUCKETS - 1));
+   }
+   ++lat->counts[stage][bucket];
+   lat->sums[stage] += v;
+   lat->max[stage] = v > lat->max[stage] ? v : lat->max[stage];
+}
+
+// Merges the histograms of `count` workers and prints count, mean and percentiles in microseconds per stage
+void
+dns_latency_print (dns_latency_t *const *lat, int count, FILE *out);
+
+#endif // _LATENCY_H_
@@ -0,0 +1,49 @@
+#ifndef _LPM_H_
+#define _LPM_H_
+
+#include <stdint.h>
+
+#include "utils/status.h"
+
+// Longest prefix match over IPv4 or IPv6 addresses, DIR-16-8 style: a 2^16 entry root indexed by the first two
+// address bytes, followed by 256 entry nodes for every further byte. Prefixes are leaf-pushed into every slot they
+// cover, so a lookup is at most one memory read per address byte past the root, however many prefixes there are.
+#define LPM_ROOT_BITS 16
+#define LPM_NODE_BITS 8
+#define LPM_CHILD_FLAG 0x80000000u
+#define LPM_NO_MATCH 0
+
+struct lpm {
+   uint32_t *root;
+   uint32_t *nodes;
+   uint8_t *root_len; /* prefix length behind every leaf, only needed while inserting */
+   uint8_t *node_len;
+   uint32_t node_count;
+   uint32_t node_cap;
+   int addr_len; /* 4 or 16 bytes */
+};
+typedef struct lpm lpm_t;
+
+lpm_t *
+new_lpm (int addr_len, dns_rc_t *rc);
+
+void
+destroy_lpm (lpm_t *lpm);
+
+// `value` must be non zero and below LPM_CHILD_FLAG. Prefixes may be inserted in any order, a prefix of the same
+// length as an existing one replaces its value.
+dns_rc_t
+lpm_insert (lpm_t *lpm, const uint8_t *addr, int prefix_len, uint32_t value);
+
+// Returns the value of the longest prefix covering `addr` or LPM_NO_MATCH
+static inline uint32_t
+lpm_lookup (const lpm_t *lpm, const uint8_t *addr)
+{
+   uint32_t e = lpm->root[((uint32_t) addr[0] << 8) | addr[1]];
+   for (int i = 2; (e & LPM_CHILD_FLAG) && i < lpm->addr_len; ++i) {
+      e = lpm->nodes[((e & ~LPM_CHILD_FLAG) << LPM_NODE_BITS) | addr[i]];
+   }
+   return e;
+}
+
+#endif // _LPM_H_
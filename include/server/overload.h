@@ -0,0 +1,49 @@
+#ifndef _OVERLOAD_H_
+#define _OVERLOAD_H_
+
+#include <stdint.h>
+
+#include "configuration/configuration.h"
+#include "server/dns_io.h"
+#include "utils/status.h"
+
+// What a worker does with the queries it would forward. Cache hits and answers of the proxy itself are served at
+// every level, they cost no more than shedding them would.
+enum dns_load_level {
+   DNS_LOAD_NORMAL = 0, /* forwarded */
+   DNS_LOAD_SHED = 1,   /* answered SERVFAIL or TC */
+   DNS_LOAD_DROP = 2    /* not answered */
+};
+typedef enum dns_load_level dns_load_level_t;
+
+extern const char *dns_load_level_desc[];
+
+// Load of one worker, measured once per batch from the fill of its socket receive buffer and the age of the oldest
+// query of the batch. A level is left once both are under half of its thresholds, so a single fast batch in the
+// middle of a flood does not let it through. Written by the worker only.
+struct dns_overload {
+   uint64_t lag_ns[3];  /* thresholds per level, index 0 unused */
+   int queue[3];        /* percent of the receive buffer */
+   dns_overload_action_t action;
+   dns_load_level_t level;
+   uint64_t last_lag_ns; /* of the last batch */
+   int last_queue;
+   uint32_t base_drops;   /* drops of the socket when the worker started */
+   uint32_t kernel_drops; /* datagrams the kernel dropped since, the receive buffer was full */
+   uint64_t shed;
+   uint64_t dropped;
+   uint64_t overloaded; /* batches over the shedding thresholds */
+};
+typedef struct dns_overload dns_overload_t;
+
+dns_overload_t *
+new_dns_overload (const dns_overload_conf_t *conf, int sockfd, dns_rc_t *rc);
+
+void
+destroy_dns_overload (dns_overload_t *ov);
+
+// Measures the listening socket `sockfd` and the queries of a batch, then sets the level the batch is served with
+void
+dns_overload_measure (dns_overload_t *ov, int sockfd, const dns_datagram_t *dgrams, int count);
+
+#endif // _OVERLOAD_H_
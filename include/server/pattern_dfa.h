@@ -0,0 +1,50 @@
+#ifndef _PATTERN_DFA_H_
+#define _PATTERN_DFA_H_
+
+#include <stdint.h>
+
+#include "configuration/configuration.h"
+#include "utils/status.h"
+
+#define DNS_DFA_MAX_STATES 65535       /* transitions are 16 bit, compiling more states fails */
+#define DNS_DFA_MAX_NFA_STATES 262144  /* bound on the expanded patterns */
+#define DNS_DFA_MAX_REPEAT 255         /* largest bound of a {n,m} counter */
+
+// Wildcard and regex filters compiled together into one minimized deterministic automaton over the dotted,
+// lowercase name. Matching is a single pass of table lookups over the name whatever the number of patterns, and
+// every state knows the first filter (in configuration order) that matches when the name ends there.
+//
+// wildcard: the whole name against `*` (any run of characters, dots included), `?` (any one character) and
+//           literal characters
+// regex:    a search for `.`, `[a-z0-9]` and `[^...]` classes, `\d`, `\w`, escaped literals, `( )`, `|` and the
+//           `*`, `+`, `?`, `{n}`, `{n,}`, `{n,m}` quantifiers. `^` and `$` anchor the match to the start and the
+//           end of the name. There are no backreferences or lookarounds, which a DFA cannot express.
+struct dns_pattern_dfa {
+   uint16_t *next; /* state * class_count + class */
+   int32_t *accept; /* first filter matching a name that ends in the state, -1 for none */
+   uint8_t *stop;   /* no further input leaves the state, the match result is final */
+   uint8_t classes[256]; /* bytes no pattern tells apart share a class and a table column */
+   int class_count;
+   int state_count;
+   int start;
+   int first; /* lowest filter index compiled, -1 without patterns */
+};
+typedef struct dns_pattern_dfa dns_pattern_dfa_t;
+
+// Compiles the wildcard and regex filters of `filters`, the others are skipped. Fails with kDataMalformed when
+// one of them is not a valid pattern and with kAborted when the automaton grows beyond DNS_DFA_MAX_STATES.
+dns_rc_t
+init_dns_pattern_dfa (dns_pattern_dfa_t *dfa, const dns_filter_conf_t *filters, int size);
+
+void
+clear_dns_pattern_dfa (dns_pattern_dfa_t *dfa);
+
+// 0 when `pattern` is a valid pattern of `type` (DNS_MT_WILDCARD or DNS_MT_REGEX), -1 otherwise
+int
+dns_pattern_check (dns_match_type_t type, const char *pattern);
+
+// First filter matching the dotted `text` of `length` bytes, -1 when none does
+int
+dns_pattern_dfa_match (const dns_pattern_dfa_t *dfa, const uint8_t *text, int length);
+
+#endif // _PATTERN_DFA_H_
@@ -0,0 +1,84 @@
+#ifndef _PENDING_H_
+#define _PENDING_H_
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "dns/dns-ecs.h"
+#include "dns/dns-protocol.h"
+#include "utils/status.h"
+
+#define DNS_PENDING_DEFAULT_SIZE 4096 /* queries waiting for an upstream answer at once */
+
+// A forwarded query waiting for its answer. It went out with a random ID on one socket of the upstream pool, the
+// answer is matched by that socket and ID and goes back to the client with the client's ID.
+struct dns_pending_query {
+   struct sockaddr_storage client;
+   socklen_t client_len;
+   uint64_t recv_ns;     /* CLOCK_REALTIME, for the query log */
+   uint64_t deadline_ns; /* CLOCK_MONOTONIC */
+   uint64_t start_ns;    /* CLOCK_REALTIME receive of the query and its upstream send for the stage latency and */
+   uint64_t sent_ns;     /* the slow queries, 0 without both */
+   uint32_t key;         /* socket << 16 | upstream ID */
+   int32_t prev;         /* neighbours in the deadline order of the upstream */
+   int32_t next;
+   int upstream;
+   int32_t prefetch; /* name of a prefetch query of the proxy itself, -1 for client queries */
+   dns_ecs_t ecs;    /* client subnet added to the query, see ecs_mode */
+   uint8_t ecs_mode;
+   uint16_t client_id;
+   uint16_t length;
+   uint8_t query[DNS_UDP_MAX_PACKLEN]; /* as the client sent it */
+};
+typedef struct dns_pending_query dns_pending_query_t;
+
+// Fixed pool of pending queries with a hash index by key. Every upstream keeps its queries in sending order, which
+// is deadline order as all of them wait the same time, so expiring only looks at the oldest ones.
+struct dns_pending {
+   dns_pending_query_t *queries;
+   int32_t *slots; /* key index, query index + 1, 0 marks an empty slot */
+   uint32_t slot_mask;
+   int32_t *free;
+   int free_count;
+   int capacity;
+   int32_t *heads; /* oldest query of every upstream, -1 when there is none */
+   int32_t *tails;
+   int upstream_count;
+   int count;
+   uint64_t rng;
+   uint64_t full; /* queries refused because every entry was in use */
+};
+typedef struct dns_pending dns_pending_t;
+
+dns_pending_t *
+new_dns_pending (int capacity, int upstream_count, dns_rc_t *rc);
+
+void
+destroy_dns_pending (dns_pending_t *pending);
+
+// Takes an entry for a query sent on `socket` of `upstream` and picks its random ID, unique on that socket.
+// Returns NULL when the table is full.
+dns_pending_query_t *
+dns_pending_add (dns_pending_t *pending, int upstream, uint16_t socket, uint64_t deadline_ns);
+
+static inline uint16_t
+dns_pending_id (const dns_pending_query_t *query)
+{
+   return (uint16_t) query->key;
+}
+
+dns_pending_query_t *
+dns_pending_find (dns_pending_t *pending, uint16_t socket, uint16_t id);
+
+void
+dns_pending_remove (dns_pending_t *pending, dns_pending_query_t *query);
+
+// Oldest query of `upstream` when its deadline has passed, NULL otherwise
+dns_pending_query_t *
+dns_pending_expired (dns_pending_t *pending, int upstream, uint64_t now_ns);
+
+// Earliest deadline of all pending queries, UINT64_MAX when there is none
+uint64_t
+dns_pending_next_deadline (const dns_pending_t *pending);
+
+#endif // _PENDING_H_
@@ -0,0 +1,59 @@
+#ifndef _POLICY_H_
+#define _POLICY_H_
+
+#include <stdatomic.h>
+#include <sys/socket.h>
+
+#include "configuration/configuration.h"
+#include "dns/dns-parse.h"
+#include "server/filter_delta.h"
+#include "server/filter_set.h"
+#include "server/lpm.h"
+#include "server/zone.h"
+#include "utils/status.h"
+
+#define DNS_DEFAULT_GROUP_NAME "default"
+
+struct dns_policy_group {
+   const uint8_t *name;
+   dns_access_type_t access;
+   dns_filter_set_t filter_set;     /* compiled from the configuration */
+   dns_filter_view_t *_Atomic view; /* what queries are matched against, replaced as a whole by delta files */
+};
+typedef struct dns_policy_group dns_policy_group_t;
+
+// Runtime form of the configuration: the client groups and the prefix tables selecting them.
+// Group 0 is the default one, built from the top level filters, for clients no group prefix covers.
+// The local zone is shared by all groups and only consulted for queries the group filters let through.
+struct dns_policy {
+   dns_policy_group_t *groups;
+   int group_count;
+   lpm_t *v4;
+   lpm_t *v6;
+   dns_zone_t *zone; /* NULL without a zone configuration */
+   dns_filter_set_t routes; /* suffix filters over the route domains, the most specific domain first */
+   dns_filter_conf_t *route_domains;
+   int *route_upstreams; /* upstream of every route domain, upstream 0 is the default forwarder */
+   dns_ecs_conf_t ecs;   /* client subnet of forwarded queries */
+};
+typedef struct dns_policy dns_policy_t;
+
+dns_policy_t *
+new_dns_policy (const dns_conf_t *conf, dns_rc_t *rc);
+
+void
+destroy_dns_policy (dns_policy_t *policy);
+
+// `client` may be NULL (offline tools), the default group is returned then
+const dns_policy_group_t *
+dns_policy_lookup (const dns_policy_t *policy, const struct sockaddr_storage *client);
+
+// Upstream for the first question of `dht`: the route of its most specific domain, 0 when none covers it
+int
+dns_policy_route (const dns_policy_t *policy, const dns_h_t *dht);
+
+// Same as dns_policy_route for the name `name`
+int
+dns_policy_route_name (const dns_policy_t *policy, const dns_name_t *name);
+
+#endif // _POLICY_H_
@@ -0,0 +1,71 @@
+#ifndef _PREFETCH_H_
+#define _PREFETCH_H_
+
+#include <stdint.h>
+
+#include "configuration/configuration.h"
+#include "dns/dns-protocol.h"
+#include "server/heavy_hitters.h"
+#include "server/policy.h"
+#include "utils/status.h"
+
+#define DNS_PREFETCH_MAX_NAMES 16384
+#define DNS_PREFETCH_QUERY_MAX (sizeof (dns_header_t) + RR_NAME_MAX + 4 + 11) /* question and an OPT record */
+#define DNS_PREFETCH_RETRY_S 10 /* wait after a timeout or an answer that cannot be cached */
+#define DNS_PREFETCH_MIN_S 1    /* shortest refresh interval, for answers with tiny TTLs */
+
+// One name and type kept in the cache, with the query that refreshes it
+struct dns_prefetch_name {
+   uint64_t due_ns; /* CLOCK_MONOTONIC */
+   int upstream;    /* route of the name */
+   uint16_t length;
+   uint8_t query[DNS_PREFETCH_QUERY_MAX];
+};
+typedef struct dns_prefetch_name dns_prefetch_name_t;
+
+// Names resolved through the forwarders at startup and again once `refresh_percent` of their TTL went by, so client
+// queries for them hit the cache. The names waiting for their refresh sit in a min-heap by due time, a name is out
+// of it while its query is on the way. Sends take a token of a bucket refilled at `queries_per_second` and holding
+// one second of them. Used by worker 0 only.
+struct dns_prefetch {
+   dns_prefetch_name_t *names;
+   int32_t *heap; /* name indexes, earliest due time first */
+   int count;
+   int heap_count;
+   int refresh_percent;
+   double rate; /* tokens per ns */
+   double tokens;
+   double burst;
+   uint64_t refill_ns;
+   uint64_t sent;
+   uint64_t refreshed; /* answers cached */
+   uint64_t failed;    /* timeouts, failed sends and answers not cached */
+};
+typedef struct dns_prefetch dns_prefetch_t;
+
+// Reads a "name [TYPE]" entry, `type` gets 0 when none is given. Returns -1 when it is malformed.
+int
+dns_prefetch_parse (const char *text, dns_name_t *name, uint16_t *type);
+
+// Names of `conf` then those of the hot names file when there is one, each without a type as A and AAAA, routed by
+// `policy`. All of them are due right away.
+dns_prefetch_t *
+new_dns_prefetch (const dns_prefetch_conf_t *conf, const dns_policy_t *policy, dns_rc_t *rc);
+
+void
+destroy_dns_prefetch (dns_prefetch_t *prefetch);
+
+// Next name to refresh when one is due and a token left, taken out of the schedule. Returns its index, -1 otherwise.
+int
+dns_prefetch_next (dns_prefetch_t *prefetch, uint64_t now_ns);
+
+// Puts name `index` back in the schedule: refreshed after `refresh_percent` of `ttl`, the TTL its answer was cached
+// with, or after DNS_PREFETCH_RETRY_S when `ttl` is 0
+void
+dns_prefetch_done (dns_prefetch_t *prefetch, int index, uint32_t ttl, uint64_t now_ns);
+
+// Writes the names of `top`, most queried first, to `path` through a temporary file renamed over it
+dns_rc_t
+dns_prefetch_save_hot (const char *path, const dns_hh_top_t *top, int count);
+
+#endif // _PREFETCH_H_
@@ -0,0 +1,63 @@
+#ifndef _RATE_LIMIT_H_
+#define _RATE_LIMIT_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include "configuration/configuration.h"
+#include "utils/status.h"
+
+#define RATE_LIMIT_DEFAULT_TABLE_SIZE 65536
+#define RATE_LIMIT_DEFAULT_IPV4_PREFIX 24
+#define RATE_LIMIT_DEFAULT_IPV6_PREFIX 56
+#define RATE_LIMIT_MAX_PROBE 8 /* slots inspected before the stalest bucket is recycled, a power of two */
+#define RATE_LIMIT_STRIPES 256 /* locks, probe group i is guarded by stripe i % RATE_LIMIT_STRIPES */
+
+// Response categories are limited independently, as in BIND RRL
+enum rate_limit_class { RL_CLASS_RESPONSE = 0, RL_CLASS_NXDOMAIN = 1, RL_CLASS_ERROR = 2 };
+typedef enum rate_limit_class rate_limit_class_t;
+
+struct rate_limit_bucket {
+   uint64_t key; /* hash of client prefix and class, 0 marks an empty slot */
+   uint64_t stamp_ns; /* time the tokens are refilled up to */
+   int64_t tokens; /* in 1/1000 of a response */
+};
+typedef struct rate_limit_bucket rate_limit_bucket_t;
+
+// Lock of a group of buckets, a cache line each so workers limiting different clients share none
+struct rate_limit_stripe {
+   _Alignas (64) pthread_mutex_t lock;
+   uint64_t limited;
+};
+typedef struct rate_limit_stripe rate_limit_stripe_t;
+
+// Workers share the table. A key only probes the RATE_LIMIT_MAX_PROBE aligned slots of its group, so one stripe
+// lock covers every bucket it can use.
+struct rate_limit {
+   rate_limit_bucket_t *buckets;
+   rate_limit_stripe_t *stripes;
+   uint64_t mask;
+   int64_t rate;  /* tokens per second, in 1/1000 of a response */
+   int64_t burst; /* bucket capacity, in 1/1000 of a response */
+   uint8_t ipv4_prefix;
+   uint8_t ipv6_prefix;
+   dns_rate_limit_action_t action;
+};
+typedef struct rate_limit rate_limit_t;
+
+rate_limit_t *
+new_rate_limit (const dns_rate_limit_conf_t *conf, dns_rc_t *rc);
+
+void
+destroy_rate_limit (rate_limit_t *rl);
+
+// Takes one token from the client prefix bucket of `cls`, returns 0 when the response is over the limit
+int
+rate_limit_allow (rate_limit_t *rl, const struct sockaddr_storage *client, rate_limit_class_t cls, uint64_t now_ns);
+
+// Responses over the limit so far, summed over all stripes
+uint64_t
+rate_limit_limited (rate_limit_t *rl);
+
+#endif // _RATE_LIMIT_H_
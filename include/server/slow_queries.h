@@ -0,0 +1,86 @@
+#ifndef _SLOW_QUERIES_H_
+#define _SLOW_QUERIES_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "configuration/configuration.h"
+#include "dns/dns-protocol.h"
+#include "server/dns_io.h"
+#include "utils/status.h"
+
+#define DNS_SLOW_QUERIES_MAX_SIZE 4096
+
+enum dns_slow_reason {
+   DNS_SLOW_THRESHOLD = 0, /* answered after the threshold */
+   DNS_SLOW_SAMPLED = 1,   /* picked by the sampling rate */
+   DNS_SLOW_TIMEOUT = 2    /* the upstream did not answer, the client got SERVFAIL */
+};
+typedef enum dns_slow_reason dns_slow_reason_t;
+
+extern const char *dns_slow_reason_desc[];
+
+struct dns_slow_info {
+   struct sockaddr_storage client;
+   uint64_t answered_ns; /* CLOCK_REALTIME */
+   uint64_t total_ns;    /* kernel receive, or pick up without timestamps, to the answer */
+   uint64_t upstream_ns; /* upstream send to its answer, 0 for answers of the proxy itself */
+   int upstream;         /* -1 for answers of the proxy itself */
+   int worker;
+   dns_slow_reason_t reason;
+};
+typedef struct dns_slow_info dns_slow_info_t;
+
+struct dns_slow_query {
+   dns_slow_info_t info;
+   uint16_t query_length;
+   uint16_t answer_length;
+   uint8_t query[DNS_UDP_MAX_PACKLEN];
+   uint8_t answer[DNS_IO_BUFFER_SIZE];
+};
+typedef struct dns_slow_query dns_slow_query_t;
+
+// Bounded ring of the queries answered slower than a threshold, plus a sample of the others, with both packets.
+// Workers take the lock only to store a capture, so queries under the threshold never touch it.
+struct dns_slow_queries {
+   pthread_mutex_t lock;
+   dns_slow_query_t *entries;
+   int size;
+   int next;
+   int count;
+   uint64_t captured;
+   uint64_t threshold_ns;
+   int sample_rate; /* one in `sample_rate` answers, 0 samples none */
+};
+typedef struct dns_slow_queries dns_slow_queries_t;
+
+dns_slow_queries_t *
+new_dns_slow_queries (const dns_slow_queries_conf_t *conf, dns_rc_t *rc);
+
+void
+destroy_dns_slow_queries (dns_slow_queries_t *slow);
+
+// Copies both packets, the oldest capture is overwritten when the ring is full
+void
+dns_slow_queries_add (dns_slow_queries_t *slow,
+                      const dns_slow_info_t *info,
+                      const uint8_t *query,
+                      int query_length,
+                      const uint8_t *answer,
+                      int answer_length);
+
+// Copy of the captures, oldest first, for the caller to free. Holds the lock only while copying.
+dns_slow_query_t *
+dns_slow_queries_snapshot (dns_slow_queries_t *slow, int *count);
+
+// Writes `count` captures as a nanosecond pcap of raw IP packets: the query from the client to `server` at its
+// receive time and the answer back at its answer time
+void
+dns_slow_queries_write_pcap (const dns_slow_query_t *entries,
+                             int count,
+                             const struct sockaddr_storage *server,
+                             FILE *out);
+
+#endif // _SLOW_QUERIES_H_
@@ -0,0 +1,60 @@
+#ifndef _ZONE_H_
+#define _ZONE_H_
+
+#include <stdint.h>
+
+#include "configuration/configuration.h"
+#include "dns/dns-parse.h"
+#include "utils/status.h"
+
+#define DNS_ZONE_MAX_CHAIN 8 /* CNAME records followed for one answer */
+
+// Records of one owner name and type, kept encoded as they go on the wire (type, class, ttl, rdlength, rdata) so
+// an answer only has to put an owner name pointer in front of every record
+struct dns_zone_rrset {
+   uint16_t type;
+   uint16_t count;
+   uint32_t data;   /* offset of the first record in dns_zone_t.data */
+   uint32_t length; /* bytes of all records, owner names excluded */
+};
+typedef struct dns_zone_rrset dns_zone_rrset_t;
+
+struct dns_zone_node {
+   uint64_t hash;
+   uint32_t name;   /* offset of the owner in dns_zone_t.data, a length byte followed by the wire format */
+   uint32_t rrsets; /* index of the first rrset, the rrsets of a node are contiguous */
+   uint16_t rrset_count; /* 0 for the domains and the names that only exist because a name below them does */
+   uint8_t apex;
+   uint8_t used;
+};
+typedef struct dns_zone_node dns_zone_node_t;
+
+// Local names compiled from the `zone` configuration, looked up by the hash of their canonical name
+struct dns_zone {
+   dns_zone_node_t *nodes;
+   uint32_t mask;
+   int node_count;
+   dns_zone_rrset_t *rrsets;
+   uint8_t *data;
+};
+typedef struct dns_zone dns_zone_t;
+
+dns_zone_t *
+new_dns_zone (const dns_zone_conf_t *conf, dns_rc_t *rc);
+
+void
+destroy_dns_zone (dns_zone_t *zone);
+
+// Encodes the presentation format `data` of a `type` record into `rdata` (DNS_UDP_MAX_PACKLEN bytes).
+// Returns the rdata length or -1 when `data` is not valid for the type.
+int
+dns_zone_encode_rdata (uint16_t type, const char *data, uint8_t *rdata);
+
+// Answers the single question of `dht` when its name belongs to the zone: the records of the
+// name, following CNAME records, NODATA when the name has no records of the type, NXDOMAIN for a missing name
+// below one of the domains. Returns the response length, 0 when the query has to be forwarded.
+// `resp` should hold at least DNS_UDP_MAX_PACKLEN bytes.
+int
+dns_zone_answer (const dns_zone_t *zone, const dns_h_t *dht, uint8_t *resp);
+
+#endif // _ZONE_H_
@@ -4,6 +4,8 @@
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
 #include "stddef.h"
 
 static inline void *
@@ -41,4 +43,34 @@ get_address_ip_binary (const uint8_t *string_addr, uint8_t *binary, int *length)
    return -1;
 }
 
+// Parses "addr/prefix" (or a bare address as a full length prefix), the address bits past the prefix are cleared
+static inline int
+get_cidr_binary (const uint8_t *cidr, uint8_t *binary, int *length, int *prefix_len)
+{
+   char addr[INET6_ADDRSTRLEN + 4] = {0};
+   const char *slash = strchr ((const char *) cidr, '/');
+   size_t addr_len = slash != NULL ? (size_t) (slash - (const char *) cidr) : strlen ((const char *) cidr);
+   if (addr_len >= sizeof (addr)) {
+      return -1;
+   }
+   memcpy (addr, cidr, addr_len);
+   if (get_address_ip_binary ((const uint8_t *) addr, binary, length) == -1) {
+      return -1;
+   }
+   *prefix_len = *length * 8;
+   if (slash != NULL) {
+      char *end = NULL;
+      long p = strtol (slash + 1, &end, 10);
+      if (end == slash + 1 || *end != 0 || p < 0 || p > *length * 8) {
+         return -1;
+      }
+      *prefix_len = (int) p;
+   }
+   for (int i = 0; i < *length; ++i) {
+      int bits = *prefix_len - i * 8;
+      binary[i] &= bits >= 8 ? 0xff : (bits <= 0 ? 0 : (uint8_t) (0xff << (8 - bits)));
+   }
+   return 0;
+}
+
 #endif // _NETWORK_TOOLS_H_
\ No newline at end of file
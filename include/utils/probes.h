@@ -0,0 +1,31 @@
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+// USDT probes of the dns_proxy provider, compiled in with -DENABLE_USDT=ON (needs sys/sdt.h of systemtap). An
+// unattached probe is a single nop; its arguments are evaluated either way, so they are only values already at hand.
+// Names are pointers to wire format names, IDs are in host order.
+//
+//   query__receive      worker, client ID, length, struct sockaddr_storage *client
+//   parse__failure      client ID, length
+//   filter__match       qname, qtype, action (dns_action_type_t), client ID
+//   cache__hit          qname, qtype, client ID
+//   cache__miss         qname, qtype, client ID
+//   query__shed         client ID, load level (dns_load_level_t), the query is answered SERVFAIL or TC, or dropped
+//   upstream__send      upstream, qname, client ID, upstream ID
+//   upstream__receive   upstream, qname, client ID, upstream ID, rcode
+//   upstream__timeout   upstream, qname, client ID, upstream ID
+//   reply__sent         client ID, rcode, length, forwarded (relayed upstream answer or SERVFAIL of a timeout)
+#ifdef DNS_PROXY_USDT
+#include <sys/sdt.h>
+#define DNS_PROBE2(name, a1, a2) DTRACE_PROBE2 (dns_proxy, name, a1, a2)
+#define DNS_PROBE3(name, a1, a2, a3) DTRACE_PROBE3 (dns_proxy, name, a1, a2, a3)
+#define DNS_PROBE4(name, a1, a2, a3, a4) DTRACE_PROBE4 (dns_proxy, name, a1, a2, a3, a4)
+#define DNS_PROBE5(name, a1, a2, a3, a4, a5) DTRACE_PROBE5 (dns_proxy, name, a1, a2, a3, a4, a5)
+#else
+#define DNS_PROBE2(name, a1, a2) ((void) 0)
+#define DNS_PROBE3(name, a1, a2, a3) ((void) 0)
+#define DNS_PROBE4(name, a1, a2, a3, a4) ((void) 0)
+#define DNS_PROBE5(name, a1, a2, a3, a4, a5) ((void) 0)
+#endif
+
+#endif // _PROBES_H_
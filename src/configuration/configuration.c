@@ -1,8 +1,651 @@
 #include "configuration/configuration.h"
+#include "dns/dns-protocol.h"
 #include "utils/file_tools.h"
 #include "utils/string_tools.h"
 #include <cJSON.h>
 
+static dns_rc_t
+parse_dns_filters (const cJSON *json_filters, dns_filter_conf_t **out_filters, int *out_size)
+{
+   if (!cJSON_IsArray (json_filters)) {
+      return kInvalidInput;
+   }
+   dns_rc_t rc = kOk;
+   int s = cJSON_GetArraySize (json_filters);
+   dns_filter_conf_t *filters = (dns_filter_conf_t *) calloc (s, sizeof (*filters));
+   *out_filters = filters;
+   *out_size = s;
+
+   int i = 0;
+   const cJSON *filter = NULL;
+   cJSON_ArrayForEach (filter, json_filters)
+   {
+      const cJSON *host = cJSON_GetObjectItem (filter, "host");
+      if (host != NULL) {
+         if (cJSON_IsString (host) && (host->valuestring != NULL)) {
+            size_t l = strlen (host->valuestring) + 1;
+            filters[i].host = (uint8_t *) malloc (l * sizeof (filters[i].host));
+            memcpy (filters[i].host, host->valuestring, l);
+         } else {
+            rc = kInvalidInput;
+            break;
+         }
+      }
+
+      const cJSON *redirect = cJSON_GetObjectItem (filter, "redirect_addr");
+      if (redirect != NULL) {
+         if (cJSON_IsString (redirect) && (redirect->valuestring != NULL)) {
+            size_t l = strlen (redirect->valuestring) + 1;
+
+            filters[i].redirect_addr = (uint8_t *) malloc (l * sizeof (filters[i].redirect_addr));
+
+            strncpy (filters[i].redirect_addr, redirect->valuestring, l);
+         } else {
+            rc = kInvalidInput;
+            break;
+         }
+      }
+
+      const cJSON *filter_type = cJSON_GetObjectItem (filter, "type");
+      if (filter_type != NULL) {
+         if (cJSON_IsString (filter_type) && (filter_type->valuestring != NULL)) {
+            if (str_i_cmp (filter_type->valuestring, "ALL") == 0)
+               filters[i].filter_type = DNS_FT_ALL;
+            else if (str_i_cmp (filter_type->valuestring, "A") == 0)
+               filters[i].filter_type = DNS_FT_IPV4;
+            else if (str_i_cmp (filter_type->valuestring, "AAAA") == 0)
+               filters[i].filter_type = DNS_FT_IPV6;
+            else {
+               rc = kInvalidInput;
+               break;
+            }
+         } else {
+            rc = kInvalidInput;
+            break;
+         }
+      }
+
+      const cJSON *match_type = cJSON_GetObjectItem (filter, "matching");
+      if (match_type != NULL) {
+         if (cJSON_IsString (match_type) && (match_type->valuestring != NULL)) {
+            if (str_i_cmp (match_type->valuestring, "contains") == 0)
+               filters[i].match_type = DNS_MT_CONTAINS;
+            else if (str_i_cmp (match_type->valuestring, "exact") == 0)
+               filters[i].match_type = DNS_MT_EXACT;
+            else if (str_i_cmp (match_type->valuestring, "suffix") == 0)
+               filters[i].match_type = DNS_MT_SUFFIX;
+            else if (str_i_cmp (match_type->valuestring, "wildcard") == 0)
+               filters[i].match_type = DNS_MT_WILDCARD;
+            else if (str_i_cmp (match_type->valuestring, "regex") == 0)
+               filters[i].match_type = DNS_MT_REGEX;
+            else {
+               rc = kInvalidInput;
+               break;
+            }
+         } else {
+            rc = kInvalidInput;
+            break;
+         }
+      }
+
+      // names are compared lower case; patterns match either case already, and folding them would turn escapes
+      // such as \D into \d
+      dns_match_type_t mt = filters[i].match_type;
+      if (filters[i].host != NULL && mt != DNS_MT_WILDCARD && mt != DNS_MT_REGEX) {
+         for (uint8_t *c = filters[i].host; *c != 0; ++c) {
+            *c = tolower (*c);
+         }
+      }
+
+      const cJSON *action_type = cJSON_GetObjectItem (filter, "action");
+      if (action_type != NULL) {
+         if (cJSON_IsString (action_type) && (action_type->valuestring != NULL)) {
+            if (str_i_cmp (action_type->valuestring, "discard") == 0)
+               filters[i].action_type = DNS_AT_NOTFOUND;
+            else if (str_i_cmp (action_type->valuestring, "refuse") == 0)
+               filters[i].action_type = DNS_AT_REFUSE;
+            else if (str_i_cmp (action_type->valuestring, "redirect") == 0)
+               filters[i].action_type = DNS_AT_REDIRECT;
+            else {
+               rc = kInvalidInput;
+               break;
+            }
+         } else {
+            rc = kInvalidInput;
+            break;
+         }
+      }
+      ++i;
+   }
+   return rc;
+}
+
+static void
+destroy_dns_filters (dns_filter_conf_t *filters, int filter_size)
+{
+   for (int i = 0; i < filter_size; ++i) {
+      if (filters[i].host != NULL) {
+         free (filters[i].host);
+      }
+      if (filters[i].redirect_addr != NULL) {
+         free (filters[i].redirect_addr);
+      }
+   }
+   if (filter_size > 0) {
+      free (filters);
+   }
+}
+
+static dns_rc_t
+parse_dns_groups (const cJSON *json_groups, dns_group_conf_t **out_groups, int *out_size)
+{
+   if (!cJSON_IsArray (json_groups)) {
+      return kInvalidInput;
+   }
+   dns_rc_t rc = kOk;
+   int s = cJSON_GetArraySize (json_groups);
+   dns_group_conf_t *groups = (dns_group_conf_t *) calloc (s, sizeof (*groups));
+   *out_groups = groups;
+   *out_size = s;
+
+   int i = 0;
+   const cJSON *group = NULL;
+   cJSON_ArrayForEach (group, json_groups)
+   {
+      const cJSON *name = cJSON_GetObjectItem (group, "name");
+      if (cJSON_IsString (name) && (name->valuestring != NULL)) {
+         size_t l = strlen (name->valuestring) + 1;
+         groups[i].name = (uint8_t *) malloc (l * sizeof (*groups[i].name));
+         strncpy (groups[i].name, name->valuestring, l);
+      } else {
+         rc = kInvalidInput;
+         break;
+      }
+
+      const cJSON *clients = cJSON_GetObjectItem (group, "clients");
+      if (cJSON_IsArray (clients)) {
+         groups[i].client_size = cJSON_GetArraySize (clients);
+         groups[i].clients = (uint8_t **) calloc (groups[i].client_size, sizeof (*groups[i].clients));
+         int j = 0;
+         const cJSON *client = NULL;
+         cJSON_ArrayForEach (client, clients)
+         {
+            if (!cJSON_IsString (client) || client->valuestring == NULL) {
+               rc = kInvalidInput;
+               break;
+            }
+            size_t l = strlen (client->valuestring) + 1;
+            groups[i].clients[j] = (uint8_t *) malloc (l * sizeof (*groups[i].clients[j]));
+            strncpy (groups[i].clients[j], client->valuestring, l);
+            ++j;
+         }
+         if (rc != kOk) {
+            break;
+         }
+      } else {
+         rc = kInvalidInput;
+         break;
+      }
+
+      const cJSON *access = cJSON_GetObjectItem (group, "access");
+      if (access != NULL) {
+         if (cJSON_IsString (access) && (access->valuestring != NULL)) {
+            if (str_i_cmp (access->valuestring, "allow") == 0)
+               groups[i].access = DNS_ACCESS_ALLOW;
+            else if (str_i_cmp (access->valuestring, "deny") == 0)
+               groups[i].access = DNS_ACCESS_DENY;
+            else {
+               rc = kInvalidInput;
+               break;
+            }
+         } else {
+            rc = kInvalidInput;
+            break;
+         }
+      }
+
+      const cJSON *filters = cJSON_GetObjectItem (group, "filters");
+      if (filters != NULL) {
+         rc = parse_dns_filters (filters, &groups[i].filters, &groups[i].filter_size);
+         if (rc != kOk) {
+            break;
+         }
+      }
+      ++i;
+   }
+   return rc;
+}
+
+static dns_rc_t
+parse_dns_upstream (const cJSON *json_upstream, dns_server_conf_t *upstream)
+{
+   if (!cJSON_IsObject (json_upstream)) {
+      return kInvalidInput;
+   }
+   const cJSON *address = cJSON_GetObjectItem (json_upstream, "address");
+   if (!(cJSON_IsNull (address))) {
+      if (cJSON_IsString (address) && (address->valuestring != NULL)) {
+         size_t l = strlen (address->valuestring) + 1;
+         upstream->addr = (uint8_t *) malloc (l * sizeof (*upstream->addr));
+         strncpy (upstream->addr, address->valuestring, l);
+      } else {
+         return kInvalidInput;
+      }
+   }
+
+   const cJSON *port = cJSON_GetObjectItem (json_upstream, "port");
+   if (port != NULL) {
+      if (cJSON_IsNumber (port)) {
+         upstream->port = (uint16_t) port->valueint;
+      } else {
+         return kInvalidInput;
+      }
+   }
+
+   upstream->timeout_ms = DEFAULT_UPSTREAM_TIMEOUT_MS;
+   const cJSON *timeout = cJSON_GetObjectItem (json_upstream, "timeout_ms");
+   if (timeout != NULL) {
+      if (cJSON_IsNumber (timeout) && timeout->valueint > 0) {
+         upstream->timeout_ms = timeout->valueint;
+      } else {
+         return kInvalidInput;
+      }
+   }
+
+   upstream->sockets = DEFAULT_UPSTREAM_SOCKETS;
+   const cJSON *sockets = cJSON_GetObjectItem (json_upstream, "sockets");
+   if (sockets != NULL) {
+      if (cJSON_IsNumber (sockets) && sockets->valueint > 0 && sockets->valueint <= MAX_UPSTREAM_SOCKETS) {
+         upstream->sockets = sockets->valueint;
+      } else {
+         return kInvalidInput;
+      }
+   }
+   return kOk;
+}
+
+static dns_rc_t
+parse_dns_slow_queries (const cJSON *json_slow, dns_slow_queries_conf_t *slow)
+{
+   if (!cJSON_IsObject (json_slow)) {
+      return kInvalidInput;
+   }
+   slow->size = DEFAULT_SLOW_QUERIES;
+   const cJSON *size = cJSON_GetObjectItem (json_slow, "size");
+   if (size != NULL) {
+      if (cJSON_IsNumber (size) && size->valueint >= 0) {
+         slow->size = size->valueint;
+      } else {
+         return kInvalidInput;
+      }
+   }
+
+   slow->threshold_ms = DEFAULT_SLOW_THRESHOLD_MS;
+   const cJSON *threshold = cJSON_GetObjectItem (json_slow, "threshold_ms");
+   if (threshold != NULL) {
+      if (cJSON_IsNumber (threshold) && threshold->valueint >= 0) {
+         slow->threshold_ms = threshold->valueint;
+      } else {
+         return kInvalidInput;
+      }
+   }
+
+   const cJSON *sample_rate = cJSON_GetObjectItem (json_slow, "sample_rate");
+   if (sample_rate != NULL) {
+      if (cJSON_IsNumber (sample_rate) && sample_rate->valueint >= 0) {
+         slow->sample_rate = sample_rate->valueint;
+      } else {
+         return kInvalidInput;
+      }
+   }
+   return kOk;
+}
+
+static dns_rc_t
+parse_dns_prefetch (const cJSON *json_prefetch, dns_prefetch_conf_t *prefetch)
+{
+   if (!cJSON_IsObject (json_prefetch)) {
+      return kInvalidInput;
+   }
+   const cJSON *names = cJSON_GetObjectItem (json_prefetch, "names");
+   if (names != NULL) {
+      if (!cJSON_IsArray (names)) {
+         return kInvalidInput;
+      }
+      prefetch->name_size = cJSON_GetArraySize (names);
+      prefetch->names = (uint8_t **) calloc (prefetch->name_size, sizeof (*prefetch->names));
+      int j = 0;
+      const cJSON *name = NULL;
+      cJSON_ArrayForEach (name, names)
+      {
+         if (!cJSON_IsString (name) || name->valuestring == NULL) {
+            return kInvalidInput;
+         }
+         size_t l = strlen (name->valuestring) + 1;
+         prefetch->names[j] = (uint8_t *) malloc (l * sizeof (*prefetch->names[j]));
+         strncpy (prefetch->names[j], name->valuestring, l);
+         ++j;
+      }
+   }
+
+   const cJSON *hot_names_file = cJSON_GetObjectItem (json_prefetch, "hot_names_file");
+   if (hot_names_file != NULL) {
+      if (cJSON_IsString (hot_names_file) && (hot_names_file->valuestring != NULL)) {
+         size_t l = strlen (hot_names_file->valuestring) + 1;
+         prefetch->hot_path = (uint8_t *) malloc (l * sizeof (*prefetch->hot_path));
+         strncpy (prefetch->hot_path, hot_names_file->valuestring, l);
+      } else {
+         return kInvalidInput;
+      }
+   }
+
+   prefetch->hot_names = DEFAULT_PREFETCH_HOT_NAMES;
+   const cJSON *hot_names = cJSON_GetObjectItem (json_prefetch, "hot_names");
+   if (hot_names != NULL) {
+      if (cJSON_IsNumber (hot_names) && hot_names->valueint >= 0) {
+         prefetch->hot_names = hot_names->valueint;
+      } else {
+         return kInvalidInput;
+      }
+   }
+
+   prefetch->queries_per_second = DEFAULT_PREFETCH_QUERIES_PER_SECOND;
+   const cJSON *qps = cJSON_GetObjectItem (json_prefetch, "queries_per_second");
+   if (qps != NULL) {
+      if (cJSON_IsNumber (qps) && qps->valueint > 0) {
+         prefetch->queries_per_second = qps->valueint;
+      } else {
+         return kInvalidInput;
+      }
+   }
+
+   prefetch->refresh_percent = DEFAULT_PREFETCH_REFRESH_PERCENT;
+   const cJSON *refresh = cJSON_GetObjectItem (json_prefetch, "refresh_percent");
+   if (refresh != NULL) {
+      if (cJSON_IsNumber (refresh) && refresh->valueint > 0 && refresh->valueint < 100) {
+         prefetch->refresh_percent = refresh->valueint;
+      } else {
+         return kInvalidInput;
+      }
+   }
+
+   prefetch->edns = 1;
+   const cJSON *edns = cJSON_GetObjectItem (json_prefetch, "edns");
+   if (edns != NULL) {
+      if (!cJSON_IsBool (edns)) {
+         return kInvalidInput;
+      }
+      prefetch->edns = cJSON_IsTrue (edns);
+   }
+   return kOk;
+}
+
+static dns_rc_t
+parse_dns_busy_poll (const cJSON *json_busy_poll, dns_busy_poll_conf_t *busy_poll)
+{
+   if (!cJSON_IsObject (json_busy_poll)) {
+      return kInvalidInput;
+   }
+   busy_poll->enabled = 1;
+   busy_poll->idle_us = DEFAULT_BUSY_POLL_IDLE_US;
+   const cJSON *idle = cJSON_GetObjectItem (json_busy_poll, "idle_us");
+   if (idle != NULL) {
+      if (cJSON_IsNumber (idle) && idle->valueint > 0) {
+         busy_poll->idle_us = idle->valueint;
+      } else {
+         return kInvalidInput;
+      }
+   }
+
+   busy_poll->socket_us = DEFAULT_BUSY_POLL_SOCKET_US;
+   const cJSON *socket_us = cJSON_GetObjectItem (json_busy_poll, "socket_us");
+   if (socket_us != NULL) {
+      if (cJSON_IsNumber (socket_us) && socket_us->valueint >= 0) {
+         busy_poll->socket_us = socket_us->valueint;
+      } else {
+         return kInvalidInput;
+      }
+   }
+
+   const cJSON *cpus = cJSON_GetObjectItem (json_busy_poll, "cpus");
+   if (cpus != NULL) {
+      if (!cJSON_IsArray (cpus)) {
+         return kInvalidInput;
+      }
+      busy_poll->cpu_size = cJSON_GetArraySize (cpus);
+      busy_poll->cpus = (int *) calloc (busy_poll->cpu_size > 0 ? busy_poll->cpu_size : 1, sizeof (*busy_poll->cpus));
+      int j = 0;
+      const cJSON *cpu = NULL;
+      cJSON_ArrayForEach (cpu, cpus)
+      {
+         if (!cJSON_IsNumber (cpu) || cpu->valueint < 0) {
+            return kInvalidInput;
+         }
+         busy_poll->cpus[j++] = cpu->valueint;
+      }
+   }
+   return kOk;
+}
+
+static dns_rc_t
+parse_dns_overload (const cJSON *json_overload, dns_overload_conf_t *overload)
+{
+   if (!cJSON_IsObject (json_overload)) {
+      return kInvalidInput;
+   }
+   overload->enabled = 1;
+   overload->lag_ms = DEFAULT_OVERLOAD_LAG_MS;
+   const cJSON *lag = cJSON_GetObjectItem (json_overload, "lag_ms");
+   if (lag != NULL) {
+      if (cJSON_IsNumber (lag) && lag->valueint > 0) {
+         overload->lag_ms = lag->valueint;
+      } else {
+         return kInvalidInput;
+      }
+   }
+
+   overload->queue_percent = DEFAULT_OVERLOAD_QUEUE_PERCENT;
+   const cJSON *queue = cJSON_GetObjectItem (json_overload, "queue_percent");
+   if (queue != NULL) {
+      if (cJSON_IsNumber (queue) && queue->valueint > 0 && queue->valueint <= 100) {
+         overload->queue_percent = queue->valueint;
+      } else {
+         return kInvalidInput;
+      }
+   }
+
+   overload->drop_lag_ms = DEFAULT_OVERLOAD_DROP_LAG_MS;
+   const cJSON *drop_lag = cJSON_GetObjectItem (json_overload, "drop_lag_ms");
+   if (drop_lag != NULL) {
+      if (cJSON_IsNumber (drop_lag) && drop_lag->valueint > 0) {
+         overload->drop_lag_ms = drop_lag->valueint;
+      } else {
+         return kInvalidInput;
+      }
+   }
+
+   overload->drop_queue_percent = DEFAULT_OVERLOAD_DROP_QUEUE_PERCENT;
+   const cJSON *drop_queue = cJSON_GetObjectItem (json_overload, "drop_queue_percent");
+   if (drop_queue != NULL) {
+      if (cJSON_IsNumber (drop_queue) && drop_queue->valueint > 0 && drop_queue->valueint <= 100) {
+         overload->drop_queue_percent = drop_queue->valueint;
+      } else {
+         return kInvalidInput;
+      }
+   }
+
+   const cJSON *action = cJSON_GetObjectItem (json_overload, "action");
+   if (action != NULL) {
+      if (cJSON_IsString (action) && (action->valuestring != NULL)) {
+         if (str_i_cmp (action->valuestring, "servfail") == 0)
+            overload->action = DNS_OVERLOAD_SERVFAIL;
+         else if (str_i_cmp (action->valuestring, "truncate") == 0)
+            overload->action = DNS_OVERLOAD_TRUNCATE;
+         else
+            return kInvalidInput;
+      } else {
+         return kInvalidInput;
+      }
+   }
+   return kOk;
+}
+
+static dns_rc_t
+parse_dns_routes (const cJSON *json_routes, dns_route_conf_t **out_routes, int *out_size)
+{
+   if (!cJSON_IsArray (json_routes)) {
+      return kInvalidInput;
+   }
+   int s = cJSON_GetArraySize (json_routes);
+   dns_route_conf_t *routes = (dns_route_conf_t *) calloc (s, sizeof (*routes));
+   *out_routes = routes;
+   *out_size = s;
+
+   int i = 0;
+   const cJSON *route = NULL;
+   cJSON_ArrayForEach (route, json_routes)
+   {
+      const cJSON *domains = cJSON_GetObjectItem (route, "domains");
+      if (!cJSON_IsArray (domains)) {
+         return kInvalidInput;
+      }
+      routes[i].domain_size = cJSON_GetArraySize (domains);
+      routes[i].domains = (uint8_t **) calloc (routes[i].domain_size, sizeof (*routes[i].domains));
+      int j = 0;
+      const cJSON *domain = NULL;
+      cJSON_ArrayForEach (domain, domains)
+      {
+         if (!cJSON_IsString (domain) || domain->valuestring == NULL) {
+            return kInvalidInput;
+         }
+         size_t l = strlen (domain->valuestring) + 1;
+         routes[i].domains[j] = (uint8_t *) malloc (l * sizeof (*routes[i].domains[j]));
+         strncpy (routes[i].domains[j], domain->valuestring, l);
+         ++j;
+      }
+
+      dns_rc_t rc = parse_dns_upstream (route, &routes[i].upstream);
+      if (rc != kOk) {
+         return rc;
+      }
+      ++i;
+   }
+   return kOk;
+}
+
+static const struct {
+   const char *name;
+   uint16_t type;
+} record_types[] = {{"A", T_A}, {"AAAA", T_AAAA}, {"CNAME", T_CNAME}, {"PTR", T_PTR}, {"TXT", T_TXT}, {"SRV", T_SRV}};
+
+static dns_rc_t
+parse_dns_records (const cJSON *json_records, dns_record_conf_t **out_records, int *out_size)
+{
+   if (!cJSON_IsArray (json_records)) {
+      return kInvalidInput;
+   }
+   dns_rc_t rc = kOk;
+   int s = cJSON_GetArraySize (json_records);
+   dns_record_conf_t *records = (dns_record_conf_t *) calloc (s, sizeof (*records));
+   *out_records = records;
+   *out_size = s;
+
+   int i = 0;
+   const cJSON *record = NULL;
+   cJSON_ArrayForEach (record, json_records)
+   {
+      const cJSON *name = cJSON_GetObjectItem (record, "name");
+      if (cJSON_IsString (name) && (name->valuestring != NULL)) {
+         size_t l = strlen (name->valuestring) + 1;
+         records[i].name = (uint8_t *) malloc (l * sizeof (*records[i].name));
+         strncpy (records[i].name, name->valuestring, l);
+      } else {
+         rc = kInvalidInput;
+         break;
+      }
+
+      const cJSON *type = cJSON_GetObjectItem (record, "type");
+      if (cJSON_IsString (type) && (type->valuestring != NULL)) {
+         for (size_t t = 0; t < sizeof (record_types) / sizeof (*record_types); ++t) {
+            if (str_i_cmp (type->valuestring, record_types[t].name) == 0) {
+               records[i].type = record_types[t].type;
+            }
+         }
+      }
+      if (records[i].type == 0) {
+         rc = kInvalidInput;
+         break;
+      }
+
+      const cJSON *data = cJSON_GetObjectItem (record, "data");
+      if (cJSON_IsString (data) && (data->valuestring != NULL)) {
+         size_t l = strlen (data->valuestring) + 1;
+         records[i].data = (uint8_t *) malloc (l * sizeof (*records[i].data));
+         strncpy (records[i].data, data->valuestring, l);
+      } else {
+         rc = kInvalidInput;
+         break;
+      }
+
+      records[i].ttl = DEFAULT_TTL;
+      const cJSON *ttl = cJSON_GetObjectItem (record, "ttl");
+      if (ttl != NULL) {
+         if (cJSON_IsNumber (ttl) && ttl->valuedouble >= 0 && ttl->valuedouble <= INT32_MAX) {
+            records[i].ttl = (uint32_t) ttl->valuedouble;
+         } else {
+            rc = kInvalidInput;
+            break;
+         }
+      }
+      ++i;
+   }
+   return rc;
+}
+
+static dns_rc_t
+parse_dns_zone (const cJSON *json_zone, dns_zone_conf_t *zone)
+{
+   if (!cJSON_IsObject (json_zone)) {
+      return kInvalidInput;
+   }
+   zone->synthesize_ptr = 1;
+
+   const cJSON *domains = cJSON_GetObjectItem (json_zone, "domains");
+   if (domains != NULL) {
+      if (!cJSON_IsArray (domains)) {
+         return kInvalidInput;
+      }
+      zone->domain_size = cJSON_GetArraySize (domains);
+      zone->domains = (uint8_t **) calloc (zone->domain_size, sizeof (*zone->domains));
+      int j = 0;
+      const cJSON *domain = NULL;
+      cJSON_ArrayForEach (domain, domains)
+      {
+         if (!cJSON_IsString (domain) || domain->valuestring == NULL) {
+            return kInvalidInput;
+         }
+         size_t l = strlen (domain->valuestring) + 1;
+         zone->domains[j] = (uint8_t *) malloc (l * sizeof (*zone->domains[j]));
+         strncpy (zone->domains[j], domain->valuestring, l);
+         ++j;
+      }
+   }
+
+   const cJSON *synthesize_ptr = cJSON_GetObjectItem (json_zone, "synthesize_ptr");
+   if (synthesize_ptr != NULL) {
+      if (!cJSON_IsBool (synthesize_ptr)) {
+         return kInvalidInput;
+      }
+      zone->synthesize_ptr = cJSON_IsTrue (synthesize_ptr);
+   }
+
+   const cJSON *records = cJSON_GetObjectItem (json_zone, "records");
+   if (records != NULL) {
+      return parse_dns_records (records, &zone->records, &zone->record_size);
+   }
+   return kOk;
+}
+
 dns_conf_t *
 new_dns_conf_from_json (const char *conf_filepath, dns_rc_t *rc)
 {
@@ -37,7 +680,7 @@ new_dns_conf_from_json (const char *conf_filepath, dns_rc_t *rc)
       *lrc = kInvalidInput;
       return NULL;
    }
-   dns_conf_t *dns_conf = (dns_conf_t *) malloc (sizeof (*dns_conf));
+   dns_conf_t *dns_conf = (dns_conf_t *) calloc (1, sizeof (*dns_conf));
    do {
       const cJSON *address = cJSON_GetObjectItem (json_conf, "address");
       if (address != NULL) {
@@ -61,25 +704,115 @@ new_dns_conf_from_json (const char *conf_filepath, dns_rc_t *rc)
          }
       }
 
+      const cJSON *io_backend = cJSON_GetObjectItem (json_conf, "io_backend");
+      if (io_backend != NULL) {
+         if (cJSON_IsString (io_backend) && (io_backend->valuestring != NULL)) {
+            if (str_i_cmp (io_backend->valuestring, "select") == 0)
+               dns_conf->io_backend = DNS_IO_SELECT;
+            else if (str_i_cmp (io_backend->valuestring, "io_uring") == 0)
+               dns_conf->io_backend = DNS_IO_URING;
+            else {
+               *lrc = kInvalidInput;
+               break;
+            }
+         } else {
+            *lrc = kInvalidInput;
+            break;
+         }
+      }
+
+      dns_conf->workers = 1;
+      const cJSON *workers = cJSON_GetObjectItem (json_conf, "workers");
+      if (workers != NULL) {
+         if (cJSON_IsNumber (workers) && workers->valueint > 0 && workers->valueint <= MAX_WORKERS) {
+            dns_conf->workers = workers->valueint;
+         } else {
+            *lrc = kInvalidInput;
+            break;
+         }
+      }
+
+      const cJSON *cpu_steering = cJSON_GetObjectItem (json_conf, "cpu_steering");
+      if (cpu_steering != NULL) {
+         if (cJSON_IsBool (cpu_steering)) {
+            dns_conf->cpu_steering = cJSON_IsTrue (cpu_steering);
+         } else {
+            *lrc = kInvalidInput;
+            break;
+         }
+      }
+
+      const cJSON *busy_poll = cJSON_GetObjectItem (json_conf, "busy_poll");
+      if (busy_poll != NULL) {
+         *lrc = parse_dns_busy_poll (busy_poll, &dns_conf->busy_poll);
+         if (*lrc != kOk) {
+            break;
+         }
+      }
+
+      const cJSON *stage_latency = cJSON_GetObjectItem (json_conf, "stage_latency");
+      if (stage_latency != NULL) {
+         if (cJSON_IsBool (stage_latency)) {
+            dns_conf->stage_latency = cJSON_IsTrue (stage_latency);
+         } else {
+            *lrc = kInvalidInput;
+            break;
+         }
+      }
+
       const cJSON *forwarder = cJSON_GetObjectItem (json_conf, "forwarder");
       if (forwarder != NULL) {
-         if (cJSON_IsObject (forwarder)) {
-            const cJSON *address = cJSON_GetObjectItem (forwarder, "address");
-            if (!(cJSON_IsNull (address))) {
-               if (cJSON_IsString (address) && (address->valuestring != NULL)) {
-                  size_t l = strlen (address->valuestring) + 1;
-                  dns_conf->upstream.addr = (uint8_t *) malloc (l * sizeof (dns_conf->upstream.addr));
-                  strncpy (dns_conf->upstream.addr, address->valuestring, l);
+         *lrc = parse_dns_upstream (forwarder, &dns_conf->upstream);
+         if (*lrc != kOk) {
+            break;
+         }
+      }
+
+      const cJSON *routes = cJSON_GetObjectItem (json_conf, "routes");
+      if (routes != NULL) {
+         *lrc = parse_dns_routes (routes, &dns_conf->routes, &dns_conf->route_size);
+         if (*lrc != kOk) {
+            break;
+         }
+      }
+
+      const cJSON *query_log = cJSON_GetObjectItem (json_conf, "query_log");
+      if (query_log != NULL) {
+         if (cJSON_IsObject (query_log)) {
+            const cJSON *path = cJSON_GetObjectItem (query_log, "path");
+            if (cJSON_IsString (path) && (path->valuestring != NULL)) {
+               size_t l = strlen (path->valuestring) + 1;
+               dns_conf->query_log.path = (uint8_t *) malloc (l * sizeof (*dns_conf->query_log.path));
+               strncpy (dns_conf->query_log.path, path->valuestring, l);
+            } else {
+               *lrc = kInvalidInput;
+               break;
+            }
+
+            const cJSON *max_size = cJSON_GetObjectItem (query_log, "max_size");
+            if (max_size != NULL) {
+               if (cJSON_IsNumber (max_size) && max_size->valuedouble >= 0) {
+                  dns_conf->query_log.max_size = (uint64_t) max_size->valuedouble;
+               } else {
+                  *lrc = kInvalidInput;
+                  break;
+               }
+            }
+
+            const cJSON *max_files = cJSON_GetObjectItem (query_log, "max_files");
+            if (max_files != NULL) {
+               if (cJSON_IsNumber (max_files) && max_files->valueint > 0) {
+                  dns_conf->query_log.max_files = max_files->valueint;
                } else {
                   *lrc = kInvalidInput;
                   break;
                }
             }
 
-            const cJSON *port = cJSON_GetObjectItem (forwarder, "port");
-            if (port != NULL) {
-               if (cJSON_IsNumber (port)) {
-                  dns_conf->upstream.port = (uint16_t) port->valueint;
+            const cJSON *ring_size = cJSON_GetObjectItem (query_log, "ring_size");
+            if (ring_size != NULL) {
+               if (cJSON_IsNumber (ring_size) && ring_size->valueint > 0) {
+                  dns_conf->query_log.ring_size = ring_size->valueint;
                } else {
                   *lrc = kInvalidInput;
                   break;
@@ -91,106 +824,234 @@ new_dns_conf_from_json (const char *conf_filepath, dns_rc_t *rc)
          }
       }
 
-      const cJSON *filters = cJSON_GetObjectItem (json_conf, "filters");
-      if (filters != NULL) {
-         if (cJSON_IsArray (filters)) {
-            int s = cJSON_GetArraySize (filters);
-            dns_conf->filter_size = s;
-            dns_conf->filters = (dns_filter_conf_t *) calloc (s, sizeof (*dns_conf->filters));
-
-            int i = 0;
-            const cJSON *filter = NULL;
-            cJSON_ArrayForEach (filter, filters)
-            {
-               const cJSON *host = cJSON_GetObjectItem (filter, "host");
-               if (host != NULL) {
-                  if (cJSON_IsString (host) && (host->valuestring != NULL)) {
-                     size_t l = strlen (host->valuestring) + 1;
-                     dns_conf->filters[i].host = (uint8_t *) malloc (l * sizeof (dns_conf->filters[i].host));
-                     strncpy (dns_conf->filters[i].host, host->valuestring, l);
-                  } else {
-                     *lrc = kInvalidInput;
-                     break;
-                  }
+      const cJSON *rate_limit = cJSON_GetObjectItem (json_conf, "rate_limit");
+      if (rate_limit != NULL) {
+         if (cJSON_IsObject (rate_limit)) {
+            const cJSON *rps = cJSON_GetObjectItem (rate_limit, "responses_per_second");
+            if (cJSON_IsNumber (rps) && rps->valueint > 0) {
+               dns_conf->rate_limit.responses_per_second = rps->valueint;
+            } else {
+               *lrc = kInvalidInput;
+               break;
+            }
+
+            const cJSON *burst = cJSON_GetObjectItem (rate_limit, "burst");
+            if (burst != NULL) {
+               if (cJSON_IsNumber (burst) && burst->valueint > 0) {
+                  dns_conf->rate_limit.burst = burst->valueint;
+               } else {
+                  *lrc = kInvalidInput;
+                  break;
                }
+            }
 
-               const cJSON *redirect = cJSON_GetObjectItem (filter, "redirect_addr");
-               if (redirect != NULL) {
-                  if (cJSON_IsString (redirect) && (redirect->valuestring != NULL)) {
-                     size_t l = strlen (redirect->valuestring) + 1;
+            const cJSON *ipv4_prefix = cJSON_GetObjectItem (rate_limit, "ipv4_prefix");
+            if (ipv4_prefix != NULL) {
+               if (cJSON_IsNumber (ipv4_prefix) && ipv4_prefix->valueint > 0 && ipv4_prefix->valueint <= 32) {
+                  dns_conf->rate_limit.ipv4_prefix = ipv4_prefix->valueint;
+               } else {
+                  *lrc = kInvalidInput;
+                  break;
+               }
+            }
 
-                     dns_conf->filters[i].redirect_addr =
-                        (uint8_t *) malloc (l * sizeof (dns_conf->filters[i].redirect_addr));
+            const cJSON *ipv6_prefix = cJSON_GetObjectItem (rate_limit, "ipv6_prefix");
+            if (ipv6_prefix != NULL) {
+               if (cJSON_IsNumber (ipv6_prefix) && ipv6_prefix->valueint > 0 && ipv6_prefix->valueint <= 128) {
+                  dns_conf->rate_limit.ipv6_prefix = ipv6_prefix->valueint;
+               } else {
+                  *lrc = kInvalidInput;
+                  break;
+               }
+            }
 
-                     strncpy (dns_conf->filters[i].redirect_addr, redirect->valuestring, l);
-                  } else {
-                     *lrc = kInvalidInput;
-                     break;
-                  }
+            const cJSON *table_size = cJSON_GetObjectItem (rate_limit, "table_size");
+            if (table_size != NULL) {
+               if (cJSON_IsNumber (table_size) && table_size->valueint > 0) {
+                  dns_conf->rate_limit.table_size = table_size->valueint;
+               } else {
+                  *lrc = kInvalidInput;
+                  break;
                }
+            }
 
-               const cJSON *filter_type = cJSON_GetObjectItem (filter, "type");
-               if (filter_type != NULL) {
-                  if (cJSON_IsString (filter_type) && (filter_type->valuestring != NULL)) {
-                     if (str_i_cmp (filter_type->valuestring, "ALL") == 0)
-                        dns_conf->filters[i].filter_type = DNS_FT_ALL;
-                     else if (str_i_cmp (filter_type->valuestring, "A") == 0)
-                        dns_conf->filters[i].filter_type = DNS_FT_IPV4;
-                     else if (str_i_cmp (filter_type->valuestring, "AAAA") == 0)
-                        dns_conf->filters[i].filter_type = DNS_FT_IPV6;
-                     else {
-                        *lrc = kInvalidInput;
-                        break;
-                     }
-                  } else {
+            const cJSON *action = cJSON_GetObjectItem (rate_limit, "action");
+            if (action != NULL) {
+               if (cJSON_IsString (action) && (action->valuestring != NULL)) {
+                  if (str_i_cmp (action->valuestring, "drop") == 0)
+                     dns_conf->rate_limit.action = DNS_RL_DROP;
+                  else if (str_i_cmp (action->valuestring, "truncate") == 0)
+                     dns_conf->rate_limit.action = DNS_RL_TRUNCATE;
+                  else {
                      *lrc = kInvalidInput;
                      break;
                   }
+               } else {
+                  *lrc = kInvalidInput;
+                  break;
                }
+            }
+         } else {
+            *lrc = kInvalidInput;
+            break;
+         }
+      }
 
-               const cJSON *match_type = cJSON_GetObjectItem (filter, "matching");
-               if (match_type != NULL) {
-                  if (cJSON_IsString (match_type) && (match_type->valuestring != NULL)) {
-                     if (str_i_cmp (match_type->valuestring, "contains") == 0)
-                        dns_conf->filters[i].match_type = DNS_MT_CONTAINS;
-                     else if (str_i_cmp (match_type->valuestring, "exact") == 0)
-                        dns_conf->filters[i].match_type = DNS_MT_EXACT;
-                     else {
-                        *lrc = kInvalidInput;
-                        break;
-                     }
-                  } else {
-                     *lrc = kInvalidInput;
-                     break;
-                  }
+      const cJSON *cache = cJSON_GetObjectItem (json_conf, "cache");
+      if (cache != NULL) {
+         if (cJSON_IsObject (cache)) {
+            const cJSON *max_entries = cJSON_GetObjectItem (cache, "max_entries");
+            if (cJSON_IsNumber (max_entries) && max_entries->valueint > 0) {
+               dns_conf->cache.max_entries = max_entries->valueint;
+            } else {
+               *lrc = kInvalidInput;
+               break;
+            }
+
+            const cJSON *max_ttl = cJSON_GetObjectItem (cache, "max_ttl");
+            if (max_ttl != NULL) {
+               if (cJSON_IsNumber (max_ttl) && max_ttl->valueint > 0) {
+                  dns_conf->cache.max_ttl = max_ttl->valueint;
+               } else {
+                  *lrc = kInvalidInput;
+                  break;
                }
+            }
 
-               const cJSON *action_type = cJSON_GetObjectItem (filter, "action");
-               if (action_type != NULL) {
-                  if (cJSON_IsString (action_type) && (action_type->valuestring != NULL)) {
-                     if (str_i_cmp (action_type->valuestring, "discard") == 0)
-                        dns_conf->filters[i].action_type = DNS_AT_NOTFOUND;
-                     else if (str_i_cmp (action_type->valuestring, "refuse") == 0)
-                        dns_conf->filters[i].action_type = DNS_AT_REFUSE;
-                     else if (str_i_cmp (action_type->valuestring, "redirect") == 0)
-                        dns_conf->filters[i].action_type = DNS_AT_REDIRECT;
-                     else {
-                        *lrc = kInvalidInput;
-                        break;
-                     }
-                  } else {
-                     *lrc = kInvalidInput;
-                     break;
-                  }
+            const cJSON *snapshot = cJSON_GetObjectItem (cache, "snapshot");
+            if (snapshot != NULL) {
+               if (cJSON_IsString (snapshot) && (snapshot->valuestring != NULL)) {
+                  size_t l = strlen (snapshot->valuestring) + 1;
+                  dns_conf->cache.snapshot_path = (uint8_t *) malloc (l * sizeof (*dns_conf->cache.snapshot_path));
+                  strncpy (dns_conf->cache.snapshot_path, snapshot->valuestring, l);
+               } else {
+                  *lrc = kInvalidInput;
+                  break;
+               }
+            }
+
+            const cJSON *snapshot_interval = cJSON_GetObjectItem (cache, "snapshot_interval");
+            if (snapshot_interval != NULL) {
+               if (cJSON_IsNumber (snapshot_interval) && snapshot_interval->valueint >= 0) {
+                  dns_conf->cache.snapshot_interval = snapshot_interval->valueint;
+               } else {
+                  *lrc = kInvalidInput;
+                  break;
+               }
+            }
+         } else {
+            *lrc = kInvalidInput;
+            break;
+         }
+      }
+
+      const cJSON *ecs = cJSON_GetObjectItem (json_conf, "ecs");
+      if (ecs != NULL) {
+         if (cJSON_IsObject (ecs)) {
+            dns_conf->ecs.enabled = 1;
+            dns_conf->ecs.ipv4_prefix = DEFAULT_ECS_IPV4_PREFIX;
+            const cJSON *ipv4_prefix = cJSON_GetObjectItem (ecs, "ipv4_prefix");
+            if (ipv4_prefix != NULL) {
+               if (cJSON_IsNumber (ipv4_prefix) && ipv4_prefix->valueint >= 0 && ipv4_prefix->valueint <= 32) {
+                  dns_conf->ecs.ipv4_prefix = ipv4_prefix->valueint;
+               } else {
+                  *lrc = kInvalidInput;
+                  break;
+               }
+            }
+
+            dns_conf->ecs.ipv6_prefix = DEFAULT_ECS_IPV6_PREFIX;
+            const cJSON *ipv6_prefix = cJSON_GetObjectItem (ecs, "ipv6_prefix");
+            if (ipv6_prefix != NULL) {
+               if (cJSON_IsNumber (ipv6_prefix) && ipv6_prefix->valueint >= 0 && ipv6_prefix->valueint <= 64) {
+                  dns_conf->ecs.ipv6_prefix = ipv6_prefix->valueint;
+               } else {
+                  *lrc = kInvalidInput;
+                  break;
+               }
+            }
+         } else {
+            *lrc = kInvalidInput;
+            break;
+         }
+      }
+
+      const cJSON *overload = cJSON_GetObjectItem (json_conf, "overload");
+      if (overload != NULL) {
+         *lrc = parse_dns_overload (overload, &dns_conf->overload);
+         if (*lrc != kOk) {
+            break;
+         }
+      }
+
+      const cJSON *prefetch = cJSON_GetObjectItem (json_conf, "prefetch");
+      if (prefetch != NULL) {
+         *lrc = parse_dns_prefetch (prefetch, &dns_conf->prefetch);
+         if (*lrc != kOk) {
+            break;
+         }
+      }
+
+      const cJSON *control = cJSON_GetObjectItem (json_conf, "control");
+      if (control != NULL) {
+         if (cJSON_IsObject (control)) {
+            const cJSON *path = cJSON_GetObjectItem (control, "path");
+            if (cJSON_IsString (path) && (path->valuestring != NULL)) {
+               size_t l = strlen (path->valuestring) + 1;
+               dns_conf->control.path = (uint8_t *) malloc (l * sizeof (*dns_conf->control.path));
+               strncpy (dns_conf->control.path, path->valuestring, l);
+            } else {
+               *lrc = kInvalidInput;
+               break;
+            }
+
+            dns_conf->control.heavy_hitters = DEFAULT_HEAVY_HITTERS;
+            const cJSON *heavy_hitters = cJSON_GetObjectItem (control, "heavy_hitters");
+            if (heavy_hitters != NULL) {
+               if (cJSON_IsNumber (heavy_hitters) && heavy_hitters->valueint >= 0) {
+                  dns_conf->control.heavy_hitters = heavy_hitters->valueint;
+               } else {
+                  *lrc = kInvalidInput;
+                  break;
                }
-               ++i;
             }
 
+            const cJSON *slow_queries = cJSON_GetObjectItem (control, "slow_queries");
+            if (slow_queries != NULL) {
+               *lrc = parse_dns_slow_queries (slow_queries, &dns_conf->control.slow_queries);
+               if (*lrc != kOk) {
+                  break;
+               }
+            }
          } else {
             *lrc = kInvalidInput;
             break;
          }
       }
+
+      const cJSON *zone = cJSON_GetObjectItem (json_conf, "zone");
+      if (zone != NULL) {
+         *lrc = parse_dns_zone (zone, &dns_conf->zone);
+         if (*lrc != kOk) {
+            break;
+         }
+      }
+
+      const cJSON *filters = cJSON_GetObjectItem (json_conf, "filters");
+      if (filters != NULL) {
+         *lrc = parse_dns_filters (filters, &dns_conf->filters, &dns_conf->filter_size);
+         if (*lrc != kOk) {
+            break;
+         }
+      }
+
+      const cJSON *groups = cJSON_GetObjectItem (json_conf, "groups");
+      if (groups != NULL) {
+         *lrc = parse_dns_groups (groups, &dns_conf->groups, &dns_conf->group_size);
+         if (*lrc != kOk) {
+            break;
+         }
+      }
    } while (0);
    free (filecontent);
    cJSON_Delete (json_conf);
@@ -214,16 +1075,83 @@ destroy_dns_conf (dns_conf_t *dns_conf)
    if (dns_conf->upstream.addr != NULL) {
       free (dns_conf->upstream.addr);
    }
-   for (int i = 0; i < dns_conf->filter_size; ++i) {
-      if (dns_conf->filters[i].host != NULL) {
-         free (dns_conf->filters[i].host);
+   if (dns_conf->query_log.path != NULL) {
+      free (dns_conf->query_log.path);
+   }
+   if (dns_conf->cache.snapshot_path != NULL) {
+      free (dns_conf->cache.snapshot_path);
+   }
+   if (dns_conf->control.path != NULL) {
+      free (dns_conf->control.path);
+   }
+   for (int i = 0; i < dns_conf->prefetch.name_size; ++i) {
+      if (dns_conf->prefetch.names[i] != NULL) {
+         free (dns_conf->prefetch.names[i]);
+      }
+   }
+   if (dns_conf->prefetch.names != NULL) {
+      free (dns_conf->prefetch.names);
+   }
+   if (dns_conf->prefetch.hot_path != NULL) {
+      free (dns_conf->prefetch.hot_path);
+   }
+   if (dns_conf->busy_poll.cpus != NULL) {
+      free (dns_conf->busy_poll.cpus);
+   }
+   for (int i = 0; i < dns_conf->zone.domain_size; ++i) {
+      if (dns_conf->zone.domains[i] != NULL) {
+         free (dns_conf->zone.domains[i]);
+      }
+   }
+   if (dns_conf->zone.domains != NULL) {
+      free (dns_conf->zone.domains);
+   }
+   for (int i = 0; i < dns_conf->zone.record_size; ++i) {
+      if (dns_conf->zone.records[i].name != NULL) {
+         free (dns_conf->zone.records[i].name);
+      }
+      if (dns_conf->zone.records[i].data != NULL) {
+         free (dns_conf->zone.records[i].data);
+      }
+   }
+   if (dns_conf->zone.records != NULL) {
+      free (dns_conf->zone.records);
+   }
+   for (int i = 0; i < dns_conf->route_size; ++i) {
+      dns_route_conf_t *route = &dns_conf->routes[i];
+      for (int j = 0; j < route->domain_size; ++j) {
+         if (route->domains[j] != NULL) {
+            free (route->domains[j]);
+         }
+      }
+      if (route->domains != NULL) {
+         free (route->domains);
+      }
+      if (route->upstream.addr != NULL) {
+         free (route->upstream.addr);
+      }
+   }
+   if (dns_conf->routes != NULL) {
+      free (dns_conf->routes);
+   }
+   destroy_dns_filters (dns_conf->filters, dns_conf->filter_size);
+   for (int i = 0; i < dns_conf->group_size; ++i) {
+      dns_group_conf_t *group = &dns_conf->groups[i];
+      if (group->name != NULL) {
+         free (group->name);
+      }
+      for (int j = 0; j < group->client_size; ++j) {
+         if (group->clients[j] != NULL) {
+            free (group->clients[j]);
+         }
       }
-      if (dns_conf->filters[i].redirect_addr != NULL) {
-         free (dns_conf->filters[i].redirect_addr);
+      if (group->clients != NULL) {
+         free (group->clients);
       }
+      destroy_dns_filters (group->filters, group->filter_size);
    }
-   if (dns_conf->filter_size > 0) {
-      free (dns_conf->filters);
+   if (dns_conf->group_size > 0) {
+      free (dns_conf->groups);
    }
    free (dns_conf);
 }
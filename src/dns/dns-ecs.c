@@ -0,0 +1,229 @@
+#include "dns/dns-ecs.h"
+#include "dns/dns-name.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+
+#define ECS_RR_FIXED_LEN 10 /* type, class, ttl and rdlength */
+#define ECS_OPTION_FIXED_LEN 8 /* code, length, family, source and scope prefix */
+#define ECS_NOT_FOUND -1
+#define ECS_MALFORMED -2
+
+int
+dns_ecs_from_client (dns_ecs_t *ecs, const struct sockaddr_storage *client, int ipv4_prefix, int ipv6_prefix)
+{
+   const uint8_t *v4 = NULL;
+   memset (ecs, 0, sizeof (*ecs));
+   if (client->ss_family == AF_INET) {
+      v4 = (const uint8_t *) &((const struct sockaddr_in *) client)->sin_addr;
+   } else if (client->ss_family == AF_INET6) {
+      const struct in6_addr *a6 = &((const struct sockaddr_in6 *) client)->sin6_addr;
+      if (IN6_IS_ADDR_V4MAPPED (a6)) {
+         v4 = a6->s6_addr + 12;
+      } else {
+         for (int i = 0; i < 8; ++i) {
+            ecs->subnet = ecs->subnet << 8 | a6->s6_addr[i];
+         }
+         ecs->family = DNS_ECS_FAMILY_INET6;
+         ecs->source = ipv6_prefix;
+      }
+   } else {
+      return -1;
+   }
+   if (v4 != NULL) {
+      ecs->subnet = (uint64_t) v4[0] << 56 | (uint64_t) v4[1] << 48 | (uint64_t) v4[2] << 40 | (uint64_t) v4[3] << 32;
+      ecs->family = DNS_ECS_FAMILY_INET;
+      ecs->source = ipv4_prefix;
+   }
+   ecs->subnet = dns_ecs_truncate (ecs->subnet, ecs->source);
+   return 0;
+}
+
+// Start of the OPT record of `msg`, `rdata` gets the start of its data. ECS_NOT_FOUND without one.
+static int
+find_opt (const uint8_t *msg, int length, int *rdata)
+{
+   if (length < (int) sizeof (dns_header_t)) {
+      return ECS_MALFORMED;
+   }
+   const dns_header_t *hdr = (const dns_header_t *) msg;
+   int off = sizeof (dns_header_t);
+   for (int i = 0; i < ntohs (hdr->qdcount); ++i) {
+      off = dns_name_skip (msg, length, off);
+      if (off < 0 || off + 4 > length) {
+         return ECS_MALFORMED;
+      }
+      off += 4;
+   }
+   int before = ntohs (hdr->ancount) + ntohs (hdr->nscount);
+   int records = before + ntohs (hdr->arcount);
+   for (int i = 0; i < records; ++i) {
+      int start = off;
+      off = dns_name_skip (msg, length, off);
+      if (off < 0 || off + ECS_RR_FIXED_LEN > length) {
+         return ECS_MALFORMED;
+      }
+      const uint8_t *p = msg + off;
+      uint16_t type = 0;
+      uint16_t rdlength = 0;
+      GETSHORT (type, p);
+      p += 6; // class and ttl
+      GETSHORT (rdlength, p);
+      if (off + ECS_RR_FIXED_LEN + rdlength > length) {
+         return ECS_MALFORMED;
+      }
+      if (type == T_OPT && i >= before) {
+         *rdata = off + ECS_RR_FIXED_LEN;
+         return start;
+      }
+      off += ECS_RR_FIXED_LEN + rdlength;
+   }
+   return ECS_NOT_FOUND;
+}
+
+static inline int
+opt_rdlength (const uint8_t *msg, int rdata)
+{
+   return msg[rdata - 2] << 8 | msg[rdata - 1];
+}
+
+static inline void
+set_opt_rdlength (uint8_t *msg, int rdata, int rdlength)
+{
+   uint8_t *p = msg + rdata - 2;
+   PUTSHORT (rdlength, p);
+}
+
+// Start of the ECS option in the OPT data at `rdata`, ECS_NOT_FOUND without one
+static int
+find_option (const uint8_t *msg, int rdata)
+{
+   int end = rdata + opt_rdlength (msg, rdata);
+   int off = rdata;
+   while (off + 4 <= end) {
+      const uint8_t *p = msg + off;
+      uint16_t code = 0;
+      uint16_t len = 0;
+      GETSHORT (code, p);
+      GETSHORT (len, p);
+      if (off + 4 + len > end) {
+         return ECS_MALFORMED;
+      }
+      if (code == DNS_ECS_OPTION_CODE) {
+         return off;
+      }
+      off += 4 + len;
+   }
+   return ECS_NOT_FOUND;
+}
+
+static int
+put_option (uint8_t *p, const dns_ecs_t *ecs)
+{
+   int bytes = (ecs->source + 7) / 8;
+   PUTSHORT (DNS_ECS_OPTION_CODE, p);
+   PUTSHORT (4 + bytes, p);
+   PUTSHORT (ecs->family, p);
+   *p++ = ecs->source;
+   *p++ = 0; // scope, set by the answer
+   for (int i = 0; i < bytes; ++i) {
+      *p++ = ecs->subnet >> (56 - 8 * i);
+   }
+   return ECS_OPTION_FIXED_LEN + bytes;
+}
+
+int
+dns_ecs_present (const uint8_t *msg, int length)
+{
+   int rdata = 0;
+   return find_opt (msg, length, &rdata) >= 0 && find_option (msg, rdata) >= 0;
+}
+
+dns_ecs_mode_t
+dns_ecs_add (uint8_t *msg, int *length, int capacity, const dns_ecs_t *ecs)
+{
+   if (ecs == NULL || ecs->family == 0) {
+      return DNS_ECS_NONE;
+   }
+   uint8_t option[ECS_OPTION_FIXED_LEN + 8];
+   int option_len = put_option (option, ecs);
+   int rdata = 0;
+   int opt = find_opt (msg, *length, &rdata);
+   if (opt >= 0) {
+      int end = rdata + opt_rdlength (msg, rdata);
+      if (find_option (msg, rdata) != ECS_NOT_FOUND || *length + option_len > capacity) {
+         return DNS_ECS_NONE;
+      }
+      memmove (msg + end + option_len, msg + end, *length - end);
+      memcpy (msg + end, option, option_len);
+      set_opt_rdlength (msg, rdata, opt_rdlength (msg, rdata) + option_len);
+      *length += option_len;
+      return DNS_ECS_OPTION;
+   }
+   // a record that has to stay last, such as a TSIG signature, leaves no place for an OPT record
+   dns_header_t *hdr = (dns_header_t *) msg;
+   if (opt == ECS_MALFORMED || hdr->arcount != 0 || *length + 1 + ECS_RR_FIXED_LEN + option_len > capacity) {
+      return DNS_ECS_NONE;
+   }
+   uint8_t *p = msg + *length;
+   *p++ = 0; // root name
+   PUTSHORT (T_OPT, p);
+   PUTSHORT (DNS_ECS_UDP_SIZE, p);
+   PUTLONG (0, p); // extended rcode, version and flags
+   PUTSHORT (option_len, p);
+   memcpy (p, option, option_len);
+   *length += 1 + ECS_RR_FIXED_LEN + option_len;
+   hdr->arcount = htons (1);
+   return DNS_ECS_OPT;
+}
+
+int
+dns_ecs_answer (uint8_t *msg, int *length, dns_ecs_mode_t mode, dns_ecs_t *ecs)
+{
+   ecs->scope = 0;
+   int rdata = 0;
+   int opt = find_opt (msg, *length, &rdata);
+   if (opt == ECS_MALFORMED) {
+      return -1;
+   }
+   if (opt == ECS_NOT_FOUND) {
+      return 0;
+   }
+   int option = find_option (msg, rdata);
+   if (option == ECS_MALFORMED) {
+      return -1;
+   }
+   int option_len = 0;
+   int matches = 1;
+   if (option >= 0) {
+      const uint8_t *p = msg + option + 2;
+      uint16_t len = 0;
+      uint16_t family = 0;
+      GETSHORT (len, p);
+      GETSHORT (family, p);
+      uint8_t source = len >= 4 ? p[0] : 0;
+      uint8_t scope = len >= 4 ? p[1] : 0;
+      int bytes = (ecs->source + 7) / 8;
+      uint64_t subnet = 0;
+      for (int i = 0; i < bytes && i < len - 4; ++i) {
+         subnet |= (uint64_t) p[2 + i] << (56 - 8 * i);
+      }
+      // RFC 7871 7.3, the family, source prefix and address have to be the ones of the query
+      matches = len == 4 + bytes && family == ecs->family && source == ecs->source && subnet == ecs->subnet;
+      ecs->scope = scope < ecs->source ? scope : ecs->source;
+      option_len = 4 + len;
+   }
+   if (mode == DNS_ECS_OPT) {
+      int end = rdata + opt_rdlength (msg, rdata);
+      memmove (msg + opt, msg + end, *length - end);
+      *length -= end - opt;
+      dns_header_t *hdr = (dns_header_t *) msg;
+      hdr->arcount = htons (ntohs (hdr->arcount) - 1);
+   } else if (mode == DNS_ECS_OPTION && option >= 0) {
+      memmove (msg + option, msg + option + option_len, *length - option - option_len);
+      set_opt_rdlength (msg, rdata, opt_rdlength (msg, rdata) - option_len);
+      *length -= option_len;
+   }
+   return matches ? 0 : -1;
+}
@@ -0,0 +1,334 @@
+#include "dns/dns-name.h"
+
+#include <ctype.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define DNS_NAME_X86 1
+#endif
+
+typedef int (*fold_fn_t) (uint8_t *, dns_name_t *, const uint8_t *, int);
+
+struct dns_name_ops {
+   dns_name_impl_t impl;
+   fold_fn_t fold;
+};
+typedef struct dns_name_ops dns_name_ops_t;
+
+const char *dns_name_impl_desc[] = {"scalar", "sse2", "avx2"};
+
+static const dns_name_ops_t *ops = NULL; /* set before main by init_ops */
+
+static int
+is_label_char (uint8_t c)
+{
+   uint8_t l = c | 0x20;
+   return (l >= 'a' && l <= 'z') || (c >= '0' && c <= '9') || c == '-' || c == '_';
+}
+
+static int
+fold_scalar (uint8_t *orig, dns_name_t *name, const uint8_t *src, int length)
+{
+   int pos = 0;
+   int labels = 0;
+   int seg = src[0];
+   while (seg != 0) {
+      if (seg > QNAME_MAX_SEG_LEN || pos + seg + 1 >= length || pos + seg + 2 > RR_NAME_MAX) {
+         return -1;
+      }
+      name->offsets[labels++] = pos;
+      orig[pos] = name->wire[pos] = seg;
+      for (int i = pos + 1; i <= pos + seg; ++i) {
+         uint8_t c = src[i];
+         if (!is_label_char (c)) {
+            return -1;
+         }
+         orig[i] = c;
+         name->wire[i] = (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+      }
+      pos += seg + 1;
+      seg = src[pos];
+   }
+   orig[pos] = name->wire[pos] = 0;
+   name->length = pos + 1;
+   name->labels = labels;
+   name->hash = dns_name_hash (name->wire, name->length);
+   return name->length;
+}
+
+static const dns_name_ops_t scalar_ops = {DNS_NAME_SCALAR, fold_scalar};
+
+#ifdef DNS_NAME_X86
+// Follows the label lengths only, recording the label offsets and marking every length byte, the root label
+// included, in `marks`. Returns the wire length of the name or -1.
+static int
+walk_labels (const uint8_t *src, int length, dns_name_t *name, uint64_t *marks)
+{
+   int pos = 0;
+   int labels = 0;
+   int seg = src[0];
+   while (seg != 0) {
+      if (seg > QNAME_MAX_SEG_LEN || pos + seg + 1 >= length || pos + seg + 2 > RR_NAME_MAX) {
+         return -1;
+      }
+      name->offsets[labels++] = pos;
+      marks[pos >> 6] |= 1ull << (pos & 63);
+      pos += seg + 1;
+      seg = src[pos];
+   }
+   marks[pos >> 6] |= 1ull << (pos & 63);
+   name->labels = labels;
+   name->length = pos + 1;
+   return pos + 1;
+}
+
+static inline uint32_t
+mark_bits (const uint64_t *marks, int off)
+{
+   uint64_t bits = marks[off >> 6] >> (off & 63);
+   if (off & 63) {
+      bits |= marks[(off >> 6) + 1] << (64 - (off & 63));
+   }
+   return (uint32_t) bits;
+}
+
+// Copies and folds 16 wire bytes, returns the mask of lanes that are not label characters. Label lengths are
+// never letters, folding leaves them alone, so they only have to be excluded from the check.
+__attribute__ ((target ("sse2"))) static inline uint32_t
+fold16 (const uint8_t *in, uint8_t *orig, uint8_t *wire)
+{
+   __m128i c = _mm_loadu_si128 ((const __m128i *) in);
+   __m128i l = _mm_or_si128 (c, _mm_set1_epi8 (0x20));
+   // unsigned range checks through a signed compare: x - lo + 128 < (hi - lo + 1) - 128
+   __m128i alpha = _mm_cmplt_epi8 (_mm_add_epi8 (l, _mm_set1_epi8 ((char) (128 - 'a'))), _mm_set1_epi8 (-128 + 26));
+   __m128i digit = _mm_cmplt_epi8 (_mm_add_epi8 (c, _mm_set1_epi8 ((char) (128 - '0'))), _mm_set1_epi8 (-128 + 10));
+   __m128i other = _mm_or_si128 (_mm_cmpeq_epi8 (c, _mm_set1_epi8 ('-')), _mm_cmpeq_epi8 (c, _mm_set1_epi8 ('_')));
+   __m128i valid = _mm_or_si128 (_mm_or_si128 (alpha, digit), other);
+   _mm_storeu_si128 ((__m128i *) orig, c);
+   _mm_storeu_si128 ((__m128i *) wire, _mm_or_si128 (c, _mm_and_si128 (alpha, _mm_set1_epi8 (0x20))));
+   return ~(uint32_t) _mm_movemask_epi8 (valid) & 0xffff;
+}
+
+// Last `count` (< 16) bytes of a name at offset `off`, folded in place when the input and output buffers extend
+// far enough for a full vector, one byte at a time otherwise
+__attribute__ ((target ("sse2"))) static int
+fold_tail (uint8_t *orig, uint8_t *wire, const uint8_t *src, int off, int count, int length, uint32_t marks)
+{
+   if (off + 16 <= length && off + 16 <= RR_NAME_MAX) {
+      return (fold16 (src + off, orig + off, wire + off) & ~marks & ((1u << count) - 1)) != 0 ? -1 : 0;
+   }
+   for (int i = 0; i < count; ++i, marks >>= 1) {
+      uint8_t c = src[off + i];
+      if (!(marks & 1) && !is_label_char (c)) {
+         return -1;
+      }
+      orig[off + i] = c;
+      wire[off + i] = (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+   }
+   return 0;
+}
+
+__attribute__ ((target ("sse2"))) static int
+fold_sse2 (uint8_t *orig, dns_name_t *name, const uint8_t *src, int length)
+{
+   uint64_t marks[5] = {0};
+   int n = walk_labels (src, length, name, marks);
+   if (n < 0) {
+      return -1;
+   }
+   uint64_t h = DNS_NAME_HASH_SEED ^ n;
+   int off = 0;
+   for (; off + 16 <= n; off += 16) {
+      if ((fold16 (src + off, orig + off, name->wire + off) & ~mark_bits (marks, off) & 0xffff) != 0) {
+         return -1;
+      }
+      h = dns_name_hash_update (h, name->wire + off, 16);
+   }
+   if (off < n) {
+      if (fold_tail (orig, name->wire, src, off, n - off, length, mark_bits (marks, off)) != 0) {
+         return -1;
+      }
+      h = dns_name_hash_update (h, name->wire + off, n - off);
+   }
+   name->hash = dns_name_hash_final (h);
+   return n;
+}
+
+static const dns_name_ops_t sse2_ops = {DNS_NAME_SSE2, fold_sse2};
+
+__attribute__ ((target ("avx2"))) static inline uint32_t
+fold32 (const uint8_t *in, uint8_t *orig, uint8_t *wire)
+{
+   __m256i c = _mm256_loadu_si256 ((const __m256i *) in);
+   __m256i l = _mm256_or_si256 (c, _mm256_set1_epi8 (0x20));
+   __m256i alpha =
+      _mm256_cmpgt_epi8 (_mm256_set1_epi8 (-128 + 26), _mm256_add_epi8 (l, _mm256_set1_epi8 ((char) (128 - 'a'))));
+   __m256i digit =
+      _mm256_cmpgt_epi8 (_mm256_set1_epi8 (-128 + 10), _mm256_add_epi8 (c, _mm256_set1_epi8 ((char) (128 - '0'))));
+   __m256i other =
+      _mm256_or_si256 (_mm256_cmpeq_epi8 (c, _mm256_set1_epi8 ('-')), _mm256_cmpeq_epi8 (c, _mm256_set1_epi8 ('_')));
+   __m256i valid = _mm256_or_si256 (_mm256_or_si256 (alpha, digit), other);
+   _mm256_storeu_si256 ((__m256i *) orig, c);
+   _mm256_storeu_si256 ((__m256i *) wire, _mm256_or_si256 (c, _mm256_and_si256 (alpha, _mm256_set1_epi8 (0x20))));
+   return ~(uint32_t) _mm256_movemask_epi8 (valid);
+}
+
+__attribute__ ((target ("avx2"))) static int
+fold_avx2 (uint8_t *orig, dns_name_t *name, const uint8_t *src, int length)
+{
+   uint64_t marks[5] = {0};
+   int n = walk_labels (src, length, name, marks);
+   if (n < 0) {
+      return -1;
+   }
+   uint64_t h = DNS_NAME_HASH_SEED ^ n;
+   int off = 0;
+   for (; off + 32 <= n; off += 32) {
+      if ((fold32 (src + off, orig + off, name->wire + off) & ~mark_bits (marks, off)) != 0) {
+         return -1;
+      }
+      h = dns_name_hash_update (h, name->wire + off, 32);
+   }
+   if (off + 16 <= n) {
+      if ((fold16 (src + off, orig + off, name->wire + off) & ~mark_bits (marks, off) & 0xffff) != 0) {
+         return -1;
+      }
+      h = dns_name_hash_update (h, name->wire + off, 16);
+      off += 16;
+   }
+   if (off < n) {
+      if (fold_tail (orig, name->wire, src, off, n - off, length, mark_bits (marks, off)) != 0) {
+         return -1;
+      }
+      h = dns_name_hash_update (h, name->wire + off, n - off);
+   }
+   name->hash = dns_name_hash_final (h);
+   return n;
+}
+
+static const dns_name_ops_t avx2_ops = {DNS_NAME_AVX2, fold_avx2};
+#endif
+
+__attribute__ ((constructor)) static void
+init_ops ()
+{
+   const dns_name_ops_t *best = &scalar_ops;
+#ifdef DNS_NAME_X86
+   __builtin_cpu_init ();
+   if (__builtin_cpu_supports ("avx2")) {
+      best = &avx2_ops;
+   } else if (__builtin_cpu_supports ("sse2")) {
+      best = &sse2_ops;
+   }
+#endif
+   ops = best;
+}
+
+int
+dns_name_fold (uint8_t *orig, dns_name_t *name, const uint8_t *src, int length)
+{
+   if (orig == NULL || name == NULL || src == NULL || length <= 0) {
+      return -1;
+   }
+   return ops->fold (orig, name, src, length);
+}
+
+int
+dns_name_from_text (dns_name_t *name, const char *text)
+{
+   if (name == NULL || text == NULL) {
+      return -1;
+   }
+   int pos = 0;
+   int labels = 0;
+   const char *c = text;
+   while (*c != 0) {
+      const char *dot = strchr (c, '.');
+      int seg = dot != NULL ? dot - c : (int) strlen (c);
+      if (seg == 0 || seg > QNAME_MAX_SEG_LEN || pos + seg + 2 > RR_NAME_MAX || labels == DNS_NAME_MAX_LABELS) {
+         return -1;
+      }
+      name->offsets[labels++] = pos;
+      name->wire[pos] = seg;
+      for (int i = 0; i < seg; ++i) {
+         name->wire[pos + 1 + i] = tolower ((unsigned char) c[i]);
+      }
+      pos += seg + 1;
+      c += seg;
+      if (*c == '.') {
+         ++c;
+      }
+   }
+   name->wire[pos] = 0;
+   name->length = pos + 1;
+   name->labels = labels;
+   name->hash = dns_name_hash (name->wire, name->length);
+   return name->length;
+}
+
+int
+dns_name_skip (const uint8_t *msg, int length, int off)
+{
+   while (off < length) {
+      uint8_t b = msg[off];
+      if ((b & POINTER_MASK) == POINTER_MASK) {
+         return off + 2 <= length ? off + 2 : -1;
+      }
+      if ((b & POINTER_MASK) != 0) {
+         return -1;
+      }
+      off += b + 1;
+      if (b == 0) {
+         return off;
+      }
+   }
+   return -1;
+}
+
+int
+dns_name_to_text (char *dst, const dns_name_t *name)
+{
+   int d = 0;
+   for (int i = 0; i < name->labels; ++i) {
+      int off = name->offsets[i];
+      if (i != 0) {
+         dst[d++] = '.';
+      }
+      memcpy (dst + d, name->wire + off + 1, name->wire[off]);
+      d += name->wire[off];
+   }
+   dst[d] = 0;
+   return d;
+}
+
+int
+dns_name_use_impl (dns_name_impl_t impl)
+{
+   switch (impl) {
+   case DNS_NAME_SCALAR:
+      ops = &scalar_ops;
+      return 0;
+#ifdef DNS_NAME_X86
+   case DNS_NAME_SSE2:
+      if (__builtin_cpu_supports ("sse2")) {
+         ops = &sse2_ops;
+         return 0;
+      }
+      break;
+   case DNS_NAME_AVX2:
+      if (__builtin_cpu_supports ("avx2")) {
+         ops = &avx2_ops;
+         return 0;
+      }
+      break;
+#endif
+   default:
+      break;
+   }
+   return -1;
+}
+
+dns_name_impl_t
+dns_name_current_impl ()
+{
+   return ops->impl;
+}
@@ -3,6 +3,7 @@
 #include <netinet/in.h>
 #include <stdio.h>
 
+#include "dns/dns-name.h"
 #include "dns/dns-parse.h"
 #include "dns/dns-protocol.h"
 #include "utils/network_tools.h"
@@ -15,9 +16,10 @@ process_qname (uint8_t *dst, const uint8_t *src, int length)
    }
    uint8_t *d = dst;
    const uint8_t *c = NULL;
-   for (c = src + 1; *c != 0 || (c - src) >= length; ++c) {
+   for (c = src + 1; *c != 0 && (c - src) < length; ++c) {
       if (segment_length > 0) {
-         if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || (*c == '-')) {
+         if ((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9') || (*c == '-') ||
+             (*c == '_')) {
             *d = *c;
             ++d;
          } else {
@@ -30,6 +32,9 @@ process_qname (uint8_t *dst, const uint8_t *src, int length)
          ++d;
       }
    }
+   if ((c - src) >= length) {
+      return -1;
+   }
    if (d - dst < length) {
       *d = 0;
    }
@@ -88,7 +93,7 @@ convert_to_dns_name (uint8_t *dst, const uint8_t *src, int length)
    if (dst == NULL || src == NULL || length == 0) {
       return kInvalidInput;
    }
-   if (*src == POINTER_MASK) {
+   if ((*src & POINTER_MASK) == POINTER_MASK) {
       *dst++ = *src++;
       *dst++ = *src++;
       return 2;
@@ -104,7 +109,7 @@ process_dns_name (uint8_t *dst, const uint8_t *src, const uint8_t *dns_packet, i
    if (dst == NULL || src == NULL || dns_packet == NULL || length == 0) {
       return kInvalidInput;
    }
-   if (*src == POINTER_MASK) {
+   if ((*src & POINTER_MASK) == POINTER_MASK) {
       *dst++ = *src++;
       *dst++ = *src++;
       return 2;
@@ -129,7 +134,7 @@ process_dns_rdata (dns_arr_t *dst, const uint8_t *rdata_src, uint16_t length)
 }
 
 dns_h_t *
-new_dns_h (const uint8_t *req, dns_rc_t *rc)
+new_dns_h (const uint8_t *req, int req_len, dns_rc_t *rc)
 {
    dns_rc_t *lrc = rc;
    if (rc == NULL) {
@@ -142,6 +147,11 @@ new_dns_h (const uint8_t *req, dns_rc_t *rc)
    if (req == NULL) {
       return dns;
    }
+   if (req_len < (int) sizeof (dns_header_t)) {
+      *lrc = kDataMalformed;
+      free (dns);
+      return NULL;
+   }
    const dns_header_t *hdr_ptr = (const dns_header_t *) req;
 
 
@@ -153,39 +163,61 @@ new_dns_h (const uint8_t *req, dns_rc_t *rc)
    dns->header.nscount = ntohs (hdr_ptr->nscount);
    dns->header.arcount = ntohs (hdr_ptr->arcount);
    const uint8_t *cur_rr = req + sizeof (*hdr_ptr);
+   const uint8_t *end = req + req_len;
    do {
+      // a question takes 5 bytes at least and an answer 11, larger counts cannot be in the message
+      if (dns->header.qdcount * 5 + dns->header.ancount * 11 > end - cur_rr) {
+         *lrc = kDataMalformed;
+         break;
+      }
       if (dns->header.qdcount > 0) {
          dns->qrs = (dns_qrr_t *) malloc (dns->header.qdcount * sizeof (*dns->qrs));
          for (int i = 0; i < dns->header.qdcount; i++) {
             // Read and offset position of cur_rr to type field
-            size_t len = 0;
-            if ((len = process_qname ((char *) dns->qrs[i].name, (char *) cur_rr, RR_NAME_MAX)) < 0) {
+            dns_qrr_t *q = &dns->qrs[i];
+            int len = dns_name_fold (q->name, &q->key, cur_rr, req + req_len - cur_rr);
+            if (len < 0 || cur_rr + len + 4 > req + req_len) {
                *lrc = kDataMalformed;
+               break;
             }
             cur_rr += len;
-            GETSHORT (dns->qrs[i].type, cur_rr);
-            GETSHORT (dns->qrs[i].class, cur_rr);
+            GETSHORT (q->type, cur_rr);
+            GETSHORT (q->class, cur_rr);
+         }
+         if (*lrc != kOk) {
+            break;
          }
       }
 
       if (dns->header.ancount > 0) {
-         dns->ancs = (dns_arr_t *) malloc (dns->header.ancount * sizeof (*dns->ancs));
+         dns->ancs = (dns_arr_t *) calloc (dns->header.ancount, sizeof (*dns->ancs));
          for (int i = 0; i < dns->header.ancount; i++) {
-            // Read and offset position of cur_rr to type field
-            size_t qlen = 0;
-            if ((qlen = process_dns_name ((char *) dns->ancs[i].name, (char *) cur_rr, req, RR_NAME_MAX)) < 0) {
+            // a name is kept as one pointer or uncompressed, so it has to be one of the two
+            dns_arr_t *a = &dns->ancs[i];
+            int name_end = dns_name_skip (req, req_len, cur_rr - req);
+            if (name_end < 0 || name_end - (cur_rr - req) > RR_NAME_MAX || req + name_end + 10 > end) {
                *lrc = kDataMalformed;
+               break;
+            }
+            int qlen = process_dns_name (a->name, cur_rr, req, req + name_end - cur_rr);
+            if (qlen != name_end - (cur_rr - req)) {
+               *lrc = kDataMalformed;
+               break;
             }
             cur_rr += qlen;
-            GETSHORT (dns->ancs[i].type, cur_rr);
-            GETSHORT (dns->ancs[i].class, cur_rr);
-            GETLONG (dns->ancs[i].ttl, cur_rr);
-            GETSHORT (dns->ancs[i].rdlength, cur_rr);
-            const uint16_t rdl = dns->ancs[i].rdlength;
-            if (process_dns_rdata (&dns->ancs[i], cur_rr, rdl) != kOk) {
+            GETSHORT (a->type, cur_rr);
+            GETSHORT (a->class, cur_rr);
+            GETLONG (a->ttl, cur_rr);
+            GETSHORT (a->rdlength, cur_rr);
+            if (cur_rr + a->rdlength > end || (a->rdlength > 0 && process_dns_rdata (a, cur_rr, a->rdlength) != kOk)) {
+               a->rdlength = 0;
                *lrc = kDataMalformed;
+               break;
             }
-            cur_rr += rdl;
+            cur_rr += a->rdlength;
+         }
+         if (*lrc != kOk) {
+            break;
          }
       }
       return dns;
@@ -219,9 +251,9 @@ new_dns_buffer (const dns_h_t *dns, dns_rc_t *rc, int *out_bufsize)
    PUTSHORT (dns->header.nscount, cur_rr);
    PUTSHORT (dns->header.arcount, cur_rr);
    for (int i = 0; i < dns->header.qdcount; ++i) {
-      // Read and offset position of cur_rr to type field
-      int len = convert_to_qname (cur_rr, dns->qrs[i].name, RR_NAME_MAX);
-      cur_rr += len;
+      // questions keep the name as it was received
+      memcpy (cur_rr, dns->qrs[i].name, dns->qrs[i].key.length);
+      cur_rr += dns->qrs[i].key.length;
       PUTSHORT (dns->qrs[i].type, cur_rr);
       PUTSHORT (dns->qrs[i].class, cur_rr);
    }
@@ -234,7 +266,9 @@ new_dns_buffer (const dns_h_t *dns, dns_rc_t *rc, int *out_bufsize)
       PUTLONG (dns->ancs[i].ttl, cur_rr);
       PUTSHORT (dns->ancs[i].rdlength, cur_rr);
       const uint16_t rdl = dns->ancs[i].rdlength;
-      memcpy (cur_rr, dns->ancs[i].rdata, rdl);
+      if (rdl > 0) {
+         memcpy (cur_rr, dns->ancs[i].rdata, rdl);
+      }
 
       cur_rr += rdl;
    }
@@ -253,11 +287,9 @@ destroy_dns_h (dns_h_t *dns)
    if (dns->qrs != NULL) {
       free (dns->qrs);
    }
-   for (int i = 0; i < dns->header.ancount; i++) {
-      if (&dns->ancs[i] != NULL) {
-         if (dns->ancs[i].rdlength > 0 && dns->ancs[i].rdata != NULL) {
-            free (dns->ancs[i].rdata);
-         }
+   for (int i = 0; dns->ancs != NULL && i < dns->header.ancount; i++) {
+      if (dns->ancs[i].rdlength > 0 && dns->ancs[i].rdata != NULL) {
+         free (dns->ancs[i].rdata);
       }
    }
    if (dns->ancs != NULL) {
@@ -0,0 +1,332 @@
+#include "log/query_log.h"
+#include "dns/dns-protocol.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Frame Streams framing (https://github.com/farsightsec/fstrm) with dnstap protobuf payloads,
+// so the files can be read with dnstap-read or any other dnstap consumer.
+#define FSTRM_CONTROL_START 0x02
+#define FSTRM_CONTROL_STOP 0x03
+#define FSTRM_FIELD_CONTENT_TYPE 0x01
+#define DNSTAP_CONTENT_TYPE "protobuf:dnstap.Dnstap"
+
+#define DNSTAP_TYPE_MESSAGE 1
+#define DNSTAP_MESSAGE_CLIENT_RESPONSE 6
+#define DNSTAP_FAMILY_INET 1
+#define DNSTAP_FAMILY_INET6 2
+#define DNSTAP_PROTOCOL_UDP 1
+
+#define PB_VARINT 0
+#define PB_FIXED32 5
+#define PB_BYTES 2
+
+#define QUERY_LOG_FRAME_MAX 2048
+#define QUERY_LOG_IDLE_SLEEP_NS 1000000
+
+static const char *action_names[] = {"drop", "reply", "forward"};
+
+static uint8_t *
+pb_varint (uint8_t *p, uint64_t v)
+{
+   while (v >= 0x80) {
+      *p++ = (uint8_t) v | 0x80;
+      v >>= 7;
+   }
+   *p++ = (uint8_t) v;
+   return p;
+}
+
+static uint8_t *
+pb_key (uint8_t *p, int field, int wire_type)
+{
+   return pb_varint (p, (field << 3) | wire_type);
+}
+
+static uint8_t *
+pb_bytes (uint8_t *p, int field, const void *data, size_t len)
+{
+   p = pb_key (p, field, PB_BYTES);
+   p = pb_varint (p, len);
+   memcpy (p, data, len);
+   return p + len;
+}
+
+static uint8_t *
+pb_fixed32 (uint8_t *p, int field, uint32_t v)
+{
+   p = pb_key (p, field, PB_FIXED32);
+   for (int i = 0; i < 4; ++i) {
+      *p++ = v >> (8 * i);
+   }
+   return p;
+}
+
+// Rebuilds a minimal response message (header and question) from the logged query prefix
+static int
+response_from_query (uint8_t *dst, const query_log_record_t *rec)
+{
+   if (rec->query_len < sizeof (dns_header_t)) {
+      return 0;
+   }
+   int qend = sizeof (dns_header_t);
+   while (qend < rec->query_len && rec->query[qend] != 0) {
+      qend += rec->query[qend] + 1;
+   }
+   qend += 5; // root label, type and class
+   if (qend > rec->query_len) {
+      qend = sizeof (dns_header_t);
+   }
+   memcpy (dst, rec->query, qend);
+   dns_header_t *hdr = (dns_header_t *) dst;
+   hdr->hb3 |= HB3_QR;
+   SET_RCODE (hdr, rec->rcode);
+   hdr->qdcount = htons (qend > (int) sizeof (dns_header_t) ? 1 : 0);
+   hdr->ancount = hdr->nscount = hdr->arcount = 0;
+   return qend;
+}
+
+// Encodes one record as a dnstap CLIENT_RESPONSE message, returns the payload length
+static int
+encode_dnstap (uint8_t *buf, const query_log_record_t *rec)
+{
+   uint8_t msg[QUERY_LOG_FRAME_MAX];
+   uint8_t *m = msg;
+   uint64_t query_ns = rec->time_ns - rec->latency_ns;
+
+   m = pb_key (m, 1, PB_VARINT);
+   m = pb_varint (m, DNSTAP_MESSAGE_CLIENT_RESPONSE);
+   m = pb_key (m, 2, PB_VARINT);
+   m = pb_varint (m, rec->client_family == AF_INET6 ? DNSTAP_FAMILY_INET6 : DNSTAP_FAMILY_INET);
+   m = pb_key (m, 3, PB_VARINT);
+   m = pb_varint (m, DNSTAP_PROTOCOL_UDP);
+   m = pb_bytes (m, 4, rec->client_addr, rec->client_family == AF_INET6 ? 16 : 4);
+   m = pb_key (m, 6, PB_VARINT);
+   m = pb_varint (m, rec->client_port);
+   m = pb_key (m, 8, PB_VARINT);
+   m = pb_varint (m, query_ns / 1000000000ull);
+   m = pb_fixed32 (m, 9, query_ns % 1000000000ull);
+   m = pb_bytes (m, 10, rec->query, rec->query_len);
+   m = pb_key (m, 12, PB_VARINT);
+   m = pb_varint (m, rec->time_ns / 1000000000ull);
+   m = pb_fixed32 (m, 13, rec->time_ns % 1000000000ull);
+   uint8_t resp[QUERY_LOG_MAX_QUERY];
+   int resp_len = response_from_query (resp, rec);
+   if (resp_len > 0) {
+      m = pb_bytes (m, 14, resp, resp_len);
+   }
+
+   // the action and latency have no dnstap field, they go to the free-form "extra"
+   char extra[64];
+   int extra_len = snprintf (extra,
+                             sizeof (extra),
+                             "action=%s latency_us=%u",
+                             rec->action < 3 ? action_names[rec->action] : "unknown",
+                             rec->latency_ns / 1000);
+
+   uint8_t *p = buf;
+   p = pb_bytes (p, 3, extra, extra_len);
+   p = pb_bytes (p, 14, msg, m - msg);
+   p = pb_key (p, 15, PB_VARINT);
+   p = pb_varint (p, DNSTAP_TYPE_MESSAGE);
+   return p - buf;
+}
+
+static void
+write_be32 (FILE *file, uint32_t v)
+{
+   uint32_t be = htonl (v);
+   fwrite (&be, sizeof (be), 1, file);
+}
+
+static void
+write_control (query_log_t *log, uint32_t type)
+{
+   const uint32_t ct_len = sizeof (DNSTAP_CONTENT_TYPE) - 1;
+   uint32_t len = 4 + (type == FSTRM_CONTROL_START ? 8 + ct_len : 0);
+   write_be32 (log->file, 0); // escape: a zero length data frame marks a control frame
+   write_be32 (log->file, len);
+   write_be32 (log->file, type);
+   if (type == FSTRM_CONTROL_START) {
+      write_be32 (log->file, FSTRM_FIELD_CONTENT_TYPE);
+      write_be32 (log->file, ct_len);
+      fwrite (DNSTAP_CONTENT_TYPE, 1, ct_len, log->file);
+   }
+   log->file_size += 8 + len;
+}
+
+static dns_rc_t
+open_log_file (query_log_t *log)
+{
+   log->file = fopen (log->path, "wbe");
+   if (log->file == NULL) {
+      return kNotFound;
+   }
+   log->file_size = 0;
+   write_control (log, FSTRM_CONTROL_START);
+   return kOk;
+}
+
+static void
+close_log_file (query_log_t *log)
+{
+   if (log->file == NULL) {
+      return;
+   }
+   write_control (log, FSTRM_CONTROL_STOP);
+   fclose (log->file);
+   log->file = NULL;
+}
+
+// path -> path.1 -> ... -> path.<max_files - 1>, the oldest one is overwritten
+static void
+rotate_log_file (query_log_t *log)
+{
+   close_log_file (log);
+   size_t len = strlen (log->path) + 16;
+   char *from = (char *) malloc (len);
+   char *to = (char *) malloc (len);
+   for (int i = log->max_files - 1; i > 0; --i) {
+      if (i == 1) {
+         snprintf (from, len, "%s", log->path);
+      } else {
+         snprintf (from, len, "%s.%d", log->path, i - 1);
+      }
+      snprintf (to, len, "%s.%d", log->path, i);
+      rename (from, to);
+   }
+   free (from);
+   free (to);
+   open_log_file (log);
+}
+
+static int
+drain_ring (query_log_t *log, query_log_ring_t *ring)
+{
+   uint8_t frame[QUERY_LOG_FRAME_MAX];
+   uint64_t tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+   uint64_t head = atomic_load_explicit (&ring->head, memory_order_acquire);
+   int drained = 0;
+   for (; tail != head; ++tail, ++drained) {
+      int len = encode_dnstap (frame, &ring->records[tail & ring->mask]);
+      // the slot may be reused as soon as the record is encoded
+      atomic_store_explicit (&ring->tail, tail + 1, memory_order_release);
+      if (log->file == NULL) {
+         continue;
+      }
+      write_be32 (log->file, len);
+      fwrite (frame, 1, len, log->file);
+      log->file_size += 4 + len;
+      if (log->max_size > 0 && log->file_size >= log->max_size) {
+         rotate_log_file (log);
+      }
+   }
+   return drained;
+}
+
+static void *
+query_log_writer (void *arg)
+{
+   query_log_t *log = (query_log_t *) arg;
+   const struct timespec idle = {0, QUERY_LOG_IDLE_SLEEP_NS};
+   for (;;) {
+      int quit = atomic_load (&log->quit);
+      int drained = 0;
+      for (int i = 0; i < log->ring_count; ++i) {
+         drained += drain_ring (log, &log->rings[i]);
+      }
+      if (quit) {
+         break;
+      }
+      if (drained == 0) {
+         if (log->file != NULL) {
+            fflush (log->file);
+         }
+         nanosleep (&idle, NULL);
+      }
+   }
+   close_log_file (log);
+   return NULL;
+}
+
+query_log_t *
+new_query_log (const dns_query_log_conf_t *conf, int workers, dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   *lrc = kOk;
+
+   if (conf == NULL || conf->path == NULL || workers <= 0) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+
+   query_log_t *log = (query_log_t *) calloc (1, sizeof (*log));
+   log->path = strdup ((const char *) conf->path);
+   log->max_size = conf->max_size > 0 ? conf->max_size : QUERY_LOG_DEFAULT_MAX_SIZE;
+   log->max_files = conf->max_files > 0 ? conf->max_files : QUERY_LOG_DEFAULT_MAX_FILES;
+
+   // round the ring up to a power of two so positions wrap with a mask
+   uint64_t ring_size = 1;
+   while (ring_size < (uint64_t) (conf->ring_size > 0 ? conf->ring_size : QUERY_LOG_DEFAULT_RING_SIZE)) {
+      ring_size <<= 1;
+   }
+   log->ring_count = workers;
+   log->rings = (query_log_ring_t *) aligned_alloc (64, workers * sizeof (*log->rings));
+   for (int i = 0; i < workers; ++i) {
+      atomic_init (&log->rings[i].head, 0);
+      atomic_init (&log->rings[i].tail, 0);
+      atomic_init (&log->rings[i].dropped, 0);
+      log->rings[i].mask = ring_size - 1;
+      log->rings[i].records = (query_log_record_t *) calloc (ring_size, sizeof (*log->rings[i].records));
+   }
+
+   // an existing log, of the previous run or of the process this one takes over from, is rotated, not truncated
+   rotate_log_file (log);
+   *lrc = log->file != NULL ? kOk : kNotFound;
+   if (*lrc != kOk) {
+      destroy_query_log (log);
+      return NULL;
+   }
+   atomic_init (&log->quit, 0);
+   if (pthread_create (&log->writer, NULL, query_log_writer, log) != 0) {
+      *lrc = kAborted;
+      close_log_file (log);
+      destroy_query_log (log);
+      return NULL;
+   }
+   return log;
+}
+
+void
+destroy_query_log (query_log_t *log)
+{
+   if (log == NULL) {
+      return;
+   }
+   if (log->writer != 0) {
+      atomic_store (&log->quit, 1);
+      pthread_join (log->writer, NULL);
+   }
+   for (int i = 0; i < log->ring_count; ++i) {
+      free (log->rings[i].records);
+   }
+   free (log->rings);
+   free (log->path);
+   free (log);
+}
+
+uint64_t
+query_log_dropped (const query_log_t *log)
+{
+   uint64_t dropped = 0;
+   for (int i = 0; log != NULL && i < log->ring_count; ++i) {
+      dropped += atomic_load_explicit (&log->rings[i].dropped, memory_order_relaxed);
+   }
+   return dropped;
+}
@@ -1,4 +1,4 @@
-#include <arpa/nameser_compat.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -22,6 +22,15 @@ handle_sigint (int sig)
    }
 }
 
+volatile uint8_t *glob_upgrade = NULL;
+void
+handle_sigusr2 (int sig)
+{
+   if (sig == SIGUSR2) {
+      ++*glob_upgrade;
+   }
+}
+
 int
 main ()
 {
@@ -47,9 +56,22 @@ main ()
    char host_ip[INET6_ADDRSTRLEN] = {0};
    get_sockaddr_ip (&server->s_storage, host_ip, sizeof (host_ip));
    glob_quit = &server->quit;
-   *glob_quit = 0;
-   printf ("listening on %s:%d\n", server->s_host, server->s_port);
+   // resolved now, the path has to name the new binary once it is replaced
+   static char exe_path[PATH_MAX];
+   ssize_t exe_len = readlink ("/proc/self/exe", exe_path, sizeof (exe_path) - 1);
+   if (exe_len > 0) {
+      exe_path[exe_len] = '\0';
+      server->upgrade_exe = exe_path;
+      glob_upgrade = &server->upgrade;
+      signal (SIGUSR2, handle_sigusr2);
+   }
+   printf ("listening on %s:%d (%s, %d workers)\n",
+           server->s_host,
+           server->s_port,
+           dns_io_backend_desc[server->workers[0].io->backend],
+           server->worker_count);
    ret = run_dns_server (server);
+   dns_server_print_stats (server, stdout);
    destroy_dns_conf (conf);
    destroy_dns_server (server);
 
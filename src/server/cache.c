@@ -0,0 +1,598 @@
+#include "server/cache.h"
+#include "dns/dns-name.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_RR_FIXED_LEN 10 /* type, class, ttl and rdlength */
+#define CACHE_OPT_DO 0x8000   /* DNSSEC OK bit of the OPT record flags */
+
+// Snapshot layout: the header, then `count` records, each followed by the blob of its entry. Integers are in
+// host byte order, a snapshot is only read back on the machine that wrote it.
+struct cache_snapshot_header {
+   uint32_t magic;
+   uint16_t version;
+   uint16_t reserved;
+   uint32_t count;
+   uint32_t created; /* CLOCK_REALTIME seconds */
+};
+
+struct cache_snapshot_record {
+   uint32_t stored;
+   uint32_t expire;
+   uint16_t type;
+   uint16_t class;
+   uint16_t length;
+   uint8_t name_len;
+   uint8_t ttl_count;
+   uint8_t flags;
+   uint8_t reserved[3];
+};
+
+static inline uint64_t
+cache_key_hash (uint64_t name_hash, uint16_t type, uint16_t class, uint8_t flags)
+{
+   uint64_t h = name_hash ^ ((uint64_t) type << 32 | (uint64_t) class << 16 | flags);
+   h = dns_name_hash_final (h * DNS_NAME_HASH_MUL);
+   return h != 0 ? h : 1;
+}
+
+static inline const uint16_t *
+entry_ttls (const dns_cache_entry_t *entry)
+{
+   return (const uint16_t *) entry->blob;
+}
+
+static inline const uint8_t *
+entry_name (const dns_cache_entry_t *entry)
+{
+   return entry->blob + entry->ttl_count * sizeof (uint16_t);
+}
+
+// Scoped entries keep their subnet between the name and the answer
+static inline int
+entry_subnet_len (uint8_t scope)
+{
+   return scope != 0 ? sizeof (uint64_t) : 0;
+}
+
+static inline uint64_t
+entry_subnet (const dns_cache_entry_t *entry)
+{
+   uint64_t subnet = 0;
+   memcpy (&subnet, entry_name (entry) + entry->name_len, entry_subnet_len (entry->scope));
+   return subnet;
+}
+
+static inline const uint8_t *
+entry_answer (const dns_cache_entry_t *entry)
+{
+   return entry_name (entry) + entry->name_len + entry_subnet_len (entry->scope);
+}
+
+static inline size_t
+entry_blob_size (uint8_t ttl_count, uint8_t name_len, uint16_t length, uint8_t scope)
+{
+   return ttl_count * sizeof (uint16_t) + name_len + entry_subnet_len (scope) + length;
+}
+
+// Key of an answer scoped to `subnet`, derived from the unscoped key `hash` of its question
+static inline uint64_t
+cache_scoped_hash (uint64_t hash, uint8_t flags, uint8_t scope, uint64_t subnet)
+{
+   uint64_t h = dns_name_hash_final (((hash ^ subnet) * DNS_NAME_HASH_MUL) ^ ((uint64_t) flags << 8 | scope));
+   return h != 0 ? h : 1;
+}
+
+// Key flags of `req`, whose question ends at `qend`. The OPT record is the first additional record of a query.
+static uint8_t
+cache_key_flags (const uint8_t *req, int req_len, int qend)
+{
+   const dns_header_t *hdr = (const dns_header_t *) req;
+   uint8_t flags = (hdr->hb4 & HB4_CD) != 0 ? DNS_CACHE_KEY_CD : 0;
+   if (ntohs (hdr->arcount) > 0 && qend + 1 + CACHE_RR_FIXED_LEN <= req_len && req[qend] == 0) {
+      const uint8_t *p = req + qend + 1;
+      uint16_t type = 0;
+      uint16_t opt_flags = 0;
+      GETSHORT (type, p);
+      if (type == T_OPT) {
+         flags |= DNS_CACHE_KEY_EDNS;
+         p += 4; // payload size, extended rcode and version
+         GETSHORT (opt_flags, p);
+         if ((opt_flags & CACHE_OPT_DO) != 0) {
+            flags |= DNS_CACHE_KEY_DO;
+         }
+      }
+   }
+   return flags;
+}
+
+static dns_cache_entry_t *
+cache_find (dns_cache_t *cache,
+            uint64_t hash,
+            const uint8_t *name,
+            uint8_t name_len,
+            uint16_t type,
+            uint16_t class,
+            uint8_t flags,
+            uint8_t scope,
+            uint64_t subnet)
+{
+   dns_cache_entry_t *set = &cache->entries[(hash & cache->set_mask) * DNS_CACHE_WAYS];
+   for (int i = 0; i < DNS_CACHE_WAYS; ++i) {
+      dns_cache_entry_t *e = &set[i];
+      if (e->hash == hash && e->type == type && e->class == class && e->flags == flags && e->name_len == name_len &&
+          e->scope == scope && memcmp (entry_name (e), name, name_len) == 0 &&
+          (scope == 0 || entry_subnet (e) == subnet)) {
+         return e;
+      }
+   }
+   return NULL;
+}
+
+static inline dns_cache_stripe_t *
+cache_stripe (const dns_cache_t *cache, uint64_t hash)
+{
+   return &cache->stripes[(hash & cache->set_mask) % DNS_CACHE_STRIPES];
+}
+
+// Takes over the blob of `entry`, replacing the entry with the same key, an empty way or the one expiring first.
+// Called with the stripe of the entry locked.
+static void
+cache_insert (dns_cache_t *cache, dns_cache_stripe_t *stripe, const dns_cache_entry_t *entry, uint32_t now)
+{
+   dns_cache_entry_t *victim = cache_find (cache,
+                                           entry->hash,
+                                           entry_name (entry),
+                                           entry->name_len,
+                                           entry->type,
+                                           entry->class,
+                                           entry->flags,
+                                           entry->scope,
+                                           entry_subnet (entry));
+   if (victim == NULL) {
+      dns_cache_entry_t *set = &cache->entries[(entry->hash & cache->set_mask) * DNS_CACHE_WAYS];
+      victim = &set[0];
+      for (int i = 1; i < DNS_CACHE_WAYS && victim->hash != 0; ++i) {
+         if (set[i].hash == 0 || set[i].expire < victim->expire) {
+            victim = &set[i];
+         }
+      }
+      if (victim->hash == 0) {
+         ++stripe->count;
+      } else if (victim->expire > now) {
+         ++stripe->evictions;
+      }
+   }
+   free (victim->blob);
+   *victim = *entry;
+}
+
+dns_cache_t *
+new_dns_cache (const dns_cache_conf_t *conf, dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   *lrc = kOk;
+
+   if (conf == NULL || conf->max_entries <= 0) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+
+   dns_cache_t *cache = (dns_cache_t *) calloc (1, sizeof (*cache));
+   uint64_t sets = 1;
+   while (sets * DNS_CACHE_WAYS < (uint64_t) conf->max_entries) {
+      sets <<= 1;
+   }
+   cache->entries = (dns_cache_entry_t *) calloc (sets * DNS_CACHE_WAYS, sizeof (*cache->entries));
+   cache->scopes = (dns_cache_scopes_t *) calloc (sets, sizeof (*cache->scopes));
+   cache->set_mask = sets - 1;
+   cache->stripes = (dns_cache_stripe_t *) aligned_alloc (
+      _Alignof (dns_cache_stripe_t), DNS_CACHE_STRIPES * sizeof (*cache->stripes));
+   memset (cache->stripes, 0, DNS_CACHE_STRIPES * sizeof (*cache->stripes));
+   for (int i = 0; i < DNS_CACHE_STRIPES; ++i) {
+      pthread_mutex_init (&cache->stripes[i].lock, NULL);
+   }
+   cache->max_ttl = conf->max_ttl > 0 ? conf->max_ttl : DNS_CACHE_DEFAULT_MAX_TTL;
+   return cache;
+}
+
+void
+destroy_dns_cache (dns_cache_t *cache)
+{
+   if (cache == NULL) {
+      return;
+   }
+   for (uint64_t i = 0; i < (cache->set_mask + 1) * DNS_CACHE_WAYS; ++i) {
+      free (cache->entries[i].blob);
+   }
+   for (int i = 0; i < DNS_CACHE_STRIPES; ++i) {
+      pthread_mutex_destroy (&cache->stripes[i].lock);
+   }
+   free (cache->stripes);
+   free (cache->scopes);
+   free (cache->entries);
+   free (cache);
+}
+
+// Copies the answer of `e` for `req`, called with the stripe of `e` locked
+static int
+cache_answer (const dns_cache_entry_t *e, const dns_qrr_t *q, const uint8_t *req, uint8_t *resp, uint32_t now)
+{
+   memcpy (resp, entry_answer (e), e->length);
+   dns_header_t *hdr = (dns_header_t *) resp;
+   hdr->id = ((const dns_header_t *) req)->id;
+   hdr->hb3 = (hdr->hb3 & ~HB3_RD) | (((const dns_header_t *) req)->hb3 & HB3_RD);
+   // the question goes back the way this client spelled it
+   memcpy (resp + sizeof (dns_header_t), q->name, q->key.length);
+   uint32_t age = now > e->stored ? now - e->stored : 0;
+   const uint16_t *ttls = entry_ttls (e);
+   for (int i = 0; i < e->ttl_count; ++i) {
+      uint8_t *p = resp + ttls[i];
+      uint32_t ttl = 0;
+      GETLONG (ttl, p);
+      p -= 4;
+      PUTLONG (ttl > age ? ttl - age : 0, p);
+   }
+   return e->length;
+}
+
+int
+dns_cache_lookup (dns_cache_t *cache,
+                  const dns_h_t *dht,
+                  const uint8_t *req,
+                  int req_len,
+                  const dns_ecs_t *ecs,
+                  uint8_t *resp,
+                  uint32_t now)
+{
+   if (cache == NULL || dht == NULL || req == NULL || resp == NULL || dht->header.qdcount != 1 ||
+       dns_ecs_present (req, req_len)) {
+      return 0;
+   }
+   const dns_qrr_t *q = dht->qrs;
+   int qend = sizeof (dns_header_t) + q->key.length + 4;
+   uint8_t flags = cache_key_flags (req, req_len, qend);
+   uint64_t hash = cache_key_hash (q->key.hash, q->type, q->class, flags);
+   dns_cache_stripe_t *stripe = cache_stripe (cache, hash);
+   pthread_mutex_lock (&stripe->lock);
+   const dns_cache_scopes_t *hint = &cache->scopes[hash & cache->set_mask];
+   uint64_t scopes = ecs != NULL && ecs->family != 0 && hint->hash == hash ? hint->mask : 0;
+   scopes &= ecs != NULL && ecs->source < 64 ? (1ull << ecs->source) - 1 : UINT64_MAX;
+   if (scopes != 0) {
+      // the most specific scope covering the client first, the answers for every client last
+      pthread_mutex_unlock (&stripe->lock);
+      uint8_t scoped_flags = flags | (ecs->family == DNS_ECS_FAMILY_INET6 ? DNS_CACHE_KEY_INET6 : 0);
+      while (scopes != 0) {
+         uint8_t scope = 64 - __builtin_clzll (scopes);
+         scopes &= ~(1ull << (scope - 1));
+         uint64_t subnet = dns_ecs_truncate (ecs->subnet, scope);
+         uint64_t scoped = cache_scoped_hash (hash, scoped_flags, scope, subnet);
+         dns_cache_stripe_t *s = cache_stripe (cache, scoped);
+         pthread_mutex_lock (&s->lock);
+         const dns_cache_entry_t *e =
+            cache_find (cache, scoped, q->key.wire, q->key.length, q->type, q->class, scoped_flags, scope, subnet);
+         if (e != NULL && e->expire > now) {
+            ++s->hits;
+            int length = cache_answer (e, q, req, resp, now);
+            pthread_mutex_unlock (&s->lock);
+            return length;
+         }
+         pthread_mutex_unlock (&s->lock);
+      }
+      pthread_mutex_lock (&stripe->lock);
+   }
+   const dns_cache_entry_t *e = cache_find (cache, hash, q->key.wire, q->key.length, q->type, q->class, flags, 0, 0);
+   if (e == NULL || e->expire <= now) {
+      ++stripe->misses;
+      pthread_mutex_unlock (&stripe->lock);
+      return 0;
+   }
+   ++stripe->hits;
+   int length = cache_answer (e, q, req, resp, now);
+   pthread_mutex_unlock (&stripe->lock);
+   return length;
+}
+
+uint32_t
+dns_cache_store (dns_cache_t *cache,
+                 const uint8_t *req,
+                 int req_len,
+                 const uint8_t *answer,
+                 int answer_len,
+                 const dns_ecs_t *ecs,
+                 uint32_t now)
+{
+   if (cache == NULL || req == NULL || answer == NULL || req_len < (int) sizeof (dns_header_t) ||
+       answer_len < (int) sizeof (dns_header_t) || answer_len > DNS_CACHE_MAX_ANSWER ||
+       dns_ecs_present (req, req_len)) {
+      return 0;
+   }
+   const dns_header_t *hdr = (const dns_header_t *) answer;
+   uint8_t rcode = RCODE (hdr);
+   if ((hdr->hb3 & HB3_QR) == 0 || (hdr->hb3 & HB3_TC) != 0 || OPCODE (hdr) != QUERY ||
+       (rcode != RCODE_NOERROR && rcode != RCODE_NXDOMAIN) || ntohs (hdr->qdcount) != 1 ||
+       ntohs (((const dns_header_t *) req)->qdcount) != 1) {
+      return 0;
+   }
+   uint8_t orig[RR_NAME_MAX];
+   dns_name_t name;
+   int name_len = dns_name_fold (orig, &name, answer + sizeof (dns_header_t), answer_len - sizeof (dns_header_t));
+   if (name_len < 0) {
+      return 0;
+   }
+   // resolvers echo the question byte for byte, anything else is not an answer to this query
+   int qend = sizeof (dns_header_t) + name_len + 4;
+   if (qend > answer_len || qend > req_len ||
+       memcmp (answer + sizeof (dns_header_t), req + sizeof (dns_header_t), qend - sizeof (dns_header_t)) != 0) {
+      return 0;
+   }
+
+   uint16_t ttls[DNS_CACHE_MAX_RECORDS];
+   int ttl_count = 0;
+   uint32_t min_ttl = UINT32_MAX;
+   int ancount = ntohs (hdr->ancount);
+   int nscount = ntohs (hdr->nscount);
+   int records = ancount + nscount + ntohs (hdr->arcount);
+   int off = qend;
+   for (int i = 0; i < records; ++i) {
+      off = dns_name_skip (answer, answer_len, off);
+      if (off < 0 || off + CACHE_RR_FIXED_LEN > answer_len) {
+         return 0;
+      }
+      const uint8_t *p = answer + off;
+      uint16_t type = 0;
+      uint16_t rdlength = 0;
+      uint32_t ttl = 0;
+      GETSHORT (type, p);
+      p += 2; // class
+      GETLONG (ttl, p);
+      GETSHORT (rdlength, p);
+      if (off + CACHE_RR_FIXED_LEN + rdlength > answer_len) {
+         return 0;
+      }
+      // the OPT ttl field holds the extended rcode and flags
+      if (type != T_OPT) {
+         if (ttl_count == DNS_CACHE_MAX_RECORDS) {
+            return 0;
+         }
+         ttls[ttl_count++] = off + 4;
+         // RFC 2308, a negative answer lives as long as the smaller of the SOA TTL and its minimum field
+         if (type == T_SOA && i >= ancount && i < ancount + nscount && rdlength >= 4) {
+            const uint8_t *m = p + rdlength - 4;
+            uint32_t minimum = 0;
+            GETLONG (minimum, m);
+            ttl = minimum < ttl ? minimum : ttl;
+         }
+         min_ttl = ttl < min_ttl ? ttl : min_ttl;
+      }
+      off += CACHE_RR_FIXED_LEN + rdlength;
+   }
+   if (off != answer_len || ttl_count == 0 || min_ttl == 0) {
+      return 0;
+   }
+   min_ttl = min_ttl < cache->max_ttl ? min_ttl : cache->max_ttl;
+
+   dns_cache_entry_t entry = {0};
+   const uint8_t *qtail = answer + qend - 4;
+   GETSHORT (entry.type, qtail);
+   GETSHORT (entry.class, qtail);
+   entry.flags = cache_key_flags (req, req_len, qend);
+   entry.hash = cache_key_hash (name.hash, entry.type, entry.class, entry.flags);
+   uint64_t unscoped = entry.hash;
+   uint64_t subnet = 0;
+   if (ecs != NULL && ecs->family != 0 && ecs->scope != 0) {
+      entry.scope = ecs->scope;
+      entry.flags |= ecs->family == DNS_ECS_FAMILY_INET6 ? DNS_CACHE_KEY_INET6 : 0;
+      subnet = dns_ecs_truncate (ecs->subnet, ecs->scope);
+      entry.hash = cache_scoped_hash (unscoped, entry.flags, entry.scope, subnet);
+   }
+   entry.stored = now;
+   entry.expire = now + min_ttl;
+   entry.length = answer_len;
+   entry.name_len = name_len;
+   entry.ttl_count = ttl_count;
+   entry.blob = (uint8_t *) malloc (entry_blob_size (entry.ttl_count, entry.name_len, entry.length, entry.scope));
+   memcpy (entry.blob, ttls, ttl_count * sizeof (*ttls));
+   memcpy ((uint8_t *) entry_name (&entry), name.wire, name_len);
+   memcpy ((uint8_t *) entry_name (&entry) + name_len, &subnet, entry_subnet_len (entry.scope));
+   uint8_t *stored = (uint8_t *) entry_answer (&entry);
+   memcpy (stored, answer, answer_len);
+   // capped here so that a hit never hands out more than max_ttl
+   for (int i = 0; i < ttl_count; ++i) {
+      uint8_t *p = stored + ttls[i];
+      uint32_t ttl = 0;
+      GETLONG (ttl, p);
+      if (ttl > cache->max_ttl) {
+         p -= 4;
+         PUTLONG (cache->max_ttl, p);
+      }
+   }
+   uint8_t scope = entry.scope;
+   dns_cache_stripe_t *stripe = cache_stripe (cache, entry.hash);
+   pthread_mutex_lock (&stripe->lock);
+   cache_insert (cache, stripe, &entry, now);
+   pthread_mutex_unlock (&stripe->lock);
+   if (scope != 0) {
+      stripe = cache_stripe (cache, unscoped);
+      pthread_mutex_lock (&stripe->lock);
+      dns_cache_scopes_t *hint = &cache->scopes[unscoped & cache->set_mask];
+      if (hint->hash != unscoped) {
+         hint->hash = unscoped;
+         hint->mask = 0;
+      }
+      hint->mask |= 1ull << (scope - 1);
+      pthread_mutex_unlock (&stripe->lock);
+   }
+   return min_ttl;
+}
+
+dns_rc_t
+dns_cache_save (dns_cache_t *cache, const char *path, uint32_t now)
+{
+   if (cache == NULL || path == NULL) {
+      return kInvalidInput;
+   }
+   size_t tmp_len = strlen (path) + sizeof (".tmp");
+   char *tmp = (char *) malloc (tmp_len);
+   snprintf (tmp, tmp_len, "%s.tmp", path);
+   FILE *f = fopen (tmp, "wb");
+   if (f == NULL) {
+      free (tmp);
+      return kAborted;
+   }
+   setvbuf (f, NULL, _IOFBF, 1 << 16);
+
+   // workers keep storing while the snapshot is written, so the count is only known at the end
+   struct cache_snapshot_header header = {DNS_CACHE_SNAPSHOT_MAGIC, DNS_CACHE_SNAPSHOT_VERSION, 0, 0, now};
+   int ok = fwrite (&header, sizeof (header), 1, f) == 1;
+   for (uint64_t set = 0; set <= cache->set_mask && ok; ++set) {
+      dns_cache_stripe_t *stripe = &cache->stripes[set % DNS_CACHE_STRIPES];
+      pthread_mutex_lock (&stripe->lock);
+      for (int i = 0; i < DNS_CACHE_WAYS && ok; ++i) {
+         const dns_cache_entry_t *e = &cache->entries[set * DNS_CACHE_WAYS + i];
+         if (e->hash == 0 || e->expire <= now || e->scope != 0) {
+            continue;
+         }
+         struct cache_snapshot_record rec = {
+            e->stored, e->expire, e->type, e->class, e->length, e->name_len, e->ttl_count, e->flags, {0}};
+         ok = fwrite (&rec, sizeof (rec), 1, f) == 1 &&
+              fwrite (e->blob, entry_blob_size (e->ttl_count, e->name_len, e->length, 0), 1, f) == 1;
+         ++header.count;
+      }
+      pthread_mutex_unlock (&stripe->lock);
+   }
+   ok = ok && fseek (f, 0, SEEK_SET) == 0 && fwrite (&header, sizeof (header), 1, f) == 1;
+   ok = ok && fflush (f) == 0 && fsync (fileno (f)) == 0;
+   ok = fclose (f) == 0 && ok;
+   if (ok && rename (tmp, path) == -1) {
+      ok = 0;
+   }
+   if (!ok) {
+      unlink (tmp);
+   }
+   free (tmp);
+   return ok ? kOk : kAborted;
+}
+
+// Offsets used on a hit have to stay inside the answer, whatever the file holds
+static int
+snapshot_record_valid (const struct cache_snapshot_record *rec, const uint8_t *blob)
+{
+   int qend = sizeof (dns_header_t) + rec->name_len + 4;
+   if (rec->name_len == 0 || rec->ttl_count == 0 || rec->ttl_count > DNS_CACHE_MAX_RECORDS ||
+       rec->length > DNS_CACHE_MAX_ANSWER || rec->length < qend) {
+      return 0;
+   }
+   for (int i = 0; i < rec->ttl_count; ++i) {
+      uint16_t off = 0;
+      memcpy (&off, blob + i * sizeof (off), sizeof (off));
+      if (off < qend || off + 4 > rec->length) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+dns_rc_t
+dns_cache_load (dns_cache_t *cache, const char *path, uint32_t now)
+{
+   if (cache == NULL || path == NULL) {
+      return kInvalidInput;
+   }
+   int fd = open (path, O_RDONLY);
+   if (fd == -1) {
+      return errno == ENOENT ? kNotFound : kAborted;
+   }
+   struct stat st;
+   if (fstat (fd, &st) == -1 || st.st_size < (off_t) sizeof (struct cache_snapshot_header)) {
+      close (fd);
+      return kDataMalformed;
+   }
+   size_t size = st.st_size;
+   uint8_t *map = (uint8_t *) mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close (fd);
+   if (map == MAP_FAILED) {
+      return kAborted;
+   }
+   madvise (map, size, MADV_SEQUENTIAL);
+
+   struct cache_snapshot_header header;
+   memcpy (&header, map, sizeof (header));
+   if (header.magic != DNS_CACHE_SNAPSHOT_MAGIC || header.version != DNS_CACHE_SNAPSHOT_VERSION) {
+      munmap (map, size);
+      return kDataMalformed;
+   }
+   dns_rc_t rc = kOk;
+   size_t off = sizeof (header);
+   for (uint32_t i = 0; i < header.count; ++i) {
+      struct cache_snapshot_record rec;
+      if (off + sizeof (rec) > size) {
+         rc = kDataMalformed;
+         break;
+      }
+      memcpy (&rec, map + off, sizeof (rec));
+      off += sizeof (rec);
+      size_t blob_size = entry_blob_size (rec.ttl_count, rec.name_len, rec.length, 0);
+      if (off + blob_size > size) {
+         rc = kDataMalformed;
+         break;
+      }
+      const uint8_t *blob = map + off;
+      off += blob_size;
+      if (rec.expire <= now) {
+         continue;
+      }
+      if (!snapshot_record_valid (&rec, blob)) {
+         rc = kDataMalformed;
+         break;
+      }
+      dns_cache_entry_t entry = {0};
+      entry.stored = rec.stored;
+      entry.expire = rec.expire;
+      entry.type = rec.type;
+      entry.class = rec.class;
+      entry.length = rec.length;
+      entry.name_len = rec.name_len;
+      entry.ttl_count = rec.ttl_count;
+      entry.flags = rec.flags;
+      entry.blob = (uint8_t *) malloc (blob_size);
+      memcpy (entry.blob, blob, blob_size);
+      // hashes are recomputed, the hash function may change between versions
+      entry.hash = cache_key_hash (
+         dns_name_hash (entry_name (&entry), entry.name_len), entry.type, entry.class, entry.flags);
+      dns_cache_stripe_t *stripe = cache_stripe (cache, entry.hash);
+      pthread_mutex_lock (&stripe->lock);
+      cache_insert (cache, stripe, &entry, now);
+      pthread_mutex_unlock (&stripe->lock);
+      ++cache->restored;
+   }
+   munmap (map, size);
+   return rc;
+}
+
+void
+dns_cache_stats (dns_cache_t *cache, dns_cache_stats_t *stats)
+{
+   memset (stats, 0, sizeof (*stats));
+   for (int i = 0; cache != NULL && i < DNS_CACHE_STRIPES; ++i) {
+      dns_cache_stripe_t *stripe = &cache->stripes[i];
+      pthread_mutex_lock (&stripe->lock);
+      stats->hits += stripe->hits;
+      stats->misses += stripe->misses;
+      stats->evictions += stripe->evictions;
+      stats->count += stripe->count;
+      pthread_mutex_unlock (&stripe->lock);
+   }
+}
@@ -0,0 +1,388 @@
+#define _GNU_SOURCE
+#include "server/control.h"
+#include "dns/dns-name.h"
+#include "server/dns_server.h"
+#include "server/heavy_hitters.h"
+#include "server/slow_queries.h"
+#include "utils/network_tools.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CONTROL_POLL_MS 200     /* how often the thread looks at quit */
+#define CONTROL_REQUEST_MS 1000 /* a client has this long to send its request */
+
+// Dotted form of a canonical wire name, "." for the root
+static void
+wire_to_text (char *dst, const uint8_t *wire, int length)
+{
+   int d = 0;
+   for (int i = 0; i < length && wire[i] != 0; i += wire[i] + 1) {
+      if (d != 0) {
+         dst[d++] = '.';
+      }
+      memcpy (dst + d, wire + i + 1, wire[i]);
+      d += wire[i];
+   }
+   if (d == 0) {
+      dst[d++] = '.';
+   }
+   dst[d] = 0;
+}
+
+static void
+key_to_text (char *dst, dns_hh_kind_t kind, const dns_hh_top_t *top)
+{
+   if (kind != DNS_HH_CLIENTS) {
+      wire_to_text (dst, top->key, top->length);
+   } else if (inet_ntop (top->key[0], top->key + 1, dst, INET6_ADDRSTRLEN) == NULL) {
+      strcpy (dst, "?");
+   }
+}
+
+static void
+print_top (const dns_server_t *server, dns_hh_kind_t kind, int n, FILE *out)
+{
+   dns_heavy_hitters_t *hh[MAX_WORKERS];
+   for (int i = 0; i < server->worker_count; ++i) {
+      hh[i] = server->workers[i].heavy_hitters;
+   }
+   if (server->worker_count == 0 || hh[0] == NULL) {
+      fprintf (out, "top lists are disabled (\"heavy_hitters\": 0)\n");
+      return;
+   }
+   dns_hh_top_t *top = (dns_hh_top_t *) malloc (n * sizeof (*top));
+   uint64_t total = 0;
+   int count = dns_heavy_hitters_top (hh, server->worker_count, kind, top, n, &total);
+   fprintf (out, "# %s of %llu\n", dns_hh_kind_desc[kind], (unsigned long long) total);
+   char text[RR_NAME_MAX + INET6_ADDRSTRLEN];
+   for (int i = 0; i < count; ++i) {
+      key_to_text (text, kind, &top[i]);
+      fprintf (out, "%llu %llu %s\n", (unsigned long long) top[i].count, (unsigned long long) top[i].error, text);
+   }
+   free (top);
+}
+
+// One capture per line: answer time, reason, total and upstream time, worker, upstream, client, question, rcode
+static void
+print_slow_query (const dns_server_t *server, const dns_slow_query_t *entry, FILE *out)
+{
+   const dns_slow_info_t *info = &entry->info;
+   char client[INET6_ADDRSTRLEN];
+   get_sockaddr_ip (&info->client, client, sizeof (client));
+   uint16_t port = info->client.ss_family == AF_INET6 ? ((const struct sockaddr_in6 *) &info->client)->sin6_port
+                                                      : ((const struct sockaddr_in *) &info->client)->sin_port;
+   char upstream[INET6_ADDRSTRLEN + 8] = "local";
+   if (info->upstream >= 0) {
+      const dns_upstream_t *u = &server->workers[0].upstreams[info->upstream];
+      snprintf (upstream, sizeof (upstream), "%s:%d", u->host, u->port);
+   }
+   char qname[RR_NAME_MAX] = "-";
+   int qtype = 0;
+   uint8_t orig[RR_NAME_MAX];
+   dns_name_t name;
+   int hlen = sizeof (dns_header_t);
+   int consumed = -1;
+   if (entry->query_length > hlen) {
+      consumed = dns_name_fold (orig, &name, entry->query + hlen, entry->query_length - hlen);
+   }
+   if (consumed > 0 && hlen + consumed + 2 <= entry->query_length) {
+      dns_name_to_text (qname, &name);
+      qtype = entry->query[hlen + consumed] << 8 | entry->query[hlen + consumed + 1];
+   }
+   fprintf (out,
+            "%llu.%06llu %s total %.3f ms upstream %.3f ms worker %d %s %s:%d %s %d rcode %d\n",
+            (unsigned long long) (info->answered_ns / 1000000000ull),
+            (unsigned long long) (info->answered_ns % 1000000000ull / 1000),
+            dns_slow_reason_desc[info->reason],
+            info->total_ns / 1e6,
+            info->upstream_ns / 1e6,
+            info->worker,
+            upstream,
+            client,
+            ntohs (port),
+            qname,
+            qtype,
+            entry->answer_length >= hlen ? RCODE ((const dns_header_t *) entry->answer) : -1);
+}
+
+// The captures as text, or as a pcap written to the connection
+static void
+print_slow (const dns_server_t *server, int pcap, FILE *out)
+{
+   dns_slow_queries_t *slow = server->slow_queries;
+   if (slow == NULL) {
+      fprintf (out, "slow query capture is disabled (no \"slow_queries\" in \"control\")\n");
+      return;
+   }
+   int count = 0;
+   dns_slow_query_t *entries = dns_slow_queries_snapshot (slow, &count);
+   if (pcap) {
+      dns_slow_queries_write_pcap (entries, count, &server->s_storage, out);
+   } else {
+      fprintf (out,
+               "# %d kept of %llu captured, threshold %llu ms, sampling 1 in %d\n",
+               count,
+               (unsigned long long) slow->captured,
+               (unsigned long long) (slow->threshold_ns / 1000000),
+               slow->sample_rate);
+      for (int i = 0; i < count; ++i) {
+         print_slow_query (server, &entries[i], out);
+      }
+   }
+   free (entries);
+}
+
+static double
+elapsed_ms (const struct timespec *start)
+{
+   struct timespec now;
+   clock_gettime (CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) * 1e3 + (now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Applies the delta file `path` to the filters of the client group `name`. Returns the group when its overlay is
+// due for a merge, -1 otherwise.
+static int
+apply_delta (dns_server_t *server, const char *path, const char *name, FILE *out)
+{
+   struct timespec start;
+   clock_gettime (CLOCK_MONOTONIC, &start);
+   const dns_policy_t *policy = server->policy;
+   int group = 0;
+   while (group < policy->group_count && strcmp ((const char *) policy->groups[group].name, name) != 0) {
+      ++group;
+   }
+   if (group == policy->group_count) {
+      fprintf (out, "unknown client group %s\n", name);
+      return -1;
+   }
+   dns_rc_t rc = kOk;
+   int line = 0;
+   dns_filter_delta_t *delta = new_dns_filter_delta (path, &line, &rc);
+   if (delta == NULL) {
+      if (line > 0) {
+         fprintf (out, "%s line %d is malformed, nothing applied\n", path, line);
+      } else {
+         fprintf (out, "%s cannot be read, nothing applied\n", path);
+      }
+      return -1;
+   }
+   dns_filter_delta_stats_t stats;
+   dns_filter_view_t *view = dns_filter_view_apply (atomic_load (&policy->groups[group].view), delta, &stats, &rc);
+   destroy_dns_filter_delta (delta);
+   if (view == NULL) {
+      fprintf (out, "%s not applied, the overlay cannot be compiled\n", path);
+      return -1;
+   }
+   dns_server_replace_filters (server, group, view);
+   fprintf (out,
+            "%s: %d added, %d removed, %d not found in %.1f ms, overlay of %d added and %d removed filters\n",
+            name,
+            stats.added,
+            stats.removed,
+            stats.unknown,
+            elapsed_ms (&start),
+            view->added_size,
+            view->removed_count);
+   return dns_filter_view_should_merge (view) ? group : -1;
+}
+
+// Compiles the overlay of `group` into a new set, the workers keep matching the current view meanwhile
+static void
+merge_filters (dns_server_t *server, int group)
+{
+   struct timespec start;
+   clock_gettime (CLOCK_MONOTONIC, &start);
+   dns_rc_t rc = kOk;
+   dns_filter_view_t *view = dns_filter_view_merge (atomic_load (&server->policy->groups[group].view), &rc);
+   if (view == NULL) {
+      printf ("Error, filters of group %s cannot be merged!\n", server->policy->groups[group].name);
+      return;
+   }
+   dns_server_replace_filters (server, group, view);
+   printf ("filters of group %s merged into %d in %.1f ms\n",
+           server->policy->groups[group].name,
+           view->set->size,
+           elapsed_ms (&start));
+}
+
+// Answers one request. Returns the client group whose filters are due for a merge, -1 for none.
+static int
+answer_request (dns_server_t *server, char *request, FILE *out)
+{
+   char *save = NULL;
+   const char *command = strtok_r (request, " \t\r\n", &save);
+   if (command != NULL && strcmp (command, "stats") == 0) {
+      dns_server_print_stats (server, out);
+      return -1;
+   }
+   if (command != NULL && strcmp (command, "slow") == 0) {
+      const char *format = strtok_r (NULL, " \t\r\n", &save);
+      if (format == NULL || strcmp (format, "pcap") == 0) {
+         print_slow (server, format != NULL, out);
+         return -1;
+      }
+   }
+   if (command != NULL && strcmp (command, "delta") == 0) {
+      const char *path = strtok_r (NULL, " \t\r\n", &save);
+      const char *group = strtok_r (NULL, " \t\r\n", &save);
+      if (path != NULL) {
+         return apply_delta (server, path, group != NULL ? group : DNS_DEFAULT_GROUP_NAME, out);
+      }
+   }
+   if (command != NULL && strcmp (command, "top") == 0) {
+      const char *what = strtok_r (NULL, " \t\r\n", &save);
+      const char *n_text = strtok_r (NULL, " \t\r\n", &save);
+      int n = n_text != NULL ? atoi (n_text) : DNS_CONTROL_DEFAULT_TOP;
+      for (int kind = 0; what != NULL && n > 0 && n <= DNS_CONTROL_MAX_TOP && kind < DNS_HH_KINDS; ++kind) {
+         if (strcmp (what, dns_hh_kind_desc[kind]) == 0) {
+            print_top (server, (dns_hh_kind_t) kind, n, out);
+            return -1;
+         }
+      }
+   }
+   fprintf (out,
+            "usage: stats | top names|blocked|clients [1-%d] | slow [pcap] | delta FILE [GROUP]\n",
+            DNS_CONTROL_MAX_TOP);
+   return -1;
+}
+
+// Reads one line, the client may send it in pieces
+static int
+read_request (int fd, char *request, int size)
+{
+   int length = 0;
+   while (length < size - 1) {
+      struct pollfd pfd = {fd, POLLIN, 0};
+      if (poll (&pfd, 1, CONTROL_REQUEST_MS) <= 0) {
+         return -1;
+      }
+      ssize_t n = recv (fd, request + length, size - 1 - length, 0);
+      if (n <= 0) {
+         break;
+      }
+      length += n;
+      if (memchr (request, '\n', length) != NULL) {
+         break;
+      }
+   }
+   request[length] = 0;
+   return length > 0 ? 0 : -1;
+}
+
+static void *
+control_main (void *arg)
+{
+   dns_control_t *control = (dns_control_t *) arg;
+   char request[DNS_CONTROL_MAX_REQUEST];
+   while (!atomic_load (&control->quit)) {
+      struct pollfd pfd = {control->sockfd, POLLIN, 0};
+      if (poll (&pfd, 1, CONTROL_POLL_MS) <= 0) {
+         continue;
+      }
+      int fd = accept4 (control->sockfd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd == -1) {
+         continue;
+      }
+      FILE *out = read_request (fd, request, sizeof (request)) == 0 ? fdopen (fd, "w") : NULL;
+      if (out == NULL) {
+         close (fd);
+         continue;
+      }
+      int merge = answer_request (control->server, request, out);
+      fclose (out);
+      // after the reply, so the client does not wait for it
+      if (merge >= 0) {
+         merge_filters (control->server, merge);
+      }
+   }
+   return NULL;
+}
+
+dns_control_t *
+new_dns_control (struct dns_server *server, const char *path, dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   *lrc = kOk;
+
+   struct sockaddr_un addr;
+   memset (&addr, 0, sizeof (addr));
+   if (server == NULL || path == NULL || strlen (path) >= sizeof (addr.sun_path)) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+   addr.sun_family = AF_UNIX;
+   strcpy (addr.sun_path, path);
+
+   dns_control_t *control = (dns_control_t *) calloc (1, sizeof (*control));
+   control->server = server;
+   control->path = strdup (path);
+   atomic_init (&control->quit, 0);
+   control->sockfd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   // a stale socket of a crashed process, or the one of the process this one upgrades, is replaced
+   struct stat st;
+   if (stat (path, &st) == 0 && S_ISSOCK (st.st_mode)) {
+      unlink (path);
+   }
+   if (control->sockfd == -1 || bind (control->sockfd, (const struct sockaddr *) &addr, sizeof (addr)) == -1 ||
+       listen (control->sockfd, 16) == -1 || stat (path, &st) == -1) {
+      perror ("control socket");
+      *lrc = kAborted;
+      destroy_dns_control (control);
+      return NULL;
+   }
+   control->dev = st.st_dev;
+   control->ino = st.st_ino;
+
+   // the serving threads take the signals
+   sigset_t block;
+   sigset_t old;
+   sigemptyset (&block);
+   sigaddset (&block, SIGINT);
+   sigaddset (&block, SIGUSR2);
+   pthread_sigmask (SIG_BLOCK, &block, &old);
+   int created = pthread_create (&control->thread, NULL, control_main, control);
+   pthread_sigmask (SIG_SETMASK, &old, NULL);
+   if (created != 0) {
+      *lrc = kAborted;
+      destroy_dns_control (control);
+      return NULL;
+   }
+   control->started = 1;
+   return control;
+}
+
+void
+destroy_dns_control (dns_control_t *control)
+{
+   if (control == NULL) {
+      return;
+   }
+   atomic_store (&control->quit, 1);
+   if (control->started) {
+      pthread_join (control->thread, NULL);
+   }
+   if (control->sockfd != -1) {
+      close (control->sockfd);
+   }
+   struct stat st;
+   if (control->ino != 0 && stat (control->path, &st) == 0 && st.st_dev == control->dev && st.st_ino == control->ino) {
+      unlink (control->path);
+   }
+   free (control->path);
+   free (control);
+}
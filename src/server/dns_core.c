@@ -0,0 +1,284 @@
+#include "server/dns_core.h"
+#include "utils/network_tools.h"
+#include "utils/probes.h"
+
+#include "stdlib.h"
+#include "string.h"
+#include <arpa/inet.h>
+
+const dns_filter_conf_t *
+find_filter (const dns_filter_view_t *view, const dns_h_t *dht, uint16_t *out_q)
+{
+   if (view == NULL || (view->set->size == 0 && view->added_size == 0) || dht == NULL) {
+      return NULL;
+   }
+
+   for (int i = 0; i < dht->header.qdcount; i++) {
+      const dns_filter_conf_t *filter = dns_filter_view_match (view, &dht->qrs[i].key);
+      if (filter != NULL) {
+         if (out_q != NULL) {
+            *out_q = i;
+         }
+         return filter;
+      }
+   }
+   return NULL;
+}
+
+dns_h_t *
+new_dns_h_refuse (const dns_h_t *dht)
+{
+   if (dht == NULL) {
+      return NULL;
+   }
+   dns_h_t *dht_resp = new_dns_h (NULL, 0, NULL);
+   if (dht_resp == NULL) {
+      return dht_resp;
+   }
+   dht_resp->header = dht->header;
+
+   if (dht_resp->header.qdcount > 0) {
+      dht_resp->qrs = (dns_qrr_t *) malloc (dht_resp->header.qdcount * sizeof (*dht_resp->qrs));
+      memcpy (dht_resp->qrs, dht->qrs, dht_resp->header.qdcount * sizeof (*dht_resp->qrs));
+   }
+   SET_RCODE (&dht_resp->header, RCODE_REFUSED);
+   return dht_resp;
+}
+
+dns_h_t *
+new_dns_h_notfound (const dns_h_t *dht)
+{
+   if (dht == NULL) {
+      return NULL;
+   }
+   dns_h_t *dht_resp = new_dns_h (NULL, 0, NULL);
+   if (dht_resp == NULL) {
+      return dht_resp;
+   }
+   dht_resp->header = dht->header;
+
+   if (dht_resp->header.qdcount > 0) {
+      dht_resp->qrs = (dns_qrr_t *) malloc (dht_resp->header.qdcount * sizeof (*dht_resp->qrs));
+      memcpy (dht_resp->qrs, dht->qrs, dht_resp->header.qdcount * sizeof (*dht_resp->qrs));
+   }
+   SET_RCODE (&dht_resp->header, RCODE_NXDOMAIN);
+   return dht_resp;
+}
+
+dns_h_t *
+new_dns_h_redirect (const dns_h_t *dht, uint16_t qindex, const uint8_t *redirect_addr)
+{
+   if (dht == NULL || redirect_addr == NULL) {
+      return NULL;
+   }
+   dns_h_t *dht_resp = new_dns_h (NULL, 0, NULL);
+   if (dht_resp == NULL) {
+      return dht_resp;
+   }
+   dht_resp->header = dht->header;
+   if (dht_resp->header.qdcount <= qindex) {
+      return NULL;
+   }
+
+   dht_resp->qrs = (dns_qrr_t *) malloc (dht_resp->header.qdcount * sizeof (*dht_resp->qrs));
+   memcpy (dht_resp->qrs, dht->qrs, dht_resp->header.qdcount * sizeof (*dht_resp->qrs));
+   dht_resp->header.ancount = 1;
+   dht_resp->ancs = (dns_arr_t *) malloc (sizeof (*dht_resp->ancs));
+   // the answer name points at the question it answers
+   uint16_t ptr_offset = sizeof (dht->header);
+   for (int i = 0; i < qindex; ++i) {
+      ptr_offset += dht->qrs[i].key.length + 4; // name, type and class
+   }
+   dht_resp->ancs->name[0] = POINTER_MASK | (ptr_offset >> 8);
+   dht_resp->ancs->name[1] = ptr_offset & 0xff;
+   uint8_t bin_addr[16] = {0};
+   int addr_size = 0;
+   if (get_address_ip_binary (redirect_addr, bin_addr, &addr_size) == -1) {
+      return NULL;
+   }
+   if ((dht_resp->qrs[qindex].type == T_A && addr_size == 4) ||
+       (dht_resp->qrs[qindex].type == T_AAAA && addr_size == 16)) {
+      dht_resp->ancs->type = dht_resp->qrs[qindex].type;
+   } else {
+      return NULL;
+   }
+   dht_resp->ancs->class = C_IN;
+   dht_resp->ancs->ttl = DEFAULT_TTL;
+   dht_resp->ancs->rdlength = addr_size;
+   dht_resp->ancs->rdata = (uint8_t *) malloc (addr_size * sizeof (*dht_resp->ancs->rdata));
+   memcpy (dht_resp->ancs->rdata, bin_addr, addr_size);
+   return dht_resp;
+}
+
+
+// Probe arguments of the first question, NULL and 0 without one
+static inline const uint8_t *
+first_qname (const dns_h_t *dht)
+{
+   return dht->header.qdcount > 0 ? dht->qrs[0].key.wire : NULL;
+}
+
+static inline uint16_t
+first_qtype (const dns_h_t *dht)
+{
+   return dht->header.qdcount > 0 ? dht->qrs[0].type : 0;
+}
+
+dns_h_t *
+decide_dns_response (const dns_policy_group_t *group, const dns_h_t *dht)
+{
+   if (group == NULL || dht == NULL) {
+      return NULL;
+   }
+   if (group->access == DNS_ACCESS_DENY) {
+      return new_dns_h_refuse (dht);
+   }
+   uint16_t q_index = 0;
+   const dns_filter_view_t *view = atomic_load_explicit (&group->view, memory_order_acquire);
+   const dns_filter_conf_t *filter = find_filter (view, dht, &q_index);
+   if (filter == NULL) {
+      return NULL;
+   }
+   dns_action_type_t action = DNS_AT_HANDLE;
+
+   if (filter->filter_type == DNS_FT_ALL) {
+      action = filter->action_type;
+   } else if (filter->filter_type == DNS_FT_IPV4 && dht->qrs->type == T_A) {
+      action = filter->action_type;
+   } else if (filter->filter_type == DNS_FT_IPV6 && dht->qrs->type == T_AAAA) {
+      action = filter->action_type;
+   }
+   DNS_PROBE4 (filter__match, dht->qrs[q_index].key.wire, dht->qrs[q_index].type, action, dht->header.id);
+   if (action == DNS_AT_NOTFOUND) {
+      return new_dns_h_notfound (dht);
+   } else if (action == DNS_AT_REFUSE) {
+      return new_dns_h_refuse (dht);
+   } else if (action == DNS_AT_REDIRECT) {
+      return new_dns_h_redirect (dht, q_index, filter->redirect_addr);
+   }
+
+   return NULL;
+}
+
+dns_verdict_t
+process_dns_query (const dns_policy_t *policy,
+                   dns_cache_t *cache,
+                   const struct sockaddr_storage *client,
+                   const uint8_t *req,
+                   int req_len,
+                   uint8_t *resp,
+                   int *resp_len,
+                   dns_query_info_t *info)
+{
+   if (policy == NULL || req == NULL || resp == NULL || resp_len == NULL) {
+      return DNS_VERDICT_DROP;
+   }
+   *resp_len = 0;
+   if (info != NULL) {
+      info->qname.length = 0;
+      info->upstream = 0;
+      info->ecs.family = 0;
+      info->filtered = 0;
+      info->parsed_ns = 0;
+      info->decided_ns = 0;
+   }
+   // a client query asks one question and carries no answers, anything else is dropped before it is parsed
+   const dns_header_t *req_hdr = (const dns_header_t *) req;
+   if (req_len < (int) sizeof (dns_header_t) || ntohs (req_hdr->qdcount) != 1 || req_hdr->ancount != 0) {
+      return DNS_VERDICT_DROP;
+   }
+
+   dns_h_t *dha = new_dns_h (req, req_len, NULL);
+   if (dha == NULL) {
+      DNS_PROBE2 (parse__failure, ntohs (((const dns_header_t *) req)->id), req_len);
+      return DNS_VERDICT_DROP;
+   }
+   dns_verdict_t verdict = DNS_VERDICT_FORWARD;
+   if (info != NULL && info->latency != NULL) {
+      info->parsed_ns = dns_latency_now (info->latency);
+   }
+   if (info != NULL && dha->header.qdcount > 0) {
+      info->qname = dha->qrs[0].key;
+   }
+   dns_ecs_t ecs = {0};
+   if (policy->ecs.enabled && client != NULL) {
+      dns_ecs_from_client (&ecs, client, policy->ecs.ipv4_prefix, policy->ecs.ipv6_prefix);
+   }
+   dns_h_t *dresp = decide_dns_response (dns_policy_lookup (policy, client), dha);
+   // FILTERED ROUTE
+   if (dresp != NULL) {
+      if (info != NULL) {
+         info->filtered = 1;
+      }
+      int buf_len = 0;
+      uint8_t *gen_buf = new_dns_buffer (dresp, NULL, &buf_len);
+      if (gen_buf != NULL && buf_len <= DNS_UDP_MAX_PACKLEN) {
+         memcpy (resp, gen_buf, buf_len);
+         *resp_len = buf_len;
+         verdict = DNS_VERDICT_REPLY;
+      } else {
+         verdict = DNS_VERDICT_DROP;
+      }
+      free (gen_buf);
+      destroy_dns_h (dresp);
+   } else if ((*resp_len = dns_zone_answer (policy->zone, dha, resp)) > 0) {
+      // LOCAL ROUTE
+      verdict = DNS_VERDICT_REPLY;
+   } else if (cache != NULL &&
+              (*resp_len = dns_cache_lookup (cache, dha, req, req_len, &ecs, resp, dns_cache_now ())) > 0) {
+      // CACHED ROUTE
+      DNS_PROBE3 (cache__hit, first_qname (dha), first_qtype (dha), dha->header.id);
+      verdict = DNS_VERDICT_REPLY;
+   } else {
+      if (cache != NULL) {
+         DNS_PROBE3 (cache__miss, first_qname (dha), first_qtype (dha), dha->header.id);
+      }
+      if (info != NULL) {
+         info->upstream = dns_policy_route (policy, dha);
+         info->ecs = ecs;
+      }
+   }
+   if (info != NULL && info->latency != NULL) {
+      info->decided_ns = dns_latency_now (info->latency);
+   }
+   destroy_dns_h (dha);
+   return verdict;
+}
+
+static int
+encode_dns_header_only (const uint8_t *req, int req_len, uint8_t *resp, uint8_t hb3, uint8_t rcode)
+{
+   if (req == NULL || resp == NULL || req_len < (int) sizeof (dns_header_t)) {
+      return -1;
+   }
+   int qend = sizeof (dns_header_t);
+   if (((const dns_header_t *) req)->qdcount != 0) {
+      while (qend < req_len && req[qend] != 0) {
+         qend += req[qend] + 1;
+      }
+      qend += 5; // root label, type and class
+      if (qend > req_len || qend > DNS_UDP_MAX_PACKLEN) {
+         return -1;
+      }
+   }
+   memcpy (resp, req, qend);
+   dns_header_t *hdr = (dns_header_t *) resp;
+   hdr->hb3 |= HB3_QR | hb3;
+   hdr->hb4 |= HB4_RA;
+   SET_RCODE (hdr, rcode);
+   hdr->qdcount = htons (qend > (int) sizeof (dns_header_t) ? 1 : 0);
+   hdr->ancount = hdr->nscount = hdr->arcount = 0;
+   return qend;
+}
+
+int
+encode_dns_truncated (const uint8_t *req, int req_len, uint8_t *resp)
+{
+   return encode_dns_header_only (req, req_len, resp, HB3_TC, RCODE_NOERROR);
+}
+
+int
+encode_dns_servfail (const uint8_t *req, int req_len, uint8_t *resp)
+{
+   return encode_dns_header_only (req, req_len, resp, 0, RCODE_SERVFAIL);
+}
@@ -0,0 +1,746 @@
+#define _GNU_SOURCE
+#include "server/dns_io.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef IORING_RECV_MULTISHOT
+#define DNS_IO_HAVE_URING 1
+#endif
+#endif
+
+const char *dns_io_backend_desc[] = {"select", "io_uring"};
+
+#define DNS_IO_CONTROL_SIZE CMSG_SPACE (sizeof (struct timespec))
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69 /* Linux 5.11, missing from older headers */
+#endif
+
+// The SCM_TIMESTAMPNS of a received message, 0 when the socket does not ask for it
+static uint64_t
+kernel_timestamp (struct msghdr *msg)
+{
+   for (struct cmsghdr *c = CMSG_FIRSTHDR (msg); c != NULL; c = CMSG_NXTHDR (msg, c)) {
+      if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMPNS) {
+         struct timespec ts;
+         memcpy (&ts, CMSG_DATA (c), sizeof (ts));
+         return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+      }
+   }
+   return 0;
+}
+
+#ifdef DNS_IO_HAVE_URING
+// user_data: the request kind in the upper half, the send slot or the socket index in the lower one
+#define URING_SEND 0ull
+#define URING_RECV 1ull
+#define URING_CANCEL 2ull
+#define URING_TAG(kind, index) ((kind) << 32 | (uint64_t) (index))
+#define URING_BUFFER_GROUP 0
+
+// A queued reply, the kernel reads the message when the request runs so it has to outlive the submission
+struct uring_send_slot {
+   struct msghdr msg;
+   struct iovec iov;
+   struct sockaddr_storage addr;
+   uint8_t data[DNS_IO_BUFFER_SIZE];
+};
+
+struct dns_io_uring {
+   int fd;
+   // submission queue
+   void *sq_ring;
+   size_t sq_ring_size;
+   uint32_t *sq_head;
+   uint32_t *sq_tail;
+   uint32_t *sq_array;
+   uint32_t sq_mask;
+   uint32_t sq_entries;
+   uint32_t sq_pending; /* prepared, not yet submitted */
+   struct io_uring_sqe *sqes;
+   size_t sqes_size;
+   // completion queue, shares the mapping of the submission queue when the kernel supports it
+   void *cq_ring;
+   size_t cq_ring_size;
+   uint32_t *cq_head;
+   uint32_t *cq_tail;
+   uint32_t cq_mask;
+   struct io_uring_cqe *cqes;
+   // provided receive buffers
+   struct io_uring_buf_ring *buf_ring;
+   size_t buf_ring_size;
+   uint8_t *buffers;
+   uint16_t buf_tail;
+   struct msghdr recv_msg; /* layout of the multishot receives: the sender address and the kernel timestamp */
+   uint8_t recv_armed[DNS_IO_MAX_SOCKETS];
+   struct uring_send_slot *slots;
+   int *free_slots;
+   int free_count;
+};
+
+static int
+uring_setup (unsigned entries, struct io_uring_params *p)
+{
+   return (int) syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_size)
+{
+   return (int) syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, arg_size);
+}
+
+static int
+uring_register (int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+   return (int) syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void
+destroy_uring (struct dns_io_uring *u)
+{
+   if (u == NULL) {
+      return;
+   }
+   if (u->fd >= 0) {
+      close (u->fd);
+   }
+   if (u->sqes != NULL && u->sqes != MAP_FAILED) {
+      munmap (u->sqes, u->sqes_size);
+   }
+   if (u->cq_ring != NULL && u->cq_ring != MAP_FAILED && u->cq_ring != u->sq_ring) {
+      munmap (u->cq_ring, u->cq_ring_size);
+   }
+   if (u->sq_ring != NULL && u->sq_ring != MAP_FAILED) {
+      munmap (u->sq_ring, u->sq_ring_size);
+   }
+   if (u->buf_ring != NULL && u->buf_ring != MAP_FAILED) {
+      munmap (u->buf_ring, u->buf_ring_size);
+   }
+   free (u->buffers);
+   free (u->slots);
+   free (u->free_slots);
+   free (u);
+}
+
+// Hands buffer `bid` back to the kernel, visible to it after the next publish_buffers
+static inline void
+recycle_buffer (struct dns_io_uring *u, uint16_t bid)
+{
+   struct io_uring_buf *buf = &u->buf_ring->bufs[u->buf_tail & (DNS_IO_URING_BUFFERS - 1)];
+   buf->addr = (uint64_t) (uintptr_t) (u->buffers + (size_t) bid * DNS_IO_BUFFER_SIZE);
+   buf->len = DNS_IO_BUFFER_SIZE;
+   buf->bid = bid;
+   ++u->buf_tail;
+}
+
+static inline void
+publish_buffers (struct dns_io_uring *u)
+{
+   __atomic_store_n (&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+static int
+submit (struct dns_io_uring *u, unsigned min_complete, unsigned flags, void *arg, size_t arg_size)
+{
+   int ret = uring_enter (u->fd, u->sq_pending, min_complete, flags, arg, arg_size);
+   if (ret >= 0) {
+      u->sq_pending -= (uint32_t) ret < u->sq_pending ? (uint32_t) ret : u->sq_pending;
+   }
+   return ret;
+}
+
+// Next free submission entry, the queue is flushed first when it is full
+static struct io_uring_sqe *
+get_sqe (struct dns_io_uring *u)
+{
+   uint32_t tail = *u->sq_tail;
+   if (tail - __atomic_load_n (u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+      if (submit (u, 0, 0, NULL, 0) < 0) {
+         return NULL;
+      }
+      if (tail - __atomic_load_n (u->sq_head, __ATOMIC_ACQUIRE) >= u->sq_entries) {
+         return NULL;
+      }
+   }
+   struct io_uring_sqe *sqe = &u->sqes[tail & u->sq_mask];
+   memset (sqe, 0, sizeof (*sqe));
+   u->sq_array[tail & u->sq_mask] = tail & u->sq_mask;
+   return sqe;
+}
+
+static inline void
+commit_sqe (struct dns_io_uring *u)
+{
+   __atomic_store_n (u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+   ++u->sq_pending;
+}
+
+static int
+arm_recv (struct dns_io_uring *u, int sockfd, int index)
+{
+   struct io_uring_sqe *sqe = get_sqe (u);
+   if (sqe == NULL) {
+      return -1;
+   }
+   sqe->opcode = IORING_OP_RECVMSG;
+   sqe->fd = sockfd;
+   sqe->addr = (uint64_t) (uintptr_t) &u->recv_msg;
+   sqe->len = 1;
+   sqe->ioprio = IORING_RECV_MULTISHOT;
+   sqe->flags = IOSQE_BUFFER_SELECT;
+   sqe->buf_group = URING_BUFFER_GROUP;
+   sqe->user_data = URING_TAG (URING_RECV, index);
+   commit_sqe (u);
+   u->recv_armed[index] = 1;
+   return 0;
+}
+
+static struct dns_io_uring *
+new_uring (int sockfd)
+{
+   struct dns_io_uring *u = (struct dns_io_uring *) calloc (1, sizeof (*u));
+   u->fd = -1;
+   struct io_uring_params p;
+   memset (&p, 0, sizeof (p));
+   p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+   u->fd = uring_setup (DNS_IO_URING_ENTRIES, &p);
+   if (u->fd < 0 && errno == EINVAL) {
+      memset (&p, 0, sizeof (p));
+      u->fd = uring_setup (DNS_IO_URING_ENTRIES, &p);
+   }
+   if (u->fd < 0 || !(p.features & IORING_FEAT_EXT_ARG)) {
+      destroy_uring (u);
+      return NULL;
+   }
+
+   u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (uint32_t);
+   u->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+   if (p.features & IORING_FEAT_SINGLE_MMAP) {
+      u->sq_ring_size = u->cq_ring_size = u->sq_ring_size > u->cq_ring_size ? u->sq_ring_size : u->cq_ring_size;
+   }
+   u->sq_ring =
+      mmap (NULL, u->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+   u->cq_ring = (p.features & IORING_FEAT_SINGLE_MMAP)
+                   ? u->sq_ring
+                   : mmap (NULL,
+                           u->cq_ring_size,
+                           PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE,
+                           u->fd,
+                           IORING_OFF_CQ_RING);
+   u->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+   u->sqes = (struct io_uring_sqe *) mmap (
+      NULL, u->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+   if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+      destroy_uring (u);
+      return NULL;
+   }
+   uint8_t *sq = (uint8_t *) u->sq_ring;
+   u->sq_head = (uint32_t *) (sq + p.sq_off.head);
+   u->sq_tail = (uint32_t *) (sq + p.sq_off.tail);
+   u->sq_mask = *(uint32_t *) (sq + p.sq_off.ring_mask);
+   u->sq_entries = *(uint32_t *) (sq + p.sq_off.ring_entries);
+   u->sq_array = (uint32_t *) (sq + p.sq_off.array);
+   uint8_t *cq = (uint8_t *) u->cq_ring;
+   u->cq_head = (uint32_t *) (cq + p.cq_off.head);
+   u->cq_tail = (uint32_t *) (cq + p.cq_off.tail);
+   u->cq_mask = *(uint32_t *) (cq + p.cq_off.ring_mask);
+   u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+   // the buffer ring has to be page aligned, the kernel reads it without copying
+   u->buf_ring_size = DNS_IO_URING_BUFFERS * sizeof (struct io_uring_buf);
+   u->buf_ring = (struct io_uring_buf_ring *) mmap (
+      NULL, u->buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (u->buf_ring == MAP_FAILED) {
+      destroy_uring (u);
+      return NULL;
+   }
+   struct io_uring_buf_reg reg;
+   memset (&reg, 0, sizeof (reg));
+   reg.ring_addr = (uint64_t) (uintptr_t) u->buf_ring;
+   reg.ring_entries = DNS_IO_URING_BUFFERS;
+   reg.bgid = URING_BUFFER_GROUP;
+   if (uring_register (u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+      destroy_uring (u);
+      return NULL;
+   }
+   u->buffers = (uint8_t *) malloc ((size_t) DNS_IO_URING_BUFFERS * DNS_IO_BUFFER_SIZE);
+   for (int i = 0; i < DNS_IO_URING_BUFFERS; ++i) {
+      recycle_buffer (u, i);
+   }
+   publish_buffers (u);
+
+   u->slots = (struct uring_send_slot *) calloc (DNS_IO_URING_SEND_SLOTS, sizeof (*u->slots));
+   u->free_slots = (int *) malloc (DNS_IO_URING_SEND_SLOTS * sizeof (*u->free_slots));
+   for (int i = 0; i < DNS_IO_URING_SEND_SLOTS; ++i) {
+      u->free_slots[u->free_count++] = DNS_IO_URING_SEND_SLOTS - 1 - i;
+   }
+
+   u->recv_msg.msg_namelen = sizeof (struct sockaddr_storage);
+   u->recv_msg.msg_controllen = DNS_IO_CONTROL_SIZE;
+   if (arm_recv (u, sockfd, 0) != 0 || submit (u, 0, 0, NULL, 0) < 0) {
+      destroy_uring (u);
+      return NULL;
+   }
+   return u;
+}
+
+// Consumes completions: finished sends free their slot, received datagrams are handed out until `max` is reached.
+// Returns the number of datagrams filled.
+static int
+reap (dns_io_t *io, dns_datagram_t *dgrams, int max)
+{
+   struct dns_io_uring *u = io->uring;
+   int count = 0;
+   uint32_t head = *u->cq_head;
+   uint32_t tail = __atomic_load_n (u->cq_tail, __ATOMIC_ACQUIRE);
+   for (; head != tail; ++head) {
+      const struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+      uint64_t kind = cqe->user_data >> 32;
+      uint32_t index = (uint32_t) cqe->user_data;
+      if (kind == URING_CANCEL) {
+         continue;
+      }
+      if (kind == URING_SEND) {
+         u->free_slots[u->free_count++] = (int) index;
+         continue;
+      }
+      if (count == max) {
+         break;
+      }
+      if (!(cqe->flags & IORING_CQE_F_MORE)) {
+         // the multishot receive ended (out of buffers, error), it is armed again with the next submission
+         u->recv_armed[index] = 0;
+      }
+      if (cqe->res < 0 || !(cqe->flags & IORING_CQE_F_BUFFER)) {
+         continue;
+      }
+      uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      uint8_t *buf = u->buffers + (size_t) bid * DNS_IO_BUFFER_SIZE;
+      const struct io_uring_recvmsg_out *out = (const struct io_uring_recvmsg_out *) buf;
+      if (out->flags & MSG_TRUNC) {
+         recycle_buffer (u, bid);
+         continue;
+      }
+      dns_datagram_t *d = &dgrams[count++];
+      const uint8_t *name = buf + sizeof (*out);
+      d->addr_len = out->namelen < sizeof (d->addr) ? out->namelen : sizeof (d->addr);
+      memcpy (&d->addr, name, d->addr_len);
+      // the control data follows the space reserved for the name
+      struct msghdr control;
+      memset (&control, 0, sizeof (control));
+      control.msg_control = (void *) (name + u->recv_msg.msg_namelen);
+      control.msg_controllen = out->controllen;
+      d->kernel_ns = kernel_timestamp (&control);
+      d->data = name + u->recv_msg.msg_namelen + u->recv_msg.msg_controllen;
+      d->length = out->payloadlen;
+      d->buffer = bid;
+      d->socket = index;
+   }
+   __atomic_store_n (u->cq_head, head, __ATOMIC_RELEASE);
+   publish_buffers (u);
+   return count;
+}
+
+static int
+uring_receive (dns_io_t *io, dns_datagram_t *dgrams, int max, int timeout_ms)
+{
+   struct dns_io_uring *u = io->uring;
+   int count = reap (io, dgrams, max);
+   if (count > 0) {
+      return count;
+   }
+   int armed = 0;
+   for (int i = 0; i < io->socket_count; ++i) {
+      // once stopped, the listening socket is not armed again
+      if (!u->recv_armed[i] && !(i == 0 && io->stopped) && arm_recv (u, io->sockets[i], i) != 0) {
+         return -1;
+      }
+      armed += u->recv_armed[i];
+   }
+   if (armed == 0) {
+      return 0;
+   }
+   // submits the queued replies and waits for the next datagram in one call
+   struct __kernel_timespec ts = {timeout_ms / 1000, (long long) (timeout_ms % 1000) * 1000000};
+   struct io_uring_getevents_arg arg;
+   memset (&arg, 0, sizeof (arg));
+   arg.ts = (uint64_t) (uintptr_t) &ts;
+   if (submit (u, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof (arg)) < 0 && errno != ETIME &&
+       errno != EINTR && errno != EBUSY) {
+      return -1;
+   }
+   return reap (io, dgrams, max);
+}
+
+static void
+uring_stop (struct dns_io_uring *u)
+{
+   if (!u->recv_armed[0]) {
+      return;
+   }
+   struct io_uring_sqe *sqe = get_sqe (u);
+   if (sqe == NULL) {
+      // not waited for then, what the receive still completes is handed out with the next datagrams
+      u->recv_armed[0] = 0;
+      return;
+   }
+   sqe->opcode = IORING_OP_ASYNC_CANCEL;
+   sqe->fd = -1;
+   sqe->addr = URING_TAG (URING_RECV, 0);
+   sqe->user_data = URING_TAG (URING_CANCEL, 0);
+   commit_sqe (u);
+   submit (u, 0, 0, NULL, 0);
+}
+
+static int
+uring_send (dns_io_t *io,
+            int socket,
+            const uint8_t *data,
+            int length,
+            const struct sockaddr_storage *addr,
+            socklen_t addr_len)
+{
+   struct dns_io_uring *u = io->uring;
+   if (u->free_count == 0 || length > DNS_IO_BUFFER_SIZE) {
+      return -1;
+   }
+   struct io_uring_sqe *sqe = get_sqe (u);
+   if (sqe == NULL) {
+      return -1;
+   }
+   int slot_index = u->free_slots[--u->free_count];
+   struct uring_send_slot *slot = &u->slots[slot_index];
+   memcpy (slot->data, data, length);
+   slot->iov.iov_base = slot->data;
+   slot->iov.iov_len = length;
+   memset (&slot->msg, 0, sizeof (slot->msg));
+   if (addr != NULL) {
+      memcpy (&slot->addr, addr, addr_len);
+      slot->msg.msg_name = &slot->addr;
+      slot->msg.msg_namelen = addr_len;
+   }
+   slot->msg.msg_iov = &slot->iov;
+   slot->msg.msg_iovlen = 1;
+   sqe->opcode = IORING_OP_SENDMSG;
+   sqe->fd = io->sockets[socket];
+   sqe->addr = (uint64_t) (uintptr_t) &slot->msg;
+   sqe->len = 1;
+   sqe->user_data = URING_TAG (URING_SEND, slot_index);
+   commit_sqe (u);
+   return 0;
+}
+#endif
+
+dns_io_t *
+new_dns_io (dns_io_backend_t backend, int sockfd, dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   *lrc = kOk;
+
+   if (sockfd < 0) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+   dns_io_t *io = (dns_io_t *) calloc (1, sizeof (*io));
+   io->backend = backend;
+   io->sockfd = sockfd;
+   io->sockets[io->socket_count++] = sockfd;
+   if (backend == DNS_IO_URING) {
+#ifdef DNS_IO_HAVE_URING
+      io->uring = new_uring (sockfd);
+#endif
+      if (io->uring == NULL) {
+         *lrc = kAborted;
+         free (io);
+         return NULL;
+      }
+   } else {
+      io->buffers = (uint8_t *) malloc ((size_t) DNS_IO_BATCH * DNS_IO_BUFFER_SIZE);
+   }
+   return io;
+}
+
+void
+destroy_dns_io (dns_io_t *io)
+{
+   if (io == NULL) {
+      return;
+   }
+#ifdef DNS_IO_HAVE_URING
+   destroy_uring (io->uring);
+#endif
+   free (io->buffers);
+   free (io->msgs);
+   free (io);
+}
+
+// Waits in poll rather than select, the sockets of all workers can take descriptors above FD_SETSIZE
+static int
+select_receive (dns_io_t *io, dns_datagram_t *dgrams, int max, int timeout_ms)
+{
+   // once stopped, the listening socket is left to the process it was handed to
+   int first = io->stopped ? 1 : 0;
+   struct pollfd fds[DNS_IO_MAX_SOCKETS];
+   int nfds = 0;
+   for (int i = first; i < io->socket_count; ++i, ++nfds) {
+      fds[nfds].fd = io->sockets[i];
+      fds[nfds].events = POLLIN;
+      fds[nfds].revents = 0;
+   }
+   if (nfds == 0) {
+      return 0;
+   }
+   int n = poll (fds, nfds, timeout_ms);
+   if (n <= 0) {
+      return n < 0 && errno != EINTR ? -1 : 0;
+   }
+   // drain what is already queued on the ready sockets without blocking again
+   int count = 0;
+   for (int i = first; i < io->socket_count && count < max; ++i) {
+      if (fds[i - first].revents == 0) {
+         continue;
+      }
+      while (count < max) {
+         dns_datagram_t *d = &dgrams[count];
+         uint8_t *buf = io->buffers + (size_t) count * DNS_IO_BUFFER_SIZE;
+         _Alignas (struct cmsghdr) uint8_t control[DNS_IO_CONTROL_SIZE];
+         struct iovec iov = {buf, DNS_IO_BUFFER_SIZE};
+         struct msghdr msg;
+         memset (&msg, 0, sizeof (msg));
+         msg.msg_name = &d->addr;
+         msg.msg_namelen = sizeof (d->addr);
+         msg.msg_iov = &iov;
+         msg.msg_iovlen = 1;
+         msg.msg_control = control;
+         msg.msg_controllen = sizeof (control);
+         ssize_t len = recvmsg (io->sockets[i], &msg, MSG_DONTWAIT);
+         if (len < 0) {
+            break;
+         }
+         // a datagram larger than the buffer is cut off, dropped as the io_uring backend does
+         if (msg.msg_flags & MSG_TRUNC) {
+            continue;
+         }
+         d->addr_len = msg.msg_namelen;
+         d->kernel_ns = kernel_timestamp (&msg);
+         d->data = buf;
+         d->length = len;
+         d->buffer = count;
+         d->socket = i;
+         ++count;
+      }
+   }
+   return count;
+}
+
+static uint64_t
+monotonic_ns ()
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// One non-blocking recvmmsg on every socket, the listening one first. Truncated datagrams are dropped as in the
+// other backends, the buffer of one stays unused until the next receive.
+static int
+busy_poll_sockets (dns_io_t *io, dns_datagram_t *dgrams, int max)
+{
+   int count = 0;
+   int used = 0;
+   for (int i = io->stopped ? 1 : 0; i < io->socket_count && used < max; ++i) {
+      for (int j = used; j < max; ++j) {
+         io->msgs[j].msg_hdr.msg_name = &dgrams[j].addr;
+         io->msgs[j].msg_hdr.msg_namelen = sizeof (dgrams[j].addr);
+         io->msgs[j].msg_hdr.msg_controllen = DNS_IO_CONTROL_SIZE;
+      }
+      int n = recvmmsg (io->sockets[i], io->msgs + used, max - used, MSG_DONTWAIT, NULL);
+      for (int j = used; j < used + n; ++j) {
+         if (io->msgs[j].msg_hdr.msg_flags & MSG_TRUNC) {
+            continue;
+         }
+         // kept datagrams move down over the dropped ones, whose entries were already read
+         dns_datagram_t *d = &dgrams[count++];
+         if (d != &dgrams[j]) {
+            memcpy (&d->addr, &dgrams[j].addr, sizeof (d->addr));
+         }
+         d->addr_len = io->msgs[j].msg_hdr.msg_namelen;
+         d->kernel_ns = kernel_timestamp (&io->msgs[j].msg_hdr);
+         d->data = io->buffers + (size_t) j * DNS_IO_BUFFER_SIZE;
+         d->length = io->msgs[j].msg_len;
+         d->buffer = j;
+         d->socket = i;
+      }
+      used += n > 0 ? n : 0;
+   }
+   return count;
+}
+
+// Spins while datagrams keep coming, sleeps in poll once none came for busy_idle_ns. Returns 0 when nothing came
+// by the timeout either way, so the caller gets to its deadlines.
+static int
+busy_receive (dns_io_t *io, dns_datagram_t *dgrams, int max, int timeout_ms)
+{
+   uint64_t now = monotonic_ns ();
+   uint64_t deadline = now + (uint64_t) timeout_ms * 1000000ull;
+   while (now - io->last_ns < io->busy_idle_ns) {
+      int count = busy_poll_sockets (io, dgrams, max);
+      if (count > 0) {
+         io->last_ns = now;
+         return count;
+      }
+      if (now >= deadline) {
+         return 0;
+      }
+      now = monotonic_ns ();
+   }
+   ++io->sleeps;
+   int count = select_receive (io, dgrams, max, timeout_ms);
+   if (count > 0) {
+      io->last_ns = monotonic_ns ();
+   }
+   return count;
+}
+
+int
+dns_io_receive (dns_io_t *io, dns_datagram_t *dgrams, int max, int timeout_ms)
+{
+   if (max > DNS_IO_BATCH) {
+      max = DNS_IO_BATCH;
+   }
+#ifdef DNS_IO_HAVE_URING
+   if (io->uring != NULL) {
+      return uring_receive (io, dgrams, max, timeout_ms);
+   }
+#endif
+   if (io->busy_idle_ns > 0) {
+      return busy_receive (io, dgrams, max, timeout_ms);
+   }
+   return select_receive (io, dgrams, max, timeout_ms);
+}
+
+void
+dns_io_release (dns_io_t *io, const dns_datagram_t *dgrams, int count)
+{
+#ifdef DNS_IO_HAVE_URING
+   if (io->uring != NULL && count > 0) {
+      for (int i = 0; i < count; ++i) {
+         recycle_buffer (io->uring, dgrams[i].buffer);
+      }
+      publish_buffers (io->uring);
+   }
+#endif
+}
+
+int
+dns_io_busy_poll (dns_io_t *io, int idle_us, int socket_us)
+{
+   if (io->uring != NULL || idle_us <= 0) {
+      return -1;
+   }
+   if (io->msgs == NULL) {
+      io->msgs = (struct mmsghdr *) calloc (DNS_IO_BATCH, sizeof (*io->msgs) + sizeof (struct iovec) +
+                                                            DNS_IO_CONTROL_SIZE);
+      struct iovec *iovs = (struct iovec *) (io->msgs + DNS_IO_BATCH);
+      uint8_t *controls = (uint8_t *) (iovs + DNS_IO_BATCH);
+      for (int i = 0; i < DNS_IO_BATCH; ++i) {
+         iovs[i].iov_base = io->buffers + (size_t) i * DNS_IO_BUFFER_SIZE;
+         iovs[i].iov_len = DNS_IO_BUFFER_SIZE;
+         io->msgs[i].msg_hdr.msg_iov = &iovs[i];
+         io->msgs[i].msg_hdr.msg_iovlen = 1;
+         io->msgs[i].msg_hdr.msg_control = controls + (size_t) i * DNS_IO_CONTROL_SIZE;
+      }
+   }
+   io->busy_idle_ns = (uint64_t) idle_us * 1000ull;
+   int rc = 0;
+   int prefer = 1;
+   for (int i = 0; i < io->socket_count && socket_us > 0; ++i) {
+      if (setsockopt (io->sockets[i], SOL_SOCKET, SO_BUSY_POLL, &socket_us, sizeof (socket_us)) == -1 ||
+          setsockopt (io->sockets[i], SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof (prefer)) == -1) {
+         rc = -1;
+      }
+   }
+   return rc;
+}
+
+int
+dns_io_add_socket (dns_io_t *io, int sockfd)
+{
+   if (io->socket_count == DNS_IO_MAX_SOCKETS) {
+      return -1;
+   }
+   int index = io->socket_count++;
+   io->sockets[index] = sockfd;
+#ifdef DNS_IO_HAVE_URING
+   if (io->uring != NULL) {
+      // submitted with the next wait, a failure leaves it to be armed again then
+      arm_recv (io->uring, sockfd, index);
+   }
+#endif
+   return index;
+}
+
+void
+dns_io_stop (dns_io_t *io)
+{
+   io->stopped = 1;
+#ifdef DNS_IO_HAVE_URING
+   if (io->uring != NULL) {
+      uring_stop (io->uring);
+   }
+#endif
+}
+
+int
+dns_io_send (dns_io_t *io,
+             int socket,
+             const uint8_t *data,
+             int length,
+             const struct sockaddr_storage *addr,
+             socklen_t addr_len)
+{
+#ifdef DNS_IO_HAVE_URING
+   // without a free slot the datagram goes out with a plain sendto
+   if (io->uring != NULL && uring_send (io, socket, data, length, addr, addr_len) == 0) {
+      return 0;
+   }
+#endif
+   socklen_t len = addr != NULL ? addr_len : 0;
+   return sendto (io->sockets[socket], data, length, 0, (const struct sockaddr *) addr, len) == length ? 0 : -1;
+}
+
+void
+dns_io_flush (dns_io_t *io)
+{
+#ifdef DNS_IO_HAVE_URING
+   if (io->uring != NULL && io->uring->sq_pending > 0) {
+      submit (io->uring, 0, 0, NULL, 0);
+   }
+#endif
+}
+
+int
+dns_io_draining (const dns_io_t *io)
+{
+#ifdef DNS_IO_HAVE_URING
+   if (io->uring != NULL) {
+      return io->stopped && io->uring->recv_armed[0];
+   }
+#endif
+   return 0;
+}
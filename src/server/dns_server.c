@@ -1,13 +1,25 @@
+#define _GNU_SOURCE
 #include "server/dns_server.h"
+#include "server/dns_core.h"
+#include "server/handoff.h"
+#include "server/zone.h"
+#include "server/pattern_dfa.h"
+#include "dns/dns-name.h"
 #include "dns/dns-parse.h"
 #include "utils/string_tools.h"
 #include "utils/network_tools.h"
-
-#include "sys/select.h"
+#include "utils/probes.h"
 
 #include "stdlib.h"
 #include "string.h"
 #include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <linux/filter.h>
 
 dns_rc_t
 init_dns_addrinfo (struct addrinfo *ainfo, const char *host, uint16_t port, struct sockaddr_storage *storage)
@@ -49,11 +61,12 @@ init_dns_addrinfo (struct addrinfo *ainfo, const char *host, uint16_t port, stru
 }
 
 
+// `reuseport` joins the SO_REUSEPORT group of the address, one socket per worker
 DNS_SOCK
-bind_dns_socket (const struct addrinfo *ainfo, struct sockaddr_storage *storage)
+bind_dns_socket (const struct addrinfo *ainfo, int reuseport)
 {
    DNS_SOCK sockfd = -1;
-   if ((sockfd = socket (ainfo->ai_family, ainfo->ai_socktype, ainfo->ai_protocol)) == -1) {
+   if ((sockfd = socket (ainfo->ai_family, ainfo->ai_socktype | SOCK_CLOEXEC, ainfo->ai_protocol)) == -1) {
       close (sockfd);
       return -1;
    }
@@ -62,7 +75,10 @@ bind_dns_socket (const struct addrinfo *ainfo, struct sockaddr_storage *storage)
       close (sockfd);
       return -1;
    }
-   struct sockaddr_in *sa = (struct sockaddr_in *) ainfo->ai_addr;
+   if (reuseport && setsockopt (sockfd, SOL_SOCKET, SO_REUSEPORT, &reuseport, sizeof (int)) == -1) {
+      close (sockfd);
+      return -1;
+   }
    if (bind (sockfd, ainfo->ai_addr, ainfo->ai_addrlen) < 0) {
       perror ("bind");
       close (sockfd);
@@ -71,6 +87,164 @@ bind_dns_socket (const struct addrinfo *ainfo, struct sockaddr_storage *storage)
    return sockfd;
 }
 
+// The listening socket of worker `index` a previous process passed when it is bound to `host` and `port`,
+// -1 otherwise
+static int
+take_inherited_socket (dns_handoff_socket_t *inherited, int count, int index, const char *host, uint16_t port)
+{
+   if (index < count && inherited[index].fd != -1 && inherited[index].port == port &&
+       strcmp (inherited[index].host, host) == 0) {
+      int fd = inherited[index].fd;
+      inherited[index].fd = -1;
+      return fd;
+   }
+   return -1;
+}
+
+// Classic BPF program for the reuseport group: a datagram goes to the socket at index cpu % workers, the one of
+// the worker pinned to the cpu that received it. The group orders its sockets by bind, which is worker order.
+static int
+attach_cpu_steering (DNS_SOCK sockfd, int workers)
+{
+   struct sock_filter code[] = {
+      {BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU},
+      {BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t) workers},
+      {BPF_RET | BPF_A, 0, 0, 0},
+   };
+   struct sock_fprog prog = {sizeof (code) / sizeof (code[0]), code};
+   return setsockopt (sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof (prog));
+}
+
+// Opens the socket pool of the upstream and has `io` receive from it. Every socket is connected: the kernel picks
+// a random source port for it, skips the route lookup on send and only lets the upstream's datagrams in.
+static dns_rc_t
+init_dns_upstream (dns_upstream_t *upstream, const dns_server_conf_t *conf, dns_io_t *io)
+{
+   strncpy (upstream->host, conf->addr, sizeof (upstream->host) - 1);
+   upstream->port = conf->port;
+   upstream->timeout_ns = (uint64_t) conf->timeout_ms * 1000000ull;
+   dns_rc_t rc = init_dns_addrinfo (&upstream->hints, upstream->host, upstream->port, &upstream->storage);
+   if (rc != kOk) {
+      return rc;
+   }
+   upstream->sockets = (DNS_SOCK *) malloc (conf->sockets * sizeof (*upstream->sockets));
+   upstream->io_sockets = (uint16_t *) malloc (conf->sockets * sizeof (*upstream->io_sockets));
+   for (int i = 0; i < conf->sockets; ++i) {
+      DNS_SOCK sockfd =
+         socket (upstream->hints.ai_family, upstream->hints.ai_socktype | SOCK_CLOEXEC, upstream->hints.ai_protocol);
+      if (sockfd == -1) {
+         return kAborted;
+      }
+      upstream->sockets[upstream->socket_count++] = sockfd;
+      if (connect (sockfd, upstream->hints.ai_addr, upstream->hints.ai_addrlen) == -1) {
+         return kAborted;
+      }
+      int index = dns_io_add_socket (io, sockfd);
+      if (index == -1) {
+         return kAborted;
+      }
+      upstream->io_sockets[i] = index;
+   }
+   return kOk;
+}
+
+// Runs on the worker's own thread: pins it, then allocates the worker state there, so first touch puts the
+// pages on the NUMA node of its cpu and an io_uring instance belongs to the thread submitting to it
+static dns_rc_t
+init_dns_worker (dns_worker_t *worker)
+{
+   const dns_server_t *server = worker->server;
+   const dns_conf_t *conf = server->conf;
+   if (worker->cpu >= 0) {
+      cpu_set_t cpus;
+      CPU_ZERO (&cpus);
+      CPU_SET (worker->cpu, &cpus);
+      if (pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus) != 0) {
+         printf ("worker %d cannot be pinned to cpu %d\n", worker->index, worker->cpu);
+         return kAborted;
+      }
+   }
+   dns_rc_t rc = kOk;
+   worker->io = new_dns_io (conf->io_backend, worker->sockfd, &rc);
+   if (rc != kOk && conf->io_backend != DNS_IO_SELECT) {
+      if (worker->index == 0) {
+         printf ("%s is not available, falling back to %s\n",
+                 dns_io_backend_desc[conf->io_backend],
+                 dns_io_backend_desc[DNS_IO_SELECT]);
+      }
+      worker->io = new_dns_io (DNS_IO_SELECT, worker->sockfd, &rc);
+   }
+   if (rc != kOk) {
+      return rc;
+   }
+   worker->upstreams = (dns_upstream_t *) calloc (server->upstream_count, sizeof (*worker->upstreams));
+   for (int i = 0; i < server->upstream_count && rc == kOk; ++i) {
+      rc = init_dns_upstream (
+         &worker->upstreams[i], i == 0 ? &conf->upstream : &conf->routes[i - 1].upstream, worker->io);
+   }
+   // set either way, a socket inherited from an upgraded process keeps the option of that configuration. Load
+   // shedding needs the timestamps of the queries only.
+   int timestamps = conf->stage_latency;
+   int query_timestamps = conf->stage_latency || conf->overload.enabled;
+   setsockopt (worker->sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &query_timestamps, sizeof (query_timestamps));
+   for (int i = 0; i < server->upstream_count && rc == kOk && timestamps; ++i) {
+      for (int j = 0; j < worker->upstreams[i].socket_count; ++j) {
+         setsockopt (worker->upstreams[i].sockets[j], SOL_SOCKET, SO_TIMESTAMPNS, &timestamps, sizeof (timestamps));
+      }
+   }
+   if (timestamps) {
+      worker->latency = new_dns_latency ();
+   }
+   // after the upstream sockets, they are busy polled too. Without CAP_NET_ADMIN the kernel refuses a timeout above
+   // net.core.busy_read, the worker still spins on its sockets.
+   if (rc == kOk && conf->busy_poll.enabled &&
+       dns_io_busy_poll (worker->io, conf->busy_poll.idle_us, conf->busy_poll.socket_us) != 0 && worker->index == 0) {
+      perror ("SO_BUSY_POLL");
+   }
+   if (rc != kOk) {
+      return rc;
+   }
+   worker->pending = new_dns_pending (DNS_PENDING_DEFAULT_SIZE, server->upstream_count, &rc);
+   worker->log_ring = query_log_ring (server->query_log, worker->index);
+   if (rc == kOk && conf->control.path != NULL && conf->control.heavy_hitters > 0) {
+      worker->heavy_hitters = new_dns_heavy_hitters (conf->control.heavy_hitters, &rc);
+   }
+   if (rc == kOk && conf->overload.enabled) {
+      worker->overload = new_dns_overload (&conf->overload, worker->sockfd, &rc);
+   }
+   return rc;
+}
+
+// Reports the setup of `worker` and waits until every worker did. Returns 1 when all of them can serve.
+static int
+report_dns_worker (dns_worker_t *worker)
+{
+   dns_server_t *server = worker->server;
+   pthread_mutex_lock (&server->startup_lock);
+   ++server->reported;
+   pthread_cond_broadcast (&server->startup_cond);
+   while (server->startup_verdict == 0) {
+      pthread_cond_wait (&server->startup_cond, &server->startup_lock);
+   }
+   int verdict = server->startup_verdict;
+   pthread_mutex_unlock (&server->startup_lock);
+   return verdict > 0;
+}
+
+static void
+serve_dns_worker (dns_worker_t *worker);
+
+static void *
+dns_worker_main (void *arg)
+{
+   dns_worker_t *worker = (dns_worker_t *) arg;
+   worker->rc = init_dns_worker (worker);
+   if (report_dns_worker (worker)) {
+      serve_dns_worker (worker);
+   }
+   return NULL;
+}
+
 dns_server_t *
 init_dns_server (const dns_conf_t *conf, dns_rc_t *rc)
 {
@@ -94,263 +268,995 @@ init_dns_server (const dns_conf_t *conf, dns_rc_t *rc)
    dns_server_t *server = (dns_server_t *) calloc (1, sizeof (*server));
    strncpy (server->s_host, conf->self.addr, addrlen);
    server->s_port = conf->self.port;
-
-   addrlen = strlen (conf->upstream.addr);
-   strncpy (server->u_host, conf->upstream.addr, addrlen);
-   server->u_port = conf->upstream.port;
    server->conf = conf;
+   server->read_timeout.tv_sec = DEFAULT_READ_TIMEOUT_SEC;
+   server->read_timeout.tv_usec = DEFAULT_READ_TIMEOUT_USEC;
+   pthread_mutex_init (&server->startup_lock, NULL);
+   pthread_cond_init (&server->startup_cond, NULL);
+
+   // started by an upgrade: the listening sockets of the running process are reused
+   int handoff = dns_handoff_channel ();
+   dns_handoff_socket_t inherited[DNS_HANDOFF_MAX_SOCKETS];
+   int inherited_count = handoff != -1 ? dns_handoff_receive (handoff, inherited, DNS_HANDOFF_MAX_SOCKETS) : 0;
+   if (inherited_count < 0) {
+      printf ("no sockets received from the previous process, starting without them\n");
+      inherited_count = 0;
+   }
 
    *lrc = init_dns_addrinfo (&server->s_hints, server->s_host, server->s_port, &server->s_storage);
    if (*lrc != kOk) {
       destroy_dns_server (server);
       return NULL;
    }
-   server->self_sockfd = bind_dns_socket (&server->s_hints, &server->s_storage);
-   if (server->self_sockfd == -1) {
-      *lrc = kAborted;
+   server->policy = new_dns_policy (conf, lrc);
+   if (*lrc != kOk) {
       destroy_dns_server (server);
       return NULL;
    }
+   if (conf->query_log.path != NULL) {
+      server->query_log = new_query_log (&conf->query_log, conf->workers, lrc);
+      if (*lrc != kOk) {
+         destroy_dns_server (server);
+         return NULL;
+      }
+   }
+   if (conf->rate_limit.responses_per_second > 0) {
+      server->rate_limit = new_rate_limit (&conf->rate_limit, lrc);
+      if (*lrc != kOk) {
+         destroy_dns_server (server);
+         return NULL;
+      }
+   }
+   if (conf->control.path != NULL && conf->control.slow_queries.size > 0) {
+      server->slow_queries = new_dns_slow_queries (&conf->control.slow_queries, lrc);
+      if (*lrc != kOk) {
+         destroy_dns_server (server);
+         return NULL;
+      }
+   }
+   if (conf->cache.max_entries > 0) {
+      server->cache = new_dns_cache (&conf->cache, lrc);
+      if (*lrc != kOk) {
+         destroy_dns_server (server);
+         return NULL;
+      }
+      // a missing or unreadable snapshot only means a cold start
+      if (conf->cache.snapshot_path != NULL) {
+         dns_rc_t load_rc = dns_cache_load (server->cache, (const char *) conf->cache.snapshot_path, dns_cache_now ());
+         if (load_rc != kOk && load_rc != kNotFound) {
+            printf ("cache snapshot %s not restored: %s\n", conf->cache.snapshot_path, code_desc[load_rc]);
+         }
+      }
+   }
 
-   *lrc = init_dns_addrinfo (&server->u_hints, server->u_host, server->u_port, &server->u_storage);
+   if (conf->prefetch.name_size > 0 || conf->prefetch.hot_path != NULL) {
+      server->prefetch = new_dns_prefetch (&conf->prefetch, server->policy, lrc);
+      if (*lrc != kOk) {
+         destroy_dns_server (server);
+         return NULL;
+      }
+   }
+
+   server->worker_count = conf->workers;
+   server->upstream_count = conf->route_size + 1;
+   server->workers = (dns_worker_t *) calloc (server->worker_count, sizeof (*server->workers));
+   for (int i = 0; i < server->worker_count; ++i) {
+      dns_worker_t *worker = &server->workers[i];
+      worker->server = server;
+      worker->index = i;
+      worker->cpu = conf->cpu_steering ? i : conf->busy_poll.cpus != NULL ? conf->busy_poll.cpus[i] : -1;
+      worker->sockfd = -1;
+   }
+   // bound in worker order, the steering program picks sockets by their position in the group
+   for (int i = 0; i < server->worker_count && *lrc == kOk; ++i) {
+      dns_worker_t *worker = &server->workers[i];
+      worker->sockfd = take_inherited_socket (inherited, inherited_count, i, server->s_host, server->s_port);
+      if (worker->sockfd == -1) {
+         worker->sockfd = bind_dns_socket (&server->s_hints, server->worker_count > 1);
+      }
+      if (worker->sockfd == -1) {
+         *lrc = kAborted;
+      }
+   }
+   // sockets of workers the previous process had in excess
+   for (int i = 0; i < inherited_count; ++i) {
+      if (inherited[i].fd != -1) {
+         close (inherited[i].fd);
+      }
+   }
+   if (*lrc == kOk && conf->cpu_steering && server->worker_count > 1 &&
+       attach_cpu_steering (server->workers[0].sockfd, server->worker_count) == -1) {
+      perror ("SO_ATTACH_REUSEPORT_CBPF");
+      *lrc = kAborted;
+   }
    if (*lrc != kOk) {
       destroy_dns_server (server);
       return NULL;
    }
-   if ((server->upstream_sockfd =
-           socket (server->u_hints.ai_family, server->u_hints.ai_socktype, server->u_hints.ai_protocol)) == -1) {
-      *lrc = kAborted;
+
+   if (conf->stage_latency) {
+      dns_latency_calibrate ();
+   }
+   // worker 0 is set up on this thread, which runs it. The others must not take the signals meant for it.
+   sigset_t block;
+   sigset_t old;
+   sigemptyset (&block);
+   sigaddset (&block, SIGINT);
+   sigaddset (&block, SIGUSR2);
+   pthread_sigmask (SIG_BLOCK, &block, &old);
+   int spawned = 0;
+   for (int i = 1; i < server->worker_count; ++i) {
+      dns_worker_t *worker = &server->workers[i];
+      if (pthread_create (&worker->thread, NULL, dns_worker_main, worker) != 0) {
+         worker->rc = kAborted;
+         continue;
+      }
+      worker->started = 1;
+      ++spawned;
+   }
+   pthread_sigmask (SIG_SETMASK, &old, NULL);
+   server->workers[0].rc = init_dns_worker (&server->workers[0]);
+
+   pthread_mutex_lock (&server->startup_lock);
+   while (server->reported < spawned) {
+      pthread_cond_wait (&server->startup_cond, &server->startup_lock);
+   }
+   for (int i = 0; i < server->worker_count && *lrc == kOk; ++i) {
+      *lrc = server->workers[i].rc;
+   }
+   server->startup_verdict = *lrc == kOk ? 1 : -1;
+   pthread_cond_broadcast (&server->startup_cond);
+   pthread_mutex_unlock (&server->startup_lock);
+   if (*lrc != kOk) {
       destroy_dns_server (server);
       return NULL;
    }
-   server->read_timeout.tv_sec = DEFAULT_READ_TIMEOUT_SEC;
-   server->read_timeout.tv_usec = DEFAULT_READ_TIMEOUT_USEC;
 
-   server->quit = 0;
+   if (conf->control.path != NULL) {
+      server->control = new_dns_control (server, (const char *) conf->control.path, lrc);
+      if (*lrc != kOk) {
+         destroy_dns_server (server);
+         return NULL;
+      }
+   }
+
+   if (handoff != -1) {
+      dns_handoff_ready (handoff);
+   }
    return server;
 }
 
-const dns_filter_conf_t *
-find_filter (const dns_filter_conf_t *filters, int fsize, const dns_h_t *dht, uint16_t *out_q)
+static inline uint64_t
+realtime_ns ()
 {
-   if (filters == NULL || fsize == 0 || dht == NULL) {
-      return NULL;
+   struct timespec ts;
+   clock_gettime (CLOCK_REALTIME, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uint64_t
+monotonic_ns ()
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC_COARSE, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static rate_limit_class_t
+rate_limit_class (dns_verdict_t verdict, const uint8_t *resp)
+{
+   if (verdict == DNS_VERDICT_FORWARD) {
+      return RL_CLASS_RESPONSE;
    }
+   uint8_t rcode = RCODE ((const dns_header_t *) resp);
+   return rcode == RCODE_NOERROR ? RL_CLASS_RESPONSE : (rcode == RCODE_NXDOMAIN ? RL_CLASS_NXDOMAIN : RL_CLASS_ERROR);
+}
 
-   for (int i = 0; i < dht->header.qdcount; i++) {
-      for (int j = 0; j < fsize; j++) {
-         if ((filters[j].match_type == DNS_MT_EXACT && (str_i_cmp (dht->qrs[i].name, filters[j].host) == 0)) ||
-             ((filters[j].match_type == DNS_MT_CONTAINS) && (str_i_str (dht->qrs[i].name, filters[j].host) != NULL))) {
-            if (out_q != NULL) {
-               *out_q = i;
-            }
-            return &filters[j];
-         }
-      }
+static void
+log_dns_query (query_log_ring_t *ring,
+               const struct sockaddr_storage *client,
+               const uint8_t *query,
+               int query_len,
+               dns_verdict_t verdict,
+               uint8_t rcode,
+               uint64_t recv_ns)
+{
+   query_log_record_t *rec = query_log_reserve (ring);
+   if (rec == NULL) {
+      return;
+   }
+   rec->time_ns = realtime_ns ();
+   rec->latency_ns = (uint32_t) (rec->time_ns - recv_ns);
+   rec->action = verdict;
+   rec->rcode = rcode;
+   rec->client_family = client->ss_family;
+   if (client->ss_family == AF_INET6) {
+      const struct sockaddr_in6 *sa6 = (const struct sockaddr_in6 *) client;
+      memcpy (rec->client_addr, &sa6->sin6_addr, 16);
+      rec->client_port = ntohs (sa6->sin6_port);
+   } else {
+      const struct sockaddr_in *sa = (const struct sockaddr_in *) client;
+      memcpy (rec->client_addr, &sa->sin_addr, 4);
+      rec->client_port = ntohs (sa->sin_port);
+   }
+   rec->query_len = query_len < QUERY_LOG_MAX_QUERY ? query_len : QUERY_LOG_MAX_QUERY;
+   memcpy (rec->query, query, rec->query_len);
+   query_log_commit (ring);
+}
+
+static int
+upstream_available (const dns_upstream_t *upstream, uint64_t now_ns)
+{
+   return upstream->failures < DNS_UPSTREAM_MAX_FAILURES || now_ns >= upstream->down_until;
+}
+
+static void
+report_upstream (dns_upstream_t *upstream, int answered, uint64_t now_ns)
+{
+   if (answered) {
+      upstream->failures = 0;
+      return;
+   }
+   ++upstream->timeouts;
+   if (++upstream->failures >= DNS_UPSTREAM_MAX_FAILURES) {
+      upstream->down_until = now_ns + DNS_UPSTREAM_HOLD_DOWN_NS;
    }
-   return NULL;
 }
 
-dns_h_t *
-new_dns_h_refuse (const dns_h_t *dht)
+// Sends `dgram` on the next socket of the upstream pool under a random ID. Returns its pending entry, NULL when the
+// upstream is down, the pending table is full or the query is too long to keep.
+static dns_pending_query_t *
+forward_dns_query (dns_worker_t *worker,
+                   int upstream_index,
+                   const dns_datagram_t *dgram,
+                   const dns_ecs_t *ecs,
+                   uint64_t recv_ns,
+                   uint64_t start_ns)
 {
-   if (dht == NULL) {
+   dns_upstream_t *upstream = &worker->upstreams[upstream_index];
+   uint64_t now_ns = monotonic_ns ();
+   if (!upstream_available (upstream, now_ns) || dgram->length > DNS_UDP_MAX_PACKLEN) {
+      return NULL;
+   }
+   int socket = upstream->io_sockets[upstream->next_socket];
+   upstream->next_socket = (upstream->next_socket + 1) % upstream->socket_count;
+   dns_pending_query_t *pending =
+      dns_pending_add (worker->pending, upstream_index, socket, now_ns + upstream->timeout_ns);
+   if (pending == NULL) {
       return NULL;
    }
-   dns_h_t *dht_resp = new_dns_h (NULL, NULL);
-   if (dht_resp == NULL) {
-      return dht_resp;
+   memcpy (pending->query, dgram->data, dgram->length);
+   pending->length = dgram->length;
+   pending->client = dgram->addr;
+   pending->client_len = dgram->addr_len;
+   pending->client_id = ((const dns_header_t *) dgram->data)->id;
+   pending->recv_ns = recv_ns;
+
+   uint8_t query[DNS_UDP_MAX_PACKLEN + DNS_ECS_MAX_ADDED];
+   int length = dgram->length;
+   memcpy (query, dgram->data, length);
+   ((dns_header_t *) query)->id = dns_pending_id (pending);
+   pending->ecs = *ecs;
+   pending->ecs_mode = dns_ecs_add (query, &length, sizeof (query), ecs);
+   if (dns_io_send (worker->io, socket, query, length, NULL, 0) != 0) {
+      dns_pending_remove (worker->pending, pending);
+      return NULL;
+   }
+   DNS_PROBE4 (upstream__send,
+               upstream_index,
+               pending->query + sizeof (dns_header_t),
+               ntohs (pending->client_id),
+               ntohs (dns_pending_id (pending)));
+   pending->start_ns = start_ns;
+   pending->sent_ns = worker->latency != NULL ? dns_latency_now (worker->latency) : worker->batch_ns;
+   ++upstream->forwarded;
+   return pending;
+}
+
+// Counts an answer for the slow query sampling, returns whether it is sampled
+static inline int
+slow_query_sampled (dns_worker_t *worker)
+{
+   int rate = worker->server->slow_queries->sample_rate;
+   return rate != 0 && ++worker->answers % rate == 0;
+}
+
+// Keeps a query with its answer in the slow query ring, `info` has the times and the reason
+static void
+capture_slow_query (dns_worker_t *worker,
+                    dns_slow_info_t *info,
+                    const struct sockaddr_storage *client,
+                    int upstream,
+                    const uint8_t *query,
+                    int query_length,
+                    const uint8_t *answer,
+                    int answer_length)
+{
+   info->client = *client;
+   info->upstream = upstream;
+   info->worker = worker->index;
+   dns_slow_queries_add (worker->server->slow_queries, info, query, query_length, answer, answer_length);
+}
+
+// Host order ID of a message for the probes, 0 when it is too short to have one
+static inline uint16_t
+message_id (const uint8_t *msg, int length)
+{
+   return length >= (int) sizeof (dns_header_t) ? ntohs (((const dns_header_t *) msg)->id) : 0;
+}
+
+// Stages of a query up to its reply or its upstream send, which ends at `done_ns`
+static void
+trace_dns_query (dns_latency_t *lat,
+                 const dns_datagram_t *dgram,
+                 uint64_t picked_ns,
+                 const dns_query_info_t *info,
+                 dns_verdict_t verdict,
+                 uint64_t done_ns)
+{
+   dns_latency_add (lat, DNS_STAGE_QUEUE, dgram->kernel_ns, picked_ns);
+   dns_latency_add (lat, DNS_STAGE_PARSE, picked_ns, info->parsed_ns);
+   dns_latency_add (lat, DNS_STAGE_DECIDE, info->parsed_ns, info->decided_ns);
+   if (verdict == DNS_VERDICT_REPLY) {
+      dns_latency_add (lat, DNS_STAGE_REPLY, info->decided_ns, done_ns);
+      dns_latency_add (lat, DNS_STAGE_TOTAL, dgram->kernel_ns != 0 ? dgram->kernel_ns : picked_ns, done_ns);
+   } else {
+      dns_latency_add (lat, DNS_STAGE_FORWARD, info->decided_ns, done_ns);
    }
-   dht_resp->header = dht->header;
+}
+
+// Everything that happens to one client datagram, whichever backend received it. Replies go through dns_io_send.
+static void
+handle_dns_query (dns_worker_t *worker, const dns_datagram_t *dgram)
+{
+   const dns_server_t *server = worker->server;
+   query_log_ring_t *log_ring = worker->log_ring;
+   uint8_t resp[DNS_CACHE_MAX_ANSWER];
+   const uint8_t *query = dgram->data;
+   int n = dgram->length;
+   const struct sockaddr_storage *client_addr = &dgram->addr;
 
-   if (dht_resp->header.qdcount > 0) {
-      dht_resp->qrs = (dns_qrr_t *) malloc (dht_resp->header.qdcount * sizeof (*dht_resp->qrs));
-      for (int i = 0; i < dht_resp->header.qdcount; i++) {
-         size_t len = strlen (dht->qrs[i].name);
-         strncpy (dht_resp->qrs[i].name, dht->qrs[i].name, len);
-         dht_resp->qrs[i].type = dht->qrs[i].type;
-         dht_resp->qrs[i].class = dht->qrs[i].class;
+   DNS_PROBE4 (query__receive, worker->index, message_id (query, n), n, client_addr);
+   uint64_t recv_ns = log_ring != NULL ? realtime_ns () : 0;
+   uint64_t picked_ns = worker->latency != NULL ? dns_latency_now (worker->latency) : worker->batch_ns;
+   int resp_len = 0;
+   dns_query_info_t info;
+   info.latency = worker->latency;
+   dns_verdict_t verdict =
+      process_dns_query (server->policy, server->cache, client_addr, query, n, resp, &resp_len, &info);
+   if (worker->heavy_hitters != NULL && verdict != DNS_VERDICT_DROP) {
+      dns_heavy_hitters_count (worker->heavy_hitters, &info.qname, info.filtered, client_addr);
+   }
+   // OVERLOADED ROUTE, queries that would be forwarded make way for the ones answered here
+   dns_overload_t *ov = worker->overload;
+   if (verdict == DNS_VERDICT_FORWARD && ov != NULL && ov->level != DNS_LOAD_NORMAL) {
+      DNS_PROBE2 (query__shed, message_id (query, n), ov->level);
+      if (ov->level == DNS_LOAD_SHED && (resp_len = ov->action == DNS_OVERLOAD_TRUNCATE
+                                                       ? encode_dns_truncated (query, n, resp)
+                                                       : encode_dns_servfail (query, n, resp)) > 0) {
+         ++ov->shed;
+         verdict = DNS_VERDICT_REPLY;
+      } else {
+         ++ov->dropped;
+         verdict = DNS_VERDICT_DROP;
       }
    }
-   SET_RCODE (&dht_resp->header, RCODE_REFUSED);
-   return dht_resp;
+   if (server->rate_limit != NULL && verdict != DNS_VERDICT_DROP &&
+       !rate_limit_allow (server->rate_limit, client_addr, rate_limit_class (verdict, resp), monotonic_ns ())) {
+      if (server->rate_limit->action == DNS_RL_TRUNCATE && (resp_len = encode_dns_truncated (query, n, resp)) > 0) {
+         dns_io_send (worker->io, 0, resp, resp_len, client_addr, dgram->addr_len);
+         DNS_PROBE4 (reply__sent, message_id (query, n), RCODE ((dns_header_t *) resp), resp_len, 0);
+      }
+      verdict = DNS_VERDICT_DROP;
+   }
+   // UNFILTERED ROUTE, a route whose upstream is down answers SERVFAIL rather than using another one
+   if (verdict == DNS_VERDICT_FORWARD && forward_dns_query (
+                                              worker,
+                                              info.upstream,
+                                              dgram,
+                                              &info.ecs,
+                                              recv_ns,
+                                              dgram->kernel_ns != 0 ? dgram->kernel_ns : picked_ns) == NULL &&
+       (resp_len = encode_dns_servfail (query, n, resp)) > 0) {
+      verdict = DNS_VERDICT_REPLY;
+   }
+   if (verdict == DNS_VERDICT_REPLY) {
+      // FILTERED ROUTE
+      dns_io_send (worker->io, 0, resp, resp_len, client_addr, dgram->addr_len);
+      DNS_PROBE4 (reply__sent, message_id (query, n), RCODE ((dns_header_t *) resp), resp_len, 0);
+      if (log_ring != NULL) {
+         log_dns_query (log_ring, client_addr, query, n, verdict, RCODE ((dns_header_t *) resp), recv_ns);
+      }
+      // answers of the proxy itself are not timed, only sampled
+      if (server->slow_queries != NULL && slow_query_sampled (worker)) {
+         dns_slow_info_t slow = {.answered_ns = realtime_ns (), .reason = DNS_SLOW_SAMPLED};
+         uint64_t start_ns = dgram->kernel_ns != 0 ? dgram->kernel_ns : picked_ns;
+         slow.total_ns = slow.answered_ns > start_ns ? slow.answered_ns - start_ns : 0;
+         capture_slow_query (worker, &slow, client_addr, -1, query, n, resp, resp_len);
+      }
+   }
+   if (worker->latency != NULL && verdict != DNS_VERDICT_DROP) {
+      trace_dns_query (worker->latency, dgram, picked_ns, &info, verdict, dns_latency_now (worker->latency));
+   }
 }
 
-dns_h_t *
-new_dns_h_notfound (const dns_h_t *dht)
+// Sends the prefetch queries that are due, unless the worker sheds load, on the upstream pools of client queries
+static void
+prefetch_dns_names (dns_worker_t *worker)
 {
-   if (dht == NULL) {
-      return NULL;
+   static const dns_ecs_t no_ecs = {0};
+   dns_prefetch_t *prefetch = worker->server->prefetch;
+   if (worker->overload != NULL && worker->overload->level != DNS_LOAD_NORMAL) {
+      return;
    }
-   dns_h_t *dht_resp = new_dns_h (NULL, NULL);
-   if (dht_resp == NULL) {
-      return dht_resp;
+   uint64_t now_ns = monotonic_ns ();
+   int index = -1;
+   while ((index = dns_prefetch_next (prefetch, now_ns)) >= 0) {
+      const dns_prefetch_name_t *name = &prefetch->names[index];
+      dns_datagram_t dgram = {.data = name->query, .length = name->length};
+      dns_pending_query_t *pending = forward_dns_query (worker, name->upstream, &dgram, &no_ecs, 0, 0);
+      if (pending == NULL) {
+         dns_prefetch_done (prefetch, index, 0, now_ns);
+         continue;
+      }
+      pending->prefetch = index;
    }
-   dht_resp->header = dht->header;
+}
 
-   if (dht_resp->header.qdcount > 0) {
-      dht_resp->qrs = (dns_qrr_t *) malloc (dht_resp->header.qdcount * sizeof (*dht_resp->qrs));
-      for (int i = 0; i < dht_resp->header.qdcount; i++) {
-         size_t len = strlen (dht->qrs[i].name);
-         strncpy (dht_resp->qrs[i].name, dht->qrs[i].name, len);
-         dht_resp->qrs[i].type = dht->qrs[i].type;
-         dht_resp->qrs[i].class = dht->qrs[i].class;
+// Upstreams echo the question, an answer carrying another one is not for this query
+static int
+same_question (const uint8_t *query, int query_len, const uint8_t *answer, int answer_len)
+{
+   const dns_header_t *qh = (const dns_header_t *) query;
+   int qend = sizeof (dns_header_t);
+   if (qh->qdcount != 0) {
+      while (qend < query_len && query[qend] != 0) {
+         qend += query[qend] + 1;
       }
+      qend += 5; // root label, type and class
    }
-   SET_RCODE (&dht_resp->header, RCODE_NXDOMAIN);
-   return dht_resp;
+   return qend <= query_len && qend <= answer_len && ((const dns_header_t *) answer)->qdcount == qh->qdcount &&
+          memcmp (query + sizeof (dns_header_t), answer + sizeof (dns_header_t), qend - sizeof (dns_header_t)) == 0;
 }
 
-dns_h_t *
-new_dns_h_redirect (const dns_h_t *dht, uint16_t qindex, const uint8_t *redirect_addr)
+// Answer to a prefetch query, it only goes to the cache
+static void
+handle_prefetch_answer (dns_worker_t *worker, dns_pending_query_t *pending, const dns_datagram_t *dgram)
 {
-   if (dht == NULL || redirect_addr == NULL) {
-      return NULL;
+   uint32_t ttl = dns_cache_store (
+      worker->server->cache, pending->query, pending->length, dgram->data, dgram->length, NULL, dns_cache_now ());
+   DNS_PROBE5 (upstream__receive,
+               pending->upstream,
+               pending->query + sizeof (dns_header_t),
+               0,
+               message_id (dgram->data, dgram->length),
+               RCODE ((const dns_header_t *) dgram->data));
+   uint64_t now_ns = monotonic_ns ();
+   report_upstream (&worker->upstreams[pending->upstream], 1, now_ns);
+   dns_prefetch_done (worker->server->prefetch, pending->prefetch, ttl, now_ns);
+   dns_pending_remove (worker->pending, pending);
+}
+
+// A datagram on one of the upstream sockets, relayed to the client whose pending query it answers. Late answers
+// to queries that already timed out and answers that match no query are dropped.
+static void
+handle_upstream_answer (dns_worker_t *worker, const dns_datagram_t *dgram)
+{
+   const dns_server_t *server = worker->server;
+   dns_latency_t *lat = worker->latency;
+   uint64_t picked_ns = lat != NULL ? dns_latency_now (lat) : 0;
+   if (dgram->length < (int) sizeof (dns_header_t)) {
+      return;
    }
-   dns_h_t *dht_resp = new_dns_h (NULL, NULL);
-   if (dht_resp == NULL) {
-      return dht_resp;
+   dns_pending_query_t *pending =
+      dns_pending_find (worker->pending, dgram->socket, ((const dns_header_t *) dgram->data)->id);
+   if (pending == NULL || !same_question (pending->query, pending->length, dgram->data, dgram->length)) {
+      return;
    }
-   dht_resp->header = dht->header;
-   size_t *qlengths = 0;
-   if (dht_resp->header.qdcount < 0 || dht_resp->header.qdcount < qindex) {
-      return NULL;
+   if (pending->prefetch >= 0) {
+      handle_prefetch_answer (worker, pending, dgram);
+      return;
+   }
+   uint8_t answer[DNS_IO_BUFFER_SIZE];
+   memcpy (answer, dgram->data, dgram->length);
+   ((dns_header_t *) answer)->id = pending->client_id;
+   int answer_len = dgram->length;
+   dns_ecs_t ecs = pending->ecs;
+   int cacheable = 1;
+   if (pending->ecs_mode != DNS_ECS_NONE) {
+      // the client gets back what it sent, the scope only keys the cache entry
+      cacheable = dns_ecs_answer (answer, &answer_len, pending->ecs_mode, &ecs) == 0;
    }
+   dns_io_send (worker->io, 0, answer, answer_len, &pending->client, pending->client_len);
+   DNS_PROBE5 (upstream__receive,
+               pending->upstream,
+               pending->query + sizeof (dns_header_t),
+               ntohs (pending->client_id),
+               message_id (dgram->data, dgram->length),
+               RCODE ((dns_header_t *) answer));
+   DNS_PROBE4 (reply__sent, ntohs (pending->client_id), RCODE ((dns_header_t *) answer), answer_len, 1);
+   if (lat != NULL) {
+      uint64_t done_ns = dns_latency_now (lat);
+      dns_latency_add (lat, DNS_STAGE_UPSTREAM, pending->sent_ns, dgram->kernel_ns != 0 ? dgram->kernel_ns : picked_ns);
+      dns_latency_add (lat, DNS_STAGE_ANSWER_QUEUE, dgram->kernel_ns, picked_ns);
+      dns_latency_add (lat, DNS_STAGE_RELAY, picked_ns, done_ns);
+      dns_latency_add (lat, DNS_STAGE_TOTAL, pending->start_ns, done_ns);
+   }
+   if (server->slow_queries != NULL) {
+      dns_slow_info_t slow = {.answered_ns = realtime_ns ()};
+      slow.total_ns = slow.answered_ns > pending->start_ns ? slow.answered_ns - pending->start_ns : 0;
+      int over = slow.total_ns >= server->slow_queries->threshold_ns;
+      if (over || slow_query_sampled (worker)) {
+         slow.reason = over ? DNS_SLOW_THRESHOLD : DNS_SLOW_SAMPLED;
+         slow.upstream_ns = slow.answered_ns > pending->sent_ns ? slow.answered_ns - pending->sent_ns : 0;
+         capture_slow_query (worker,
+                             &slow,
+                             &pending->client,
+                             pending->upstream,
+                             pending->query,
+                             pending->length,
+                             answer,
+                             answer_len);
+      }
+   }
+   report_upstream (&worker->upstreams[pending->upstream], 1, monotonic_ns ());
+   if (cacheable) {
+      dns_cache_store (server->cache,
+                       pending->query,
+                       pending->length,
+                       answer,
+                       answer_len,
+                       pending->ecs_mode != DNS_ECS_NONE ? &ecs : NULL,
+                       dns_cache_now ());
+   }
+   if (worker->log_ring != NULL) {
+      log_dns_query (worker->log_ring,
+                     &pending->client,
+                     pending->query,
+                     pending->length,
+                     DNS_VERDICT_FORWARD,
+                     RCODE ((dns_header_t *) answer),
+                     pending->recv_ns);
+   }
+   dns_pending_remove (worker->pending, pending);
+}
 
-   dht_resp->qrs = (dns_qrr_t *) malloc (dht_resp->header.qdcount * sizeof (*dht_resp->qrs));
-   qlengths = (size_t *) calloc (dht_resp->header.qdcount, sizeof (*qlengths));
+// Answers SERVFAIL to the queries whose upstream did not answer in time, prefetch queries are tried again later
+static void
+expire_pending_queries (dns_worker_t *worker)
+{
+   uint8_t resp[DNS_UDP_MAX_PACKLEN];
+   uint64_t now_ns = monotonic_ns ();
+   for (int i = 0; i < worker->server->upstream_count; ++i) {
+      dns_pending_query_t *pending = NULL;
+      while ((pending = dns_pending_expired (worker->pending, i, now_ns)) != NULL) {
+         report_upstream (&worker->upstreams[i], 0, now_ns);
+         DNS_PROBE4 (upstream__timeout,
+                     i,
+                     pending->query + sizeof (dns_header_t),
+                     ntohs (pending->client_id),
+                     ntohs (dns_pending_id (pending)));
+         int resp_len = 0;
+         if (pending->prefetch >= 0) {
+            dns_prefetch_done (worker->server->prefetch, pending->prefetch, 0, now_ns);
+         } else if ((resp_len = encode_dns_servfail (pending->query, pending->length, resp)) > 0) {
+            ((dns_header_t *) resp)->id = pending->client_id;
+            dns_io_send (worker->io, 0, resp, resp_len, &pending->client, pending->client_len);
+            DNS_PROBE4 (reply__sent, ntohs (pending->client_id), RCODE_SERVFAIL, resp_len, 1);
+            if (worker->server->slow_queries != NULL) {
+               dns_slow_info_t slow = {.answered_ns = realtime_ns (), .reason = DNS_SLOW_TIMEOUT};
+               slow.total_ns = slow.answered_ns > pending->start_ns ? slow.answered_ns - pending->start_ns : 0;
+               slow.upstream_ns = slow.answered_ns > pending->sent_ns ? slow.answered_ns - pending->sent_ns : 0;
+               capture_slow_query (
+                  worker, &slow, &pending->client, i, pending->query, pending->length, resp, resp_len);
+            }
+            if (worker->log_ring != NULL) {
+               log_dns_query (worker->log_ring,
+                              &pending->client,
+                              pending->query,
+                              pending->length,
+                              DNS_VERDICT_FORWARD,
+                              RCODE_SERVFAIL,
+                              pending->recv_ns);
+            }
+         }
+         dns_pending_remove (worker->pending, pending);
+      }
+   }
+}
 
-   for (int i = 0; i < dht_resp->header.qdcount; i++) {
-      size_t len = strlen (dht->qrs[i].name);
-      strncpy (dht_resp->qrs[i].name, dht->qrs[i].name, len);
-      dht_resp->qrs[i].type = dht->qrs[i].type;
-      dht_resp->qrs[i].class = dht->qrs[i].class;
+// How long dns_io_receive may wait without missing the deadline of a pending query
+static int
+pending_wait_ms (const dns_worker_t *worker, int timeout_ms)
+{
+   uint64_t deadline_ns = dns_pending_next_deadline (worker->pending);
+   if (deadline_ns == UINT64_MAX) {
+      return timeout_ms;
+   }
+   uint64_t now_ns = monotonic_ns ();
+   uint64_t wait_ms = deadline_ns > now_ns ? (deadline_ns - now_ns + 999999) / 1000000 : 0;
+   return wait_ms < (uint64_t) timeout_ms ? (int) wait_ms : timeout_ms;
+}
 
-      qlengths[i] += (sizeof (*dht_resp->qrs) - sizeof (dht_resp->qrs->name) + len);
+// One batch from dns_io_receive: client queries and upstream answers, then the timeouts, then everything queued
+// goes out together
+static void
+serve_datagrams (dns_worker_t *worker, const dns_datagram_t *dgrams, int count)
+{
+   if (worker->latency != NULL) {
+      dns_latency_anchor (worker->latency);
    }
-   dht_resp->header.ancount = 1;
-   dht_resp->ancs = (dns_arr_t *) malloc (sizeof (*dht_resp->ancs));
-   dht_resp->ancs->name[0] = POINTER_MASK;
-   uint8_t ptr_offset = sizeof (dht->header);
-   for (int i = 0; i < (dht_resp->header.qdcount - 1); ++i) {
-      ptr_offset += qlengths[i];
+   if (worker->server->slow_queries != NULL) {
+      worker->batch_ns = realtime_ns ();
    }
-   free (qlengths);
-   dht_resp->ancs->name[1] = ptr_offset;
-   uint8_t bin_addr[16] = {0};
-   int addr_size = 0;
-   if (get_address_ip_binary (redirect_addr, bin_addr, &addr_size) == -1) {
-      return NULL;
+   if (worker->overload != NULL) {
+      dns_overload_measure (worker->overload, worker->sockfd, dgrams, count);
    }
-   if ((dht_resp->qrs[qindex].type == T_A && addr_size == 4) ||
-       (dht_resp->qrs[qindex].type == T_AAAA && addr_size == 16)) {
-      dht_resp->ancs->type = dht_resp->qrs[qindex].type;
-   } else {
-      return NULL;
+   for (int i = 0; i < count; ++i) {
+      if (dgrams[i].socket == 0) {
+         handle_dns_query (worker, &dgrams[i]);
+      } else {
+         handle_upstream_answer (worker, &dgrams[i]);
+      }
    }
-   dht_resp->ancs->class = C_IN;
-   dht_resp->ancs->ttl = DEFAULT_TTL;
-   dht_resp->ancs->rdlength = addr_size;
-   dht_resp->ancs->rdata = (uint8_t *) malloc (addr_size * sizeof (*dht_resp->ancs->rdata));
-   memcpy (dht_resp->ancs->rdata, bin_addr, addr_size);
-   return dht_resp;
+   dns_io_release (worker->io, dgrams, count);
+   if (worker->index == 0 && worker->server->prefetch != NULL && !worker->server->handed_off) {
+      prefetch_dns_names (worker);
+   }
+   expire_pending_queries (worker);
+   dns_io_flush (worker->io);
+   // nothing of the batch is referenced past this point
+   atomic_store_explicit (&worker->quiescent,
+                          atomic_load_explicit (&worker->server->epoch, memory_order_acquire),
+                          memory_order_release);
 }
 
-
-dns_h_t *
-decide_dns_response (const dns_server_t *server, const dns_h_t *dht)
+// Writes the most queried names for the prefetch of the next start, leaving out the ones clients were refused
+static void
+save_hot_names (const dns_server_t *server)
 {
-   if (server == NULL || dht == NULL) {
-      return NULL;
+   const dns_prefetch_conf_t *conf = &server->conf->prefetch;
+   if (conf->hot_path == NULL || conf->hot_names == 0 || server->workers[0].heavy_hitters == NULL) {
+      return;
    }
-   uint16_t q_index = 0;
-   const dns_filter_conf_t *filter = find_filter (server->conf->filters, server->conf->filter_size, dht, &q_index);
-   if (filter == NULL) {
-      return NULL;
+   dns_heavy_hitters_t *hh[MAX_WORKERS];
+   for (int i = 0; i < server->worker_count; ++i) {
+      hh[i] = server->workers[i].heavy_hitters;
+   }
+   int n = conf->hot_names;
+   dns_hh_top_t *top = (dns_hh_top_t *) malloc (n * sizeof (*top));
+   dns_hh_top_t *blocked = (dns_hh_top_t *) malloc (n * sizeof (*blocked));
+   uint64_t total = 0;
+   int count = dns_heavy_hitters_top (hh, server->worker_count, DNS_HH_NAMES, top, n, &total);
+   int blocked_count = dns_heavy_hitters_top (hh, server->worker_count, DNS_HH_BLOCKED, blocked, n, &total);
+   int kept = 0;
+   for (int i = 0; i < count; ++i) {
+      int j = 0;
+      while (j < blocked_count && (blocked[j].length != top[i].length ||
+                                   memcmp (blocked[j].key, top[i].key, top[i].length) != 0)) {
+         ++j;
+      }
+      if (j == blocked_count) {
+         top[kept++] = top[i];
+      }
+   }
+   if (dns_prefetch_save_hot ((const char *) conf->hot_path, top, kept) != kOk) {
+      printf ("Error, hot names %s not written!\n", conf->hot_path);
    }
-   dns_action_type_t action = DNS_AT_HANDLE;
+   free (blocked);
+   free (top);
+}
 
-   if (filter->filter_type == DNS_FT_ALL) {
-      action = filter->action_type;
-   } else if (filter->filter_type == DNS_FT_IPV4 && dht->qrs->type == T_A) {
-      action = filter->action_type;
-   } else if (filter->filter_type == DNS_FT_IPV6 && dht->qrs->type == T_AAAA) {
-      action = filter->action_type;
+// Starts the upgraded binary and passes it the listening sockets of all workers. The cache snapshot and the hot
+// names are written first, the new process reads them while starting. Returns the handoff channel or -1.
+static int
+start_dns_upgrade (const dns_server_t *server, pid_t *pid)
+{
+   if (server->upgrade_exe == NULL) {
+      return -1;
+   }
+   if (server->cache != NULL && server->conf->cache.snapshot_path != NULL) {
+      dns_cache_save (server->cache, (const char *) server->conf->cache.snapshot_path, dns_cache_now ());
    }
-   if (action == DNS_AT_NOTFOUND) {
-      return new_dns_h_notfound (dht);
-   } else if (action == DNS_AT_REFUSE) {
-      return new_dns_h_refuse (dht);
-   } else if (action == DNS_AT_REDIRECT) {
-      return new_dns_h_redirect (dht, q_index, filter->redirect_addr);
+   save_hot_names (server);
+   // upstream sockets stay here, answers to the queries this process still waits for arrive on them
+   dns_handoff_socket_t listening[DNS_HANDOFF_MAX_SOCKETS];
+   for (int i = 0; i < server->worker_count; ++i) {
+      strncpy (listening[i].host, server->s_host, sizeof (listening[i].host));
+      listening[i].port = server->s_port;
+      listening[i].fd = server->workers[i].sockfd;
    }
+   return dns_handoff_spawn (server->upgrade_exe, listening, server->worker_count, pid);
+}
 
-   return NULL;
+// After a handoff the new process serves the sockets, what this worker already received is still answered here
+// and its forwarded queries wait for their answers or time out
+static void
+drain_dns_worker (dns_worker_t *worker, int timeout_ms)
+{
+   dns_datagram_t dgrams[DNS_IO_BATCH];
+   dns_io_stop (worker->io);
+   while (dns_io_draining (worker->io) || worker->pending->count > 0) {
+      int count = dns_io_receive (worker->io, dgrams, DNS_IO_BATCH, pending_wait_ms (worker, timeout_ms));
+      if (count < 0) {
+         break;
+      }
+      serve_datagrams (worker, dgrams, count);
+   }
 }
 
+// Loop of the workers running on their own thread, until quit or a handoff
+static void
+serve_dns_worker (dns_worker_t *worker)
+{
+   const dns_server_t *server = worker->server;
+   dns_datagram_t dgrams[DNS_IO_BATCH];
+   int timeout_ms = server->read_timeout.tv_sec * 1000 + server->read_timeout.tv_usec / 1000;
+   while (server->quit == 0 && server->handed_off == 0) {
+      int count = dns_io_receive (worker->io, dgrams, DNS_IO_BATCH, pending_wait_ms (worker, timeout_ms));
+      if (count < 0) {
+         printf ("Error, worker %d socket receive failed!\n", worker->index);
+         break;
+      }
+      serve_datagrams (worker, dgrams, count);
+   }
+   if (server->handed_off) {
+      drain_dns_worker (worker, timeout_ms);
+   }
+   atomic_store (&worker->quiescent, UINT64_MAX);
+}
 
-#define BUFFER_SIZE 1024
 dns_rc_t
-run_dns_server (const dns_server_t *server)
+run_dns_server (dns_server_t *server)
 {
-   char buffer[BUFFER_SIZE] = {0};
-   struct sockaddr_in client_addr = {0};
-
-   socklen_t c_len = sizeof (client_addr);
-   socklen_t u_len = server->u_hints.ai_addrlen;
-   ssize_t n;
-   fd_set read_fds;
-
-   // select expects non-const timeout pointer
-   READ_TIMEOUT read_timeout = server->read_timeout;
+   dns_worker_t *worker = &server->workers[0];
+   dns_datagram_t dgrams[DNS_IO_BATCH];
+   int timeout_ms = server->read_timeout.tv_sec * 1000 + server->read_timeout.tv_usec / 1000;
+   const char *snapshot_path = server->cache != NULL ? (const char *) server->conf->cache.snapshot_path : NULL;
+   int snapshot_interval = server->conf->cache.snapshot_interval;
+   uint32_t next_snapshot = dns_cache_now () + snapshot_interval;
+   uint8_t upgrade = server->upgrade;
+   int handoff = -1;
+   pid_t handoff_pid = -1;
+   uint64_t handoff_deadline = 0;
 
+   // worker 0 also writes the snapshots and runs upgrades
    while (server->quit == 0) {
-      FD_ZERO (&read_fds);
-      FD_SET (server->self_sockfd, &read_fds);
-      n = select (server->self_sockfd + 1, &read_fds, NULL, NULL, &read_timeout);
-      if (n < 0) {
-         printf ("Error, socket select failed!\n");
+      int count = dns_io_receive (worker->io, dgrams, DNS_IO_BATCH, pending_wait_ms (worker, timeout_ms));
+      if (count < 0) {
+         printf ("Error, socket receive failed!\n");
          break;
-      } else if (n == 0) {
-         continue;
       }
-      // invert FD_ISSET to prevents code from nesting several if-statements
-      if (!FD_ISSET (server->self_sockfd, &read_fds)) {
-         printf ("Error, socket expects to a have data!\n");
-         break;
+      serve_datagrams (worker, dgrams, count);
+      if (snapshot_path != NULL && snapshot_interval > 0 && dns_cache_now () >= next_snapshot) {
+         dns_cache_save (server->cache, snapshot_path, dns_cache_now ());
+         next_snapshot = dns_cache_now () + snapshot_interval;
       }
-      // Receive a message from a client
-      n = recvfrom (server->self_sockfd, buffer, BUFFER_SIZE, 0, (struct sockaddr *) &client_addr, &c_len);
-      dns_h_t *dha = new_dns_h (buffer, NULL);
-      if (dha == NULL) {
-         printf ("Error, cannot alloc memory for response!\n");
-         break;
+
+      if (server->upgrade != upgrade && handoff == -1) {
+         upgrade = server->upgrade;
+         handoff = start_dns_upgrade (server, &handoff_pid);
+         handoff_deadline = monotonic_ns () + DNS_HANDOFF_TIMEOUT_MS * 1000000ull;
+         if (handoff == -1) {
+            printf ("Error, upgrade cannot start %s!\n", server->upgrade_exe);
+         }
+      }
+      if (handoff != -1) {
+         int state = dns_handoff_poll (handoff);
+         if (state > 0) {
+            server->handed_off = 1;
+            break;
+         }
+         if (state < 0 || monotonic_ns () > handoff_deadline) {
+            printf ("Error, upgraded process did not start, still serving\n");
+            kill (handoff_pid, SIGKILL);
+            waitpid (handoff_pid, NULL, 0);
+            close (handoff);
+            handoff = -1;
+         }
       }
+   }
+   if (server->handed_off) {
+      drain_dns_worker (worker, timeout_ms);
+   } else {
+      // a failed receive stops the other workers too
+      server->quit = 1;
+   }
+   atomic_store (&worker->quiescent, UINT64_MAX);
+   for (int i = 1; i < server->worker_count; ++i) {
+      if (server->workers[i].started) {
+         pthread_join (server->workers[i].thread, NULL);
+         server->workers[i].started = 0;
+      }
+   }
+   if (handoff == -1) {
+      save_hot_names (server);
+   }
+   if (handoff != -1) {
+      close (handoff);
+      printf ("upgraded, process %d took over\n", (int) handoff_pid);
+   } else if (snapshot_path != NULL && dns_cache_save (server->cache, snapshot_path, dns_cache_now ()) != kOk) {
+      printf ("Error, cache snapshot %s not written!\n", snapshot_path);
+   }
+   return kOk;
+}
 
-      dns_h_t *resp = decide_dns_response (server, dha);
-      // FILTERED ROUTE
-      if (resp != NULL) {
-         int buf_len = 0;
-         uint8_t *gen_buf = new_dns_buffer (resp, NULL, &buf_len);
+void
+dns_server_replace_filters (dns_server_t *server, int group, dns_filter_view_t *view)
+{
+   dns_filter_view_t *old = atomic_exchange (&server->policy->groups[group].view, view);
+   uint64_t epoch = atomic_fetch_add (&server->epoch, 1) + 1;
+   // a worker that saw the new epoch after a batch no longer uses `old`, an idle one gets there by its read timeout
+   for (int i = 0; i < server->worker_count; ++i) {
+      while (atomic_load (&server->workers[i].quiescent) < epoch) {
+         usleep (1000);
+      }
+   }
+   destroy_dns_filter_view (old, old->set != view->set);
+}
 
-         sendto (server->self_sockfd, gen_buf, buf_len, 0, (struct sockaddr *) &client_addr, c_len);
-         memset (buffer, 0, BUFFER_SIZE);
+void
+dns_server_print_stats (const dns_server_t *server, FILE *out)
+{
+   // every worker counts on its own
+   for (int i = 0; i < server->upstream_count; ++i) {
+      uint64_t forwarded = 0;
+      uint64_t timeouts = 0;
+      for (int w = 0; w < server->worker_count; ++w) {
+         forwarded += server->workers[w].upstreams[i].forwarded;
+         timeouts += server->workers[w].upstreams[i].timeouts;
+      }
+      const dns_upstream_t *upstream = &server->workers[0].upstreams[i];
+      fprintf (out,
+               "upstream %s:%d forwarded %llu timed out %llu\n",
+               upstream->host,
+               upstream->port,
+               (unsigned long long) forwarded,
+               (unsigned long long) timeouts);
+   }
+   uint64_t pending_full = 0;
+   for (int w = 0; w < server->worker_count; ++w) {
+      pending_full += server->workers[w].pending->full;
+   }
+   if (pending_full > 0) {
+      fprintf (out, "%llu queries refused with every pending entry in use\n", (unsigned long long) pending_full);
+   }
+   if (server->rate_limit != NULL) {
+      fprintf (out, "rate limited %llu responses\n", (unsigned long long) rate_limit_limited (server->rate_limit));
+   }
+   if (server->cache != NULL) {
+      dns_cache_stats_t stats;
+      dns_cache_stats (server->cache, &stats);
+      fprintf (out,
+               "cache hits %llu misses %llu evictions %llu, %d entries restored from the snapshot\n",
+               (unsigned long long) stats.hits,
+               (unsigned long long) stats.misses,
+               (unsigned long long) stats.evictions,
+               server->cache->restored);
+   }
+   if (server->prefetch != NULL) {
+      const dns_prefetch_t *prefetch = server->prefetch;
+      fprintf (out,
+               "prefetch of %d names sent %llu, cached %llu, failed %llu\n",
+               prefetch->count,
+               (unsigned long long) prefetch->sent,
+               (unsigned long long) prefetch->refreshed,
+               (unsigned long long) prefetch->failed);
+   }
+   for (int w = 0; w < server->worker_count; ++w) {
+      const dns_overload_t *ov = server->workers[w].overload;
+      if (ov == NULL) {
+         continue;
+      }
+      fprintf (out,
+               "worker %d load %s, lag %.1f ms, receive buffer %d%% full, kernel dropped %u, shed %llu, "
+               "dropped %llu, %llu batches overloaded\n",
+               w,
+               dns_load_level_desc[ov->level],
+               ov->last_lag_ns / 1e6,
+               ov->last_queue,
+               ov->kernel_drops,
+               (unsigned long long) ov->shed,
+               (unsigned long long) ov->dropped,
+               (unsigned long long) ov->overloaded);
+   }
+   for (int w = 0; w < server->worker_count && server->conf->busy_poll.enabled; ++w) {
+      fprintf (out,
+               "worker %d busy polling on cpu %d, slept %llu times\n",
+               w,
+               server->workers[w].cpu,
+               (unsigned long long) server->workers[w].io->sleeps);
+   }
+   if (server->query_log != NULL) {
+      fprintf (out, "query log dropped %llu records\n", (unsigned long long) query_log_dropped (server->query_log));
+   }
+   if (server->worker_count > 0 && server->workers[0].latency != NULL) {
+      dns_latency_t *lat[MAX_WORKERS];
+      for (int w = 0; w < server->worker_count; ++w) {
+         lat[w] = server->workers[w].latency;
+      }
+      dns_latency_print (lat, server->worker_count, out);
+   }
+}
 
-         destroy_dns_h (resp);
-         free (gen_buf);
-      } else {
-         // UNFILTERED ROUTE
-         sendto (server->upstream_sockfd, buffer, n, 0, server->u_hints.ai_addr, server->u_hints.ai_addrlen);
-         memset (buffer, 0, BUFFER_SIZE);
+static const uint8_t *
+validate_dns_filters (const dns_filter_conf_t *filters, int filter_size, dns_rc_t *lrc)
+{
+   struct sockaddr_in sa;
+   struct sockaddr_in6 sa6;
+   for (int i = 0; i < filter_size; ++i) {
+      if (filters[i].host == NULL) {
+         *lrc = kDataMalformed;
+         static const uint8_t *err = "one of the filters \"host\" is not provided";
+         return err;
+      }
+      dns_name_t name;
+      int pattern = filters[i].match_type == DNS_MT_WILDCARD || filters[i].match_type == DNS_MT_REGEX;
+      if (pattern && dns_pattern_check (filters[i].match_type, (const char *) filters[i].host) < 0) {
+         *lrc = kDataMalformed;
+         static const uint8_t *err = "one of the \"wildcard\" or \"regex\" filters \"host\" is not a valid pattern";
+         return err;
+      }
+      if (filters[i].match_type != DNS_MT_CONTAINS && !pattern &&
+          dns_name_from_text (&name, (const char *) filters[i].host) < 0) {
+         *lrc = kDataMalformed;
+         static const uint8_t *err = "one of the \"exact\" or \"suffix\" filters \"host\" is not a valid name";
+         return err;
+      }
 
-         n = recvfrom (server->upstream_sockfd, buffer, BUFFER_SIZE, 0, server->u_hints.ai_addr, &u_len);
+      if (filters[i].action_type == DNS_AT_REDIRECT) {
+         if (filters[i].redirect_addr == NULL) {
+            *lrc = kDataMalformed;
+            static const uint8_t *err = "selected action is \"redirect\" but \"redirect_addr\" is not provided";
+            return err;
+         }
 
-         sendto (server->self_sockfd, buffer, n, 0, (struct sockaddr *) &client_addr, c_len);
-         memset (buffer, 0, BUFFER_SIZE);
+         if (inet_pton (AF_INET, filters[i].redirect_addr, &(sa.sin_addr)) != 1) {
+            if (inet_pton (AF_INET6, filters[i].redirect_addr, &(sa6.sin6_addr)) != 1) {
+               *lrc = kDataMalformed;
+               static const uint8_t *err =
+                  "provided \"redirect_addr\" is invalid, it should be valid ipv4 or ipv6 address";
+               return err;
+            }
+         }
       }
-      destroy_dns_h (dha);
    }
-   return kOk;
+   // every pattern is valid on its own, together they may still need too many states
+   dns_pattern_dfa_t patterns;
+   if (init_dns_pattern_dfa (&patterns, filters, filter_size) != kOk) {
+      *lrc = kDataMalformed;
+      static const uint8_t *err = "the \"wildcard\" and \"regex\" filters compile to too many states";
+      return err;
+   }
+   clear_dns_pattern_dfa (&patterns);
+   return NULL;
+}
+
+static const uint8_t *
+validate_dns_zone (const dns_zone_conf_t *zone, dns_rc_t *lrc)
+{
+   dns_name_t name;
+   for (int i = 0; i < zone->domain_size; ++i) {
+      if (dns_name_from_text (&name, (const char *) zone->domains[i]) < 0 || name.labels == 0) {
+         *lrc = kDataMalformed;
+         static const uint8_t *err = "one of the zone \"domains\" is not a valid name";
+         return err;
+      }
+   }
+   for (int i = 0; i < zone->record_size; ++i) {
+      if (dns_name_from_text (&name, (const char *) zone->records[i].name) < 0) {
+         *lrc = kDataMalformed;
+         static const uint8_t *err = "one of the zone records \"name\" is not a valid name";
+         return err;
+      }
+      uint8_t rdata[DNS_UDP_MAX_PACKLEN];
+      if (dns_zone_encode_rdata (zone->records[i].type, (const char *) zone->records[i].data, rdata) < 0) {
+         *lrc = kDataMalformed;
+         static const uint8_t *err = "one of the zone records \"data\" does not match its \"type\"";
+         return err;
+      }
+   }
+   return NULL;
 }
 
 const uint8_t *
@@ -410,29 +1316,121 @@ validate_dns_conf (const dns_conf_t *conf, dns_rc_t *rc)
       static const uint8_t *err = "provided upstream port address is 0, it should be greater than 0";
       return err;
    }
-   for (int i = 0; i < conf->filter_size; ++i) {
-      if (conf->filters[i].host == NULL) {
+   for (int i = 0; i < conf->route_size; ++i) {
+      const dns_route_conf_t *route = &conf->routes[i];
+      if (route->upstream.addr == NULL || (inet_pton (AF_INET, route->upstream.addr, &(sa.sin_addr)) != 1 &&
+                                           inet_pton (AF_INET6, route->upstream.addr, &(sa6.sin6_addr)) != 1)) {
          *lrc = kDataMalformed;
-         static const uint8_t *err = "one of the filters \"host\" is not provided";
+         static const uint8_t *err = "one of the routes \"address\" is not a valid ipv4 or ipv6 address";
          return err;
       }
-
-      if (conf->filters[i].action_type == DNS_AT_REDIRECT) {
-         if (conf->filters[i].redirect_addr == NULL) {
+      if (route->upstream.port == 0) {
+         *lrc = kDataMalformed;
+         static const uint8_t *err = "one of the routes \"port\" is 0, it should be greater than 0";
+         return err;
+      }
+      for (int j = 0; j < route->domain_size; ++j) {
+         dns_name_t name;
+         if (dns_name_from_text (&name, (const char *) route->domains[j]) < 0) {
             *lrc = kDataMalformed;
-            static const uint8_t *err = "selected action is \"redirect\" but \"redirect_addr\" is not provided";
+            static const uint8_t *err = "one of the routes \"domains\" is not a valid name";
             return err;
          }
-
-         if (inet_pton (AF_INET, conf->filters[i].redirect_addr, &(sa.sin_addr)) != 1) {
-            if (inet_pton (AF_INET6, conf->filters[i].redirect_addr, &(sa6.sin6_addr)) != 1) {
-               *lrc = kDataMalformed;
-               static const uint8_t *err =
-                  "provided \"redirect_addr\" is invalid, it should be valid ipv4 or ipv6 address";
-               return err;
-            }
+      }
+   }
+   if (conf->workers <= 0 || conf->workers > MAX_WORKERS || conf->workers > DNS_HANDOFF_MAX_SOCKETS) {
+      *lrc = kDataMalformed;
+      static const uint8_t *err = "\"workers\" should be between 1 and 64";
+      return err;
+   }
+   if (conf->cpu_steering && conf->workers > sysconf (_SC_NPROCESSORS_ONLN)) {
+      *lrc = kDataMalformed;
+      static const uint8_t *err = "\"cpu_steering\" pins worker i to cpu i, \"workers\" exceeds the online cpus";
+      return err;
+   }
+   struct sockaddr_un control_addr;
+   if (conf->control.path != NULL && strlen ((const char *) conf->control.path) >= sizeof (control_addr.sun_path)) {
+      *lrc = kDataMalformed;
+      static const uint8_t *err = "control \"path\" is too long for a unix socket";
+      return err;
+   }
+   if (conf->control.slow_queries.size > DNS_SLOW_QUERIES_MAX_SIZE) {
+      *lrc = kDataMalformed;
+      static const uint8_t *err = "control \"slow_queries\" \"size\" should be at most 4096";
+      return err;
+   }
+   if (conf->overload.enabled && (conf->overload.drop_lag_ms < conf->overload.lag_ms ||
+                                  conf->overload.drop_queue_percent < conf->overload.queue_percent)) {
+      *lrc = kDataMalformed;
+      static const uint8_t *err = "overload \"drop_lag_ms\" and \"drop_queue_percent\" should be at least the others";
+      return err;
+   }
+   if (conf->control.heavy_hitters > DNS_HH_MAX_SIZE) {
+      *lrc = kDataMalformed;
+      static const uint8_t *err = "control \"heavy_hitters\" should be at most 16384";
+      return err;
+   }
+   if (conf->busy_poll.enabled && conf->io_backend != DNS_IO_SELECT) {
+      *lrc = kDataMalformed;
+      static const uint8_t *err = "busy_poll needs the select io_backend";
+      return err;
+   }
+   if (conf->busy_poll.cpus != NULL && (conf->cpu_steering || conf->busy_poll.cpu_size < conf->workers)) {
+      *lrc = kDataMalformed;
+      static const uint8_t *err = "busy_poll \"cpus\" should list a cpu for every worker, without cpu_steering";
+      return err;
+   }
+   if ((conf->prefetch.name_size > 0 || conf->prefetch.hot_path != NULL) && conf->cache.max_entries == 0) {
+      *lrc = kDataMalformed;
+      static const uint8_t *err = "prefetch needs a cache to keep the answers in";
+      return err;
+   }
+   if (conf->prefetch.hot_names > DNS_PREFETCH_MAX_NAMES / 2) {
+      *lrc = kDataMalformed;
+      static const uint8_t *err = "prefetch \"hot_names\" should be at most 8192";
+      return err;
+   }
+   for (int i = 0; i < conf->prefetch.name_size; ++i) {
+      dns_name_t name;
+      uint16_t type = 0;
+      if (dns_prefetch_parse ((const char *) conf->prefetch.names[i], &name, &type) != 0) {
+         *lrc = kDataMalformed;
+         static const uint8_t *err = "prefetch names should be a host name, optionally followed by a record type";
+         return err;
+      }
+   }
+   int socket_count = 1 + conf->upstream.sockets;
+   for (int i = 0; i < conf->route_size; ++i) {
+      socket_count += conf->routes[i].upstream.sockets;
+   }
+   if (socket_count > DNS_IO_MAX_SOCKETS) {
+      *lrc = kDataMalformed;
+      static const uint8_t *err = "forwarder and routes use too many upstream \"sockets\" together";
+      return err;
+   }
+   const uint8_t *err = validate_dns_filters (conf->filters, conf->filter_size, lrc);
+   if (err != NULL) {
+      return err;
+   }
+   err = validate_dns_zone (&conf->zone, lrc);
+   if (err != NULL) {
+      return err;
+   }
+   for (int i = 0; i < conf->group_size; ++i) {
+      for (int j = 0; j < conf->groups[i].client_size; ++j) {
+         uint8_t addr[16];
+         int addr_len = 0;
+         int prefix_len = 0;
+         if (get_cidr_binary (conf->groups[i].clients[j], addr, &addr_len, &prefix_len) == -1) {
+            *lrc = kDataMalformed;
+            static const uint8_t *err = "one of the group \"clients\" is not a valid ipv4 or ipv6 prefix";
+            return err;
          }
       }
+      err = validate_dns_filters (conf->groups[i].filters, conf->groups[i].filter_size, lrc);
+      if (err != NULL) {
+         return err;
+      }
    }
    return NULL;
 }
@@ -440,7 +1438,41 @@ validate_dns_conf (const dns_conf_t *conf, dns_rc_t *rc)
 void
 destroy_dns_server (dns_server_t *server)
 {
+   if (server == NULL) {
+      return;
+   }
+   server->quit = 1;
+   destroy_dns_control (server->control);
+   for (int i = 0; server->workers != NULL && i < server->worker_count; ++i) {
+      dns_worker_t *worker = &server->workers[i];
+      if (worker->started) {
+         pthread_join (worker->thread, NULL);
+      }
+      destroy_dns_io (worker->io);
+      if (worker->sockfd != -1) {
+         close (worker->sockfd);
+      }
+      for (int j = 0; worker->upstreams != NULL && j < server->upstream_count; ++j) {
+         for (int k = 0; k < worker->upstreams[j].socket_count; ++k) {
+            close (worker->upstreams[j].sockets[k]);
+         }
+         free (worker->upstreams[j].sockets);
+         free (worker->upstreams[j].io_sockets);
+      }
+      free (worker->upstreams);
+      destroy_dns_pending (worker->pending);
+      destroy_dns_heavy_hitters (worker->heavy_hitters);
+      destroy_dns_latency (worker->latency);
+      destroy_dns_overload (worker->overload);
+   }
+   free (server->workers);
+   destroy_query_log (server->query_log);
+   destroy_dns_policy (server->policy);
+   destroy_rate_limit (server->rate_limit);
+   destroy_dns_cache (server->cache);
+   destroy_dns_slow_queries (server->slow_queries);
+   destroy_dns_prefetch (server->prefetch);
+   pthread_cond_destroy (&server->startup_cond);
+   pthread_mutex_destroy (&server->startup_lock);
    free (server);
-   close (server->self_sockfd);
-   close (server->upstream_sockfd);
-}
\ No newline at end of file
+}
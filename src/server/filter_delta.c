@@ -0,0 +1,340 @@
+#include "server/filter_delta.h"
+#include "dns/dns-name.h"
+#include "utils/string_tools.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint8_t *
+copy_text (const uint8_t *text)
+{
+   return text != NULL ? (uint8_t *) strdup ((const char *) text) : NULL;
+}
+
+static void
+free_filters (dns_filter_conf_t *filters, int size)
+{
+   for (int i = 0; filters != NULL && i < size; ++i) {
+      free (filters[i].host);
+      free (filters[i].redirect_addr);
+   }
+   free (filters);
+}
+
+// Fills `change` from the fields of one line, returns -1 when it is malformed
+static int
+parse_change (char *line, dns_filter_change_t *change)
+{
+   char *save = NULL;
+   char *host = strtok_r (line + 1, " \t\r\n", &save);
+   const char *match = strtok_r (NULL, " \t\r\n", &save);
+   const char *action = strtok_r (NULL, " \t\r\n", &save);
+   dns_name_t name;
+   if (host == NULL || strtok_r (NULL, " \t\r\n", &save) != NULL || dns_name_from_text (&name, host) < 0) {
+      return -1;
+   }
+   change->add = line[0] == '+';
+   change->match_type = DNS_MT_SUFFIX;
+   change->action_type = DNS_AT_REFUSE;
+   if (match != NULL && str_i_cmp (match, "exact") == 0) {
+      change->match_type = DNS_MT_EXACT;
+   } else if (match != NULL && str_i_cmp (match, "suffix") != 0) {
+      return -1;
+   }
+   if (action != NULL && !change->add) {
+      return -1;
+   }
+   if (action != NULL && str_i_cmp (action, "discard") == 0) {
+      change->action_type = DNS_AT_NOTFOUND;
+   } else if (action != NULL && str_i_cmp (action, "refuse") != 0) {
+      return -1;
+   }
+   for (char *c = host; *c != 0; ++c) {
+      *c = tolower ((unsigned char) *c);
+   }
+   change->host = (uint8_t *) strdup (host);
+   return 0;
+}
+
+dns_filter_delta_t *
+new_dns_filter_delta (const char *path, int *line, dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   *lrc = kOk;
+   *line = 0;
+   FILE *f = path != NULL ? fopen (path, "r") : NULL;
+   if (f == NULL) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+   dns_filter_delta_t *delta = (dns_filter_delta_t *) calloc (1, sizeof (*delta));
+   int cap = 256;
+   delta->changes = (dns_filter_change_t *) malloc (cap * sizeof (*delta->changes));
+   char text[DNS_FILTER_DELTA_MAX_LINE];
+   int number = 0;
+   while (fgets (text, sizeof (text), f) != NULL) {
+      ++number;
+      char *p = text + strspn (text, " \t");
+      if (*p == '#' || *p == '\n' || *p == '\r' || *p == 0) {
+         continue;
+      }
+      if (delta->size == cap) {
+         cap *= 2;
+         delta->changes = (dns_filter_change_t *) realloc (delta->changes, cap * sizeof (*delta->changes));
+      }
+      if ((*p != '+' && *p != '-') || (strchr (p, '\n') == NULL && !feof (f)) ||
+          parse_change (p, &delta->changes[delta->size]) != 0) {
+         *line = number;
+         *lrc = kDataMalformed;
+         break;
+      }
+      ++delta->size;
+   }
+   if (*lrc == kOk && ferror (f)) {
+      *lrc = kAborted;
+   }
+   fclose (f);
+   if (*lrc != kOk) {
+      destroy_dns_filter_delta (delta);
+      return NULL;
+   }
+   return delta;
+}
+
+void
+destroy_dns_filter_delta (dns_filter_delta_t *delta)
+{
+   if (delta == NULL) {
+      return;
+   }
+   for (int i = 0; i < delta->size; ++i) {
+      free (delta->changes[i].host);
+   }
+   free (delta->changes);
+   free (delta);
+}
+
+dns_filter_view_t *
+new_dns_filter_view (const dns_filter_set_t *set, dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   if (set == NULL) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+   dns_filter_view_t *view = (dns_filter_view_t *) calloc (1, sizeof (*view));
+   view->set = set;
+   *lrc = init_dns_filter_set (&view->added_set, NULL, 0);
+   return view;
+}
+
+void
+destroy_dns_filter_view (dns_filter_view_t *view, int with_set)
+{
+   if (view == NULL) {
+      return;
+   }
+   if (with_set && view->merged != NULL) {
+      free_filters (view->merged_filters, view->merged->size);
+      clear_dns_filter_set (view->merged);
+      free (view->merged);
+   }
+   clear_dns_filter_set (&view->added_set);
+   free_filters (view->added, view->added_size);
+   free (view->removed);
+   free (view);
+}
+
+static uint64_t
+change_hash (const uint8_t *host, dns_match_type_t match_type)
+{
+   return dns_name_hash (host, strlen ((const char *) host)) ^ match_type;
+}
+
+// Index in `added` of the filter of `change` the delta added, -1 when there is none. `slots` holds one more than
+// the indexes, by hash of the host and match type.
+static int
+find_added (const dns_filter_conf_t *added, const int *slots, uint32_t mask, const dns_filter_change_t *change)
+{
+   for (uint32_t h = change_hash (change->host, change->match_type) & mask; slots[h] != 0; h = (h + 1) & mask) {
+      const dns_filter_conf_t *filter = &added[slots[h] - 1];
+      if (filter->host != NULL && filter->match_type == change->match_type &&
+          strcmp ((const char *) filter->host, (const char *) change->host) == 0) {
+         return slots[h] - 1;
+      }
+   }
+   return -1;
+}
+
+static void
+insert_added (int *slots, uint32_t mask, const dns_filter_conf_t *added, int index)
+{
+   uint32_t h = change_hash (added[index].host, added[index].match_type) & mask;
+   while (slots[h] != 0) {
+      h = (h + 1) & mask;
+   }
+   slots[h] = index + 1;
+}
+
+dns_filter_view_t *
+dns_filter_view_apply (const dns_filter_view_t *view,
+                       const dns_filter_delta_t *delta,
+                       dns_filter_delta_stats_t *stats,
+                       dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   *lrc = kOk;
+   if (view == NULL || delta == NULL || stats == NULL) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+   memset (stats, 0, sizeof (*stats));
+   dns_filter_view_t *next = (dns_filter_view_t *) calloc (1, sizeof (*next));
+   next->set = view->set;
+   next->merged = view->merged;
+   next->merged_filters = view->merged_filters;
+   size_t removed_size = (view->set->size + 7) / 8;
+   next->removed = (uint8_t *) calloc (removed_size > 0 ? removed_size : 1, 1);
+   if (view->removed != NULL) {
+      memcpy (next->removed, view->removed, removed_size);
+   }
+   next->removed_count = view->removed_count;
+   // the added filters of `view` keep their order, the ones of `delta` follow them; a host is looked up in the
+   // compiled overlay of `view`, the ones this delta adds in a table of their own
+   int cap = view->added_size + delta->size;
+   dns_filter_conf_t *added = (dns_filter_conf_t *) calloc (cap > 0 ? cap : 1, sizeof (*added));
+   for (int i = 0; i < view->added_size; ++i) {
+      added[i] = view->added[i];
+      added[i].host = copy_text (view->added[i].host);
+      added[i].redirect_addr = copy_text (view->added[i].redirect_addr);
+   }
+   int count = view->added_size;
+   uint32_t mask = 15;
+   while (mask < 2u * delta->size) {
+      mask = mask << 1 | 1;
+   }
+   int *slots = (int *) calloc (mask + 1, sizeof (*slots));
+   for (int i = 0; i < delta->size; ++i) {
+      const dns_filter_change_t *change = &delta->changes[i];
+      dns_name_t name;
+      dns_name_from_text (&name, (const char *) change->host);
+      int a = dns_filter_set_find (&view->added_set, change->match_type, &name);
+      if (a < 0 || added[a].host == NULL) {
+         a = find_added (added, slots, mask, change);
+      }
+      int f = dns_filter_set_find (view->set, change->match_type, &name);
+      int in_set = f >= 0 && !(next->removed[f >> 3] >> (f & 7) & 1);
+      if (change->add) {
+         if (in_set && a < 0 && view->set->filters[f].action_type != change->action_type) {
+            // the filter of the set would match first, the added one takes its place
+            next->removed[f >> 3] |= 1 << (f & 7);
+            ++next->removed_count;
+            in_set = 0;
+         }
+         if (a >= 0) {
+            added[a].action_type = change->action_type;
+         } else if (!in_set) {
+            added[count].host = copy_text (change->host);
+            added[count].match_type = change->match_type;
+            added[count].action_type = change->action_type;
+            added[count].filter_type = DNS_FT_ALL;
+            insert_added (slots, mask, added, count++);
+         }
+         ++stats->added;
+         continue;
+      }
+      if (a < 0 && !in_set) {
+         ++stats->unknown;
+         continue;
+      }
+      if (a >= 0) {
+         // removed ones stay in place until the overlay is compiled, so the indexes of the set stay valid
+         free (added[a].host);
+         free (added[a].redirect_addr);
+         added[a].host = NULL;
+         added[a].redirect_addr = NULL;
+      }
+      if (in_set) {
+         next->removed[f >> 3] |= 1 << (f & 7);
+         ++next->removed_count;
+      }
+      ++stats->removed;
+   }
+   free (slots);
+   int kept = 0;
+   for (int i = 0; i < count; ++i) {
+      if (added[i].host != NULL) {
+         added[kept++] = added[i];
+      }
+   }
+   next->added = added;
+   next->added_size = kept;
+   *lrc = init_dns_filter_set (&next->added_set, next->added, next->added_size);
+   if (*lrc != kOk) {
+      destroy_dns_filter_view (next, 0);
+      return NULL;
+   }
+   return next;
+}
+
+dns_filter_view_t *
+dns_filter_view_merge (const dns_filter_view_t *view, dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   *lrc = kOk;
+   if (view == NULL) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+   const dns_filter_set_t *set = view->set;
+   int size = set->size - view->removed_count + view->added_size;
+   dns_filter_conf_t *filters = (dns_filter_conf_t *) calloc (size > 0 ? size : 1, sizeof (*filters));
+   int n = 0;
+   for (int i = 0; i < set->size; ++i) {
+      if (view->removed == NULL || !(view->removed[i >> 3] >> (i & 7) & 1)) {
+         filters[n] = set->filters[i];
+         filters[n].host = copy_text (set->filters[i].host);
+         filters[n].redirect_addr = copy_text (set->filters[i].redirect_addr);
+         ++n;
+      }
+   }
+   for (int i = 0; i < view->added_size; ++i, ++n) {
+      filters[n] = view->added[i];
+      filters[n].host = copy_text (view->added[i].host);
+      filters[n].redirect_addr = copy_text (view->added[i].redirect_addr);
+   }
+   dns_filter_view_t *next = (dns_filter_view_t *) calloc (1, sizeof (*next));
+   next->merged = (dns_filter_set_t *) calloc (1, sizeof (*next->merged));
+   next->merged_filters = filters;
+   next->set = next->merged;
+   *lrc = init_dns_filter_set (next->merged, filters, n);
+   if (*lrc == kOk) {
+      *lrc = init_dns_filter_set (&next->added_set, NULL, 0);
+   }
+   if (*lrc != kOk) {
+      // a set failing to build is already cleared
+      free_filters (filters, n);
+      next->merged_filters = NULL;
+      destroy_dns_filter_view (next, 1);
+      return NULL;
+   }
+   return next;
+}
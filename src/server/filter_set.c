@@ -0,0 +1,211 @@
+#include "server/filter_set.h"
+#include "dns/dns-name.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define FILTER_TABLE_MIN_SLOTS 16
+
+// 64 bit set of the byte pairs of a string, folded by a cheap hash
+static uint64_t
+bigrams (const uint8_t *s)
+{
+   uint64_t grams = 0;
+   for (; s[0] != 0 && s[1] != 0; ++s) {
+      grams |= 1ull << (((s[0] * 31u) ^ s[1]) & 63);
+   }
+   return grams;
+}
+
+static void
+init_table (dns_filter_table_t *table, int count)
+{
+   uint32_t slots = FILTER_TABLE_MIN_SLOTS;
+   while (slots < (uint32_t) count * 2) {
+      slots <<= 1;
+   }
+   table->slots = (dns_filter_key_t *) malloc (slots * sizeof (*table->slots));
+   for (uint32_t i = 0; i < slots; ++i) {
+      table->slots[i].filter = -1;
+   }
+   table->mask = slots - 1;
+   table->count = 0;
+}
+
+static int
+table_find (const dns_filter_table_t *table, const uint8_t *keys, uint64_t hash, const uint8_t *wire, int length)
+{
+   for (uint32_t i = hash & table->mask;; i = (i + 1) & table->mask) {
+      const dns_filter_key_t *slot = &table->slots[i];
+      if (slot->filter < 0) {
+         return -1;
+      }
+      const uint8_t *key = keys + slot->key;
+      if (slot->hash == hash && key[0] == length && memcmp (key + 1, wire, length) == 0) {
+         return slot->filter;
+      }
+   }
+}
+
+// Keeps the first filter of a host, later duplicates can never be the first match
+static void
+table_insert (dns_filter_table_t *table, const uint8_t *keys, uint32_t key, uint64_t hash, int filter)
+{
+   if (table_find (table, keys, hash, keys + key + 1, keys[key]) >= 0) {
+      return;
+   }
+   uint32_t i = hash & table->mask;
+   while (table->slots[i].filter >= 0) {
+      i = (i + 1) & table->mask;
+   }
+   table->slots[i].hash = hash;
+   table->slots[i].filter = filter;
+   table->slots[i].key = key;
+   ++table->count;
+}
+
+dns_rc_t
+init_dns_filter_set (dns_filter_set_t *set, const dns_filter_conf_t *filters, int size)
+{
+   if (set == NULL || (filters == NULL && size > 0)) {
+      return kInvalidInput;
+   }
+   memset (set, 0, sizeof (*set));
+   set->filters = filters;
+   set->size = size;
+
+   dns_rc_t rc = init_dns_pattern_dfa (&set->patterns, filters, size);
+   if (rc != kOk) {
+      return rc;
+   }
+   int exact = 0;
+   int suffix = 0;
+   int contains = 0;
+   for (int i = 0; i < size; ++i) {
+      exact += filters[i].match_type == DNS_MT_EXACT;
+      suffix += filters[i].match_type == DNS_MT_SUFFIX;
+      contains += filters[i].match_type == DNS_MT_CONTAINS;
+   }
+   init_table (&set->exact, exact);
+   init_table (&set->suffix, suffix);
+   set->contains = (int *) malloc ((contains + 1) * sizeof (*set->contains));
+   set->contains_grams = (uint64_t *) malloc ((contains + 1) * sizeof (*set->contains_grams));
+
+   size_t keys_cap = 4096;
+   size_t keys_len = 0;
+   set->keys = (uint8_t *) malloc (keys_cap);
+   for (int i = 0; i < size; ++i) {
+      if (filters[i].match_type == DNS_MT_WILDCARD || filters[i].match_type == DNS_MT_REGEX) {
+         continue;
+      }
+      if (filters[i].match_type == DNS_MT_CONTAINS) {
+         if (filters[i].host == NULL) {
+            clear_dns_filter_set (set);
+            return kDataMalformed;
+         }
+         set->contains_grams[set->contains_count] = bigrams (filters[i].host);
+         set->contains[set->contains_count++] = i;
+         continue;
+      }
+      dns_name_t name;
+      if (filters[i].host == NULL || dns_name_from_text (&name, (const char *) filters[i].host) < 0) {
+         clear_dns_filter_set (set);
+         return kDataMalformed;
+      }
+      if (keys_len + name.length + 1 > keys_cap) {
+         keys_cap *= 2;
+         set->keys = (uint8_t *) realloc (set->keys, keys_cap);
+      }
+      set->keys[keys_len] = name.length;
+      memcpy (set->keys + keys_len + 1, name.wire, name.length);
+      table_insert (filters[i].match_type == DNS_MT_EXACT ? &set->exact : &set->suffix,
+                    set->keys,
+                    keys_len,
+                    name.hash,
+                    i);
+      keys_len += name.length + 1;
+   }
+   return kOk;
+}
+
+void
+clear_dns_filter_set (dns_filter_set_t *set)
+{
+   if (set == NULL) {
+      return;
+   }
+   free (set->exact.slots);
+   free (set->suffix.slots);
+   free (set->contains);
+   free (set->contains_grams);
+   free (set->keys);
+   clear_dns_pattern_dfa (&set->patterns);
+   memset (set, 0, sizeof (*set));
+}
+
+int
+dns_filter_set_find (const dns_filter_set_t *set, dns_match_type_t match_type, const dns_name_t *name)
+{
+   if (match_type != DNS_MT_EXACT && match_type != DNS_MT_SUFFIX) {
+      return -1;
+   }
+   const dns_filter_table_t *table = match_type == DNS_MT_EXACT ? &set->exact : &set->suffix;
+   return table->count > 0 ? table_find (table, set->keys, name->hash, name->wire, name->length) : -1;
+}
+
+static inline int
+removed_filter (const uint8_t *removed, int f)
+{
+   return removed != NULL && f >= 0 && (removed[f >> 3] >> (f & 7) & 1);
+}
+
+int
+dns_filter_set_match (const dns_filter_set_t *set, const dns_name_t *name)
+{
+   return dns_filter_set_match_except (set, NULL, name);
+}
+
+int
+dns_filter_set_match_except (const dns_filter_set_t *set, const uint8_t *removed, const dns_name_t *name)
+{
+   int best = -1;
+   if (set->exact.count > 0) {
+      best = table_find (&set->exact, set->keys, name->hash, name->wire, name->length);
+      best = removed_filter (removed, best) ? -1 : best;
+   }
+   if (set->suffix.count > 0) {
+      for (int k = 0; k < name->labels; ++k) {
+         int off = name->offsets[k];
+         uint64_t hash = k == 0 ? name->hash : dns_name_suffix_hash (name, k);
+         int f = table_find (&set->suffix, set->keys, hash, name->wire + off, name->length - off);
+         if (f >= 0 && (best < 0 || f < best) && !removed_filter (removed, f)) {
+            best = f;
+         }
+      }
+   }
+   int contains = set->contains_count > 0 && (best < 0 || set->contains[0] < best);
+   int patterns = set->patterns.first >= 0 && (best < 0 || set->patterns.first < best);
+   if (!contains && !patterns) {
+      return best;
+   }
+   // substrings and patterns may span labels, so these are matched against the dotted form
+   char text[RR_NAME_MAX];
+   int length = dns_name_to_text (text, name);
+   if (contains) {
+      uint64_t grams = bigrams ((const uint8_t *) text);
+      for (int i = 0; i < set->contains_count && (best < 0 || set->contains[i] < best); ++i) {
+         if ((set->contains_grams[i] & ~grams) == 0 &&
+             strstr (text, (const char *) set->filters[set->contains[i]].host) != NULL) {
+            best = set->contains[i];
+            break;
+         }
+      }
+   }
+   if (patterns && (best < 0 || set->patterns.first < best)) {
+      int f = dns_pattern_dfa_match (&set->patterns, (const uint8_t *) text, length);
+      if (f >= 0 && (best < 0 || f < best)) {
+         best = f;
+      }
+   }
+   return best;
+}
@@ -0,0 +1,189 @@
+#include "server/handoff.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define HANDOFF_MAGIC 0x46464f48 /* "HOFF" read as a little endian word */
+#define HANDOFF_READY 'r'
+
+extern char **environ;
+
+struct handoff_msg {
+   uint32_t magic;
+   uint32_t count;
+   struct {
+      char host[INET6_ADDRSTRLEN];
+      uint16_t port;
+   } sockets[DNS_HANDOFF_MAX_SOCKETS];
+};
+
+static int
+send_sockets (int channel, const dns_handoff_socket_t *sockets, int count)
+{
+   struct handoff_msg msg;
+   memset (&msg, 0, sizeof (msg));
+   msg.magic = HANDOFF_MAGIC;
+   msg.count = count;
+   for (int i = 0; i < count; ++i) {
+      memcpy (msg.sockets[i].host, sockets[i].host, sizeof (msg.sockets[i].host));
+      msg.sockets[i].port = sockets[i].port;
+   }
+   union {
+      char buf[CMSG_SPACE (sizeof (int) * DNS_HANDOFF_MAX_SOCKETS)];
+      struct cmsghdr align;
+   } control;
+   memset (&control, 0, sizeof (control));
+   struct iovec iov = {&msg, sizeof (msg)};
+   struct msghdr hdr;
+   memset (&hdr, 0, sizeof (hdr));
+   hdr.msg_iov = &iov;
+   hdr.msg_iovlen = 1;
+   hdr.msg_control = control.buf;
+   hdr.msg_controllen = CMSG_SPACE (sizeof (int) * count);
+   struct cmsghdr *cmsg = CMSG_FIRSTHDR (&hdr);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN (sizeof (int) * count);
+   int *fds = (int *) CMSG_DATA (cmsg);
+   for (int i = 0; i < count; ++i) {
+      fds[i] = sockets[i].fd;
+   }
+   return sendmsg (channel, &hdr, 0) == (ssize_t) sizeof (msg) ? 0 : -1;
+}
+
+int
+dns_handoff_spawn (const char *exe, const dns_handoff_socket_t *sockets, int count, pid_t *pid)
+{
+   if (exe == NULL || sockets == NULL || count <= 0 || count > DNS_HANDOFF_MAX_SOCKETS) {
+      return -1;
+   }
+   // the new process only inherits its end of the pair, every other descriptor is close-on-exec
+   int pair[2];
+   if (socketpair (AF_UNIX, SOCK_SEQPACKET, 0, pair) == -1) {
+      return -1;
+   }
+   fcntl (pair[0], F_SETFD, FD_CLOEXEC);
+
+   // built before fork, the child of a threaded process may only make async-signal-safe calls before exec
+   char channel_var[sizeof (DNS_HANDOFF_ENV) + 16];
+   snprintf (channel_var, sizeof (channel_var), "%s=%d", DNS_HANDOFF_ENV, pair[1]);
+   int env_count = 0;
+   while (environ[env_count] != NULL) {
+      ++env_count;
+   }
+   char **envp = (char **) malloc ((env_count + 2) * sizeof (*envp));
+   int n = 0;
+   for (int i = 0; i < env_count; ++i) {
+      if (strncmp (environ[i], DNS_HANDOFF_ENV "=", sizeof (DNS_HANDOFF_ENV)) != 0) {
+         envp[n++] = environ[i];
+      }
+   }
+   envp[n++] = channel_var;
+   envp[n] = NULL;
+   char *const argv[] = {(char *) exe, NULL};
+
+   pid_t child = fork ();
+   if (child == 0) {
+      execve (exe, argv, envp);
+      _exit (127);
+   }
+   free (envp);
+   close (pair[1]);
+   if (child == -1) {
+      close (pair[0]);
+      return -1;
+   }
+   if (send_sockets (pair[0], sockets, count) != 0) {
+      close (pair[0]);
+      kill (child, SIGKILL);
+      waitpid (child, NULL, 0);
+      return -1;
+   }
+   *pid = child;
+   return pair[0];
+}
+
+int
+dns_handoff_poll (int channel)
+{
+   char state = 0;
+   ssize_t n = recv (channel, &state, 1, MSG_DONTWAIT);
+   if (n == 1) {
+      return state == HANDOFF_READY ? 1 : -1;
+   }
+   return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+}
+
+int
+dns_handoff_channel ()
+{
+   const char *text = getenv (DNS_HANDOFF_ENV);
+   if (text == NULL) {
+      return -1;
+   }
+   int channel = atoi (text);
+   unsetenv (DNS_HANDOFF_ENV);
+   // a later upgrade of this process must not pass it on
+   if (channel < 0 || fcntl (channel, F_SETFD, FD_CLOEXEC) == -1) {
+      return -1;
+   }
+   return channel;
+}
+
+int
+dns_handoff_receive (int channel, dns_handoff_socket_t *sockets, int max)
+{
+   struct timeval timeout = {DNS_HANDOFF_TIMEOUT_MS / 1000, (DNS_HANDOFF_TIMEOUT_MS % 1000) * 1000};
+   setsockopt (channel, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+
+   struct handoff_msg msg;
+   union {
+      char buf[CMSG_SPACE (sizeof (int) * DNS_HANDOFF_MAX_SOCKETS)];
+      struct cmsghdr align;
+   } control;
+   struct iovec iov = {&msg, sizeof (msg)};
+   struct msghdr hdr;
+   memset (&hdr, 0, sizeof (hdr));
+   hdr.msg_iov = &iov;
+   hdr.msg_iovlen = 1;
+   hdr.msg_control = control.buf;
+   hdr.msg_controllen = sizeof (control.buf);
+   ssize_t n = recvmsg (channel, &hdr, MSG_CMSG_CLOEXEC);
+   struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR (&hdr) : NULL;
+   if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+      return -1;
+   }
+   int fd_count = (cmsg->cmsg_len - CMSG_LEN (0)) / sizeof (int);
+   const int *fds = (const int *) CMSG_DATA (cmsg);
+   int count = 0;
+   if (n == (ssize_t) sizeof (msg) && msg.magic == HANDOFF_MAGIC && msg.count == (uint32_t) fd_count) {
+      count = fd_count;
+   }
+   for (int i = 0; i < fd_count; ++i) {
+      if (i >= count || i >= max) {
+         close (fds[i]);
+         continue;
+      }
+      memcpy (sockets[i].host, msg.sockets[i].host, sizeof (sockets[i].host));
+      sockets[i].host[sizeof (sockets[i].host) - 1] = '\0';
+      sockets[i].port = msg.sockets[i].port;
+      sockets[i].fd = fds[i];
+   }
+   return count == 0 ? -1 : (count < max ? count : max);
+}
+
+void
+dns_handoff_ready (int channel)
+{
+   char state = HANDOFF_READY;
+   send (channel, &state, 1, MSG_NOSIGNAL);
+   close (channel);
+}
@@ -0,0 +1,315 @@
+#include "server/heavy_hitters.h"
+#include "dns/dns-name.h"
+
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+const char *dns_hh_kind_desc[] = {"names", "blocked", "clients"};
+
+static inline int
+same_key (const dns_hh_entry_t *entry, uint64_t hash, const uint8_t *key, int length)
+{
+   return entry->hash == hash && entry->length == length && memcmp (entry->key, key, length) == 0;
+}
+
+static int64_t
+find_slot (const dns_hh_sketch_t *sketch, uint64_t hash, const uint8_t *key, int length)
+{
+   for (uint32_t h = hash & sketch->slot_mask; sketch->slots[h] != 0; h = (h + 1) & sketch->slot_mask) {
+      if (same_key (&sketch->entries[sketch->slots[h] - 1], hash, key, length)) {
+         return h;
+      }
+   }
+   return -1;
+}
+
+static void
+insert_slot (dns_hh_sketch_t *sketch, int32_t index)
+{
+   uint32_t h = sketch->entries[index].hash & sketch->slot_mask;
+   while (sketch->slots[h] != 0) {
+      h = (h + 1) & sketch->slot_mask;
+   }
+   sketch->slots[h] = index + 1;
+}
+
+// backward shift deletion, as in the pending table
+static void
+remove_slot (dns_hh_sketch_t *sketch, uint32_t i)
+{
+   sketch->slots[i] = 0;
+   for (uint32_t j = (i + 1) & sketch->slot_mask; sketch->slots[j] != 0; j = (j + 1) & sketch->slot_mask) {
+      uint32_t home = sketch->entries[sketch->slots[j] - 1].hash & sketch->slot_mask;
+      int stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+      if (!stays) {
+         sketch->slots[i] = sketch->slots[j];
+         sketch->slots[j] = 0;
+         i = j;
+      }
+   }
+}
+
+static inline void
+heap_set (dns_hh_sketch_t *sketch, int pos, int32_t index)
+{
+   sketch->heap[pos] = index;
+   sketch->entries[index].heap = pos;
+}
+
+static void
+sift_up (dns_hh_sketch_t *sketch, int pos)
+{
+   int32_t index = sketch->heap[pos];
+   while (pos > 0) {
+      int parent = (pos - 1) / 2;
+      if (sketch->entries[sketch->heap[parent]].count <= sketch->entries[index].count) {
+         break;
+      }
+      heap_set (sketch, pos, sketch->heap[parent]);
+      pos = parent;
+   }
+   heap_set (sketch, pos, index);
+}
+
+static void
+sift_down (dns_hh_sketch_t *sketch, int pos)
+{
+   int32_t index = sketch->heap[pos];
+   for (;;) {
+      int child = pos * 2 + 1;
+      if (child >= sketch->count) {
+         break;
+      }
+      if (child + 1 < sketch->count &&
+          sketch->entries[sketch->heap[child + 1]].count < sketch->entries[sketch->heap[child]].count) {
+         ++child;
+      }
+      if (sketch->entries[index].count <= sketch->entries[sketch->heap[child]].count) {
+         break;
+      }
+      heap_set (sketch, pos, sketch->heap[child]);
+      pos = child;
+   }
+   heap_set (sketch, pos, index);
+}
+
+static void
+init_sketch (dns_hh_sketch_t *sketch, int size)
+{
+   sketch->entries = (dns_hh_entry_t *) malloc (size * sizeof (*sketch->entries));
+   sketch->heap = (int32_t *) malloc (size * sizeof (*sketch->heap));
+   uint32_t slots = 1;
+   while (slots < (uint32_t) size * 2) {
+      slots <<= 1;
+   }
+   sketch->slots = (int32_t *) calloc (slots, sizeof (*sketch->slots));
+   sketch->slot_mask = slots - 1;
+   sketch->size = size;
+   sketch->count = 0;
+   sketch->total = 0;
+}
+
+static void
+clear_sketch (dns_hh_sketch_t *sketch)
+{
+   free (sketch->entries);
+   free (sketch->heap);
+   free (sketch->slots);
+}
+
+static void
+sketch_add (dns_hh_sketch_t *sketch, uint64_t hash, const uint8_t *key, int length)
+{
+   ++sketch->total;
+   int64_t found = find_slot (sketch, hash, key, length);
+   if (found >= 0) {
+      dns_hh_entry_t *entry = &sketch->entries[sketch->slots[found] - 1];
+      ++entry->count;
+      sift_down (sketch, entry->heap);
+      return;
+   }
+   int32_t index;
+   uint64_t floor = 0;
+   if (sketch->count < sketch->size) {
+      index = sketch->count;
+      sketch->heap[sketch->count++] = index;
+      sketch->entries[index].heap = index;
+   } else {
+      // the smallest counter changes hands, its count becomes the error of the new key
+      index = sketch->heap[0];
+      dns_hh_entry_t *victim = &sketch->entries[index];
+      remove_slot (sketch, (uint32_t) find_slot (sketch, victim->hash, victim->key, victim->length));
+      floor = victim->count;
+   }
+   dns_hh_entry_t *entry = &sketch->entries[index];
+   entry->hash = hash;
+   entry->count = floor + 1;
+   entry->error = floor;
+   entry->length = length;
+   memcpy (entry->key, key, length);
+   insert_slot (sketch, index);
+   if (floor == 0) {
+      sift_up (sketch, entry->heap);
+   } else {
+      sift_down (sketch, entry->heap);
+   }
+}
+
+dns_heavy_hitters_t *
+new_dns_heavy_hitters (int size, dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   *lrc = kOk;
+
+   if (size <= 0 || size > DNS_HH_MAX_SIZE) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+   dns_heavy_hitters_t *hh = (dns_heavy_hitters_t *) calloc (1, sizeof (*hh));
+   pthread_mutex_init (&hh->lock, NULL);
+   for (int i = 0; i < DNS_HH_KINDS; ++i) {
+      init_sketch (&hh->sketches[i], size);
+   }
+   return hh;
+}
+
+void
+destroy_dns_heavy_hitters (dns_heavy_hitters_t *hh)
+{
+   if (hh == NULL) {
+      return;
+   }
+   for (int i = 0; i < DNS_HH_KINDS; ++i) {
+      clear_sketch (&hh->sketches[i]);
+   }
+   pthread_mutex_destroy (&hh->lock);
+   free (hh);
+}
+
+void
+dns_heavy_hitters_count (dns_heavy_hitters_t *hh,
+                         const dns_name_t *qname,
+                         int blocked,
+                         const struct sockaddr_storage *client)
+{
+   uint8_t addr[17];
+   int addr_len = 0;
+   addr[addr_len++] = (uint8_t) client->ss_family;
+   if (client->ss_family == AF_INET6) {
+      memcpy (addr + addr_len, &((const struct sockaddr_in6 *) client)->sin6_addr, 16);
+      addr_len += 16;
+   } else {
+      memcpy (addr + addr_len, &((const struct sockaddr_in *) client)->sin_addr, 4);
+      addr_len += 4;
+   }
+   uint64_t addr_hash = dns_name_hash (addr, addr_len);
+
+   pthread_mutex_lock (&hh->lock);
+   if (qname->length > 0) {
+      sketch_add (&hh->sketches[DNS_HH_NAMES], qname->hash, qname->wire, qname->length);
+      if (blocked) {
+         sketch_add (&hh->sketches[DNS_HH_BLOCKED], qname->hash, qname->wire, qname->length);
+      }
+   }
+   sketch_add (&hh->sketches[DNS_HH_CLIENTS], addr_hash, addr, addr_len);
+   pthread_mutex_unlock (&hh->lock);
+}
+
+// A key of one worker while merging. `floor` is what the worker would add for a key it does not track.
+struct merge_item {
+   uint64_t hash;
+   uint64_t count;
+   uint64_t error;
+   uint64_t floor;
+   uint16_t length;
+   uint8_t key[DNS_HH_KEY_MAX];
+};
+typedef struct merge_item merge_item_t;
+
+static int
+compare_key (const void *a, const void *b)
+{
+   const merge_item_t *x = (const merge_item_t *) a;
+   const merge_item_t *y = (const merge_item_t *) b;
+   if (x->hash != y->hash) {
+      return x->hash < y->hash ? -1 : 1;
+   }
+   if (x->length != y->length) {
+      return x->length - y->length;
+   }
+   return memcmp (x->key, y->key, x->length);
+}
+
+static int
+compare_count (const void *a, const void *b)
+{
+   const merge_item_t *x = (const merge_item_t *) a;
+   const merge_item_t *y = (const merge_item_t *) b;
+   return x->count != y->count ? (x->count > y->count ? -1 : 1) : compare_key (a, b);
+}
+
+int
+dns_heavy_hitters_top (
+   dns_heavy_hitters_t *const *hh, int count, dns_hh_kind_t kind, dns_hh_top_t *top, int n, uint64_t *total)
+{
+   *total = 0;
+   int capacity = 0;
+   for (int w = 0; w < count; ++w) {
+      capacity += hh[w]->sketches[kind].size;
+   }
+   merge_item_t *items = (merge_item_t *) malloc ((capacity + 1) * sizeof (*items));
+   int item_count = 0;
+   uint64_t floors = 0; /* sum of the floors of every worker */
+   for (int w = 0; w < count; ++w) {
+      pthread_mutex_lock (&hh[w]->lock);
+      const dns_hh_sketch_t *sketch = &hh[w]->sketches[kind];
+      // a key missing from a full sketch may still have been seen up to its smallest count
+      uint64_t floor = sketch->count == sketch->size ? sketch->entries[sketch->heap[0]].count : 0;
+      for (int i = 0; i < sketch->count; ++i) {
+         const dns_hh_entry_t *entry = &sketch->entries[i];
+         merge_item_t *item = &items[item_count++];
+         item->hash = entry->hash;
+         item->count = entry->count;
+         item->error = entry->error;
+         item->floor = floor;
+         item->length = entry->length;
+         memcpy (item->key, entry->key, entry->length);
+      }
+      *total += sketch->total;
+      pthread_mutex_unlock (&hh[w]->lock);
+      floors += floor;
+   }
+
+   // equal keys of different workers become one, the floors of the workers missing it add to its count and error
+   qsort (items, item_count, sizeof (*items), compare_key);
+   int merged = 0;
+   for (int i = 0; i < item_count;) {
+      merge_item_t *item = &items[merged++];
+      if (item != &items[i]) {
+         *item = items[i];
+      }
+      uint64_t present = items[i].floor;
+      for (++i; i < item_count && compare_key (item, &items[i]) == 0; ++i) {
+         item->count += items[i].count;
+         item->error += items[i].error;
+         present += items[i].floor;
+      }
+      item->count += floors - present;
+      item->error += floors - present;
+   }
+   qsort (items, merged, sizeof (*items), compare_count);
+   int written = merged < n ? merged : n;
+   for (int i = 0; i < written; ++i) {
+      top[i].count = items[i].count;
+      top[i].error = items[i].error;
+      top[i].length = items[i].length;
+      memcpy (top[i].key, items[i].key, items[i].length);
+   }
+   free (items);
+   return written;
+}
@@ -0,0 +1,133 @@
+#include "server/latency.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define DNS_LATENCY_X86 1
+#endif
+
+#define CALIBRATION_NS 20000000 /* how long the TSC rate is measured */
+
+const char *dns_stage_desc[] = {
+   "queue", "parse", "decide", "reply", "forward", "upstream", "answer_queue", "relay", "total"};
+
+static uint64_t tsc_mult; /* ns per tick << 32, 0 when clock_gettime is used */
+
+static inline uint64_t
+clock_ns (clockid_t clock)
+{
+   struct timespec ts;
+   clock_gettime (clock, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void
+dns_latency_calibrate (void)
+{
+#ifdef DNS_LATENCY_X86
+   // the TSC has to tick at a constant rate in every power state and on every core
+   unsigned int eax = 0;
+   unsigned int ebx = 0;
+   unsigned int ecx = 0;
+   unsigned int edx = 0;
+   if (!__get_cpuid (0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8))) {
+      return;
+   }
+   uint64_t ns = clock_ns (CLOCK_MONOTONIC);
+   uint64_t tsc = __rdtsc ();
+   struct timespec pause = {0, CALIBRATION_NS};
+   nanosleep (&pause, NULL);
+   ns = clock_ns (CLOCK_MONOTONIC) - ns;
+   tsc = __rdtsc () - tsc;
+   if (tsc > 0) {
+      tsc_mult = (ns << 32) / tsc;
+   }
+#endif
+}
+
+dns_latency_t *
+new_dns_latency (void)
+{
+   return (dns_latency_t *) calloc (1, sizeof (dns_latency_t));
+}
+
+void
+destroy_dns_latency (dns_latency_t *lat)
+{
+   free (lat);
+}
+
+void
+dns_latency_anchor (dns_latency_t *lat)
+{
+#ifdef DNS_LATENCY_X86
+   if (tsc_mult != 0) {
+      lat->anchor_tsc = __rdtsc ();
+   }
+#endif
+   lat->anchor_ns = clock_ns (CLOCK_REALTIME);
+}
+
+uint64_t
+dns_latency_now (const dns_latency_t *lat)
+{
+#ifdef DNS_LATENCY_X86
+   if (tsc_mult != 0) {
+      return lat->anchor_ns + (uint64_t) (((unsigned __int128) (__rdtsc () - lat->anchor_tsc) * tsc_mult) >> 32);
+   }
+#endif
+   return clock_ns (CLOCK_REALTIME);
+}
+
+// Upper edge of a bucket in ns
+static uint64_t
+bucket_edge (int bucket)
+{
+   if (bucket < DNS_LATENCY_SUB_BUCKETS) {
+      return bucket;
+   }
+   int msb = bucket / DNS_LATENCY_SUB_BUCKETS + 1;
+   uint64_t width = 1ull << (msb - 2);
+   return (uint64_t) (DNS_LATENCY_SUB_BUCKETS + bucket % DNS_LATENCY_SUB_BUCKETS) * width + width - 1;
+}
+
+void
+dns_latency_print (dns_latency_t *const *lat, int count, FILE *out)
+{
+   static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+   fprintf (out, "latency (us)      count       mean        p50        p90        p99      p99.9        max\n");
+   for (int stage = 0; stage < DNS_STAGES; ++stage) {
+      uint64_t counts[DNS_LATENCY_BUCKETS];
+      memset (counts, 0, sizeof (counts));
+      uint64_t total = 0;
+      uint64_t sum = 0;
+      uint64_t max = 0;
+      for (int w = 0; w < count; ++w) {
+         for (int b = 0; b < DNS_LATENCY_BUCKETS; ++b) {
+            counts[b] += lat[w]->counts[stage][b];
+            total += lat[w]->counts[stage][b];
+         }
+         sum += lat[w]->sums[stage];
+         max = lat[w]->max[stage] > max ? lat[w]->max[stage] : max;
+      }
+      if (total == 0) {
+         continue;
+      }
+      fprintf (out, "%-12s %10llu %10.1f", dns_stage_desc[stage], (unsigned long long) total, sum / 1000.0 / total);
+      int b = 0;
+      uint64_t seen = counts[0];
+      for (int q = 0; q < (int) (sizeof (quantiles) / sizeof (quantiles[0])); ++q) {
+         uint64_t rank = (uint64_t) (quantiles[q] * total);
+         while (seen <= rank && b < DNS_LATENCY_BUCKETS - 1) {
+            seen += counts[++b];
+         }
+         uint64_t edge = bucket_edge (b);
+         fprintf (out, " %10.1f", (edge < max ? edge : max) / 1000.0);
+      }
+      fprintf (out, " %10.1f\n", max / 1000.0);
+   }
+}
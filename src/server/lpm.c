@@ -0,0 +1,119 @@
+#include "server/lpm.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LPM_INITIAL_NODES 64
+
+lpm_t *
+new_lpm (int addr_len, dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   *lrc = kOk;
+
+   if (addr_len != 4 && addr_len != 16) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+   lpm_t *lpm = (lpm_t *) calloc (1, sizeof (*lpm));
+   lpm->addr_len = addr_len;
+   lpm->root = (uint32_t *) calloc (1u << LPM_ROOT_BITS, sizeof (*lpm->root));
+   lpm->root_len = (uint8_t *) calloc (1u << LPM_ROOT_BITS, sizeof (*lpm->root_len));
+   lpm->node_cap = LPM_INITIAL_NODES;
+   lpm->nodes = (uint32_t *) malloc ((lpm->node_cap << LPM_NODE_BITS) * sizeof (*lpm->nodes));
+   lpm->node_len = (uint8_t *) malloc ((lpm->node_cap << LPM_NODE_BITS) * sizeof (*lpm->node_len));
+   return lpm;
+}
+
+void
+destroy_lpm (lpm_t *lpm)
+{
+   if (lpm == NULL) {
+      return;
+   }
+   free (lpm->root);
+   free (lpm->root_len);
+   free (lpm->nodes);
+   free (lpm->node_len);
+   free (lpm);
+}
+
+// Returns the child node of a slot, a leaf is first replaced by a node with the leaf pushed into all of its slots
+static uint32_t
+expand_slot (lpm_t *lpm, int in_root, uint32_t slot)
+{
+   uint32_t e = in_root ? lpm->root[slot] : lpm->nodes[slot];
+   uint8_t len = in_root ? lpm->root_len[slot] : lpm->node_len[slot];
+   if (e & LPM_CHILD_FLAG) {
+      return e & ~LPM_CHILD_FLAG;
+   }
+   if (lpm->node_count == lpm->node_cap) {
+      lpm->node_cap *= 2;
+      lpm->nodes = (uint32_t *) realloc (lpm->nodes, (lpm->node_cap << LPM_NODE_BITS) * sizeof (*lpm->nodes));
+      lpm->node_len = (uint8_t *) realloc (lpm->node_len, (lpm->node_cap << LPM_NODE_BITS) * sizeof (*lpm->node_len));
+   }
+   uint32_t node = lpm->node_count++;
+   for (uint32_t i = 0; i < (1u << LPM_NODE_BITS); ++i) {
+      lpm->nodes[(node << LPM_NODE_BITS) | i] = e;
+      lpm->node_len[(node << LPM_NODE_BITS) | i] = len;
+   }
+   if (in_root) {
+      lpm->root[slot] = node | LPM_CHILD_FLAG;
+   } else {
+      lpm->nodes[slot] = node | LPM_CHILD_FLAG;
+   }
+   return node;
+}
+
+// Sets every leaf of [first, first + count) that is not covered by a longer prefix, children included
+static void
+fill_range (lpm_t *lpm, int in_root, uint32_t first, uint32_t count, uint32_t value, uint8_t prefix_len)
+{
+   uint32_t *table = in_root ? lpm->root : lpm->nodes;
+   uint8_t *lens = in_root ? lpm->root_len : lpm->node_len;
+   for (uint32_t i = first; i < first + count; ++i) {
+      if (table[i] & LPM_CHILD_FLAG) {
+         uint32_t node = table[i] & ~LPM_CHILD_FLAG;
+         fill_range (lpm, 0, node << LPM_NODE_BITS, 1u << LPM_NODE_BITS, value, prefix_len);
+      } else if (lens[i] <= prefix_len) {
+         table[i] = value;
+         lens[i] = prefix_len;
+      }
+   }
+}
+
+dns_rc_t
+lpm_insert (lpm_t *lpm, const uint8_t *addr, int prefix_len, uint32_t value)
+{
+   if (lpm == NULL || addr == NULL || value == LPM_NO_MATCH || (value & LPM_CHILD_FLAG) || prefix_len < 0 ||
+       prefix_len > lpm->addr_len * 8) {
+      return kInvalidInput;
+   }
+
+   // a /0 is stored as length 0 as well, so keep lengths one above the prefix to tell it from an empty slot
+   uint8_t len = prefix_len + 1;
+   uint32_t idx = ((uint32_t) addr[0] << 8) | addr[1];
+   if (prefix_len <= LPM_ROOT_BITS) {
+      uint32_t span = LPM_ROOT_BITS - prefix_len;
+      fill_range (lpm, 1, (idx >> span) << span, 1u << span, value, len);
+      return kOk;
+   }
+
+   uint32_t node = expand_slot (lpm, 1, idx);
+   int remaining = prefix_len - LPM_ROOT_BITS;
+   for (int i = 2; i < lpm->addr_len; ++i) {
+      if (remaining <= LPM_NODE_BITS) {
+         uint32_t span = LPM_NODE_BITS - remaining;
+         uint32_t first = (node << LPM_NODE_BITS) | ((addr[i] >> span) << span);
+         fill_range (lpm, 0, first, 1u << span, value, len);
+         return kOk;
+      }
+      node = expand_slot (lpm, 0, (node << LPM_NODE_BITS) | addr[i]);
+      remaining -= LPM_NODE_BITS;
+   }
+   return kOk;
+}
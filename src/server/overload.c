@@ -0,0 +1,90 @@
+#include "server/overload.h"
+
+#include <linux/sock_diag.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <time.h>
+
+const char *dns_load_level_desc[] = {"normal", "shed", "drop"};
+
+// Receive buffer use in percent and drops of `sockfd`, 0 for both when the kernel cannot tell (before 4.6)
+static int
+socket_queue (int sockfd, uint32_t *drops)
+{
+   *drops = 0;
+#ifdef SO_MEMINFO
+   uint32_t mem[SK_MEMINFO_VARS] = {0};
+   socklen_t len = sizeof (mem);
+   if (getsockopt (sockfd, SOL_SOCKET, SO_MEMINFO, mem, &len) == 0 && mem[SK_MEMINFO_RCVBUF] > 0) {
+      *drops = mem[SK_MEMINFO_DROPS];
+      return (int) ((uint64_t) mem[SK_MEMINFO_RMEM_ALLOC] * 100 / mem[SK_MEMINFO_RCVBUF]);
+   }
+#else
+   (void) sockfd;
+#endif
+   return 0;
+}
+
+dns_overload_t *
+new_dns_overload (const dns_overload_conf_t *conf, int sockfd, dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   *lrc = kOk;
+   if (conf == NULL || conf->lag_ms <= 0 || conf->queue_percent <= 0 || conf->drop_lag_ms < conf->lag_ms ||
+       conf->drop_queue_percent < conf->queue_percent) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+   dns_overload_t *ov = (dns_overload_t *) calloc (1, sizeof (*ov));
+   ov->lag_ns[DNS_LOAD_SHED] = (uint64_t) conf->lag_ms * 1000000ull;
+   ov->lag_ns[DNS_LOAD_DROP] = (uint64_t) conf->drop_lag_ms * 1000000ull;
+   ov->queue[DNS_LOAD_SHED] = conf->queue_percent;
+   ov->queue[DNS_LOAD_DROP] = conf->drop_queue_percent;
+   ov->action = conf->action;
+   socket_queue (sockfd, &ov->base_drops);
+   return ov;
+}
+
+void
+destroy_dns_overload (dns_overload_t *ov)
+{
+   free (ov);
+}
+
+// Whether the measurements reach the thresholds of `level` divided by `div`
+static inline int
+over (const dns_overload_t *ov, dns_load_level_t level, int div)
+{
+   return ov->last_lag_ns * div >= ov->lag_ns[level] || ov->last_queue * div >= ov->queue[level];
+}
+
+void
+dns_overload_measure (dns_overload_t *ov, int sockfd, const dns_datagram_t *dgrams, int count)
+{
+   uint32_t drops = 0;
+   ov->last_queue = socket_queue (sockfd, &drops);
+   ov->kernel_drops = drops - ov->base_drops;
+   // queries of one socket come in arrival order, the first one waited longest
+   ov->last_lag_ns = 0;
+   for (int i = 0; i < count; ++i) {
+      if (dgrams[i].socket == 0 && dgrams[i].kernel_ns != 0) {
+         struct timespec ts;
+         clock_gettime (CLOCK_REALTIME, &ts);
+         uint64_t now_ns = (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+         ov->last_lag_ns = now_ns > dgrams[i].kernel_ns ? now_ns - dgrams[i].kernel_ns : 0;
+         break;
+      }
+   }
+   dns_load_level_t level = over (ov, DNS_LOAD_DROP, 1) ? DNS_LOAD_DROP
+                            : over (ov, DNS_LOAD_SHED, 1) ? DNS_LOAD_SHED
+                                                          : DNS_LOAD_NORMAL;
+   if (level < ov->level && over (ov, ov->level, 2)) {
+      level = ov->level;
+   }
+   ov->level = level;
+   ov->overloaded += level != DNS_LOAD_NORMAL;
+}
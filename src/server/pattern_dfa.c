@@ -0,0 +1,852 @@
+#include "server/pattern_dfa.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Patterns are parsed into a syntax tree, expanded into one Thompson NFA, turned into a DFA by subset
+// construction over byte classes and minimized by partition refinement. All of it happens at configuration load.
+
+enum ast_kind { AST_EMPTY = 0, AST_SET = 1, AST_CAT = 2, AST_ALT = 3, AST_REPEAT = 4 };
+
+struct ast_node {
+   uint8_t kind;
+   int a; /* AST_SET: byte set, AST_CAT and AST_ALT: left, AST_REPEAT: child */
+   int b; /* AST_CAT and AST_ALT: right */
+   int min;
+   int max; /* -1 for unbounded */
+};
+typedef struct ast_node ast_node_t;
+
+struct byte_set {
+   uint64_t bits[4];
+};
+typedef struct byte_set byte_set_t;
+
+enum nfa_kind { NFA_EPS = 0, NFA_SPLIT = 1, NFA_SET = 2, NFA_ACCEPT = 3 };
+
+struct nfa_node {
+   uint8_t kind;
+   int out;  /* NFA_EPS, NFA_SPLIT, NFA_SET: next node, -1 while unpatched */
+   int out1; /* NFA_SPLIT: second branch */
+   int arg;  /* NFA_SET: byte set, NFA_ACCEPT: filter index */
+};
+typedef struct nfa_node nfa_node_t;
+
+// Syntax trees and byte sets of every pattern, the NFA they expand to
+struct pattern_builder {
+   ast_node_t *ast;
+   int ast_count;
+   int ast_cap;
+   byte_set_t *sets;
+   int set_count;
+   int set_cap;
+   nfa_node_t *nfa;
+   int nfa_count;
+   int nfa_cap;
+   int *starts; /* first node of every pattern */
+   int start_count;
+};
+typedef struct pattern_builder pattern_builder_t;
+
+struct regex_parser {
+   pattern_builder_t *b;
+   const char *text;
+   int pos;
+   int error;
+};
+typedef struct regex_parser regex_parser_t;
+
+static void
+set_add (byte_set_t *set, int c)
+{
+   set->bits[c >> 6] |= 1ull << (c & 63);
+}
+
+static int
+set_has (const byte_set_t *set, int c)
+{
+   return (set->bits[c >> 6] >> (c & 63)) & 1;
+}
+
+// Names are matched in canonical lowercase, so patterns are case-insensitive
+static void
+set_fold (byte_set_t *set)
+{
+   for (int c = 'A'; c <= 'Z'; ++c) {
+      if (set_has (set, c)) {
+         set_add (set, c + 'a' - 'A');
+      }
+   }
+}
+
+static int
+new_set (pattern_builder_t *b)
+{
+   if (b->set_count == b->set_cap) {
+      b->set_cap = b->set_cap != 0 ? b->set_cap * 2 : 64;
+      b->sets = (byte_set_t *) realloc (b->sets, b->set_cap * sizeof (*b->sets));
+   }
+   memset (&b->sets[b->set_count], 0, sizeof (b->sets[0]));
+   return b->set_count++;
+}
+
+static int
+new_ast (pattern_builder_t *b, uint8_t kind, int a, int bb, int min, int max)
+{
+   if (b->ast_count == b->ast_cap) {
+      b->ast_cap = b->ast_cap != 0 ? b->ast_cap * 2 : 64;
+      b->ast = (ast_node_t *) realloc (b->ast, b->ast_cap * sizeof (*b->ast));
+   }
+   ast_node_t *node = &b->ast[b->ast_count];
+   node->kind = kind;
+   node->a = a;
+   node->b = bb;
+   node->min = min;
+   node->max = max;
+   return b->ast_count++;
+}
+
+static int
+ast_char (pattern_builder_t *b, int c)
+{
+   int set = new_set (b);
+   set_add (&b->sets[set], c >= 'A' && c <= 'Z' ? c + 'a' - 'A' : c);
+   return new_ast (b, AST_SET, set, -1, 0, 0);
+}
+
+static int
+ast_any (pattern_builder_t *b)
+{
+   int set = new_set (b);
+   memset (b->sets[set].bits, 0xff, sizeof (b->sets[set].bits));
+   return new_ast (b, AST_SET, set, -1, 0, 0);
+}
+
+static int
+ast_cat (pattern_builder_t *b, int left, int right)
+{
+   if (left < 0) {
+      return right;
+   }
+   return right < 0 ? left : new_ast (b, AST_CAT, left, right, 0, 0);
+}
+
+// \d and \w, inside and outside of classes
+static int
+add_escape_class (byte_set_t *set, char c)
+{
+   if (c == 'd' || c == 'w') {
+      for (int x = '0'; x <= '9'; ++x) {
+         set_add (set, x);
+      }
+      for (int x = 'a'; c == 'w' && x <= 'z'; ++x) {
+         set_add (set, x);
+      }
+      if (c == 'w') {
+         set_add (set, '_');
+      }
+      return 1;
+   }
+   return 0;
+}
+
+// Only punctuation can be escaped, so a letter escape of another dialect is rejected instead of misread
+static int
+escapable (char c)
+{
+   return c != 0 && strchr (".\\-^$*+?()[]{}|/_", c) != NULL;
+}
+
+static int parse_alt (regex_parser_t *p);
+
+static int
+parse_class (regex_parser_t *p)
+{
+   pattern_builder_t *b = p->b;
+   int set = new_set (b);
+   int negate = p->text[p->pos] == '^';
+   p->pos += negate;
+   int first = 1;
+   while (p->text[p->pos] != ']' || first) {
+      char c = p->text[p->pos];
+      if (c == 0) {
+         p->error = 1;
+         return -1;
+      }
+      ++p->pos;
+      first = 0;
+      int lo = (uint8_t) c;
+      if (c == '\\') {
+         c = p->text[p->pos++];
+         if (add_escape_class (&b->sets[set], c)) {
+            continue;
+         }
+         if (!escapable (c)) {
+            p->error = 1;
+            return -1;
+         }
+         lo = (uint8_t) c;
+      }
+      int hi = lo;
+      if (p->text[p->pos] == '-' && p->text[p->pos + 1] != ']' && p->text[p->pos + 1] != 0) {
+         hi = (uint8_t) p->text[p->pos + 1];
+         p->pos += 2;
+         if (hi == '\\') {
+            hi = (uint8_t) p->text[p->pos++];
+            if (!escapable ((char) hi)) {
+               p->error = 1;
+               return -1;
+            }
+         }
+         if (hi < lo) {
+            p->error = 1;
+            return -1;
+         }
+      }
+      for (int x = lo; x <= hi; ++x) {
+         set_add (&b->sets[set], x);
+      }
+   }
+   ++p->pos;
+   set_fold (&b->sets[set]);
+   if (negate) {
+      for (int i = 0; i < 4; ++i) {
+         b->sets[set].bits[i] = ~b->sets[set].bits[i];
+      }
+   }
+   return new_ast (b, AST_SET, set, -1, 0, 0);
+}
+
+static int
+parse_atom (regex_parser_t *p)
+{
+   pattern_builder_t *b = p->b;
+   char c = p->text[p->pos++];
+   switch (c) {
+   case '(': {
+      int inner = parse_alt (p);
+      if (p->text[p->pos] != ')') {
+         p->error = 1;
+         return -1;
+      }
+      ++p->pos;
+      return inner;
+   }
+   case '[':
+      return parse_class (p);
+   case '.':
+      return ast_any (b);
+   case '\\': {
+      c = p->text[p->pos++];
+      int set = new_set (b);
+      if (add_escape_class (&b->sets[set], c)) {
+         return new_ast (b, AST_SET, set, -1, 0, 0);
+      }
+      --b->set_count;
+      if (!escapable (c)) {
+         p->error = 1;
+         return -1;
+      }
+      return ast_char (b, (uint8_t) c);
+   }
+   case '^':
+   case '$':
+   case ')':
+   case '|':
+   case '*':
+   case '+':
+   case '?':
+   case '{':
+   case 0:
+      // anchors only at the ends, quantifiers only after an atom
+      p->error = 1;
+      return -1;
+   default:
+      return ast_char (b, (uint8_t) c);
+   }
+}
+
+static int
+parse_number (regex_parser_t *p)
+{
+   int n = -1;
+   while (p->text[p->pos] >= '0' && p->text[p->pos] <= '9') {
+      n = (n < 0 ? 0 : n) * 10 + (p->text[p->pos++] - '0');
+      if (n > DNS_DFA_MAX_REPEAT) {
+         p->error = 1;
+         return -1;
+      }
+   }
+   return n;
+}
+
+static int
+parse_repeat (regex_parser_t *p)
+{
+   int atom = parse_atom (p);
+   while (!p->error) {
+      char c = p->text[p->pos];
+      int min = 0;
+      int max = -1;
+      if (c == '*') {
+         ++p->pos;
+      } else if (c == '+') {
+         ++p->pos;
+         min = 1;
+      } else if (c == '?') {
+         ++p->pos;
+         max = 1;
+      } else if (c == '{') {
+         ++p->pos;
+         min = parse_number (p);
+         max = min;
+         if (p->text[p->pos] == ',') {
+            ++p->pos;
+            max = parse_number (p);
+         }
+         if (p->error || min < 0 || p->text[p->pos] != '}' || (max >= 0 && max < min)) {
+            p->error = 1;
+            return -1;
+         }
+         ++p->pos;
+      } else {
+         break;
+      }
+      atom = new_ast (p->b, AST_REPEAT, atom, -1, min, max);
+   }
+   return atom;
+}
+
+static int
+parse_concat (regex_parser_t *p)
+{
+   int node = -1;
+   while (!p->error) {
+      char c = p->text[p->pos];
+      if (c == 0 || c == '|' || c == ')' || (c == '$' && p->text[p->pos + 1] == 0)) {
+         break;
+      }
+      node = ast_cat (p->b, node, parse_repeat (p));
+   }
+   return node >= 0 ? node : new_ast (p->b, AST_EMPTY, -1, -1, 0, 0);
+}
+
+static int
+parse_alt (regex_parser_t *p)
+{
+   int node = parse_concat (p);
+   while (!p->error && p->text[p->pos] == '|') {
+      ++p->pos;
+      node = new_ast (p->b, AST_ALT, node, parse_concat (p), 0, 0);
+   }
+   return node;
+}
+
+// The tree of a regex, wrapped in `.*` on every side it is not anchored to
+static int
+parse_regex (pattern_builder_t *b, const char *text)
+{
+   regex_parser_t p = {b, text, 0, 0};
+   int anchored_start = text[0] == '^';
+   p.pos = anchored_start;
+   int node = parse_alt (&p);
+   int anchored_end = !p.error && text[p.pos] == '$';
+   p.pos += anchored_end;
+   if (p.error || text[p.pos] != 0) {
+      return -1;
+   }
+   if (!anchored_start) {
+      node = ast_cat (b, new_ast (b, AST_REPEAT, ast_any (b), -1, 0, -1), node);
+   }
+   if (!anchored_end) {
+      node = ast_cat (b, node, new_ast (b, AST_REPEAT, ast_any (b), -1, 0, -1));
+   }
+   return node;
+}
+
+static int
+parse_wildcard (pattern_builder_t *b, const char *text)
+{
+   int node = -1;
+   for (const char *c = text; *c != 0; ++c) {
+      int atom = -1;
+      if (*c == '*') {
+         atom = new_ast (b, AST_REPEAT, ast_any (b), -1, 0, -1);
+      } else if (*c == '?') {
+         atom = ast_any (b);
+      } else {
+         atom = ast_char (b, (uint8_t) *c);
+      }
+      node = ast_cat (b, node, atom);
+   }
+   return node >= 0 ? node : new_ast (b, AST_EMPTY, -1, -1, 0, 0);
+}
+
+static int
+new_nfa (pattern_builder_t *b, uint8_t kind, int out, int out1, int arg)
+{
+   if (b->nfa_count >= DNS_DFA_MAX_NFA_STATES) {
+      return -1;
+   }
+   if (b->nfa_count == b->nfa_cap) {
+      b->nfa_cap = b->nfa_cap != 0 ? b->nfa_cap * 2 : 256;
+      b->nfa = (nfa_node_t *) realloc (b->nfa, b->nfa_cap * sizeof (*b->nfa));
+   }
+   nfa_node_t *node = &b->nfa[b->nfa_count];
+   node->kind = kind;
+   node->out = out;
+   node->out1 = out1;
+   node->arg = arg;
+   return b->nfa_count++;
+}
+
+// Expands `ast` into NFA nodes. Returns the entry node, `*end` gets the epsilon node leaving the fragment.
+// Returns -1 when the NFA grows too large.
+static int
+emit_nfa (pattern_builder_t *b, int ast, int *end)
+{
+   const ast_node_t node = b->ast[ast];
+   switch (node.kind) {
+   case AST_SET: {
+      int e = new_nfa (b, NFA_EPS, -1, -1, 0);
+      *end = e;
+      return e < 0 ? -1 : new_nfa (b, NFA_SET, e, -1, node.a);
+   }
+   case AST_CAT: {
+      int left_end = -1;
+      int right_end = -1;
+      int left = emit_nfa (b, node.a, &left_end);
+      int right = left < 0 ? -1 : emit_nfa (b, node.b, &right_end);
+      if (right < 0) {
+         return -1;
+      }
+      b->nfa[left_end].out = right;
+      *end = right_end;
+      return left;
+   }
+   case AST_ALT: {
+      int left_end = -1;
+      int right_end = -1;
+      int left = emit_nfa (b, node.a, &left_end);
+      int right = left < 0 ? -1 : emit_nfa (b, node.b, &right_end);
+      int e = right < 0 ? -1 : new_nfa (b, NFA_EPS, -1, -1, 0);
+      if (e < 0) {
+         return -1;
+      }
+      b->nfa[left_end].out = e;
+      b->nfa[right_end].out = e;
+      *end = e;
+      return new_nfa (b, NFA_SPLIT, left, right, 0);
+   }
+   case AST_REPEAT: {
+      int start = new_nfa (b, NFA_EPS, -1, -1, 0);
+      int tail = start;
+      for (int i = 0; i < node.min && tail >= 0; ++i) {
+         int child_end = -1;
+         int child = emit_nfa (b, node.a, &child_end);
+         if (child < 0) {
+            return -1;
+         }
+         b->nfa[tail].out = child;
+         tail = child_end;
+      }
+      // the optional copies: one loop when unbounded, max - min nested choices otherwise
+      int optional = node.max < 0 ? 1 : node.max - node.min;
+      for (int i = 0; i < optional && tail >= 0; ++i) {
+         int child_end = -1;
+         int child = emit_nfa (b, node.a, &child_end);
+         int e = child < 0 ? -1 : new_nfa (b, NFA_EPS, -1, -1, 0);
+         int split = e < 0 ? -1 : new_nfa (b, NFA_SPLIT, child, e, 0);
+         if (split < 0) {
+            return -1;
+         }
+         b->nfa[tail].out = split;
+         b->nfa[child_end].out = node.max < 0 ? split : e;
+         tail = e;
+      }
+      *end = tail;
+      return tail < 0 ? -1 : start;
+   }
+   default: {
+      int e = new_nfa (b, NFA_EPS, -1, -1, 0);
+      *end = e;
+      return e;
+   }
+   }
+}
+
+static void
+clear_builder (pattern_builder_t *b)
+{
+   free (b->ast);
+   free (b->sets);
+   free (b->nfa);
+   free (b->starts);
+   memset (b, 0, sizeof (*b));
+}
+
+// Parses `pattern` and appends its NFA, accepting with `filter`. Returns kDataMalformed on a syntax error.
+static dns_rc_t
+add_pattern (pattern_builder_t *b, dns_match_type_t type, const char *pattern, int filter)
+{
+   if (pattern == NULL) {
+      return kDataMalformed;
+   }
+   int ast = type == DNS_MT_WILDCARD ? parse_wildcard (b, pattern) : parse_regex (b, pattern);
+   if (ast < 0) {
+      return kDataMalformed;
+   }
+   int end = -1;
+   int start = emit_nfa (b, ast, &end);
+   int accept = start < 0 ? -1 : new_nfa (b, NFA_ACCEPT, -1, -1, filter);
+   if (accept < 0) {
+      return kAborted;
+   }
+   b->nfa[end].out = accept;
+   b->starts = (int *) realloc (b->starts, (b->start_count + 1) * sizeof (*b->starts));
+   b->starts[b->start_count++] = start;
+   // the tree is only needed until it is expanded
+   b->ast_count = 0;
+   return kOk;
+}
+
+int
+dns_pattern_check (dns_match_type_t type, const char *pattern)
+{
+   if (type != DNS_MT_WILDCARD && type != DNS_MT_REGEX) {
+      return -1;
+   }
+   pattern_builder_t b;
+   memset (&b, 0, sizeof (b));
+   dns_rc_t rc = add_pattern (&b, type, pattern, 0);
+   clear_builder (&b);
+   return rc == kOk ? 0 : -1;
+}
+
+// Sets of NFA nodes met during subset construction, interned so equal sets get the same DFA state
+struct subset_table {
+   int *nodes; /* members of all sets, sorted within a set */
+   size_t node_count;
+   size_t node_cap;
+   size_t *offsets; /* per DFA state */
+   int *lengths;
+   int count;
+   int cap;
+   int *slots; /* hash index, DFA state + 1, 0 marks an empty slot */
+   uint32_t slot_mask;
+};
+typedef struct subset_table subset_table_t;
+
+static uint32_t
+hash_nodes (const int *nodes, int length)
+{
+   uint32_t h = 2166136261u;
+   for (int i = 0; i < length; ++i) {
+      h = (h ^ (uint32_t) nodes[i]) * 16777619u;
+   }
+   return h;
+}
+
+static int
+compare_int (const void *a, const void *b)
+{
+   return *(const int *) a - *(const int *) b;
+}
+
+static void
+grow_slots (subset_table_t *t)
+{
+   uint32_t size = t->slot_mask + 1 != 1 ? (t->slot_mask + 1) * 2 : 1024;
+   free (t->slots);
+   t->slots = (int *) calloc (size, sizeof (*t->slots));
+   t->slot_mask = size - 1;
+   for (int s = 0; s < t->count; ++s) {
+      uint32_t h = hash_nodes (t->nodes + t->offsets[s], t->lengths[s]) & t->slot_mask;
+      while (t->slots[h] != 0) {
+         h = (h + 1) & t->slot_mask;
+      }
+      t->slots[h] = s + 1;
+   }
+}
+
+// DFA state of the sorted node set, a new one when it was not met before. *created tells which.
+static int
+intern_subset (subset_table_t *t, const int *nodes, int length, int *created)
+{
+   *created = 0;
+   if (t->slots == NULL || (uint32_t) t->count * 2 >= t->slot_mask + 1) {
+      grow_slots (t);
+   }
+   uint32_t h = hash_nodes (nodes, length) & t->slot_mask;
+   for (; t->slots[h] != 0; h = (h + 1) & t->slot_mask) {
+      int s = t->slots[h] - 1;
+      if (t->lengths[s] == length && memcmp (t->nodes + t->offsets[s], nodes, length * sizeof (*nodes)) == 0) {
+         return s;
+      }
+   }
+   if (t->count == t->cap) {
+      t->cap = t->cap != 0 ? t->cap * 2 : 256;
+      t->offsets = (size_t *) realloc (t->offsets, t->cap * sizeof (*t->offsets));
+      t->lengths = (int *) realloc (t->lengths, t->cap * sizeof (*t->lengths));
+   }
+   if (t->node_count + length > t->node_cap) {
+      while (t->node_count + length > t->node_cap) {
+         t->node_cap = t->node_cap != 0 ? t->node_cap * 2 : 4096;
+      }
+      t->nodes = (int *) realloc (t->nodes, t->node_cap * sizeof (*t->nodes));
+   }
+   memcpy (t->nodes + t->node_count, nodes, length * sizeof (*nodes));
+   t->offsets[t->count] = t->node_count;
+   t->lengths[t->count] = length;
+   t->node_count += length;
+   t->slots[h] = t->count + 1;
+   *created = 1;
+   return t->count++;
+}
+
+static void
+clear_subsets (subset_table_t *t)
+{
+   free (t->nodes);
+   free (t->offsets);
+   free (t->lengths);
+   free (t->slots);
+}
+
+// Epsilon closure of the `count` nodes in `stack`, keeping only the set and accept nodes, sorted into `out`.
+// `mark` holds the generation each node was last visited in.
+static int
+closure (const pattern_builder_t *b, int *stack, int count, int *out, uint32_t *mark, uint32_t generation)
+{
+   int length = 0;
+   while (count > 0) {
+      int n = stack[--count];
+      if (n < 0 || mark[n] == generation) {
+         continue;
+      }
+      mark[n] = generation;
+      const nfa_node_t *node = &b->nfa[n];
+      if (node->kind == NFA_EPS) {
+         stack[count++] = node->out;
+      } else if (node->kind == NFA_SPLIT) {
+         stack[count++] = node->out1;
+         stack[count++] = node->out;
+      } else {
+         out[length++] = n;
+      }
+   }
+   qsort (out, length, sizeof (*out), compare_int);
+   return length;
+}
+
+// Bytes that belong to the same sets in every pattern behave alike and share one class
+static int
+byte_classes (const pattern_builder_t *b, uint8_t *classes)
+{
+   int count = 1;
+   memset (classes, 0, 256);
+   for (int s = 0; s < b->set_count; ++s) {
+      int remap[512];
+      memset (remap, 0xff, sizeof (remap));
+      int next_count = 0;
+      for (int c = 0; c < 256; ++c) {
+         int key = classes[c] * 2 + set_has (&b->sets[s], c);
+         if (remap[key] < 0) {
+            remap[key] = next_count++;
+         }
+         classes[c] = (uint8_t) remap[key];
+      }
+      count = next_count;
+   }
+   return count;
+}
+
+// Moore's partition refinement: states start grouped by their accept value and are split until every state of a
+// group moves to the same groups. Returns the group count, `group` maps every state to its group.
+static int
+minimize (const uint32_t *next, const int32_t *accept, int states, int classes, int *group)
+{
+   int *signature_slots = NULL;
+   int *next_group = (int *) malloc (states * sizeof (*next_group));
+   int count = 0;
+   // round 0 groups by accept value, the later ones by group and successor groups
+   for (int round = 0;; ++round) {
+      uint32_t size = 16;
+      while (size < (uint32_t) states * 2) {
+         size <<= 1;
+      }
+      signature_slots = (int *) realloc (signature_slots, size * sizeof (*signature_slots));
+      memset (signature_slots, 0xff, size * sizeof (*signature_slots));
+      int next_count = 0;
+      for (int s = 0; s < states; ++s) {
+         uint32_t h = round == 0 ? (uint32_t) accept[s] * 2654435761u : (uint32_t) group[s] * 2654435761u;
+         for (int c = 0; round > 0 && c < classes; ++c) {
+            h = (h ^ (uint32_t) group[next[(size_t) s * classes + c]]) * 16777619u;
+         }
+         for (h &= size - 1;; h = (h + 1) & (size - 1)) {
+            int other = signature_slots[h];
+            if (other < 0) {
+               signature_slots[h] = s;
+               next_group[s] = next_count++;
+               break;
+            }
+            int same = round == 0 ? accept[other] == accept[s] : group[other] == group[s];
+            for (int c = 0; same && round > 0 && c < classes; ++c) {
+               same = group[next[(size_t) other * classes + c]] == group[next[(size_t) s * classes + c]];
+            }
+            if (same) {
+               next_group[s] = next_group[other];
+               break;
+            }
+         }
+      }
+      memcpy (group, next_group, states * sizeof (*group));
+      if (next_count == count) {
+         break;
+      }
+      count = next_count;
+   }
+   free (signature_slots);
+   free (next_group);
+   return count;
+}
+
+dns_rc_t
+init_dns_pattern_dfa (dns_pattern_dfa_t *dfa, const dns_filter_conf_t *filters, int size)
+{
+   if (dfa == NULL || (filters == NULL && size > 0)) {
+      return kInvalidInput;
+   }
+   memset (dfa, 0, sizeof (*dfa));
+   dfa->first = -1;
+
+   pattern_builder_t b;
+   memset (&b, 0, sizeof (b));
+   dns_rc_t rc = kOk;
+   for (int i = 0; i < size && rc == kOk; ++i) {
+      if (filters[i].match_type == DNS_MT_WILDCARD || filters[i].match_type == DNS_MT_REGEX) {
+         rc = add_pattern (&b, filters[i].match_type, (const char *) filters[i].host, i);
+         dfa->first = dfa->first < 0 ? i : dfa->first;
+      }
+   }
+   if (rc != kOk || b.start_count == 0) {
+      clear_builder (&b);
+      dfa->first = rc == kOk ? -1 : dfa->first;
+      return rc;
+   }
+
+   dfa->class_count = byte_classes (&b, dfa->classes);
+   int representative[256];
+   for (int c = 255; c >= 0; --c) {
+      representative[dfa->classes[c]] = c;
+   }
+
+   // subset construction, DFA states are numbered in discovery order
+   subset_table_t subsets;
+   memset (&subsets, 0, sizeof (subsets));
+   uint32_t *mark = (uint32_t *) calloc (b.nfa_count, sizeof (*mark));
+   int *stack = (int *) malloc ((b.nfa_count * 2 + b.start_count) * sizeof (*stack));
+   int *set = (int *) malloc (b.nfa_count * sizeof (*set));
+   uint32_t *next = NULL;
+   int32_t *accept = NULL;
+   size_t state_cap = 0;
+   uint32_t generation = 1;
+
+   memcpy (stack, b.starts, b.start_count * sizeof (*stack));
+   int length = closure (&b, stack, b.start_count, set, mark, generation++);
+   int created = 0;
+   intern_subset (&subsets, set, length, &created);
+   for (int s = 0; s < subsets.count && rc == kOk; ++s) {
+      if ((size_t) subsets.count > state_cap) {
+         state_cap = state_cap != 0 ? state_cap * 2 : 256;
+         while (state_cap < (size_t) subsets.count) {
+            state_cap *= 2;
+         }
+         next = (uint32_t *) realloc (next, state_cap * dfa->class_count * sizeof (*next));
+         accept = (int32_t *) realloc (accept, state_cap * sizeof (*accept));
+      }
+      accept[s] = -1;
+      for (int i = 0; i < subsets.lengths[s]; ++i) {
+         const nfa_node_t *node = &b.nfa[subsets.nodes[subsets.offsets[s] + i]];
+         if (node->kind == NFA_ACCEPT && (accept[s] < 0 || node->arg < accept[s])) {
+            accept[s] = node->arg;
+         }
+      }
+      for (int c = 0; c < dfa->class_count; ++c) {
+         int count = 0;
+         for (int i = 0; i < subsets.lengths[s]; ++i) {
+            const nfa_node_t *node = &b.nfa[subsets.nodes[subsets.offsets[s] + i]];
+            if (node->kind == NFA_SET && set_has (&b.sets[node->arg], representative[c])) {
+               stack[count++] = node->out;
+            }
+         }
+         length = closure (&b, stack, count, set, mark, generation++);
+         next[(size_t) s * dfa->class_count + c] = intern_subset (&subsets, set, length, &created);
+         if (subsets.count > DNS_DFA_MAX_STATES) {
+            rc = kAborted;
+            break;
+         }
+      }
+   }
+   int states = subsets.count;
+   clear_subsets (&subsets);
+   free (mark);
+   free (stack);
+   free (set);
+   clear_builder (&b);
+   if (rc != kOk) {
+      free (next);
+      free (accept);
+      return rc;
+   }
+
+   int *group = (int *) malloc (states * sizeof (*group));
+   dfa->state_count = minimize (next, accept, states, dfa->class_count, group);
+   dfa->next = (uint16_t *) malloc ((size_t) dfa->state_count * dfa->class_count * sizeof (*dfa->next));
+   dfa->accept = (int32_t *) malloc (dfa->state_count * sizeof (*dfa->accept));
+   dfa->stop = (uint8_t *) malloc (dfa->state_count);
+   for (int s = 0; s < states; ++s) {
+      int g = group[s];
+      dfa->accept[g] = accept[s];
+      for (int c = 0; c < dfa->class_count; ++c) {
+         dfa->next[(size_t) g * dfa->class_count + c] = (uint16_t) group[next[(size_t) s * dfa->class_count + c]];
+      }
+   }
+   for (int g = 0; g < dfa->state_count; ++g) {
+      dfa->stop[g] = 1;
+      for (int c = 0; c < dfa->class_count && dfa->stop[g]; ++c) {
+         dfa->stop[g] = dfa->next[(size_t) g * dfa->class_count + c] == g;
+      }
+   }
+   dfa->start = group[0];
+   free (group);
+   free (next);
+   free (accept);
+   return kOk;
+}
+
+void
+clear_dns_pattern_dfa (dns_pattern_dfa_t *dfa)
+{
+   if (dfa == NULL) {
+      return;
+   }
+   free (dfa->next);
+   free (dfa->accept);
+   free (dfa->stop);
+   memset (dfa, 0, sizeof (*dfa));
+   dfa->first = -1;
+}
+
+int
+dns_pattern_dfa_match (const dns_pattern_dfa_t *dfa, const uint8_t *text, int length)
+{
+   if (dfa->state_count == 0) {
+      return -1;
+   }
+   int state = dfa->start;
+   for (int i = 0; i < length && !dfa->stop[state]; ++i) {
+      state = dfa->next[state * dfa->class_count + dfa->classes[text[i]]];
+   }
+   return dfa->accept[state];
+}
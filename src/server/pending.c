@@ -0,0 +1,192 @@
+#include "server/pending.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+#include <time.h>
+#include <unistd.h>
+
+static inline uint32_t
+slot_hash (const dns_pending_t *pending, uint32_t key)
+{
+   uint64_t h = (uint64_t) key * 0x9e3779b97f4a7c15ull;
+   return (uint32_t) (h >> 32) & pending->slot_mask;
+}
+
+// xorshift64*, seeded from the kernel: upstream IDs must not be predictable
+static inline uint64_t
+next_random (dns_pending_t *pending)
+{
+   uint64_t x = pending->rng;
+   x ^= x >> 12;
+   x ^= x << 25;
+   x ^= x >> 27;
+   pending->rng = x;
+   return x * 0x2545f4914f6cdd1dull;
+}
+
+static int64_t
+find_slot (const dns_pending_t *pending, uint32_t key)
+{
+   for (uint32_t h = slot_hash (pending, key); pending->slots[h] != 0; h = (h + 1) & pending->slot_mask) {
+      if (pending->queries[pending->slots[h] - 1].key == key) {
+         return h;
+      }
+   }
+   return -1;
+}
+
+dns_pending_t *
+new_dns_pending (int capacity, int upstream_count, dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   *lrc = kOk;
+
+   if (capacity <= 0 || capacity > 65535 || upstream_count <= 0) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+   dns_pending_t *pending = (dns_pending_t *) calloc (1, sizeof (*pending));
+   pending->capacity = capacity;
+   pending->queries = (dns_pending_query_t *) calloc (capacity, sizeof (*pending->queries));
+   pending->free = (int32_t *) malloc (capacity * sizeof (*pending->free));
+   for (int i = 0; i < capacity; ++i) {
+      pending->free[pending->free_count++] = capacity - 1 - i;
+   }
+   uint32_t slots = 1;
+   while (slots < (uint32_t) capacity * 2) {
+      slots <<= 1;
+   }
+   pending->slots = (int32_t *) calloc (slots, sizeof (*pending->slots));
+   pending->slot_mask = slots - 1;
+   pending->upstream_count = upstream_count;
+   pending->heads = (int32_t *) malloc (upstream_count * sizeof (*pending->heads));
+   pending->tails = (int32_t *) malloc (upstream_count * sizeof (*pending->tails));
+   for (int i = 0; i < upstream_count; ++i) {
+      pending->heads[i] = pending->tails[i] = -1;
+   }
+   if (getrandom (&pending->rng, sizeof (pending->rng), 0) != sizeof (pending->rng)) {
+      struct timespec ts;
+      clock_gettime (CLOCK_REALTIME, &ts);
+      pending->rng = ((uint64_t) ts.tv_nsec << 32) ^ (uint64_t) ts.tv_sec ^ ((uint64_t) getpid () << 16);
+   }
+   pending->rng |= 1;
+   return pending;
+}
+
+void
+destroy_dns_pending (dns_pending_t *pending)
+{
+   if (pending == NULL) {
+      return;
+   }
+   free (pending->queries);
+   free (pending->slots);
+   free (pending->free);
+   free (pending->heads);
+   free (pending->tails);
+   free (pending);
+}
+
+dns_pending_query_t *
+dns_pending_add (dns_pending_t *pending, int upstream, uint16_t socket, uint64_t deadline_ns)
+{
+   if (pending->free_count == 0 || upstream < 0 || upstream >= pending->upstream_count) {
+      ++pending->full;
+      return NULL;
+   }
+   // fewer queries than IDs are pending on one socket, so a free ID turns up quickly
+   uint32_t key = 0;
+   do {
+      key = (uint32_t) socket << 16 | (uint16_t) next_random (pending);
+   } while (find_slot (pending, key) >= 0);
+
+   int32_t index = pending->free[--pending->free_count];
+   dns_pending_query_t *query = &pending->queries[index];
+   query->key = key;
+   query->deadline_ns = deadline_ns;
+   query->upstream = upstream;
+   query->prefetch = -1;
+   query->next = -1;
+   query->prev = pending->tails[upstream];
+   if (query->prev != -1) {
+      pending->queries[query->prev].next = index;
+   } else {
+      pending->heads[upstream] = index;
+   }
+   pending->tails[upstream] = index;
+
+   uint32_t h = slot_hash (pending, key);
+   while (pending->slots[h] != 0) {
+      h = (h + 1) & pending->slot_mask;
+   }
+   pending->slots[h] = index + 1;
+   ++pending->count;
+   return query;
+}
+
+dns_pending_query_t *
+dns_pending_find (dns_pending_t *pending, uint16_t socket, uint16_t id)
+{
+   int64_t h = find_slot (pending, (uint32_t) socket << 16 | id);
+   return h >= 0 ? &pending->queries[pending->slots[h] - 1] : NULL;
+}
+
+void
+dns_pending_remove (dns_pending_t *pending, dns_pending_query_t *query)
+{
+   int32_t index = query - pending->queries;
+   if (query->prev != -1) {
+      pending->queries[query->prev].next = query->next;
+   } else {
+      pending->heads[query->upstream] = query->next;
+   }
+   if (query->next != -1) {
+      pending->queries[query->next].prev = query->prev;
+   } else {
+      pending->tails[query->upstream] = query->prev;
+   }
+
+   // backward shift deletion keeps every probe sequence without holes
+   int64_t found = find_slot (pending, query->key);
+   if (found >= 0) {
+      uint32_t i = (uint32_t) found;
+      pending->slots[i] = 0;
+      for (uint32_t j = (i + 1) & pending->slot_mask; pending->slots[j] != 0; j = (j + 1) & pending->slot_mask) {
+         uint32_t home = slot_hash (pending, pending->queries[pending->slots[j] - 1].key);
+         // the entry at j may fill the hole at i unless its home lies cyclically in (i, j]
+         int stays = i <= j ? (home > i && home <= j) : (home > i || home <= j);
+         if (!stays) {
+            pending->slots[i] = pending->slots[j];
+            pending->slots[j] = 0;
+            i = j;
+         }
+      }
+   }
+   pending->free[pending->free_count++] = index;
+   --pending->count;
+}
+
+dns_pending_query_t *
+dns_pending_expired (dns_pending_t *pending, int upstream, uint64_t now_ns)
+{
+   int32_t head = pending->heads[upstream];
+   return head != -1 && pending->queries[head].deadline_ns <= now_ns ? &pending->queries[head] : NULL;
+}
+
+uint64_t
+dns_pending_next_deadline (const dns_pending_t *pending)
+{
+   uint64_t deadline_ns = UINT64_MAX;
+   for (int i = 0; i < pending->upstream_count; ++i) {
+      int32_t head = pending->heads[i];
+      if (head != -1 && pending->queries[head].deadline_ns < deadline_ns) {
+         deadline_ns = pending->queries[head].deadline_ns;
+      }
+   }
+   return deadline_ns;
+}
@@ -0,0 +1,189 @@
+#include "server/policy.h"
+#include "dns/dns-name.h"
+#include "utils/network_tools.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static const uint8_t v4_mapped_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+struct route_domain {
+   uint8_t *domain;
+   int labels;
+   int upstream;
+};
+
+static int
+compare_route_domains (const void *a, const void *b)
+{
+   return ((const struct route_domain *) b)->labels - ((const struct route_domain *) a)->labels;
+}
+
+// The filter set returns its lowest matching index, so ordering the domains by label count makes it return the
+// longest matching suffix
+static dns_rc_t
+init_dns_routes (dns_policy_t *policy, const dns_conf_t *conf)
+{
+   int count = 0;
+   for (int i = 0; i < conf->route_size; ++i) {
+      count += conf->routes[i].domain_size;
+   }
+   struct route_domain *domains = (struct route_domain *) calloc (count + 1, sizeof (*domains));
+   int d = 0;
+   for (int i = 0; i < conf->route_size; ++i) {
+      for (int j = 0; j < conf->routes[i].domain_size; ++j) {
+         dns_name_t name;
+         if (dns_name_from_text (&name, (const char *) conf->routes[i].domains[j]) < 0) {
+            free (domains);
+            return kDataMalformed;
+         }
+         domains[d].domain = conf->routes[i].domains[j];
+         domains[d].labels = name.labels;
+         domains[d].upstream = i + 1;
+         ++d;
+      }
+   }
+   qsort (domains, count, sizeof (*domains), compare_route_domains);
+
+   policy->route_domains = (dns_filter_conf_t *) calloc (count + 1, sizeof (*policy->route_domains));
+   policy->route_upstreams = (int *) calloc (count + 1, sizeof (*policy->route_upstreams));
+   for (int i = 0; i < count; ++i) {
+      policy->route_domains[i].host = domains[i].domain;
+      policy->route_domains[i].match_type = DNS_MT_SUFFIX;
+      policy->route_upstreams[i] = domains[i].upstream;
+   }
+   free (domains);
+   return init_dns_filter_set (&policy->routes, policy->route_domains, count);
+}
+
+dns_policy_t *
+new_dns_policy (const dns_conf_t *conf, dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   *lrc = kOk;
+
+   if (conf == NULL) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+
+   dns_policy_t *policy = (dns_policy_t *) calloc (1, sizeof (*policy));
+   policy->ecs = conf->ecs;
+   policy->group_count = conf->group_size + 1;
+   policy->groups = (dns_policy_group_t *) calloc (policy->group_count, sizeof (*policy->groups));
+   policy->groups[0].name = (const uint8_t *) DNS_DEFAULT_GROUP_NAME;
+   policy->groups[0].access = DNS_ACCESS_ALLOW;
+   *lrc = init_dns_filter_set (&policy->groups[0].filter_set, conf->filters, conf->filter_size);
+   if (*lrc == kOk) {
+      atomic_init (&policy->groups[0].view, new_dns_filter_view (&policy->groups[0].filter_set, lrc));
+   }
+
+   if (*lrc == kOk) {
+      policy->v4 = new_lpm (4, lrc);
+   }
+   if (*lrc == kOk) {
+      policy->v6 = new_lpm (16, lrc);
+   }
+   if (*lrc == kOk && (conf->zone.record_size > 0 || conf->zone.domain_size > 0)) {
+      policy->zone = new_dns_zone (&conf->zone, lrc);
+   }
+   if (*lrc == kOk) {
+      *lrc = init_dns_routes (policy, conf);
+   }
+   for (int i = 0; i < conf->group_size && *lrc == kOk; ++i) {
+      const dns_group_conf_t *gc = &conf->groups[i];
+      dns_policy_group_t *group = &policy->groups[i + 1];
+      group->name = gc->name;
+      group->access = gc->access;
+      *lrc = init_dns_filter_set (&group->filter_set, gc->filters, gc->filter_size);
+      if (*lrc == kOk) {
+         atomic_init (&group->view, new_dns_filter_view (&group->filter_set, lrc));
+      }
+      if (*lrc != kOk) {
+         break;
+      }
+
+      for (int j = 0; j < gc->client_size; ++j) {
+         uint8_t addr[16] = {0};
+         int addr_len = 0;
+         int prefix_len = 0;
+         if (get_cidr_binary (gc->clients[j], addr, &addr_len, &prefix_len) == -1) {
+            *lrc = kDataMalformed;
+            break;
+         }
+         // lpm values are group indexes shifted by one, LPM_NO_MATCH falls back to the default group
+         *lrc = lpm_insert (addr_len == 4 ? policy->v4 : policy->v6, addr, prefix_len, i + 1);
+         if (*lrc != kOk) {
+            break;
+         }
+      }
+   }
+   if (*lrc != kOk) {
+      destroy_dns_policy (policy);
+      return NULL;
+   }
+   return policy;
+}
+
+void
+destroy_dns_policy (dns_policy_t *policy)
+{
+   if (policy == NULL) {
+      return;
+   }
+   destroy_lpm (policy->v4);
+   destroy_lpm (policy->v6);
+   destroy_dns_zone (policy->zone);
+   clear_dns_filter_set (&policy->routes);
+   free (policy->route_domains);
+   free (policy->route_upstreams);
+   for (int i = 0; i < policy->group_count; ++i) {
+      destroy_dns_filter_view (atomic_load (&policy->groups[i].view), 1);
+      clear_dns_filter_set (&policy->groups[i].filter_set);
+   }
+   free (policy->groups);
+   free (policy);
+}
+
+const dns_policy_group_t *
+dns_policy_lookup (const dns_policy_t *policy, const struct sockaddr_storage *client)
+{
+   uint32_t group = LPM_NO_MATCH;
+   if (client != NULL && policy->group_count > 1) {
+      if (client->ss_family == AF_INET) {
+         group = lpm_lookup (policy->v4, (const uint8_t *) &((const struct sockaddr_in *) client)->sin_addr);
+      } else if (client->ss_family == AF_INET6) {
+         const uint8_t *addr = (const uint8_t *) &((const struct sockaddr_in6 *) client)->sin6_addr;
+         // IPv4 clients of a dual stack socket are matched against the IPv4 prefixes
+         if (memcmp (addr, v4_mapped_prefix, sizeof (v4_mapped_prefix)) == 0) {
+            group = lpm_lookup (policy->v4, addr + sizeof (v4_mapped_prefix));
+         } else {
+            group = lpm_lookup (policy->v6, addr);
+         }
+      }
+   }
+   return &policy->groups[group];
+}
+
+int
+dns_policy_route (const dns_policy_t *policy, const dns_h_t *dht)
+{
+   if (policy->routes.size == 0 || dht->header.qdcount == 0) {
+      return 0;
+   }
+   return dns_policy_route_name (policy, &dht->qrs[0].key);
+}
+
+int
+dns_policy_route_name (const dns_policy_t *policy, const dns_name_t *name)
+{
+   if (policy->routes.size == 0) {
+      return 0;
+   }
+   int domain = dns_filter_set_match (&policy->routes, name);
+   return domain < 0 ? 0 : policy->route_upstreams[domain];
+}
@@ -0,0 +1,289 @@
+#include "server/prefetch.h"
+#include "dns/dns-name.h"
+#include "server/cache.h"
+#include "utils/string_tools.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PREFETCH_MAX_LINE 512
+
+static const struct {
+   const char *name;
+   uint16_t type;
+} prefetch_types[] = {{"A", T_A},
+                      {"AAAA", T_AAAA},
+                      {"CNAME", T_CNAME},
+                      {"MX", T_MX},
+                      {"NS", T_NS},
+                      {"PTR", T_PTR},
+                      {"TXT", T_TXT},
+                      {"SRV", T_SRV},
+                      {"CAA", T_CAA},
+                      {"SVCB", T_SVCB},
+                      {"HTTPS", T_HTTPS}};
+
+int
+dns_prefetch_parse (const char *text, dns_name_t *name, uint16_t *type)
+{
+   char line[PREFETCH_MAX_LINE];
+   if (text == NULL || strlen (text) >= sizeof (line)) {
+      return -1;
+   }
+   strcpy (line, text);
+   char *save = NULL;
+   const char *host = strtok_r (line, " \t\r\n", &save);
+   const char *type_name = strtok_r (NULL, " \t\r\n", &save);
+   if (host == NULL || strtok_r (NULL, " \t\r\n", &save) != NULL || dns_name_from_text (name, host) < 0 ||
+       name->labels == 0) {
+      return -1;
+   }
+   *type = 0;
+   for (size_t t = 0; type_name != NULL && t < sizeof (prefetch_types) / sizeof (*prefetch_types); ++t) {
+      if (str_i_cmp (type_name, prefetch_types[t].name) == 0) {
+         *type = prefetch_types[t].type;
+      }
+   }
+   return type_name != NULL && *type == 0 ? -1 : 0;
+}
+
+static int
+earlier (const dns_prefetch_t *prefetch, int32_t a, int32_t b)
+{
+   return prefetch->names[a].due_ns < prefetch->names[b].due_ns;
+}
+
+static void
+heap_push (dns_prefetch_t *prefetch, int32_t index)
+{
+   int i = prefetch->heap_count++;
+   while (i > 0 && earlier (prefetch, index, prefetch->heap[(i - 1) / 2])) {
+      prefetch->heap[i] = prefetch->heap[(i - 1) / 2];
+      i = (i - 1) / 2;
+   }
+   prefetch->heap[i] = index;
+}
+
+static int32_t
+heap_pop (dns_prefetch_t *prefetch)
+{
+   int32_t top = prefetch->heap[0];
+   int32_t last = prefetch->heap[--prefetch->heap_count];
+   int i = 0;
+   for (;;) {
+      int child = 2 * i + 1;
+      if (child >= prefetch->heap_count) {
+         break;
+      }
+      if (child + 1 < prefetch->heap_count && earlier (prefetch, prefetch->heap[child + 1], prefetch->heap[child])) {
+         ++child;
+      }
+      if (!earlier (prefetch, prefetch->heap[child], last)) {
+         break;
+      }
+      prefetch->heap[i] = prefetch->heap[child];
+      i = child;
+   }
+   prefetch->heap[i] = last;
+   return top;
+}
+
+// Query for `name` and `type` as a stub resolver sends it, the ID is set when it goes out
+static int
+build_query (uint8_t *query, const dns_name_t *name, uint16_t type, int edns)
+{
+   uint8_t *p = query;
+   PUTSHORT (0, p);
+   *p++ = HB3_RD;
+   *p++ = 0;
+   PUTSHORT (1, p);
+   PUTSHORT (0, p);
+   PUTSHORT (0, p);
+   PUTSHORT (edns ? 1 : 0, p);
+   memcpy (p, name->wire, name->length);
+   p += name->length;
+   PUTSHORT (type, p);
+   PUTSHORT (C_IN, p);
+   if (edns) {
+      *p++ = 0; // root name
+      PUTSHORT (T_OPT, p);
+      PUTSHORT (DNS_CACHE_MAX_ANSWER, p);
+      PUTLONG (0, p); // extended rcode, version and flags
+      PUTSHORT (0, p);
+   }
+   return p - query;
+}
+
+// Adds `name` with `type`, or as A and AAAA for type 0, unless it is there already or the list is full
+static void
+add_names (dns_prefetch_t *prefetch,
+           int32_t *slots,
+           uint32_t mask,
+           const dns_policy_t *policy,
+           const dns_name_t *name,
+           uint16_t type,
+           int edns)
+{
+   uint16_t types[2] = {type, 0};
+   if (type == 0) {
+      types[0] = T_A;
+      types[1] = T_AAAA;
+   }
+   for (int t = 0; t < 2 && types[t] != 0 && prefetch->count < DNS_PREFETCH_MAX_NAMES; ++t) {
+      dns_prefetch_name_t *entry = &prefetch->names[prefetch->count];
+      entry->length = build_query (entry->query, name, types[t], edns);
+      uint64_t hash = dns_name_hash (entry->query, entry->length);
+      uint32_t h = hash & mask;
+      for (; slots[h] != 0; h = (h + 1) & mask) {
+         const dns_prefetch_name_t *other = &prefetch->names[slots[h] - 1];
+         if (other->length == entry->length && memcmp (other->query, entry->query, entry->length) == 0) {
+            break;
+         }
+      }
+      if (slots[h] != 0) {
+         continue;
+      }
+      slots[h] = prefetch->count + 1;
+      entry->upstream = dns_policy_route_name (policy, name);
+      ++prefetch->count;
+   }
+}
+
+dns_prefetch_t *
+new_dns_prefetch (const dns_prefetch_conf_t *conf, const dns_policy_t *policy, dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   *lrc = kOk;
+   if (conf == NULL || policy == NULL || conf->queries_per_second <= 0 || conf->refresh_percent <= 0 ||
+       conf->refresh_percent >= 100) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+   dns_prefetch_t *prefetch = (dns_prefetch_t *) calloc (1, sizeof (*prefetch));
+   prefetch->names = (dns_prefetch_name_t *) malloc (DNS_PREFETCH_MAX_NAMES * sizeof (*prefetch->names));
+   prefetch->heap = (int32_t *) malloc (DNS_PREFETCH_MAX_NAMES * sizeof (*prefetch->heap));
+   prefetch->refresh_percent = conf->refresh_percent;
+   prefetch->rate = conf->queries_per_second / 1e9;
+   prefetch->burst = conf->queries_per_second;
+   prefetch->tokens = prefetch->burst;
+   // every name twice at most, so the index stays at most half full
+   uint32_t mask = 4 * DNS_PREFETCH_MAX_NAMES - 1;
+   int32_t *slots = (int32_t *) calloc (mask + 1, sizeof (*slots));
+   dns_name_t name;
+   uint16_t type = 0;
+   for (int i = 0; i < conf->name_size; ++i) {
+      if (dns_prefetch_parse ((const char *) conf->names[i], &name, &type) != 0) {
+         *lrc = kInvalidInput;
+         free (slots);
+         destroy_dns_prefetch (prefetch);
+         return NULL;
+      }
+      add_names (prefetch, slots, mask, policy, &name, type, conf->edns);
+   }
+   // written by the previous run, a missing file only means there were no queries yet
+   FILE *f = conf->hot_path != NULL ? fopen ((const char *) conf->hot_path, "r") : NULL;
+   if (f != NULL) {
+      char line[PREFETCH_MAX_LINE];
+      while (fgets (line, sizeof (line), f) != NULL) {
+         if (line[0] != '#' && dns_prefetch_parse (line, &name, &type) == 0) {
+            add_names (prefetch, slots, mask, policy, &name, type, conf->edns);
+         }
+      }
+      fclose (f);
+   }
+   free (slots);
+   for (int i = 0; i < prefetch->count; ++i) {
+      prefetch->names[i].due_ns = 0;
+      heap_push (prefetch, i);
+   }
+   return prefetch;
+}
+
+void
+destroy_dns_prefetch (dns_prefetch_t *prefetch)
+{
+   if (prefetch == NULL) {
+      return;
+   }
+   free (prefetch->heap);
+   free (prefetch->names);
+   free (prefetch);
+}
+
+int
+dns_prefetch_next (dns_prefetch_t *prefetch, uint64_t now_ns)
+{
+   if (prefetch->heap_count == 0 || prefetch->names[prefetch->heap[0]].due_ns > now_ns) {
+      return -1;
+   }
+   if (now_ns > prefetch->refill_ns) {
+      prefetch->tokens += prefetch->refill_ns != 0 ? (now_ns - prefetch->refill_ns) * prefetch->rate : 0;
+      prefetch->tokens = prefetch->tokens < prefetch->burst ? prefetch->tokens : prefetch->burst;
+      prefetch->refill_ns = now_ns;
+   }
+   if (prefetch->tokens < 1) {
+      return -1;
+   }
+   prefetch->tokens -= 1;
+   ++prefetch->sent;
+   return heap_pop (prefetch);
+}
+
+void
+dns_prefetch_done (dns_prefetch_t *prefetch, int index, uint32_t ttl, uint64_t now_ns)
+{
+   uint64_t wait_s = DNS_PREFETCH_RETRY_S;
+   if (ttl > 0) {
+      wait_s = (uint64_t) ttl * prefetch->refresh_percent / 100;
+      wait_s = wait_s > DNS_PREFETCH_MIN_S ? wait_s : DNS_PREFETCH_MIN_S;
+      ++prefetch->refreshed;
+   } else {
+      ++prefetch->failed;
+   }
+   prefetch->names[index].due_ns = now_ns + wait_s * 1000000000ull;
+   heap_push (prefetch, index);
+}
+
+dns_rc_t
+dns_prefetch_save_hot (const char *path, const dns_hh_top_t *top, int count)
+{
+   if (path == NULL || (top == NULL && count > 0)) {
+      return kInvalidInput;
+   }
+   size_t tmp_len = strlen (path) + sizeof (".tmp");
+   char *tmp = (char *) malloc (tmp_len);
+   snprintf (tmp, tmp_len, "%s.tmp", path);
+   FILE *f = fopen (tmp, "w");
+   if (f == NULL) {
+      free (tmp);
+      return kAborted;
+   }
+   int ok = fprintf (f, "# most queried names, prefetched at startup\n") > 0;
+   uint8_t orig[RR_NAME_MAX];
+   dns_name_t name;
+   char text[RR_NAME_MAX + 1];
+   for (int i = 0; i < count && ok; ++i) {
+      // the root and other names no query of a client would be prefetched for are left out
+      if (dns_name_fold (orig, &name, top[i].key, top[i].length) < 0 || name.labels == 0) {
+         continue;
+      }
+      dns_name_to_text (text, &name);
+      ok = fprintf (f, "%s\n", text) > 0;
+   }
+   ok = fclose (f) == 0 && ok;
+   if (ok && rename (tmp, path) == -1) {
+      ok = 0;
+   }
+   if (!ok) {
+      unlink (tmp);
+   }
+   free (tmp);
+   return ok ? kOk : kAborted;
+}
@@ -0,0 +1,155 @@
+#include "server/rate_limit.h"
+
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+static inline uint64_t
+mix64 (uint64_t x)
+{
+   x ^= x >> 33;
+   x *= 0xff51afd7ed558ccdull;
+   x ^= x >> 33;
+   x *= 0xc4ceb9fe1a85ec53ull;
+   x ^= x >> 33;
+   return x;
+}
+
+// Hash of the masked client prefix and the response class
+static uint64_t
+rate_limit_key (const rate_limit_t *rl, const struct sockaddr_storage *client, rate_limit_class_t cls)
+{
+   const uint8_t *addr = NULL;
+   int prefix = 0;
+   if (client->ss_family == AF_INET6) {
+      addr = (const uint8_t *) &((const struct sockaddr_in6 *) client)->sin6_addr;
+      prefix = rl->ipv6_prefix;
+   } else {
+      addr = (const uint8_t *) &((const struct sockaddr_in *) client)->sin_addr;
+      prefix = rl->ipv4_prefix;
+   }
+   uint64_t h = ((uint64_t) client->ss_family << 56) | ((uint64_t) cls << 48);
+   for (int i = 0; prefix > 0; ++i, prefix -= 8) {
+      uint8_t b = prefix >= 8 ? addr[i] : addr[i] & (uint8_t) (0xff << (8 - prefix));
+      h = mix64 (h ^ b ^ ((uint64_t) i << 8));
+   }
+   h = mix64 (h);
+   return h != 0 ? h : 1;
+}
+
+rate_limit_t *
+new_rate_limit (const dns_rate_limit_conf_t *conf, dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   *lrc = kOk;
+
+   if (conf == NULL || conf->responses_per_second <= 0) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+
+   rate_limit_t *rl = (rate_limit_t *) calloc (1, sizeof (*rl));
+   uint64_t size = RATE_LIMIT_MAX_PROBE;
+   while (size < (uint64_t) (conf->table_size > 0 ? conf->table_size : RATE_LIMIT_DEFAULT_TABLE_SIZE)) {
+      size <<= 1;
+   }
+   rl->buckets = (rate_limit_bucket_t *) calloc (size, sizeof (*rl->buckets));
+   rl->mask = size - 1;
+   rl->stripes = (rate_limit_stripe_t *) aligned_alloc (
+      _Alignof (rate_limit_stripe_t), RATE_LIMIT_STRIPES * sizeof (*rl->stripes));
+   memset (rl->stripes, 0, RATE_LIMIT_STRIPES * sizeof (*rl->stripes));
+   for (int i = 0; i < RATE_LIMIT_STRIPES; ++i) {
+      pthread_mutex_init (&rl->stripes[i].lock, NULL);
+   }
+   rl->rate = (int64_t) conf->responses_per_second * 1000;
+   rl->burst = (int64_t) (conf->burst > 0 ? conf->burst : conf->responses_per_second) * 1000;
+   rl->ipv4_prefix = conf->ipv4_prefix > 0 ? conf->ipv4_prefix : RATE_LIMIT_DEFAULT_IPV4_PREFIX;
+   rl->ipv6_prefix = conf->ipv6_prefix > 0 ? conf->ipv6_prefix : RATE_LIMIT_DEFAULT_IPV6_PREFIX;
+   rl->action = conf->action;
+   return rl;
+}
+
+void
+destroy_rate_limit (rate_limit_t *rl)
+{
+   if (rl == NULL) {
+      return;
+   }
+   for (int i = 0; i < RATE_LIMIT_STRIPES; ++i) {
+      pthread_mutex_destroy (&rl->stripes[i].lock);
+   }
+   free (rl->stripes);
+   free (rl->buckets);
+   free (rl);
+}
+
+int
+rate_limit_allow (rate_limit_t *rl, const struct sockaddr_storage *client, rate_limit_class_t cls, uint64_t now_ns)
+{
+   uint64_t key = rate_limit_key (rl, client, cls);
+   uint64_t group = key & rl->mask & ~(uint64_t) (RATE_LIMIT_MAX_PROBE - 1);
+   rate_limit_stripe_t *stripe = &rl->stripes[(group / RATE_LIMIT_MAX_PROBE) % RATE_LIMIT_STRIPES];
+   pthread_mutex_lock (&stripe->lock);
+   rate_limit_bucket_t *bucket = NULL;
+   rate_limit_bucket_t *stalest = NULL;
+   for (int i = 0; i < RATE_LIMIT_MAX_PROBE; ++i) {
+      rate_limit_bucket_t *b = &rl->buckets[group | ((key + i) & (RATE_LIMIT_MAX_PROBE - 1))];
+      if (b->key == key) {
+         bucket = b;
+         break;
+      }
+      if (b->key == 0) {
+         stalest = b;
+         break;
+      }
+      if (stalest == NULL || b->stamp_ns < stalest->stamp_ns) {
+         stalest = b;
+      }
+   }
+
+   if (bucket == NULL) {
+      // a recycled bucket had been refilling since its last use, so starting full loses little state
+      bucket = stalest;
+      bucket->key = key;
+      bucket->stamp_ns = now_ns;
+      bucket->tokens = rl->burst;
+   } else if (now_ns > bucket->stamp_ns) {
+      // the time that fills an empty bucket is all that can count, the cap only keeps the product from overflowing
+      uint64_t elapsed = now_ns - bucket->stamp_ns;
+      uint64_t fill_ns = (uint64_t) rl->burst * 1000000000ull / rl->rate + 1;
+      int64_t refill = (int64_t) ((elapsed < fill_ns ? elapsed : fill_ns) * rl->rate / 1000000000ull);
+      if (bucket->tokens + refill >= rl->burst) {
+         bucket->tokens = rl->burst;
+         bucket->stamp_ns = now_ns;
+      } else {
+         // only the time turned into tokens is taken, the rest of it counts towards the next one
+         bucket->tokens += refill;
+         bucket->stamp_ns += (uint64_t) refill * 1000000000ull / rl->rate;
+      }
+   }
+
+   int allowed = bucket->tokens >= 1000;
+   if (allowed) {
+      bucket->tokens -= 1000;
+   } else {
+      ++stripe->limited;
+   }
+   pthread_mutex_unlock (&stripe->lock);
+   return allowed;
+}
+
+uint64_t
+rate_limit_limited (rate_limit_t *rl)
+{
+   uint64_t limited = 0;
+   for (int i = 0; i < RATE_LIMIT_STRIPES; ++i) {
+      pthread_mutex_lock (&rl->stripes[i].lock);
+      limited += rl->stripes[i].limited;
+      pthread_mutex_unlock (&rl->stripes[i].lock);
+   }
+   return limited;
+}
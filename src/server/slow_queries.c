@@ -0,0 +1,229 @@
+#include "server/slow_queries.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PCAP_MAGIC_NS 0xa1b23c4d /* nanosecond timestamps */
+#define PCAP_LINKTYPE_RAW 101    /* packets start with the IP header, version 4 or 6 */
+#define PCAP_SNAPLEN 65535
+
+const char *dns_slow_reason_desc[] = {"slow", "sampled", "timeout"};
+
+dns_slow_queries_t *
+new_dns_slow_queries (const dns_slow_queries_conf_t *conf, dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   *lrc = kOk;
+   if (conf == NULL || conf->size <= 0 || conf->size > DNS_SLOW_QUERIES_MAX_SIZE || conf->threshold_ms < 0 ||
+       conf->sample_rate < 0) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+   dns_slow_queries_t *slow = (dns_slow_queries_t *) calloc (1, sizeof (*slow));
+   slow->entries = (dns_slow_query_t *) malloc (conf->size * sizeof (*slow->entries));
+   slow->size = conf->size;
+   slow->threshold_ns = (uint64_t) conf->threshold_ms * 1000000ull;
+   slow->sample_rate = conf->sample_rate;
+   pthread_mutex_init (&slow->lock, NULL);
+   return slow;
+}
+
+void
+destroy_dns_slow_queries (dns_slow_queries_t *slow)
+{
+   if (slow == NULL) {
+      return;
+   }
+   pthread_mutex_destroy (&slow->lock);
+   free (slow->entries);
+   free (slow);
+}
+
+void
+dns_slow_queries_add (dns_slow_queries_t *slow,
+                      const dns_slow_info_t *info,
+                      const uint8_t *query,
+                      int query_length,
+                      const uint8_t *answer,
+                      int answer_length)
+{
+   const int query_max = sizeof (slow->entries->query);
+   const int answer_max = sizeof (slow->entries->answer);
+   query_length = query_length < query_max ? query_length : query_max;
+   answer_length = answer_length < answer_max ? answer_length : answer_max;
+   pthread_mutex_lock (&slow->lock);
+   dns_slow_query_t *entry = &slow->entries[slow->next];
+   slow->next = (slow->next + 1) % slow->size;
+   slow->count += slow->count < slow->size;
+   ++slow->captured;
+   entry->info = *info;
+   entry->query_length = query_length;
+   entry->answer_length = answer_length;
+   memcpy (entry->query, query, query_length);
+   memcpy (entry->answer, answer, answer_length);
+   pthread_mutex_unlock (&slow->lock);
+}
+
+dns_slow_query_t *
+dns_slow_queries_snapshot (dns_slow_queries_t *slow, int *count)
+{
+   pthread_mutex_lock (&slow->lock);
+   *count = slow->count;
+   dns_slow_query_t *copy = (dns_slow_query_t *) malloc ((slow->count > 0 ? slow->count : 1) * sizeof (*copy));
+   int first = (slow->next - slow->count + slow->size) % slow->size;
+   for (int i = 0; i < slow->count; ++i) {
+      copy[i] = slow->entries[(first + i) % slow->size];
+   }
+   pthread_mutex_unlock (&slow->lock);
+   return copy;
+}
+
+// Address bytes and port of `sa` in network order, returns the address length
+static int
+endpoint (const struct sockaddr_storage *sa, const uint8_t **addr, uint16_t *port)
+{
+   if (sa->ss_family == AF_INET6) {
+      const struct sockaddr_in6 *sa6 = (const struct sockaddr_in6 *) sa;
+      *addr = sa6->sin6_addr.s6_addr;
+      *port = sa6->sin6_port;
+      return 16;
+   }
+   const struct sockaddr_in *sa4 = (const struct sockaddr_in *) sa;
+   *addr = (const uint8_t *) &sa4->sin_addr;
+   *port = sa4->sin_port;
+   return 4;
+}
+
+static uint32_t
+sum16 (uint32_t sum, const uint8_t *p, int n)
+{
+   for (int i = 0; i + 1 < n; i += 2) {
+      sum += (uint32_t) p[i] << 8 | p[i + 1];
+   }
+   if (n & 1) {
+      sum += (uint32_t) p[n - 1] << 8;
+   }
+   return sum;
+}
+
+static uint16_t
+fold16 (uint32_t sum)
+{
+   while (sum >> 16) {
+      sum = (sum & 0xffff) + (sum >> 16);
+   }
+   return (uint16_t) ~sum;
+}
+
+// One UDP datagram in an IPv4 or IPv6 header, with checksums so tools do not flag it
+static void
+write_packet (FILE *out,
+              uint64_t ts_ns,
+              int addr_len,
+              const uint8_t *src,
+              uint16_t sport,
+              const uint8_t *dst,
+              uint16_t dport,
+              const uint8_t *payload,
+              int length)
+{
+   uint8_t packet[40 + 8 + DNS_IO_BUFFER_SIZE];
+   int ip_len = addr_len == 4 ? 20 : 40;
+   int udp_len = 8 + length;
+   memset (packet, 0, ip_len + 8);
+   if (addr_len == 4) {
+      packet[0] = 0x45;
+      packet[2] = (ip_len + udp_len) >> 8;
+      packet[3] = (ip_len + udp_len) & 0xff;
+      packet[8] = 64;
+      packet[9] = IPPROTO_UDP;
+      memcpy (packet + 12, src, 4);
+      memcpy (packet + 16, dst, 4);
+      uint16_t check = fold16 (sum16 (0, packet, 20));
+      packet[10] = check >> 8;
+      packet[11] = check & 0xff;
+   } else {
+      packet[0] = 0x60;
+      packet[4] = udp_len >> 8;
+      packet[5] = udp_len & 0xff;
+      packet[6] = IPPROTO_UDP;
+      packet[7] = 64;
+      memcpy (packet + 8, src, 16);
+      memcpy (packet + 24, dst, 16);
+   }
+   uint8_t *udp = packet + ip_len;
+   memcpy (udp, &sport, 2);
+   memcpy (udp + 2, &dport, 2);
+   udp[4] = udp_len >> 8;
+   udp[5] = udp_len & 0xff;
+   memcpy (udp + 8, payload, length);
+   // pseudo header: addresses, protocol and UDP length
+   uint32_t sum = sum16 (sum16 (0, src, addr_len), dst, addr_len) + IPPROTO_UDP + udp_len;
+   uint16_t check = fold16 (sum16 (sum, udp, udp_len));
+   check = check != 0 ? check : 0xffff;
+   udp[6] = check >> 8;
+   udp[7] = check & 0xff;
+
+   uint32_t record[4] = {(uint32_t) (ts_ns / 1000000000ull),
+                         (uint32_t) (ts_ns % 1000000000ull),
+                         (uint32_t) (ip_len + udp_len),
+                         (uint32_t) (ip_len + udp_len)};
+   fwrite (record, sizeof (record), 1, out);
+   fwrite (packet, ip_len + udp_len, 1, out);
+}
+
+void
+dns_slow_queries_write_pcap (const dns_slow_query_t *entries,
+                             int count,
+                             const struct sockaddr_storage *server,
+                             FILE *out)
+{
+   // in host order, readers tell it by the magic
+   struct {
+      uint32_t magic;
+      uint16_t major;
+      uint16_t minor;
+      int32_t zone;
+      uint32_t sigfigs;
+      uint32_t snaplen;
+      uint32_t linktype;
+   } header = {PCAP_MAGIC_NS, 2, 4, 0, 0, PCAP_SNAPLEN, PCAP_LINKTYPE_RAW};
+   fwrite (&header, sizeof (header), 1, out);
+   static const uint8_t any[16] = {0};
+   for (int i = 0; i < count; ++i) {
+      const dns_slow_info_t *info = &entries[i].info;
+      const uint8_t *client = NULL;
+      const uint8_t *self = NULL;
+      uint16_t client_port = 0;
+      uint16_t self_port = 0;
+      int addr_len = endpoint (&info->client, &client, &client_port);
+      // a listening address of the other family shows as the unspecified address
+      if (endpoint (server, &self, &self_port) != addr_len) {
+         self = any;
+      }
+      write_packet (out,
+                    info->answered_ns - info->total_ns,
+                    addr_len,
+                    client,
+                    client_port,
+                    self,
+                    self_port,
+                    entries[i].query,
+                    entries[i].query_length);
+      write_packet (out,
+                    info->answered_ns,
+                    addr_len,
+                    self,
+                    self_port,
+                    client,
+                    client_port,
+                    entries[i].answer,
+                    entries[i].answer_length);
+   }
+}
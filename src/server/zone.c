@@ -0,0 +1,477 @@
+#include "server/zone.h"
+#include "dns/dns-name.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ZONE_TABLE_MIN_SLOTS 16
+#define ZONE_RR_FIXED_LEN 10 /* type, class, ttl and rdlength */
+
+struct zone_entry {
+   dns_name_t owner;
+   uint32_t ttl;
+   uint32_t rdata; /* offset in the rdata buffer */
+   uint16_t rdlength;
+   uint16_t type;
+   uint8_t synthetic; /* PTR derived from an A or AAAA record */
+   int order;
+};
+typedef struct zone_entry zone_entry_t;
+
+struct zone_buf {
+   uint8_t *data;
+   size_t length;
+   size_t cap;
+};
+typedef struct zone_buf zone_buf_t;
+
+static uint32_t
+buf_append (zone_buf_t *buf, const uint8_t *src, size_t length)
+{
+   while (buf->length + length > buf->cap) {
+      buf->cap = buf->cap == 0 ? 4096 : buf->cap * 2;
+      buf->data = (uint8_t *) realloc (buf->data, buf->cap);
+   }
+   uint32_t off = buf->length;
+   memcpy (buf->data + off, src, length);
+   buf->length += length;
+   return off;
+}
+
+static int
+encode_name (const char *text, uint8_t *dst)
+{
+   // "." alone is the root name, a bare label list for every other name
+   dns_name_t name;
+   if (dns_name_from_text (&name, strcmp (text, ".") == 0 ? "" : text) < 0) {
+      return -1;
+   }
+   memcpy (dst, name.wire, name.length);
+   return name.length;
+}
+
+int
+dns_zone_encode_rdata (uint16_t type, const char *data, uint8_t *rdata)
+{
+   if (data == NULL || rdata == NULL) {
+      return -1;
+   }
+   switch (type) {
+   case T_A:
+      return inet_pton (AF_INET, data, rdata) == 1 ? 4 : -1;
+   case T_AAAA:
+      return inet_pton (AF_INET6, data, rdata) == 1 ? 16 : -1;
+   case T_CNAME:
+   case T_PTR:
+      return encode_name (data, rdata);
+   case T_TXT: {
+      // split into character strings of at most 255 bytes, an empty text is one empty string
+      size_t len = strlen (data);
+      if (len + len / 255 + 1 > DNS_UDP_MAX_PACKLEN) {
+         return -1;
+      }
+      int d = 0;
+      do {
+         size_t chunk = len < 255 ? len : 255;
+         rdata[d++] = chunk;
+         memcpy (rdata + d, data, chunk);
+         d += chunk;
+         data += chunk;
+         len -= chunk;
+      } while (len > 0);
+      return d;
+   }
+   case T_SRV: {
+      unsigned priority = 0;
+      unsigned weight = 0;
+      unsigned port = 0;
+      char target[RR_NAME_MAX + 1] = {0};
+      int end = 0;
+      if (sscanf (data, "%u %u %u %255s %n", &priority, &weight, &port, target, &end) != 4 || data[end] != 0 ||
+          priority > 0xffff || weight > 0xffff || port > 0xffff) {
+         return -1;
+      }
+      uint8_t *d = rdata;
+      PUTSHORT (priority, d);
+      PUTSHORT (weight, d);
+      PUTSHORT (port, d);
+      int len = encode_name (target, d);
+      return len < 0 ? -1 : len + 6;
+   }
+   default:
+      return -1;
+   }
+}
+
+// Owner of the PTR record pointing back at the name of an A or AAAA record
+static int
+reverse_name (dns_name_t *name, const uint8_t *addr, int addr_len)
+{
+   char text[RR_NAME_MAX] = {0};
+   int t = 0;
+   if (addr_len == 4) {
+      t = snprintf (text, sizeof (text), "%u.%u.%u.%u.in-addr.arpa", addr[3], addr[2], addr[1], addr[0]);
+   } else {
+      static const char hex[] = "0123456789abcdef";
+      for (int i = 15; i >= 0; --i) {
+         text[t++] = hex[addr[i] & 0xf];
+         text[t++] = '.';
+         text[t++] = hex[addr[i] >> 4];
+         text[t++] = '.';
+      }
+      memcpy (text + t, "ip6.arpa", sizeof ("ip6.arpa"));
+   }
+   return dns_name_from_text (name, text);
+}
+
+// Groups the entries by owner and type, configured records before synthesized ones, then in configuration order
+static int
+compare_entries (const void *a, const void *b)
+{
+   const zone_entry_t *ea = (const zone_entry_t *) a;
+   const zone_entry_t *eb = (const zone_entry_t *) b;
+   if (ea->owner.length != eb->owner.length) {
+      return ea->owner.length - eb->owner.length;
+   }
+   int c = memcmp (ea->owner.wire, eb->owner.wire, ea->owner.length);
+   if (c != 0) {
+      return c;
+   }
+   if (ea->type != eb->type) {
+      return ea->type - eb->type;
+   }
+   if (ea->synthetic != eb->synthetic) {
+      return ea->synthetic - eb->synthetic;
+   }
+   return ea->order - eb->order;
+}
+
+static dns_zone_node_t *
+find_node (const dns_zone_t *zone, const uint8_t *wire, int length, uint64_t hash)
+{
+   for (uint32_t i = hash & zone->mask;; i = (i + 1) & zone->mask) {
+      dns_zone_node_t *node = &zone->nodes[i];
+      if (!node->used) {
+         return NULL;
+      }
+      const uint8_t *name = zone->data + node->name;
+      if (node->hash == hash && name[0] == length && memcmp (name + 1, wire, length) == 0) {
+         return node;
+      }
+   }
+}
+
+static dns_zone_node_t *
+insert_node (dns_zone_t *zone, zone_buf_t *data, const uint8_t *wire, int length)
+{
+   uint64_t hash = dns_name_hash (wire, length);
+   dns_zone_node_t *node = find_node (zone, wire, length, hash);
+   if (node != NULL) {
+      return node;
+   }
+   uint32_t i = hash & zone->mask;
+   while (zone->nodes[i].used) {
+      i = (i + 1) & zone->mask;
+   }
+   node = &zone->nodes[i];
+   uint8_t len = length;
+   node->name = buf_append (data, &len, 1);
+   buf_append (data, wire, length);
+   zone->data = data->data;
+   node->hash = hash;
+   node->used = 1;
+   ++zone->node_count;
+   return node;
+}
+
+// Whether the name is one of the domains or below one
+static int
+in_domains (const dns_zone_t *zone, const uint8_t *wire, int length)
+{
+   for (int off = 0; wire[off] != 0; off += wire[off] + 1) {
+      const dns_zone_node_t *node = find_node (zone, wire + off, length - off, dns_name_hash (wire + off, length - off));
+      if (node != NULL && node->apex) {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+// Adds the rrsets of the entries of one owner
+static dns_rc_t
+add_owner (dns_zone_t *zone, zone_buf_t *data, const zone_buf_t *rdata, const zone_entry_t *e, int count, int *rrsets)
+{
+   dns_zone_node_t *node = insert_node (zone, data, e->owner.wire, e->owner.length);
+   node->rrsets = *rrsets;
+   node->rrset_count = 0;
+   int cname = 0;
+   for (int i = 0; i < count;) {
+      int j = i;
+      uint32_t ttl = e[i].ttl;
+      while (j < count && e[j].type == e[i].type) {
+         ttl = e[j].ttl < ttl ? e[j].ttl : ttl;
+         ++j;
+      }
+      // configured records of a type sort before the synthesized ones, which are only used when there are none; an
+      // address with several names gets the PTR of the first one only
+      int last = i + 1;
+      while (!e[i].synthetic && last < j && !e[last].synthetic) {
+         ++last;
+      }
+      dns_zone_rrset_t *rrset = &zone->rrsets[(*rrsets)++];
+      rrset->type = e[i].type;
+      rrset->count = 0;
+      rrset->data = data->length;
+      for (int k = i; k < last; ++k) {
+         const uint8_t *rd = rdata->data + e[k].rdata;
+         int dup = 0;
+         for (int p = i; p < k && !dup; ++p) {
+            dup = e[p].rdlength == e[k].rdlength && memcmp (rdata->data + e[p].rdata, rd, e[k].rdlength) == 0;
+         }
+         if (dup) {
+            continue;
+         }
+         uint8_t fixed[ZONE_RR_FIXED_LEN];
+         uint8_t *f = fixed;
+         PUTSHORT (e[k].type, f);
+         PUTSHORT (C_IN, f);
+         PUTLONG (ttl, f);
+         PUTSHORT (e[k].rdlength, f);
+         buf_append (data, fixed, sizeof (fixed));
+         buf_append (data, rd, e[k].rdlength);
+         ++rrset->count;
+      }
+      rrset->length = data->length - rrset->data;
+      cname += rrset->type == T_CNAME ? rrset->count : 0;
+      ++node->rrset_count;
+      i = j;
+   }
+   zone->data = data->data;
+   // a CNAME owner can not have any other record
+   if (cname > 1 || (cname == 1 && node->rrset_count > 1)) {
+      return kDataMalformed;
+   }
+   return kOk;
+}
+
+dns_zone_t *
+new_dns_zone (const dns_zone_conf_t *conf, dns_rc_t *rc)
+{
+   dns_rc_t *lrc = rc;
+   if (rc == NULL) {
+      dns_rc_t trc;
+      lrc = &trc;
+   }
+   *lrc = kOk;
+
+   if (conf == NULL) {
+      *lrc = kInvalidInput;
+      return NULL;
+   }
+
+   zone_entry_t *entries = (zone_entry_t *) calloc (conf->record_size * 2 + 1, sizeof (*entries));
+   zone_buf_t rdata = {0};
+   zone_buf_t data = {0};
+   int count = 0;
+   int labels = 0;
+   for (int i = 0; i < conf->record_size && *lrc == kOk; ++i) {
+      const dns_record_conf_t *rec = &conf->records[i];
+      zone_entry_t *e = &entries[count++];
+      uint8_t rd[DNS_UDP_MAX_PACKLEN];
+      int rdlength = dns_zone_encode_rdata (rec->type, (const char *) rec->data, rd);
+      if (rec->name == NULL || dns_name_from_text (&e->owner, (const char *) rec->name) < 0 || rdlength < 0) {
+         *lrc = kDataMalformed;
+         break;
+      }
+      e->type = rec->type;
+      e->ttl = rec->ttl;
+      e->rdata = buf_append (&rdata, rd, rdlength);
+      e->rdlength = rdlength;
+      e->order = i;
+      labels += e->owner.labels;
+
+      if (conf->synthesize_ptr && (rec->type == T_A || rec->type == T_AAAA)) {
+         zone_entry_t *ptr = &entries[count++];
+         reverse_name (&ptr->owner, rd, rdlength);
+         ptr->type = T_PTR;
+         ptr->ttl = rec->ttl;
+         ptr->rdata = buf_append (&rdata, e->owner.wire, e->owner.length);
+         ptr->rdlength = e->owner.length;
+         ptr->synthetic = 1;
+         ptr->order = i;
+         labels += ptr->owner.labels;
+      }
+   }
+
+   dns_zone_t *zone = (dns_zone_t *) calloc (1, sizeof (*zone));
+   do {
+      if (*lrc != kOk) {
+         break;
+      }
+      qsort (entries, count, sizeof (*entries), compare_entries);
+
+      // every entry and each of its parents may become a node
+      uint32_t slots = ZONE_TABLE_MIN_SLOTS;
+      while (slots < (uint32_t) (count + labels + conf->domain_size) * 2) {
+         slots <<= 1;
+      }
+      zone->nodes = (dns_zone_node_t *) calloc (slots, sizeof (*zone->nodes));
+      zone->mask = slots - 1;
+      zone->rrsets = (dns_zone_rrset_t *) calloc (count + 1, sizeof (*zone->rrsets));
+
+      for (int i = 0; i < conf->domain_size; ++i) {
+         dns_name_t domain;
+         if (conf->domains[i] == NULL || dns_name_from_text (&domain, (const char *) conf->domains[i]) < 0 ||
+             domain.labels == 0) {
+            *lrc = kDataMalformed;
+            break;
+         }
+         insert_node (zone, &data, domain.wire, domain.length)->apex = 1;
+      }
+      int rrsets = 0;
+      for (int i = 0; i < count && *lrc == kOk;) {
+         int j = i + 1;
+         while (j < count && entries[j].owner.length == entries[i].owner.length &&
+                memcmp (entries[j].owner.wire, entries[i].owner.wire, entries[i].owner.length) == 0) {
+            ++j;
+         }
+         *lrc = add_owner (zone, &data, &rdata, &entries[i], j - i, &rrsets);
+         i = j;
+      }
+      if (*lrc != kOk) {
+         break;
+      }
+      // names between a domain and the records below it exist too, they get NODATA instead of NXDOMAIN
+      for (int i = 0; i < count; ++i) {
+         const dns_name_t *owner = &entries[i].owner;
+         for (int k = 1; k < owner->labels; ++k) {
+            const uint8_t *wire = owner->wire + owner->offsets[k];
+            int length = owner->length - owner->offsets[k];
+            if (!in_domains (zone, wire, length)) {
+               break;
+            }
+            insert_node (zone, &data, wire, length);
+         }
+      }
+      zone->data = data.data;
+   } while (0);
+   free (entries);
+   free (rdata.data);
+   if (*lrc != kOk) {
+      zone->data = data.data;
+      destroy_dns_zone (zone);
+      return NULL;
+   }
+   return zone;
+}
+
+void
+destroy_dns_zone (dns_zone_t *zone)
+{
+   if (zone == NULL) {
+      return;
+   }
+   free (zone->nodes);
+   free (zone->rrsets);
+   free (zone->data);
+   free (zone);
+}
+
+// Appends every record of `rrset` owned by the name at `owner`, returns the new length or -1 when it does not fit
+static int
+put_rrset (const dns_zone_t *zone, const dns_zone_rrset_t *rrset, uint16_t owner, uint8_t *resp, int len)
+{
+   const uint8_t *rr = zone->data + rrset->data;
+   const uint8_t *end = rr + rrset->length;
+   while (rr < end) {
+      int rr_len = ZONE_RR_FIXED_LEN + ((rr[8] << 8) | rr[9]);
+      if (len + 2 + rr_len > DNS_UDP_MAX_PACKLEN) {
+         return -1;
+      }
+      resp[len++] = POINTER_MASK | (owner >> 8);
+      resp[len++] = owner & 0xff;
+      memcpy (resp + len, rr, rr_len);
+      len += rr_len;
+      rr += rr_len;
+   }
+   return len;
+}
+
+int
+dns_zone_answer (const dns_zone_t *zone, const dns_h_t *dht, uint8_t *resp)
+{
+   if (zone == NULL || dht == NULL || resp == NULL || dht->header.qdcount != 1 ||
+       OPCODE (&dht->header) != QUERY) {
+      return 0;
+   }
+   const dns_qrr_t *q = &dht->qrs[0];
+   if (q->class != C_IN && q->class != C_ANY) {
+      return 0;
+   }
+   const dns_zone_node_t *node = find_node (zone, q->key.wire, q->key.length, q->key.hash);
+   if (node == NULL && !in_domains (zone, q->key.wire, q->key.length)) {
+      return 0;
+   }
+
+   uint8_t *cur = resp;
+   PUTSHORT (dht->header.id, cur);
+   *cur++ = (dht->header.hb3 & (HB3_OPCODE | HB3_RD)) | HB3_QR | HB3_AA;
+   *cur++ = HB4_RA | RCODE_NOERROR;
+   PUTSHORT (1, cur);
+   memset (cur, 0, 6); // ancount, nscount and arcount
+   cur += 6;
+   memcpy (cur, q->name, q->key.length);
+   cur += q->key.length;
+   PUTSHORT (q->type, cur);
+   PUTSHORT (q->class, cur);
+   const int qend = cur - resp;
+
+   int len = qend;
+   int answers = 0;
+   uint16_t owner = sizeof (dns_header_t); // the question name
+   for (int chain = 0;; ++chain) {
+      if (node == NULL) {
+         SET_RCODE ((dns_header_t *) resp, RCODE_NXDOMAIN);
+         break;
+      }
+      const dns_zone_rrset_t *cname = NULL;
+      int matched = 0;
+      for (int i = 0; i < node->rrset_count && len > 0; ++i) {
+         const dns_zone_rrset_t *rrset = &zone->rrsets[node->rrsets + i];
+         if (rrset->type == q->type || q->type == T_ANY) {
+            len = put_rrset (zone, rrset, owner, resp, len);
+            answers += rrset->count;
+            matched = 1;
+         } else if (rrset->type == T_CNAME) {
+            cname = rrset;
+         }
+      }
+      if (len < 0 || matched || cname == NULL || chain == DNS_ZONE_MAX_CHAIN) {
+         break;
+      }
+      // the records of the target are owned by the name inside the CNAME rdata
+      uint16_t target_owner = len + 2 + ZONE_RR_FIXED_LEN;
+      len = put_rrset (zone, cname, owner, resp, len);
+      if (len < 0) {
+         break;
+      }
+      owner = target_owner;
+      ++answers;
+      const uint8_t *target = zone->data + cname->data + ZONE_RR_FIXED_LEN;
+      int target_len = cname->length - ZONE_RR_FIXED_LEN;
+      node = find_node (zone, target, target_len, dns_name_hash (target, target_len));
+      if (node == NULL && !in_domains (zone, target, target_len)) {
+         // the chain leaves the local names, the client resolves the rest
+         break;
+      }
+   }
+   dns_header_t *hdr = (dns_header_t *) resp;
+   if (len < 0) {
+      hdr->hb3 |= HB3_TC;
+      return qend;
+   }
+   hdr->ancount = htons (answers);
+   return len;
+}
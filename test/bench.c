@@ -0,0 +1,562 @@
+// Microbenchmarks for the packet parser, serializer and filter matching, and the loopback round trip of dns_io.
+//
+// Every result is printed as one JSON object per line (ns/op, allocations/op, cycles/op), so runs of
+// different commits can be diffed or loaded into a spreadsheet directly.
+// Allocations are counted by wrapping malloc/calloc/realloc at link time (-Wl,--wrap=...).
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/perf_event.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "dns/dns-name.h"
+#include "dns/dns-parse.h"
+#include "dns/dns-protocol.h"
+#include "server/dns_core.h"
+#include "server/dns_io.h"
+
+static unsigned long long alloc_count = 0;
+
+void *__real_malloc (size_t size);
+void *__real_calloc (size_t nmemb, size_t size);
+void *__real_realloc (void *ptr, size_t size);
+
+void *
+__wrap_malloc (size_t size)
+{
+   ++alloc_count;
+   return __real_malloc (size);
+}
+
+void *
+__wrap_calloc (size_t nmemb, size_t size)
+{
+   ++alloc_count;
+   return __real_calloc (nmemb, size);
+}
+
+void *
+__wrap_realloc (void *ptr, size_t size)
+{
+   ++alloc_count;
+   return __real_realloc (ptr, size);
+}
+
+typedef void (*bench_fn_t) (void *ctx);
+
+struct bench_opts {
+   const char *label;
+   const char *only;
+   double min_time_sec;
+   int max_filters;
+};
+typedef struct bench_opts bench_opts_t;
+
+struct bench_packet {
+   const char *name;
+   char text[RR_NAME_MAX]; /* first question, dotted */
+   uint8_t data[DNS_UDP_MAX_PACKLEN];
+   int length;
+   dns_h_t *parsed;
+};
+typedef struct bench_packet bench_packet_t;
+
+struct bench_filters {
+   dns_filter_conf_t *filters;
+   int size;
+   dns_filter_set_t set;
+   dns_filter_view_t view; /* of `set`, without overlay */
+   dns_h_t *query;
+};
+typedef struct bench_filters bench_filters_t;
+
+// Loopback echo server of the udp_echo bench, answering through dns_io like a worker does
+struct bench_echo {
+   dns_io_t *io;
+   volatile int stop;
+};
+typedef struct bench_echo bench_echo_t;
+
+static int cycle_fd = -1;
+static const char *cycle_source = "none";
+static volatile uintptr_t sink;
+
+static uint64_t
+now_ns ()
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Prefers the hardware cycle counter, falls back to TSC ticks when perf events are not permitted
+static void
+init_cycles ()
+{
+   struct perf_event_attr attr;
+   memset (&attr, 0, sizeof (attr));
+   attr.type = PERF_TYPE_HARDWARE;
+   attr.size = sizeof (attr);
+   attr.config = PERF_COUNT_HW_CPU_CYCLES;
+   attr.exclude_kernel = 1;
+   attr.exclude_hv = 1;
+   cycle_fd = syscall (__NR_perf_event_open, &attr, 0, -1, -1, 0);
+   if (cycle_fd >= 0) {
+      cycle_source = "perf";
+      return;
+   }
+#if defined(__x86_64__) || defined(__i386__)
+   cycle_source = "tsc";
+#endif
+}
+
+static uint64_t
+read_cycles ()
+{
+   if (cycle_fd >= 0) {
+      uint64_t v = 0;
+      if (read (cycle_fd, &v, sizeof (v)) == sizeof (v)) {
+         return v;
+      }
+      return 0;
+   }
+#if defined(__x86_64__) || defined(__i386__)
+   return __rdtsc ();
+#else
+   return 0;
+#endif
+}
+
+static void
+run_bench (const bench_opts_t *opts, const char *bench, const char *cs, bench_fn_t fn, void *ctx)
+{
+   if (opts->only != NULL && strstr (bench, opts->only) == NULL) {
+      return;
+   }
+   // calibrate until one batch takes at least 1/10 of the requested time
+   uint64_t iters = 1;
+   uint64_t elapsed = 0;
+   for (;;) {
+      uint64_t start = now_ns ();
+      for (uint64_t i = 0; i < iters; ++i) {
+         fn (ctx);
+      }
+      elapsed = now_ns () - start;
+      if (elapsed >= opts->min_time_sec * 1e8 || iters >= (1ull << 40)) {
+         break;
+      }
+      iters *= 2;
+   }
+   if (elapsed > 0 && elapsed < opts->min_time_sec * 1e9) {
+      iters = (uint64_t) (iters * (opts->min_time_sec * 1e9 / elapsed)) + 1;
+   }
+
+   unsigned long long allocs = alloc_count;
+   uint64_t cycles = read_cycles ();
+   uint64_t start = now_ns ();
+   for (uint64_t i = 0; i < iters; ++i) {
+      fn (ctx);
+   }
+   elapsed = now_ns () - start;
+   cycles = read_cycles () - cycles;
+   allocs = alloc_count - allocs;
+
+   printf ("{\"label\":\"%s\",\"bench\":\"%s\",\"case\":\"%s\",\"iterations\":%llu,\"ns_per_op\":%.2f,"
+           "\"allocs_per_op\":%.2f,\"cycles_per_op\":%.1f,\"cycles_source\":\"%s\"}\n",
+           opts->label,
+           bench,
+           cs,
+           (unsigned long long) iters,
+           (double) elapsed / iters,
+           (double) allocs / iters,
+           (double) cycles / iters,
+           cycle_source);
+   fflush (stdout);
+}
+
+static int
+put_name (uint8_t *dst, const char *name)
+{
+   return convert_to_qname (dst, name, RR_NAME_MAX);
+}
+
+// Builds a query (or a response with `answers` compressed A records pointing at the first question)
+static int
+build_packet (uint8_t *buf, const char **names, int qcount, uint16_t qtype, int answers)
+{
+   uint8_t *cp = buf;
+   PUTSHORT (0x1234, cp);
+   *cp++ = answers > 0 ? HB3_QR | HB3_RD : HB3_RD;
+   *cp++ = answers > 0 ? HB4_RA : 0;
+   PUTSHORT (qcount, cp);
+   PUTSHORT (answers, cp);
+   PUTSHORT (0, cp);
+   PUTSHORT (0, cp);
+   for (int i = 0; i < qcount; ++i) {
+      cp += put_name (cp, names[i]);
+      PUTSHORT (qtype, cp);
+      PUTSHORT (C_IN, cp);
+   }
+   for (int i = 0; i < answers; ++i) {
+      *cp++ = POINTER_MASK;
+      *cp++ = sizeof (dns_header_t);
+      PUTSHORT (T_A, cp);
+      PUTSHORT (C_IN, cp);
+      PUTLONG (DEFAULT_TTL, cp);
+      PUTSHORT (4, cp);
+      *cp++ = 192;
+      *cp++ = 0;
+      *cp++ = 2;
+      *cp++ = i + 1;
+   }
+   return cp - buf;
+}
+
+static void
+bench_new_dns_h (void *ctx)
+{
+   const bench_packet_t *p = (const bench_packet_t *) ctx;
+   dns_h_t *dht = new_dns_h (p->data, p->length, NULL);
+   sink = (uintptr_t) dht;
+   destroy_dns_h (dht);
+}
+
+static void
+bench_new_dns_buffer (void *ctx)
+{
+   const bench_packet_t *p = (const bench_packet_t *) ctx;
+   int len = 0;
+   uint8_t *buf = new_dns_buffer (p->parsed, NULL, &len);
+   sink = (uintptr_t) buf + len;
+   free (buf);
+}
+
+static void
+bench_process_qname (void *ctx)
+{
+   const bench_packet_t *p = (const bench_packet_t *) ctx;
+   uint8_t name[RR_NAME_MAX];
+   sink = process_qname (name, p->data + sizeof (dns_header_t), RR_NAME_MAX);
+}
+
+static void
+bench_dns_name_fold (void *ctx)
+{
+   const bench_packet_t *p = (const bench_packet_t *) ctx;
+   uint8_t orig[RR_NAME_MAX];
+   dns_name_t name;
+   sink = dns_name_fold (orig, &name, p->data + sizeof (dns_header_t), p->length - sizeof (dns_header_t)) + name.hash;
+}
+
+static void
+bench_convert_to_qname (void *ctx)
+{
+   const bench_packet_t *p = (const bench_packet_t *) ctx;
+   uint8_t wire[RR_NAME_MAX + 2];
+   sink = convert_to_qname (wire, p->text, sizeof (wire));
+}
+
+static void
+bench_find_filter (void *ctx)
+{
+   const bench_filters_t *f = (const bench_filters_t *) ctx;
+   uint16_t q = 0;
+   sink = (uintptr_t) find_filter (&f->view, f->query, &q);
+}
+
+static dns_filter_conf_t *
+new_filter_set (int size)
+{
+   dns_filter_conf_t *filters = (dns_filter_conf_t *) calloc (size, sizeof (*filters));
+   char host[64];
+   for (int i = 0; i < size; ++i) {
+      int l = snprintf (host, sizeof (host), "tracker%d.ads%d.example", i, i % 97) + 1;
+      filters[i].host = (uint8_t *) malloc (l);
+      memcpy (filters[i].host, host, l);
+      filters[i].filter_type = DNS_FT_ALL;
+      // a mix similar to real blocklists: mostly exact entries, every 4th matches as substring
+      filters[i].match_type = (i % 4 == 0) ? DNS_MT_CONTAINS : DNS_MT_EXACT;
+      filters[i].action_type = DNS_AT_REFUSE;
+   }
+   return filters;
+}
+
+// wildcard and regex filters, all compiled into one automaton
+static dns_filter_conf_t *
+new_pattern_set (int size)
+{
+   dns_filter_conf_t *filters = (dns_filter_conf_t *) calloc (size, sizeof (*filters));
+   char host[64];
+   for (int i = 0; i < size; ++i) {
+      int l = (i % 2 == 0) ? snprintf (host, sizeof (host), "tracker%d.*.example", i)
+                           : snprintf (host, sizeof (host), "^ads%d-[a-z0-9]+\\.", i);
+      filters[i].host = (uint8_t *) malloc (l + 1);
+      memcpy (filters[i].host, host, l + 1);
+      filters[i].filter_type = DNS_FT_ALL;
+      filters[i].match_type = (i % 2 == 0) ? DNS_MT_WILDCARD : DNS_MT_REGEX;
+      filters[i].action_type = DNS_AT_REFUSE;
+   }
+   return filters;
+}
+
+static void
+destroy_filter_set (dns_filter_conf_t *filters, int size)
+{
+   for (int i = 0; i < size; ++i) {
+      free (filters[i].host);
+   }
+   free (filters);
+}
+
+static dns_h_t *
+new_query (const char *name)
+{
+   uint8_t buf[DNS_UDP_MAX_PACKLEN];
+   int len = build_packet (buf, &name, 1, T_A, 0);
+   return new_dns_h (buf, len, NULL);
+}
+
+static void *
+echo_loop (void *ctx)
+{
+   bench_echo_t *echo = (bench_echo_t *) ctx;
+   dns_datagram_t dgrams[DNS_IO_BATCH];
+   while (!echo->stop) {
+      int n = dns_io_receive (echo->io, dgrams, DNS_IO_BATCH, 100);
+      for (int i = 0; i < n; ++i) {
+         dns_io_send (echo->io, 0, dgrams[i].data, dgrams[i].length, &dgrams[i].addr, dgrams[i].addr_len);
+      }
+      dns_io_release (echo->io, dgrams, n > 0 ? n : 0);
+      dns_io_flush (echo->io);
+   }
+   return NULL;
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+   uint64_t x = *(const uint64_t *) a;
+   uint64_t y = *(const uint64_t *) b;
+   return x < y ? -1 : x > y;
+}
+
+// Round trips of a query to a dns_io echo server on loopback, one at a time, reported as percentiles since a
+// sleeping receiver shows in the tail more than in the mean
+static void
+bench_udp_echo (const bench_opts_t *opts, const char *cs, const bench_packet_t *p, int busy_poll)
+{
+   if (opts->only != NULL && strstr ("udp_echo", opts->only) == NULL) {
+      return;
+   }
+   struct sockaddr_in addr;
+   memset (&addr, 0, sizeof (addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+   socklen_t addr_len = sizeof (addr);
+   int server_fd = socket (AF_INET, SOCK_DGRAM, 0);
+   int client_fd = socket (AF_INET, SOCK_DGRAM, 0);
+   if (server_fd < 0 || client_fd < 0 || bind (server_fd, (struct sockaddr *) &addr, addr_len) != 0 ||
+       getsockname (server_fd, (struct sockaddr *) &addr, &addr_len) != 0 ||
+       connect (client_fd, (struct sockaddr *) &addr, addr_len) != 0) {
+      perror ("udp_echo");
+      close (server_fd);
+      close (client_fd);
+      return;
+   }
+   bench_echo_t echo = {new_dns_io (DNS_IO_SELECT, server_fd, NULL), 0};
+   // a long idle time keeps the server spinning between the round trips
+   if (busy_poll && dns_io_busy_poll (echo.io, 1000000, 50) != 0) {
+      perror ("SO_BUSY_POLL");
+   }
+   pthread_t thread;
+   pthread_create (&thread, NULL, echo_loop, &echo);
+
+   int cap = 1 << 16;
+   uint64_t *samples = (uint64_t *) malloc (cap * sizeof (*samples));
+   int count = 0;
+   uint8_t answer[DNS_UDP_MAX_PACKLEN];
+   uint64_t end = now_ns () + opts->min_time_sec * 1e9;
+   for (uint64_t start = now_ns (); start < end || count < 100; start = now_ns ()) {
+      if (send (client_fd, p->data, p->length, 0) != p->length || recv (client_fd, answer, sizeof (answer), 0) < 0) {
+         break;
+      }
+      if (count == cap) {
+         cap *= 2;
+         samples = (uint64_t *) realloc (samples, cap * sizeof (*samples));
+      }
+      samples[count++] = now_ns () - start;
+   }
+   echo.stop = 1;
+   pthread_join (thread, NULL);
+   destroy_dns_io (echo.io);
+   close (server_fd);
+   close (client_fd);
+
+   if (count > 0) {
+      qsort (samples, count, sizeof (*samples), compare_u64);
+      printf ("{\"label\":\"%s\",\"bench\":\"udp_echo\",\"case\":\"%s\",\"iterations\":%d,\"p50_ns\":%llu,"
+              "\"p99_ns\":%llu}\n",
+              opts->label,
+              cs,
+              count,
+              (unsigned long long) samples[count / 2],
+              (unsigned long long) samples[(int) (count * 0.99)]);
+      fflush (stdout);
+   }
+   free (samples);
+}
+
+static void
+usage (const char *prog)
+{
+   printf ("usage: %s [-l LABEL] [-b BENCH] [-t SECONDS] [-m MAX_FILTERS]\n"
+           "  -l LABEL        label attached to every result, e.g. a commit hash\n"
+           "  -b BENCH        run only benchmarks whose name contains BENCH\n"
+           "  -t SECONDS      measuring time per case (default 0.2)\n"
+           "  -m MAX_FILTERS  largest filter set for find_filter (default 1000000)\n",
+           prog);
+}
+
+int
+main (int argc, char **argv)
+{
+   bench_opts_t opts = {"", NULL, 0.2, 1000000};
+   int opt;
+   while ((opt = getopt (argc, argv, "l:b:t:m:h")) != -1) {
+      switch (opt) {
+      case 'l':
+         opts.label = optarg;
+         break;
+      case 'b':
+         opts.only = optarg;
+         break;
+      case 't':
+         opts.min_time_sec = atof (optarg);
+         break;
+      case 'm':
+         opts.max_filters = atoi (optarg);
+         break;
+      default:
+         usage (argv[0]);
+         return opt == 'h' ? 0 : -kInvalidInput;
+      }
+   }
+   init_cycles ();
+
+   const char *short_name[] = {"a.io"};
+   const char *long_name[] = {"very-long-label-number-one.another-fairly-long-label.third-label-of-the-name."
+                              "fourth-level-subdomain.edge-cache-cluster-07.eu-west-3.cdn.example-content.com"};
+   const char *multi_name[] = {"www.example.com", "mail.example.org", "api.v2.service.internal.example.net"};
+   static bench_packet_t packets[] = {
+      {.name = "short"},
+      {.name = "long"},
+      {.name = "multi_question"},
+      {.name = "compressed_answers"},
+   };
+   packets[0].length = build_packet (packets[0].data, short_name, 1, T_A, 0);
+   packets[1].length = build_packet (packets[1].data, long_name, 1, T_A, 0);
+   packets[2].length = build_packet (packets[2].data, multi_name, 3, T_A, 0);
+   packets[3].length = build_packet (packets[3].data, multi_name, 1, T_A, 8);
+   const int npackets = sizeof (packets) / sizeof (packets[0]);
+   for (int i = 0; i < npackets; ++i) {
+      packets[i].parsed = new_dns_h (packets[i].data, packets[i].length, NULL);
+      dns_name_to_text (packets[i].text, &packets[i].parsed->qrs[0].key);
+   }
+
+   char cs[64];
+   for (int i = 0; i < npackets; ++i) {
+      run_bench (&opts, "new_dns_h", packets[i].name, bench_new_dns_h, &packets[i]);
+   }
+   for (int i = 0; i < npackets; ++i) {
+      run_bench (&opts, "new_dns_buffer", packets[i].name, bench_new_dns_buffer, &packets[i]);
+   }
+   for (int i = 0; i < 2; ++i) {
+      run_bench (&opts, "process_qname", packets[i].name, bench_process_qname, &packets[i]);
+      run_bench (&opts, "convert_to_qname", packets[i].name, bench_convert_to_qname, &packets[i]);
+   }
+   // every implementation the CPU supports, the dispatched one is restored afterwards
+   dns_name_impl_t best = dns_name_current_impl ();
+   for (int impl = DNS_NAME_SCALAR; impl <= DNS_NAME_AVX2; ++impl) {
+      if (dns_name_use_impl ((dns_name_impl_t) impl) != 0) {
+         continue;
+      }
+      for (int i = 0; i < 2; ++i) {
+         snprintf (cs, sizeof (cs), "%s_%s", packets[i].name, dns_name_impl_desc[impl]);
+         run_bench (&opts, "dns_name_fold", cs, bench_dns_name_fold, &packets[i]);
+      }
+   }
+   dns_name_use_impl (best);
+
+   const int sizes[] = {10, 1000, 100000, 1000000};
+   for (int s = 0; s < (int) (sizeof (sizes) / sizeof (sizes[0])); ++s) {
+      if (sizes[s] > opts.max_filters) {
+         break;
+      }
+      if (opts.only != NULL && strstr ("find_filter", opts.only) == NULL) {
+         break;
+      }
+      bench_filters_t f = {.filters = new_filter_set (sizes[s]), .size = sizes[s]};
+      init_dns_filter_set (&f.set, f.filters, f.size);
+      f.view.set = &f.set;
+      char hit[64];
+      snprintf (hit, sizeof (hit), "tracker%d.ads%d.example", sizes[s] / 2 + 1, (sizes[s] / 2 + 1) % 97);
+
+      f.query = new_query ("www.not-listed.example.org");
+      snprintf (cs, sizeof (cs), "miss_%d", sizes[s]);
+      run_bench (&opts, "find_filter", cs, bench_find_filter, &f);
+      destroy_dns_h (f.query);
+
+      f.query = new_query (hit);
+      snprintf (cs, sizeof (cs), "hit_middle_%d", sizes[s]);
+      run_bench (&opts, "find_filter", cs, bench_find_filter, &f);
+      destroy_dns_h (f.query);
+
+      clear_dns_filter_set (&f.set);
+      destroy_filter_set (f.filters, f.size);
+   }
+
+   const int pattern_sizes[] = {10, 1000};
+   for (int s = 0; s < (int) (sizeof (pattern_sizes) / sizeof (pattern_sizes[0])); ++s) {
+      if (pattern_sizes[s] > opts.max_filters || (opts.only != NULL && strstr ("find_filter", opts.only) == NULL)) {
+         break;
+      }
+      bench_filters_t f = {.filters = new_pattern_set (pattern_sizes[s]), .size = pattern_sizes[s]};
+      init_dns_filter_set (&f.set, f.filters, f.size);
+      f.view.set = &f.set;
+      char hit[64];
+      snprintf (hit, sizeof (hit), "tracker%d.cdn.example", pattern_sizes[s] / 2);
+
+      f.query = new_query ("www.not-listed.example.org");
+      snprintf (cs, sizeof (cs), "pattern_miss_%d", pattern_sizes[s]);
+      run_bench (&opts, "find_filter", cs, bench_find_filter, &f);
+      destroy_dns_h (f.query);
+
+      f.query = new_query (hit);
+      snprintf (cs, sizeof (cs), "pattern_hit_middle_%d", pattern_sizes[s]);
+      run_bench (&opts, "find_filter", cs, bench_find_filter, &f);
+      destroy_dns_h (f.query);
+
+      clear_dns_filter_set (&f.set);
+      destroy_filter_set (f.filters, f.size);
+   }
+
+   bench_udp_echo (&opts, "select", &packets[0], 0);
+   bench_udp_echo (&opts, "busy_poll", &packets[0], 1);
+
+   for (int i = 0; i < npackets; ++i) {
+      destroy_dns_h (packets[i].parsed);
+   }
+   if (cycle_fd >= 0) {
+      close (cycle_fd);
+   }
+   return 0;
+}
@@ -0,0 +1,441 @@
+// Offline replay of captured queries through the in-memory packet pipeline (parse -> decide -> encode).
+//
+// Reads a pcap (Ethernet, Linux cooked, raw IP or BSD loopback link types, UDP on the DNS port) or a file of
+// 2-byte big-endian length prefixed DNS messages. Queries are replayed through process_dns_query, queries that
+// would be forwarded are answered from the responses found in the same capture, so no socket is involved.
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "configuration/configuration.h"
+#include "server/dns_core.h"
+#include "server/dns_server.h"
+
+#define REPLAY_RECORD_BUCKETS 65536
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_MAGIC_NSEC 0xa1b23c4d
+
+struct replay_msg {
+   uint8_t *data;
+   int length;
+};
+typedef struct replay_msg replay_msg_t;
+
+struct replay_record {
+   struct replay_record *next;
+   uint64_t key;
+   replay_msg_t msg;
+};
+typedef struct replay_record replay_record_t;
+
+struct replay_set {
+   replay_msg_t *queries;
+   int query_count;
+   int query_cap;
+   replay_record_t **records;
+   int record_count;
+};
+typedef struct replay_set replay_set_t;
+
+struct replay_worker {
+   pthread_t thread;
+   const dns_policy_t *policy;
+   const replay_set_t *set;
+   int cpu;
+   int loops;
+   uint64_t elapsed_ns;
+   uint64_t packets;
+   uint64_t replied;
+   uint64_t forwarded;
+   uint64_t unanswered;
+   uint64_t dropped;
+};
+typedef struct replay_worker replay_worker_t;
+
+static volatile uintptr_t sink;
+
+static uint64_t
+now_ns ()
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Case-folded hash of the first question (name and type), 0 when the message has none
+static uint64_t
+question_key (const uint8_t *msg, int length)
+{
+   uint64_t h = 0xcbf29ce484222325ull;
+   int off = sizeof (dns_header_t);
+   if (length <= off || ntohs (((const dns_header_t *) msg)->qdcount) == 0) {
+      return 0;
+   }
+   while (off < length && msg[off] != 0) {
+      int seg = msg[off];
+      if (seg > QNAME_MAX_SEG_LEN || off + seg + 1 >= length) {
+         return 0;
+      }
+      for (int i = 0; i <= seg; ++i) {
+         uint8_t c = msg[off + i];
+         h = (h ^ ((c >= 'A' && c <= 'Z') ? c + 'a' - 'A' : c)) * 0x100000001b3ull;
+      }
+      off += seg + 1;
+   }
+   if (off + 3 > length) {
+      return 0;
+   }
+   h = (h ^ msg[off + 1]) * 0x100000001b3ull;
+   h = (h ^ msg[off + 2]) * 0x100000001b3ull;
+   return h | 1;
+}
+
+static void
+add_message (replay_set_t *set, const uint8_t *data, int length)
+{
+   if (length < (int) sizeof (dns_header_t) || length > DNS_UDP_MAX_PACKLEN) {
+      return;
+   }
+   replay_msg_t msg = {(uint8_t *) malloc (length), length};
+   memcpy (msg.data, data, length);
+   if (!(data[2] & HB3_QR)) {
+      if (set->query_count == set->query_cap) {
+         set->query_cap = set->query_cap ? set->query_cap * 2 : 1024;
+         set->queries = (replay_msg_t *) realloc (set->queries, set->query_cap * sizeof (*set->queries));
+      }
+      set->queries[set->query_count++] = msg;
+      return;
+   }
+   uint64_t key = question_key (data, length);
+   if (key == 0) {
+      free (msg.data);
+      return;
+   }
+   replay_record_t *rec = (replay_record_t *) malloc (sizeof (*rec));
+   rec->key = key;
+   rec->msg = msg;
+   rec->next = set->records[key % REPLAY_RECORD_BUCKETS];
+   set->records[key % REPLAY_RECORD_BUCKETS] = rec;
+   ++set->record_count;
+}
+
+static const replay_msg_t *
+find_record (const replay_set_t *set, uint64_t key)
+{
+   for (const replay_record_t *rec = set->records[key % REPLAY_RECORD_BUCKETS]; rec != NULL; rec = rec->next) {
+      if (rec->key == key) {
+         return &rec->msg;
+      }
+   }
+   return NULL;
+}
+
+static uint32_t
+pcap_u32 (const uint8_t *p, int swap)
+{
+   uint32_t v;
+   memcpy (&v, p, sizeof (v));
+   return swap ? __builtin_bswap32 (v) : v;
+}
+
+// Strips link, IP and UDP headers, returns the UDP payload or NULL when the frame is not DNS over UDP
+static const uint8_t *
+pcap_udp_payload (const uint8_t *frame, uint32_t caplen, uint32_t linktype, uint16_t port, int *out_len)
+{
+   const uint8_t *p = frame;
+   const uint8_t *end = frame + caplen;
+   uint16_t ethertype = 0;
+   switch (linktype) {
+   case 0: // BSD loopback, family in host order
+      if (caplen < 4) {
+         return NULL;
+      }
+      p += 4;
+      ethertype = (p[0] >> 4) == 6 ? 0x86dd : 0x0800;
+      break;
+   case 1: // Ethernet
+      if (caplen < 14) {
+         return NULL;
+      }
+      ethertype = (p[12] << 8) | p[13];
+      p += 14;
+      while (ethertype == 0x8100 && p + 4 <= end) { // 802.1Q tags
+         ethertype = (p[2] << 8) | p[3];
+         p += 4;
+      }
+      break;
+   case 12:
+   case 14:
+   case 101: // raw IP
+      if (caplen < 1) {
+         return NULL;
+      }
+      ethertype = (p[0] >> 4) == 6 ? 0x86dd : 0x0800;
+      break;
+   case 113: // Linux cooked
+      if (caplen < 16) {
+         return NULL;
+      }
+      ethertype = (p[14] << 8) | p[15];
+      p += 16;
+      break;
+   case 276: // Linux cooked v2
+      if (caplen < 20) {
+         return NULL;
+      }
+      ethertype = (p[0] << 8) | p[1];
+      p += 20;
+      break;
+   default:
+      return NULL;
+   }
+
+   if (ethertype == 0x0800) {
+      if (p + 20 > end || p[9] != IPPROTO_UDP) {
+         return NULL;
+      }
+      p += (p[0] & 0x0f) * 4;
+   } else if (ethertype == 0x86dd) {
+      if (p + 40 > end || p[6] != IPPROTO_UDP) {
+         return NULL;
+      }
+      p += 40;
+   } else {
+      return NULL;
+   }
+   if (p + 8 > end) {
+      return NULL;
+   }
+   uint16_t sport = (p[0] << 8) | p[1];
+   uint16_t dport = (p[2] << 8) | p[3];
+   if (sport != port && dport != port) {
+      return NULL;
+   }
+   p += 8;
+   *out_len = end - p;
+   return p;
+}
+
+static dns_rc_t
+load_capture (const char *path, uint16_t port, replay_set_t *set)
+{
+   FILE *file = fopen (path, "rb");
+   if (file == NULL) {
+      return kNotFound;
+   }
+   set->records = (replay_record_t **) calloc (REPLAY_RECORD_BUCKETS, sizeof (*set->records));
+
+   uint8_t hdr[24];
+   size_t got = fread (hdr, 1, sizeof (hdr), file);
+   uint32_t magic = got >= 4 ? pcap_u32 (hdr, 0) : 0;
+   int swap = magic == __builtin_bswap32 (PCAP_MAGIC) || magic == __builtin_bswap32 (PCAP_MAGIC_NSEC);
+   uint8_t *frame = (uint8_t *) malloc (65536);
+
+   if (got == sizeof (hdr) && (swap || magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC)) {
+      uint32_t linktype = pcap_u32 (hdr + 20, swap) & 0x0fffffff;
+      uint8_t rec[16];
+      while (fread (rec, 1, sizeof (rec), file) == sizeof (rec)) {
+         uint32_t caplen = pcap_u32 (rec + 8, swap);
+         if (caplen > 65536 || fread (frame, 1, caplen, file) != caplen) {
+            break;
+         }
+         int len = 0;
+         const uint8_t *payload = pcap_udp_payload (frame, caplen, linktype, port, &len);
+         if (payload != NULL) {
+            add_message (set, payload, len);
+         }
+      }
+   } else {
+      // length prefixed messages
+      fseek (file, 0, SEEK_SET);
+      uint8_t lenbuf[2];
+      while (fread (lenbuf, 1, 2, file) == 2) {
+         uint16_t len = ((uint16_t) lenbuf[0] << 8) | lenbuf[1];
+         if (fread (frame, 1, len, file) != len) {
+            break;
+         }
+         add_message (set, frame, len);
+      }
+   }
+   free (frame);
+   fclose (file);
+   return set->query_count > 0 ? kOk : kDataMalformed;
+}
+
+static void
+destroy_replay_set (replay_set_t *set)
+{
+   for (int i = 0; i < set->query_count; ++i) {
+      free (set->queries[i].data);
+   }
+   free (set->queries);
+   for (int i = 0; set->records != NULL && i < REPLAY_RECORD_BUCKETS; ++i) {
+      replay_record_t *rec = set->records[i];
+      while (rec != NULL) {
+         replay_record_t *next = rec->next;
+         free (rec->msg.data);
+         free (rec);
+         rec = next;
+      }
+   }
+   free (set->records);
+}
+
+static void *
+replay_worker_main (void *arg)
+{
+   replay_worker_t *w = (replay_worker_t *) arg;
+   if (w->cpu >= 0) {
+      cpu_set_t cpus;
+      CPU_ZERO (&cpus);
+      CPU_SET (w->cpu, &cpus);
+      pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus);
+   }
+   uint8_t resp[DNS_CACHE_MAX_ANSWER];
+   uint64_t start = now_ns ();
+   for (int l = 0; l < w->loops; ++l) {
+      for (int i = 0; i < w->set->query_count; ++i) {
+         const replay_msg_t *q = &w->set->queries[i];
+         int resp_len = 0;
+         dns_verdict_t verdict = process_dns_query (w->policy, NULL, NULL, q->data, q->length, resp, &resp_len, NULL);
+         if (verdict == DNS_VERDICT_REPLY) {
+            ++w->replied;
+         } else if (verdict == DNS_VERDICT_FORWARD) {
+            // stubbed upstream: copy the recorded answer and restore the query ID
+            const replay_msg_t *r = find_record (w->set, question_key (q->data, q->length));
+            if (r != NULL) {
+               memcpy (resp, r->data, r->length);
+               memcpy (resp, q->data, sizeof (uint16_t));
+               resp_len = r->length;
+               ++w->forwarded;
+            } else {
+               ++w->unanswered;
+            }
+         } else {
+            ++w->dropped;
+         }
+         sink += resp_len;
+         ++w->packets;
+      }
+   }
+   w->elapsed_ns = now_ns () - start;
+   return NULL;
+}
+
+static void
+usage (const char *prog)
+{
+   printf ("usage: %s [-c CONFIG] [-n LOOPS] [-j THREADS] [-p PORT] CAPTURE\n"
+           "  -c CONFIG    proxy configuration with the filters to apply (default ./config.json)\n"
+           "  -n LOOPS     how many times every worker replays the capture (default 100)\n"
+           "  -j THREADS   number of workers, worker i is pinned to cpu i (default 1)\n"
+           "  -p PORT      DNS port used to pick packets out of a pcap (default 53)\n"
+           "CAPTURE is a pcap file or a file of 2-byte length prefixed DNS messages\n",
+           prog);
+}
+
+int
+main (int argc, char **argv)
+{
+   const char *conf_path = "./config.json";
+   int loops = 100;
+   int threads = 1;
+   uint16_t port = 53;
+   int opt;
+   while ((opt = getopt (argc, argv, "c:n:j:p:h")) != -1) {
+      switch (opt) {
+      case 'c':
+         conf_path = optarg;
+         break;
+      case 'n':
+         loops = atoi (optarg);
+         break;
+      case 'j':
+         threads = atoi (optarg);
+         break;
+      case 'p':
+         port = (uint16_t) atoi (optarg);
+         break;
+      default:
+         usage (argv[0]);
+         return opt == 'h' ? 0 : -kInvalidInput;
+      }
+   }
+   if (optind >= argc || loops <= 0 || threads <= 0) {
+      usage (argv[0]);
+      return -kInvalidInput;
+   }
+
+   dns_rc_t ret = kOk;
+   dns_conf_t *conf = new_dns_conf_from_json (conf_path, &ret);
+   if (ret != kOk) {
+      printf ("Err, new_dns_conf_from_json %s\n", code_desc[ret]);
+      return -(ret);
+   }
+   const uint8_t *c_err_msg = validate_dns_conf (conf, &ret);
+   if (ret != kOk) {
+      printf ("Err, validate_dns_conf %s\n", c_err_msg);
+      destroy_dns_conf (conf);
+      return -(ret);
+   }
+
+   dns_policy_t *policy = new_dns_policy (conf, &ret);
+   if (ret != kOk) {
+      printf ("Err, new_dns_policy %s\n", code_desc[ret]);
+      destroy_dns_conf (conf);
+      return -(ret);
+   }
+
+   replay_set_t set = {0};
+   ret = load_capture (argv[optind], port, &set);
+   if (ret != kOk) {
+      printf ("Err, load_capture %s %s\n", argv[optind], code_desc[ret]);
+      destroy_replay_set (&set);
+      destroy_dns_policy (policy);
+      destroy_dns_conf (conf);
+      return -(ret);
+   }
+   printf ("loaded %d queries, %d recorded responses\n", set.query_count, set.record_count);
+
+   long ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+   replay_worker_t *workers = (replay_worker_t *) calloc (threads, sizeof (*workers));
+   for (int i = 0; i < threads; ++i) {
+      workers[i].policy = policy;
+      workers[i].set = &set;
+      workers[i].loops = loops;
+      workers[i].cpu = i < ncpu ? i : -1;
+      pthread_create (&workers[i].thread, NULL, replay_worker_main, &workers[i]);
+   }
+
+   double total_pps = 0;
+   for (int i = 0; i < threads; ++i) {
+      replay_worker_t *w = &workers[i];
+      pthread_join (w->thread, NULL);
+      double pps = w->elapsed_ns > 0 ? w->packets * 1e9 / w->elapsed_ns : 0;
+      total_pps += pps;
+      printf ("worker %d cpu %d: %llu packets in %.3f s, %.0f packets/s "
+              "(replied %llu, forwarded %llu, unanswered %llu, dropped %llu)\n",
+              i,
+              w->cpu,
+              (unsigned long long) w->packets,
+              w->elapsed_ns / 1e9,
+              pps,
+              (unsigned long long) w->replied,
+              (unsigned long long) w->forwarded,
+              (unsigned long long) w->unanswered,
+              (unsigned long long) w->dropped);
+   }
+   printf ("total: %.0f packets/s, %.0f packets/s per core\n", total_pps, total_pps / threads);
+
+   free (workers);
+   destroy_replay_set (&set);
+   destroy_dns_policy (policy);
+   destroy_dns_conf (conf);
+   return 0;
+}
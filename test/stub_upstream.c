@@ -0,0 +1,488 @@
+// Standalone fake upstream resolver used to benchmark the proxy on localhost.
+//
+// Answers either from a synthetic zone (every name exists, A/AAAA addresses are derived from the name hash)
+// or from a recorded response set (a file of 2-byte big-endian length prefixed DNS messages, the same framing
+// as DNS over TCP). Every fate (drop, truncate, NXDOMAIN, latency) is derived from a hash of the seed and the
+// query, so the same query stream always gets the same answers regardless of timing.
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#include "dns/dns-protocol.h"
+#include "utils/status.h"
+
+#define STUB_MAX_PENDING 65536
+#define STUB_RECORD_BUCKETS 4096
+
+enum stub_latency_kind { STUB_LAT_NONE = 0, STUB_LAT_FIXED = 1, STUB_LAT_UNIFORM = 2, STUB_LAT_EXP = 3 };
+typedef enum stub_latency_kind stub_latency_kind_t;
+
+struct stub_latency {
+   stub_latency_kind_t kind;
+   double a; // fixed value, uniform min or exponential mean (usec)
+   double b; // uniform max (usec)
+};
+typedef struct stub_latency stub_latency_t;
+
+struct stub_record {
+   struct stub_record *next;
+   uint64_t key;
+   uint16_t length;
+   uint8_t *packet;
+};
+typedef struct stub_record stub_record_t;
+
+struct stub_reply {
+   uint64_t due_ns;
+   struct sockaddr_storage addr;
+   socklen_t addr_len;
+   uint16_t length;
+   uint8_t packet[DNS_UDP_MAX_PACKLEN];
+};
+typedef struct stub_reply stub_reply_t;
+
+struct stub_stats {
+   uint64_t received;
+   uint64_t answered;
+   uint64_t dropped;
+   uint64_t truncated;
+   uint64_t nxdomain;
+   uint64_t malformed;
+};
+typedef struct stub_stats stub_stats_t;
+
+static volatile sig_atomic_t quit = 0;
+
+static void
+handle_sigint (int sig)
+{
+   (void) sig;
+   quit = 1;
+}
+
+static uint64_t
+now_ns ()
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint64_t
+mix64 (uint64_t x)
+{
+   x ^= x >> 33;
+   x *= 0xff51afd7ed558ccdull;
+   x ^= x >> 33;
+   x *= 0xc4ceb9fe1a85ec53ull;
+   x ^= x >> 33;
+   return x;
+}
+
+// uniform double in [0, 1) drawn from the per query hash stream
+static double
+unit (uint64_t *state)
+{
+   *state = mix64 (*state + 0x9e3779b97f4a7c15ull);
+   return (*state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Returns wire length of the question name and its case-folded FNV-1a hash, or -1 when malformed
+static int
+question_key (const uint8_t *packet, int length, uint64_t *out_hash)
+{
+   uint64_t h = 0xcbf29ce484222325ull;
+   int off = sizeof (dns_header_t);
+   while (off < length && packet[off] != 0) {
+      int seg = packet[off];
+      if (seg > QNAME_MAX_SEG_LEN || off + seg + 1 >= length) {
+         return -1;
+      }
+      for (int i = 0; i <= seg; ++i) {
+         uint8_t c = packet[off + i];
+         if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+         }
+         h = (h ^ c) * 0x100000001b3ull;
+      }
+      off += seg + 1;
+   }
+   if (off + 5 > length) {
+      return -1;
+   }
+   const uint8_t *cp = packet + off + 1;
+   uint16_t qtype = 0;
+   GETSHORT (qtype, cp);
+   *out_hash = mix64 (h ^ qtype);
+   return off + 1 - (int) sizeof (dns_header_t);
+}
+
+static dns_rc_t
+parse_latency (const char *spec, stub_latency_t *lat)
+{
+   if (strncmp (spec, "fixed:", 6) == 0) {
+      lat->kind = STUB_LAT_FIXED;
+      return sscanf (spec + 6, "%lf", &lat->a) == 1 ? kOk : kInvalidInput;
+   } else if (strncmp (spec, "uniform:", 8) == 0) {
+      lat->kind = STUB_LAT_UNIFORM;
+      return (sscanf (spec + 8, "%lf:%lf", &lat->a, &lat->b) == 2 && lat->a <= lat->b) ? kOk : kInvalidInput;
+   } else if (strncmp (spec, "exp:", 4) == 0) {
+      lat->kind = STUB_LAT_EXP;
+      return sscanf (spec + 4, "%lf", &lat->a) == 1 ? kOk : kInvalidInput;
+   } else if (strcmp (spec, "none") == 0) {
+      lat->kind = STUB_LAT_NONE;
+      return kOk;
+   }
+   return kInvalidInput;
+}
+
+static uint64_t
+sample_latency_ns (const stub_latency_t *lat, uint64_t *state)
+{
+   double usec = 0;
+   switch (lat->kind) {
+   case STUB_LAT_FIXED:
+      usec = lat->a;
+      break;
+   case STUB_LAT_UNIFORM:
+      usec = lat->a + (lat->b - lat->a) * unit (state);
+      break;
+   case STUB_LAT_EXP:
+      usec = -lat->a * log (1.0 - unit (state));
+      break;
+   default:
+      break;
+   }
+   return (uint64_t) (usec * 1000.0);
+}
+
+static stub_record_t **
+load_records (const char *path, int *out_count)
+{
+   FILE *file = fopen (path, "rb");
+   if (file == NULL) {
+      return NULL;
+   }
+   stub_record_t **buckets = (stub_record_t **) calloc (STUB_RECORD_BUCKETS, sizeof (*buckets));
+   uint8_t lenbuf[2];
+   *out_count = 0;
+   while (fread (lenbuf, 1, 2, file) == 2) {
+      uint16_t len = ((uint16_t) lenbuf[0] << 8) | lenbuf[1];
+      uint8_t *packet = (uint8_t *) malloc (len);
+      if (fread (packet, 1, len, file) != len) {
+         free (packet);
+         break;
+      }
+      uint64_t key = 0;
+      // only responses are usable as answers, queries in the same capture are skipped
+      if (len < sizeof (dns_header_t) || !(packet[2] & HB3_QR) || question_key (packet, len, &key) < 0) {
+         free (packet);
+         continue;
+      }
+      stub_record_t *rec = (stub_record_t *) malloc (sizeof (*rec));
+      rec->key = key;
+      rec->length = len;
+      rec->packet = packet;
+      rec->next = buckets[key % STUB_RECORD_BUCKETS];
+      buckets[key % STUB_RECORD_BUCKETS] = rec;
+      ++(*out_count);
+   }
+   fclose (file);
+   return buckets;
+}
+
+static const stub_record_t *
+find_record (stub_record_t *const *buckets, uint64_t key)
+{
+   for (const stub_record_t *rec = buckets[key % STUB_RECORD_BUCKETS]; rec != NULL; rec = rec->next) {
+      if (rec->key == key) {
+         return rec;
+      }
+   }
+   return NULL;
+}
+
+// Appends a synthetic answer for A/AAAA questions, other types get an empty NOERROR (NODATA) answer
+static int
+synthesize_answer (uint8_t *packet, int qend, uint16_t qtype, uint64_t key, uint32_t ttl)
+{
+   uint8_t *cp = packet + qend;
+   int rdlength = qtype == T_A ? 4 : (qtype == T_AAAA ? 16 : 0);
+   if (rdlength == 0) {
+      return qend;
+   }
+   *cp++ = POINTER_MASK;
+   *cp++ = sizeof (dns_header_t);
+   PUTSHORT (qtype, cp);
+   PUTSHORT (C_IN, cp);
+   PUTLONG (ttl, cp);
+   PUTSHORT (rdlength, cp);
+   if (qtype == T_A) {
+      // 10.0.0.0/8 keeps synthetic answers out of routable space
+      *cp++ = 10;
+      *cp++ = key >> 16;
+      *cp++ = key >> 8;
+      *cp++ = key;
+   } else {
+      *cp++ = 0xfd;
+      for (int i = 1; i < 16; ++i) {
+         *cp++ = key >> ((i % 8) * 8);
+      }
+   }
+   dns_header_t *hdr = (dns_header_t *) packet;
+   hdr->ancount = htons (1);
+   return cp - packet;
+}
+
+static void
+usage (const char *prog)
+{
+   printf ("usage: %s [options]\n"
+           "  -a ADDR        listen address (default 127.0.0.1)\n"
+           "  -p PORT        listen port (default 5353)\n"
+           "  -r FILE        answer from recorded responses (2-byte length prefixed DNS messages)\n"
+           "  -l SPEC        latency: none | fixed:USEC | uniform:MIN:MAX | exp:MEAN (default none)\n"
+           "  -d RATIO       fraction of queries dropped (0..1)\n"
+           "  -t RATIO       fraction of queries answered with TC=1\n"
+           "  -n RATIO       fraction of queries answered with NXDOMAIN\n"
+           "  -T TTL         ttl of synthetic answers (default 300)\n"
+           "  -s SEED        seed of the per query fate hash (default 1)\n",
+           prog);
+}
+
+static void
+push_reply (stub_reply_t *heap, int *size, const stub_reply_t *reply)
+{
+   int i = (*size)++;
+   heap[i] = *reply;
+   while (i > 0 && heap[(i - 1) / 2].due_ns > heap[i].due_ns) {
+      stub_reply_t t = heap[i];
+      heap[i] = heap[(i - 1) / 2];
+      heap[(i - 1) / 2] = t;
+      i = (i - 1) / 2;
+   }
+}
+
+static void
+pop_reply (stub_reply_t *heap, int *size)
+{
+   heap[0] = heap[--(*size)];
+   int i = 0;
+   for (;;) {
+      int l = 2 * i + 1, r = l + 1, m = i;
+      if (l < *size && heap[l].due_ns < heap[m].due_ns) {
+         m = l;
+      }
+      if (r < *size && heap[r].due_ns < heap[m].due_ns) {
+         m = r;
+      }
+      if (m == i) {
+         break;
+      }
+      stub_reply_t t = heap[i];
+      heap[i] = heap[m];
+      heap[m] = t;
+      i = m;
+   }
+}
+
+int
+main (int argc, char **argv)
+{
+   const char *addr = "127.0.0.1";
+   const char *records_path = NULL;
+   uint16_t port = 5353;
+   stub_latency_t latency = {STUB_LAT_NONE, 0, 0};
+   double drop_ratio = 0, tc_ratio = 0, nx_ratio = 0;
+   uint32_t ttl = DEFAULT_TTL;
+   uint64_t seed = 1;
+
+   int opt;
+   while ((opt = getopt (argc, argv, "a:p:r:l:d:t:n:T:s:h")) != -1) {
+      switch (opt) {
+      case 'a':
+         addr = optarg;
+         break;
+      case 'p':
+         port = (uint16_t) atoi (optarg);
+         break;
+      case 'r':
+         records_path = optarg;
+         break;
+      case 'l':
+         if (parse_latency (optarg, &latency) != kOk) {
+            printf ("Err, invalid latency spec %s\n", optarg);
+            return -kInvalidInput;
+         }
+         break;
+      case 'd':
+         drop_ratio = atof (optarg);
+         break;
+      case 't':
+         tc_ratio = atof (optarg);
+         break;
+      case 'n':
+         nx_ratio = atof (optarg);
+         break;
+      case 'T':
+         ttl = (uint32_t) strtoul (optarg, NULL, 10);
+         break;
+      case 's':
+         seed = strtoull (optarg, NULL, 10);
+         break;
+      default:
+         usage (argv[0]);
+         return opt == 'h' ? 0 : -kInvalidInput;
+      }
+   }
+
+   stub_record_t **records = NULL;
+   if (records_path != NULL) {
+      int count = 0;
+      if ((records = load_records (records_path, &count)) == NULL) {
+         printf ("Err, cannot open recorded responses %s\n", records_path);
+         return -kNotFound;
+      }
+      printf ("loaded %d recorded responses\n", count);
+   }
+
+   struct sockaddr_storage storage = {0};
+   socklen_t storage_len = 0;
+   struct sockaddr_in *sa = (struct sockaddr_in *) &storage;
+   struct sockaddr_in6 *sa6 = (struct sockaddr_in6 *) &storage;
+   if (inet_pton (AF_INET, addr, &sa->sin_addr) == 1) {
+      sa->sin_family = AF_INET;
+      sa->sin_port = htons (port);
+      storage_len = sizeof (*sa);
+   } else if (inet_pton (AF_INET6, addr, &sa6->sin6_addr) == 1) {
+      sa6->sin6_family = AF_INET6;
+      sa6->sin6_port = htons (port);
+      storage_len = sizeof (*sa6);
+   } else {
+      printf ("Err, invalid listen address %s\n", addr);
+      return -kDataMalformed;
+   }
+   int sockfd = socket (storage.ss_family, SOCK_DGRAM, IPPROTO_UDP);
+   if (sockfd == -1 || bind (sockfd, (struct sockaddr *) &storage, storage_len) < 0) {
+      perror ("bind");
+      return -kAborted;
+   }
+
+   signal (SIGINT, handle_sigint);
+   signal (SIGTERM, handle_sigint);
+   printf ("stub upstream listening on %s:%d\n", addr, port);
+
+   stub_reply_t *heap = (stub_reply_t *) malloc (STUB_MAX_PENDING * sizeof (*heap));
+   int heap_size = 0;
+   stub_stats_t stats = {0};
+   stub_reply_t reply;
+
+   while (quit == 0) {
+      int timeout_ms = 100;
+      if (heap_size > 0) {
+         uint64_t now = now_ns ();
+         timeout_ms = heap[0].due_ns <= now ? 0 : (int) ((heap[0].due_ns - now + 999999) / 1000000);
+      }
+      struct pollfd pfd = {sockfd, POLLIN, 0};
+      int n = poll (&pfd, 1, timeout_ms);
+      if (n < 0 && errno != EINTR) {
+         perror ("poll");
+         break;
+      }
+
+      // flush every reply whose artificial latency has elapsed
+      uint64_t now = now_ns ();
+      while (heap_size > 0 && heap[0].due_ns <= now) {
+         sendto (sockfd, heap[0].packet, heap[0].length, 0, (struct sockaddr *) &heap[0].addr, heap[0].addr_len);
+         pop_reply (heap, &heap_size);
+      }
+      if (n <= 0 || !(pfd.revents & POLLIN)) {
+         continue;
+      }
+
+      reply.addr_len = sizeof (reply.addr);
+      ssize_t len =
+         recvfrom (sockfd, reply.packet, sizeof (reply.packet), 0, (struct sockaddr *) &reply.addr, &reply.addr_len);
+      if (len <= 0) {
+         continue;
+      }
+      ++stats.received;
+
+      uint64_t key = 0;
+      int qlen = len >= (ssize_t) sizeof (dns_header_t) ? question_key (reply.packet, len, &key) : -1;
+      if (qlen < 0) {
+         ++stats.malformed;
+         continue;
+      }
+      const uint8_t *qp = reply.packet + sizeof (dns_header_t) + qlen;
+      uint16_t qtype = 0;
+      GETSHORT (qtype, qp);
+      const int qend = sizeof (dns_header_t) + qlen + 4;
+      dns_header_t *hdr = (dns_header_t *) reply.packet;
+
+      uint64_t state = mix64 (seed ^ key ^ ((uint64_t) ntohs (hdr->id) << 48));
+      if (unit (&state) < drop_ratio) {
+         ++stats.dropped;
+         continue;
+      }
+
+      const stub_record_t *rec = records != NULL ? find_record (records, key) : NULL;
+      double fate = unit (&state);
+      if (fate < tc_ratio) {
+         ++stats.truncated;
+         hdr->hb3 |= HB3_QR | HB3_TC;
+         hdr->hb4 |= HB4_RA;
+         hdr->qdcount = htons (1);
+         hdr->ancount = hdr->nscount = hdr->arcount = 0;
+         reply.length = qend;
+      } else if (fate < tc_ratio + nx_ratio || (records != NULL && rec == NULL)) {
+         ++stats.nxdomain;
+         hdr->hb3 |= HB3_QR;
+         hdr->hb4 |= HB4_RA;
+         SET_RCODE (hdr, RCODE_NXDOMAIN);
+         hdr->qdcount = htons (1);
+         hdr->ancount = hdr->nscount = hdr->arcount = 0;
+         reply.length = qend;
+      } else if (rec != NULL) {
+         uint16_t id = hdr->id;
+         reply.length = rec->length < sizeof (reply.packet) ? rec->length : sizeof (reply.packet);
+         memcpy (reply.packet, rec->packet, reply.length);
+         hdr->id = id;
+      } else {
+         hdr->hb3 |= HB3_QR;
+         hdr->hb4 |= HB4_RA;
+         SET_RCODE (hdr, RCODE_NOERROR);
+         hdr->qdcount = htons (1);
+         hdr->ancount = hdr->nscount = hdr->arcount = 0;
+         reply.length = synthesize_answer (reply.packet, qend, qtype, key, ttl);
+      }
+      ++stats.answered;
+
+      uint64_t delay = sample_latency_ns (&latency, &state);
+      if (delay == 0 || heap_size == STUB_MAX_PENDING) {
+         sendto (sockfd, reply.packet, reply.length, 0, (struct sockaddr *) &reply.addr, reply.addr_len);
+      } else {
+         reply.due_ns = now_ns () + delay;
+         push_reply (heap, &heap_size, &reply);
+      }
+   }
+
+   printf ("\nreceived %llu answered %llu dropped %llu truncated %llu nxdomain %llu malformed %llu\n",
+           (unsigned long long) stats.received,
+           (unsigned long long) stats.answered,
+           (unsigned long long) stats.dropped,
+           (unsigned long long) stats.truncated,
+           (unsigned long long) stats.nxdomain,
+           (unsigned long long) stats.malformed);
+   free (heap);
+   close (sockfd);
+   return 0;
+}
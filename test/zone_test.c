@@ -0,0 +1,93 @@
+// Checks of the local zone answers, run by ctest. Prints every failed check and exits with 1 when there was one.
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "dns/dns-parse.h"
+#include "dns/dns-protocol.h"
+#include "server/zone.h"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                      \
+   do {                                                                  \
+      if (!(cond)) {                                                     \
+         printf ("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+         ++failures;                                                     \
+      }                                                                  \
+   } while (0)
+
+// Answer count of the zone response to a `type` query for `name`, -1 when the query is forwarded
+static int
+answer_count (const dns_zone_t *zone, const char *name, uint16_t type)
+{
+   uint8_t query[DNS_UDP_MAX_PACKLEN];
+   uint8_t *p = query;
+   PUTSHORT (0x1234, p);
+   *p++ = HB3_RD;
+   *p++ = 0;
+   PUTSHORT (1, p);
+   PUTSHORT (0, p);
+   PUTSHORT (0, p);
+   PUTSHORT (0, p);
+   p += convert_to_qname (p, name, RR_NAME_MAX);
+   PUTSHORT (type, p);
+   PUTSHORT (C_IN, p);
+   dns_h_t *dht = new_dns_h (query, p - query, NULL);
+   uint8_t resp[DNS_UDP_MAX_PACKLEN];
+   int length = dht != NULL ? dns_zone_answer (zone, dht, resp) : 0;
+   destroy_dns_h (dht);
+   return length > 0 ? ntohs (((const dns_header_t *) resp)->ancount) : -1;
+}
+
+static dns_zone_t *
+new_zone (dns_record_conf_t *records, int size)
+{
+   dns_zone_conf_t conf;
+   memset (&conf, 0, sizeof (conf));
+   conf.records = records;
+   conf.record_size = size;
+   conf.synthesize_ptr = 1;
+   dns_rc_t rc = kOk;
+   dns_zone_t *zone = new_dns_zone (&conf, &rc);
+   CHECK (zone != NULL && rc == kOk);
+   return zone;
+}
+
+// Another type on the reverse name leaves the synthesized PTR in place, a configured PTR replaces it
+static void
+test_synthesized_ptr ()
+{
+   dns_record_conf_t records[] = {
+      {(uint8_t *) "host.example.org", (uint8_t *) "192.0.2.1", T_A, 300},
+      {(uint8_t *) "1.2.0.192.in-addr.arpa", (uint8_t *) "reverse note", T_TXT, 300},
+      {(uint8_t *) "mail.example.org", (uint8_t *) "192.0.2.2", T_A, 300},
+      {(uint8_t *) "2.2.0.192.in-addr.arpa", (uint8_t *) "other.example.org", T_PTR, 300},
+      // a type sorting before PTR on the reverse name
+      {(uint8_t *) "www.example.org", (uint8_t *) "192.0.2.3", T_A, 300},
+      {(uint8_t *) "3.2.0.192.in-addr.arpa", (uint8_t *) "192.0.2.3", T_A, 300},
+   };
+   dns_zone_t *zone = new_zone (records, sizeof (records) / sizeof (*records));
+   if (zone == NULL) {
+      return;
+   }
+   CHECK (answer_count (zone, "1.2.0.192.in-addr.arpa", T_PTR) == 1);
+   CHECK (answer_count (zone, "1.2.0.192.in-addr.arpa", T_TXT) == 1);
+   CHECK (answer_count (zone, "2.2.0.192.in-addr.arpa", T_PTR) == 1);
+   CHECK (answer_count (zone, "3.2.0.192.in-addr.arpa", T_PTR) == 1);
+   CHECK (answer_count (zone, "3.2.0.192.in-addr.arpa", T_A) == 1);
+   CHECK (answer_count (zone, "host.example.org", T_A) == 1);
+   destroy_dns_zone (zone);
+}
+
+int
+main ()
+{
+   test_synthesized_ptr ();
+   if (failures > 0) {
+      printf ("%d checks failed\n", failures);
+      return 1;
+   }
+   printf ("all checks passed\n");
+   return 0;
+}